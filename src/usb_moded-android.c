@@ -24,12 +24,14 @@
 
 #include "usb_moded-android.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
 #include "usb_moded-modesetting.h"
 
 #include <unistd.h>
+#include <limits.h>
 #include <stdio.h>
 
 /* ========================================================================= *
@@ -52,6 +54,7 @@ bool         android_set_function     (const char *function);
 bool         android_set_productid    (const char *id);
 bool         android_set_vendorid     (const char *id);
 bool         android_set_attr         (const char *function, const char *attr, const char *value);
+bool         android_is_configured    (void);
 
 /* ========================================================================= *
  * Data
@@ -105,7 +108,8 @@ android_probe(void)
     LOG_REGISTER_CONTEXT;
 
     if( android_probed <= 0 ) {
-        android_probed = access(ANDROID0_ENABLE, F_OK) == 0;
+        char real[PATH_MAX];
+        android_probed = access(common_sysroot_path(ANDROID0_ENABLE, real, sizeof real), F_OK) == 0;
         log_warning("ANDROID0 %sdetected", android_probed ? "" : "not ");
     }
 
@@ -385,3 +389,26 @@ android_set_attr(const char *function, const char *attr, const char *value)
               function, attr, value, ack);
     return ack;
 }
+
+/** Check if usb host has configured the android gadget
+ *
+ * @return true if android0 state is CONFIGURED, false otherwise
+ */
+bool
+android_is_configured(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool  configured = false;
+    char  buff[64];
+    char  real[PATH_MAX];
+    FILE *file = fopen(common_sysroot_path(ANDROID0_STATE, real, sizeof real), "r");
+
+    if( file ) {
+        if( fgets(buff, sizeof buff, file) )
+            configured = !strncmp(buff, "CONFIGURED", 10);
+        fclose(file);
+    }
+
+    return configured;
+}
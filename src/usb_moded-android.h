@@ -40,6 +40,7 @@
 # define ANDROID0_MANUFACTURER  "/sys/class/android_usb/android0/iManufacturer"
 # define ANDROID0_PRODUCT       "/sys/class/android_usb/android0/iProduct"
 # define ANDROID0_SERIAL        "/sys/class/android_usb/android0/iSerial"
+# define ANDROID0_STATE         "/sys/class/android_usb/android0/state"
 
 /* ========================================================================= *
  * Prototypes
@@ -59,5 +60,6 @@ bool   android_set_function     (const char *function);
 bool   android_set_productid    (const char *id);
 bool   android_set_vendorid     (const char *id);
 bool   android_set_attr         (const char *function, const char *attr, const char *value);
+bool   android_is_configured    (void);
 
 #endif /* USB_MODED_ANDROID_H_ */
@@ -29,10 +29,33 @@
 #include "usb_moded-appsync-dbus-private.h"
 
 #include "usb_moded-appsync.h"
+#include "usb_moded-common.h"
 #include "usb_moded-log.h"
 
 #include <dbus/dbus.h>
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+#define SYSTEMD_DBUS_SERVICE     "org.freedesktop.systemd1"
+#define SYSTEMD_DBUS_PATH        "/org/freedesktop/systemd1"
+#define SYSTEMD_DBUS_INTERFACE   "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_DBUS_SUBSCRIBE   "Subscribe"
+#define SYSTEMD_DBUS_JOB_REMOVED "JobRemoved"
+
+#define NAME_OWNER_CHANGED_MATCH\
+    "type='signal'"\
+    ",sender='"DBUS_SERVICE_DBUS"'"\
+    ",interface='"DBUS_INTERFACE_DBUS"'"\
+    ",member='NameOwnerChanged'"
+
+#define JOB_REMOVED_MATCH\
+    "type='signal'"\
+    ",sender='"SYSTEMD_DBUS_SERVICE"'"\
+    ",interface='"SYSTEMD_DBUS_INTERFACE"'"\
+    ",member='"SYSTEMD_DBUS_JOB_REMOVED"'"
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -41,15 +64,17 @@
  * DBUSAPPSYNC
  * ------------------------------------------------------------------------- */
 
-static void              dbusappsync_release_name      (void);
-static gboolean          dbusappsync_obtain_name       (void);
-static DBusHandlerResult dbusappsync_msg_handler       (DBusConnection *const connection, DBusMessage *const msg, gpointer const user_data);
-static DBusHandlerResult dbusappsync_handle_disconnect (DBusConnection *conn, DBusMessage *msg, void *user_data);
-static void              dbusappsync_cleanup_connection(void);
-gboolean                 dbusappsync_init_connection   (void);
-gboolean                 dbusappsync_init              (void);
-void                     dbusappsync_cleanup           (void);
-int                      dbusappsync_launch_app        (char *launch);
+static void              dbusappsync_release_name       (void);
+static gboolean          dbusappsync_obtain_name        (void);
+static DBusHandlerResult dbusappsync_msg_handler        (DBusConnection *const connection, DBusMessage *const msg, gpointer const user_data);
+static DBusHandlerResult dbusappsync_handle_disconnect  (DBusConnection *conn, DBusMessage *msg, void *user_data);
+static DBusHandlerResult dbusappsync_handle_state_change(DBusConnection *conn, DBusMessage *msg, void *user_data);
+static void              dbusappsync_subscribe_systemd  (void);
+static void              dbusappsync_cleanup_connection (void);
+gboolean                 dbusappsync_init_connection    (void);
+gboolean                 dbusappsync_init               (void);
+void                     dbusappsync_cleanup            (void);
+int                      dbusappsync_launch_app         (char *launch);
 
 /* ========================================================================= *
  * Data
@@ -239,6 +264,48 @@ static DBusHandlerResult dbusappsync_handle_disconnect(DBusConnection *conn, DBu
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
+/**
+ * Wake up waits for state changes in the user session
+ *
+ * Mtp daemon and other mode specific services run in the user
+ * session. Name owner changes and completed systemd jobs are
+ * likely to mean that something waited for is now available.
+ */
+static DBusHandlerResult dbusappsync_handle_state_change(DBusConnection *conn, DBusMessage *msg, void *user_data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)conn;
+    (void)user_data;
+
+    if( dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS, "NameOwnerChanged") ||
+        dbus_message_is_signal(msg, SYSTEMD_DBUS_INTERFACE, SYSTEMD_DBUS_JOB_REMOVED) )
+    {
+        common_wait_notify();
+    }
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * Ask user session systemd to broadcast job state changes
+ */
+static void dbusappsync_subscribe_systemd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage *req = dbus_message_new_method_call(SYSTEMD_DBUS_SERVICE,
+                                                    SYSTEMD_DBUS_PATH,
+                                                    SYSTEMD_DBUS_INTERFACE,
+                                                    SYSTEMD_DBUS_SUBSCRIBE);
+    if( req )
+    {
+        dbus_message_set_no_reply(req, TRUE);
+        if( !dbus_connection_send(dbus_connection_ses, req, 0) )
+            log_warning("failed to subscribe to systemd signals");
+        dbus_message_unref(req);
+    }
+}
+
 /**
  * Detach from session bus
  */
@@ -251,10 +318,13 @@ static void dbusappsync_cleanup_connection(void)
         /* Remove message filters */
         dbus_connection_remove_filter(dbus_connection_ses, dbusappsync_msg_handler, 0);
         dbus_connection_remove_filter(dbus_connection_ses, dbusappsync_handle_disconnect, 0);
+        dbus_connection_remove_filter(dbus_connection_ses, dbusappsync_handle_state_change, 0);
 
         /* Release name, but only if we can still talk to dbus daemon */
         if( !dbus_connection_disc )
         {
+            dbus_bus_remove_match(dbus_connection_ses, NAME_OWNER_CHANGED_MATCH, 0);
+            dbus_bus_remove_match(dbus_connection_ses, JOB_REMOVED_MATCH, 0);
             dbusappsync_release_name();
         }
 
@@ -300,6 +370,12 @@ gboolean dbusappsync_init_connection(void)
     /* Add method call handler */
     dbus_connection_add_filter(dbus_connection_ses, dbusappsync_msg_handler, 0, 0);
 
+    /* Track session services, so that waits for them can be cut short */
+    dbus_connection_add_filter(dbus_connection_ses, dbusappsync_handle_state_change, 0, 0);
+    dbus_bus_add_match(dbus_connection_ses, NAME_OWNER_CHANGED_MATCH, 0);
+    dbus_bus_add_match(dbus_connection_ses, JOB_REMOVED_MATCH, 0);
+    dbusappsync_subscribe_systemd();
+
     /* Make sure we do not get forced to exit if dbus session dies or stops */
     dbus_connection_set_exit_on_disconnect(dbus_connection_ses, FALSE);
 
@@ -94,6 +94,7 @@ void            appsync_free_configuration        (void);
 void            appsync_load_configuration        (void);
 int             appsync_activate_pre              (const char *mode);
 int             appsync_activate_post             (const char *mode);
+static bool     appsync_start_units_locked        (systemd_batch_t *batch, int post);
 static int      appsync_mark_active_locked        (const char *name, int post);
 int             appsync_mark_active               (const char *name, int post);
 #ifdef APP_SYNC_DBUS
@@ -428,6 +429,7 @@ int appsync_activate_pre(const char *mode)
     LOG_REGISTER_CONTEXT;
     int ret = 0; // assume success
     int count = 0;
+    systemd_batch_t *batch = systemd_batch_create(SYSTEMD_START);
 
     log_debug("activate-pre mode=%s", mode);
 
@@ -500,12 +502,8 @@ int appsync_activate_pre(const char *mode)
             log_debug("launching pre-enum-app %s", application->name);
             if(application->systemd)
             {
-                if(!systemd_control_service(application->name, SYSTEMD_START)) {
-                    log_debug("systemd pre-enum-app %s failed", application->name);
-                    ret = 1;
-                    goto cleanup;
-                }
-                appsync_mark_active_locked(application->name, 0);
+                /* started in parallel once all apps are queued */
+                systemd_batch_add_unit(batch, application->name);
             }
             else if(application->launch)
             {
@@ -533,9 +531,14 @@ int appsync_activate_pre(const char *mode)
         }
     }
 
+    if( !appsync_start_units_locked(batch, 0) )
+        ret = 1;
+
 cleanup:
     APPSYNC_LOCKED_LEAVE;
 
+    systemd_batch_delete(batch);
+
     return ret;
 }
 
@@ -553,6 +556,7 @@ int appsync_activate_post(const char *mode)
     LOG_REGISTER_CONTEXT;
 
     int ret = 0; // assume success
+    systemd_batch_t *batch = systemd_batch_create(SYSTEMD_START);
 
     log_debug("activate-post mode=%s", mode);
 
@@ -584,12 +588,8 @@ int appsync_activate_post(const char *mode)
 
             log_debug("launching post-enum-app %s\n", application->name);
             if( application->systemd ) {
-                if(!systemd_control_service(application->name, SYSTEMD_START)) {
-                    log_err("systemd post-enum-app %s failed", application->name);
-                    ret = 1;
-                    break;
-                }
-                appsync_mark_active_locked(application->name, 1);
+                /* started in parallel once all apps are queued */
+                systemd_batch_add_unit(batch, application->name);
             }
             else if( application->launch ) {
                 /* skipping if dbus session bus is not available,
@@ -610,12 +610,61 @@ int appsync_activate_post(const char *mode)
         }
     }
 
+    if( ret == 0 && !appsync_start_units_locked(batch, 1) )
+        ret = 1;
+
 cleanup:
     APPSYNC_LOCKED_LEAVE;
 
+    systemd_batch_delete(batch);
+
     return ret;
 }
 
+/** Start queued systemd units in parallel
+ *
+ * The appsync lock is released while waiting for systemd jobs to
+ * finish so that mainloop side appsync_mark_active() calls do not
+ * get blocked. Units that were started successfully are then marked
+ * active in the current configuration.
+ *
+ * @param batch  StartUnit batch
+ * @param post   0=pre-enum apps, or 1=post-enum apps
+ *
+ * @note Assumes that appsync configuration data is already locked.
+ *
+ * @return true if all units were started, false otherwise
+ */
+static bool appsync_start_units_locked(systemd_batch_t *batch, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+
+    if( systemd_batch_count(batch) == 0 )
+        goto EXIT;
+
+    APPSYNC_LOCKED_LEAVE;
+    ack = systemd_batch_execute(batch, SYSTEMD_JOB_TIMEOUT_MS);
+    APPSYNC_LOCKED_ENTER;
+
+    for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) ) {
+        application_t *application = iter->data;
+
+        if( !application->systemd || application->post != post )
+            continue;
+
+        if( systemd_batch_unit_ok(batch, application->name) )
+            appsync_mark_active_locked(application->name, post);
+        else if( application->state == APP_STATE_INACTIVE )
+            log_err("systemd %s-enum-app %s failed",
+                    post ? "post" : "pre", application->name);
+    }
+
+EXIT:
+    return ack;
+}
+
 /** Set application state as successfully started
  *
  * @param name  Application name
@@ -0,0 +1,720 @@
+/**
+ * @file usb_moded-backend.c
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-backend.h"
+
+#include "usb_moded.h"
+#include "usb_moded-android.h"
+#include "usb_moded-common.h"
+#include "usb_moded-configfs.h"
+#include "usb_moded-control.h"
+#include "usb_moded-log.h"
+#include "usb_moded-modules.h"
+
+#include <sys/inotify.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <libudev.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** File that signals mount table changes via POLLPRI */
+#define BACKEND_MOUNTINFO_PATH      "/proc/self/mountinfo"
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * BACKEND
+ * ------------------------------------------------------------------------- */
+
+static const char *backend_probe            (void);
+static const char *backend_fallback         (void);
+static void        backend_finish           (const char *name);
+static void        backend_rethink          (void);
+bool               backend_discovery_pending(void);
+void               backend_init_done_changed(void);
+static gboolean    backend_timeout_cb       (gpointer aptr);
+bool               backend_init             (void);
+void               backend_quit             (void);
+
+/* ------------------------------------------------------------------------- *
+ * BACKEND_WATCH
+ * ------------------------------------------------------------------------- */
+
+static void     backend_watch_add_dirs(void);
+static gboolean backend_watch_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static bool     backend_watch_start   (void);
+static void     backend_watch_stop    (void);
+
+/* ------------------------------------------------------------------------- *
+ * BACKEND_MOUNT
+ * ------------------------------------------------------------------------- */
+
+static gboolean backend_mount_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static bool     backend_mount_start   (void);
+static void     backend_mount_stop    (void);
+
+/* ------------------------------------------------------------------------- *
+ * BACKEND_UDEV
+ * ------------------------------------------------------------------------- */
+
+static gboolean backend_udev_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static bool     backend_udev_start   (void);
+static void     backend_udev_stop    (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Flag for: Gadget backend has not been selected yet */
+static bool backend_pending = false;
+
+/** Monotonic timestamp of discovery start [us] */
+static int64_t backend_discovery_t0 = 0;
+
+/** Flag for: configfs gadget has been initialized */
+static bool backend_configfs_found = false;
+
+/** Timer for giving up on configfs / android gadget discovery */
+static guint backend_timeout_id = 0;
+
+/** inotify file descriptor for tracking gadget directories */
+static int   backend_watch_fd = -1;
+
+/** I/O watch id for backend_watch_fd */
+static guint backend_watch_id = 0;
+
+/** File descriptor for tracking mount table changes */
+static int   backend_mount_fd = -1;
+
+/** I/O watch id for backend_mount_fd */
+static guint backend_mount_id = 0;
+
+/** udev context for tracking gadget device additions */
+static struct udev         *backend_udev_object  = 0;
+
+/** udev monitor for tracking gadget device additions */
+static struct udev_monitor *backend_udev_monitor = 0;
+
+/** I/O watch id for backend_udev_monitor */
+static guint                backend_udev_id      = 0;
+
+/* ========================================================================= *
+ * BACKEND
+ * ========================================================================= */
+
+/** Try to initialize configfs or android gadget backend
+ *
+ * @return backend name, or NULL if neither is available yet
+ */
+static const char *
+backend_probe(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !backend_configfs_found )
+        backend_configfs_found = configfs_init();
+
+    if( backend_configfs_found ) {
+        /* Gadget can't be enabled until there is a device controller */
+        if( configfs_has_udc() )
+            return "configfs";
+        log_debug("configfs gadget exists; waiting for udc");
+        return 0;
+    }
+
+    if( android_init() )
+        return "android";
+
+    return 0;
+}
+
+/** Choose backend to use after giving up on waiting
+ *
+ * @return backend name, or NULL if there is nothing to use
+ */
+static const char *
+backend_fallback(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Configfs gadget without udc is still better than nothing */
+    if( backend_configfs_found )
+        return "configfs";
+
+    if( modules_init() )
+        return "modules";
+
+    return 0;
+}
+
+/** Stop discovery and allow mode selection to proceed
+ *
+ * @param name  name of selected backend, or NULL
+ */
+static void
+backend_finish(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int64_t ms = (common_get_monotonic_us() - backend_discovery_t0) / 1000;
+
+    if( name )
+        log_notice("%s backend attached after %lld ms", name, (long long)ms);
+    else
+        log_crit("No supported usb control mechanisms found");
+
+    backend_pending = false;
+
+    if( backend_timeout_id ) {
+        g_source_remove(backend_timeout_id),
+            backend_timeout_id = 0;
+    }
+    backend_udev_stop();
+    backend_mount_stop();
+    backend_watch_stop();
+
+    control_backend_changed();
+}
+
+/** Re-probe gadget backends after filesystem / device changes
+ */
+static void
+backend_rethink(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *name = 0;
+
+    if( !backend_pending )
+        goto EXIT;
+
+    if( (name = backend_probe()) )
+        backend_finish(name);
+
+EXIT:
+    return;
+}
+
+/** Predicate for: Backend discovery has not finished yet
+ *
+ * @return true while waiting for gadget backend, false otherwise
+ */
+bool
+backend_discovery_pending(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return backend_pending;
+}
+
+/** React to init-done changes
+ *
+ * Gadget control structures should be in place by the time bootup
+ * is finished -> stop waiting and fall back to kernel modules.
+ */
+void
+backend_init_done_changed(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( backend_pending && usbmoded_init_done_p() ) {
+        log_warning("init-done reached; stop waiting for gadget");
+        backend_finish(backend_fallback());
+    }
+}
+
+/** Timer callback for giving up on gadget discovery
+ *
+ * @param aptr (unused)
+ *
+ * @return FALSE to stop timer from repeating
+ */
+static gboolean
+backend_timeout_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    if( backend_timeout_id ) {
+        backend_timeout_id = 0;
+        log_warning("configfs / android gadget did not show up");
+        backend_finish(backend_fallback());
+    }
+
+    return FALSE;
+}
+
+/** Select gadget backend
+ *
+ * If configfs or android gadget is not available during bootup, start
+ * tracking events that could signal their arrival. Usb mode selection
+ * is blocked until a backend gets selected.
+ *
+ * @return true if discovery was finished or started, false on failure
+ */
+bool
+backend_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    backend_discovery_t0 = common_get_monotonic_us();
+    backend_pending      = true;
+
+    /* Gadget might be there already */
+    backend_rethink();
+    if( !backend_pending )
+        goto DONE;
+
+    /* Do not wait if bootup has already been finished */
+    if( usbmoded_init_done_p() ) {
+        backend_finish(backend_fallback());
+        goto DONE;
+    }
+
+    /* Start tracking - all of these are best effort */
+    backend_watch_start();
+    backend_mount_start();
+    backend_udev_start();
+
+    /* In case something showed up while setting up tracking */
+    backend_rethink();
+    if( !backend_pending )
+        goto DONE;
+
+    backend_timeout_id = g_timeout_add(BACKEND_DISCOVERY_TIMEOUT_MS,
+                                       backend_timeout_cb, 0);
+    if( !backend_timeout_id )
+        goto EXIT;
+
+    log_notice("waiting for gadget backend to show up");
+
+DONE:
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Release resources allocated by backend_init()
+ */
+void
+backend_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    backend_pending = false;
+
+    if( backend_timeout_id ) {
+        g_source_remove(backend_timeout_id),
+            backend_timeout_id = 0;
+    }
+    backend_udev_stop();
+    backend_mount_stop();
+    backend_watch_stop();
+}
+
+/* ========================================================================= *
+ * BACKEND_WATCH
+ * ========================================================================= */
+
+/** Add inotify watches for directories where gadget items show up
+ *
+ * The gadget gets created in the parent of configured gadget base
+ * directory, which in turn appears in the configfs mount point.
+ *
+ * Note: Adding an existing watch again is harmless.
+ */
+static void
+backend_watch_add_dirs(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *base   = configfs_get_base_directory();
+    gchar *gadget = g_path_get_dirname(base);
+    gchar *mount  = g_path_get_dirname(gadget);
+
+    const char * const lut[] = {
+        mount,
+        gadget,
+        CONFIGFS_UDC_CLASS_DIR,
+        0
+    };
+
+    for( size_t i = 0; lut[i]; ++i ) {
+        char        real[PATH_MAX];
+        const char *path = common_sysroot_path(lut[i], real, sizeof real);
+        if( inotify_add_watch(backend_watch_fd, path,
+                              IN_CREATE | IN_MOVED_TO) == -1 &&
+            errno != ENOENT )
+            log_warning("%s: can't add inotify watch: %m", path);
+    }
+
+    g_free(mount);
+    g_free(gadget);
+    g_free(base);
+}
+
+/** Glib io watch callback for reading inotify events
+ *
+ * @param chn   glib io channel
+ * @param cnd   wakeup reason
+ * @param aptr  user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean
+backend_watch_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    gboolean keep_watch = FALSE;
+    int      fd         = g_io_channel_unix_get_fd(chn);
+
+    char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if( cnd & ~G_IO_IN )
+        goto EXIT;
+
+    for( ;; ) {
+        ssize_t rc = read(fd, buf, sizeof buf);
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            log_err("gadget watch: read: %m");
+            goto EXIT;
+        }
+        if( rc == 0 ) {
+            log_err("gadget watch: unexpected eof");
+            goto EXIT;
+        }
+    }
+
+    keep_watch = TRUE;
+
+    /* Gadget dir might have been created just now */
+    backend_watch_add_dirs();
+
+EXIT:
+    if( !keep_watch ) {
+        backend_watch_id = 0;
+        backend_watch_stop();
+    }
+
+    backend_rethink();
+
+    return keep_watch;
+}
+
+/** Start tracking gadget directories
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+backend_watch_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GIOChannel *chn = 0;
+
+    if( backend_watch_id )
+        goto EXIT;
+
+    if( (backend_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ) {
+        log_err("inotify_init: %m");
+        goto EXIT;
+    }
+
+    backend_watch_add_dirs();
+
+    if( !(chn = g_io_channel_unix_new(backend_watch_fd)) )
+        goto EXIT;
+
+    backend_watch_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                      backend_watch_input_cb, 0);
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( !backend_watch_id )
+        backend_watch_stop();
+
+    return backend_watch_id != 0;
+}
+
+/** Stop tracking gadget directories
+ */
+static void
+backend_watch_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( backend_watch_id ) {
+        g_source_remove(backend_watch_id),
+            backend_watch_id = 0;
+    }
+
+    if( backend_watch_fd != -1 ) {
+        close(backend_watch_fd),
+            backend_watch_fd = -1;
+    }
+}
+
+/* ========================================================================= *
+ * BACKEND_MOUNT
+ * ========================================================================= */
+
+/** Glib io watch callback for mount table changes
+ *
+ * Directory watches do not see configfs getting mounted on top
+ * of the watched directory, so track mount table changes too.
+ *
+ * @param chn   glib io channel
+ * @param cnd   wakeup reason
+ * @param aptr  user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean
+backend_mount_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)chn;
+    (void)aptr;
+
+    gboolean keep_watch = TRUE;
+
+    /* Mount table changes are signaled as POLLPRI | POLLERR */
+    if( cnd & (G_IO_HUP | G_IO_NVAL) ) {
+        log_err("mount watch: unexpected wakeup: 0x%x", (unsigned)cnd);
+        keep_watch = FALSE;
+        backend_mount_id = 0;
+        backend_mount_stop();
+    }
+    else {
+        log_debug("mount table changed");
+        if( backend_watch_fd != -1 )
+            backend_watch_add_dirs();
+    }
+
+    backend_rethink();
+
+    return keep_watch;
+}
+
+/** Start tracking mount table changes
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+backend_mount_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GIOChannel *chn = 0;
+
+    if( backend_mount_id )
+        goto EXIT;
+
+    if( (backend_mount_fd = open(BACKEND_MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC)) == -1 ) {
+        log_warning("%s: can't open: %m", BACKEND_MOUNTINFO_PATH);
+        goto EXIT;
+    }
+
+    if( !(chn = g_io_channel_unix_new(backend_mount_fd)) )
+        goto EXIT;
+
+    backend_mount_id = g_io_add_watch(chn, G_IO_PRI | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                      backend_mount_input_cb, 0);
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( !backend_mount_id )
+        backend_mount_stop();
+
+    return backend_mount_id != 0;
+}
+
+/** Stop tracking mount table changes
+ */
+static void
+backend_mount_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( backend_mount_id ) {
+        g_source_remove(backend_mount_id),
+            backend_mount_id = 0;
+    }
+
+    if( backend_mount_fd != -1 ) {
+        close(backend_mount_fd),
+            backend_mount_fd = -1;
+    }
+}
+
+/* ========================================================================= *
+ * BACKEND_UDEV
+ * ========================================================================= */
+
+/** Glib io watch callback for udev events
+ *
+ * Sysfs does not deliver inotify events for kernel created entries,
+ * so device controller and android gadget arrival is tracked via udev.
+ *
+ * @param chn   glib io channel
+ * @param cnd   wakeup reason
+ * @param aptr  user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean
+backend_udev_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)chn;
+    (void)aptr;
+
+    gboolean            keep_watch = FALSE;
+    struct udev_device *dev        = 0;
+
+    if( cnd & ~G_IO_IN )
+        goto EXIT;
+
+    if( !(dev = udev_monitor_receive_device(backend_udev_monitor)) )
+        goto EXIT;
+
+    keep_watch = TRUE;
+
+    log_debug("action=%s subsystem=%s syspath=%s",
+              udev_device_get_action(dev) ?: "n/a",
+              udev_device_get_subsystem(dev) ?: "n/a",
+              udev_device_get_syspath(dev) ?: "n/a");
+
+    if( !g_strcmp0(udev_device_get_action(dev), "add") )
+        backend_rethink();
+
+EXIT:
+    if( dev )
+        udev_device_unref(dev);
+
+    if( !keep_watch ) {
+        log_err("gadget udev watch disabled");
+        backend_udev_id = 0;
+        backend_udev_stop();
+    }
+
+    return keep_watch;
+}
+
+/** Start tracking udc and android_usb device additions
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+backend_udev_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GIOChannel *chn = 0;
+
+    if( backend_udev_id )
+        goto EXIT;
+
+    if( !(backend_udev_object = udev_new()) ) {
+        log_err("Can't create udev");
+        goto EXIT;
+    }
+
+    backend_udev_monitor = udev_monitor_new_from_netlink(backend_udev_object, "udev");
+    if( !backend_udev_monitor ) {
+        log_err("Unable to monitor the netlink");
+        goto EXIT;
+    }
+
+    if( udev_monitor_filter_add_match_subsystem_devtype(backend_udev_monitor, "udc", 0) != 0 ||
+        udev_monitor_filter_add_match_subsystem_devtype(backend_udev_monitor, "android_usb", 0) != 0 ) {
+        log_err("Unable to add udev subsystem filters");
+        goto EXIT;
+    }
+
+    if( udev_monitor_enable_receiving(backend_udev_monitor) != 0 ) {
+        log_err("Failed to enable monitor receiving");
+        goto EXIT;
+    }
+
+    if( !(chn = g_io_channel_unix_new(udev_monitor_get_fd(backend_udev_monitor))) )
+        goto EXIT;
+
+    backend_udev_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                     backend_udev_input_cb, 0);
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( !backend_udev_id )
+        backend_udev_stop();
+
+    return backend_udev_id != 0;
+}
+
+/** Stop tracking udc and android_usb device additions
+ */
+static void
+backend_udev_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( backend_udev_id ) {
+        g_source_remove(backend_udev_id),
+            backend_udev_id = 0;
+    }
+
+    if( backend_udev_monitor ) {
+        udev_monitor_unref(backend_udev_monitor),
+            backend_udev_monitor = 0;
+    }
+
+    if( backend_udev_object ) {
+        udev_unref(backend_udev_object),
+            backend_udev_object = 0;
+    }
+}
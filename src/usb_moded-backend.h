@@ -0,0 +1,49 @@
+/**
+ * @file usb_moded-backend.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_BACKEND_H_
+# define USB_MODED_BACKEND_H_
+
+# include <stdbool.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** How long to wait for configfs / android gadget to show up [ms]
+ *
+ * After this kernel modules based gadget configuration is tried.
+ */
+# define BACKEND_DISCOVERY_TIMEOUT_MS 20000
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * BACKEND
+ * ------------------------------------------------------------------------- */
+
+bool backend_discovery_pending(void);
+void backend_init_done_changed(void);
+bool backend_init             (void);
+void backend_quit             (void);
+
+#endif /* USB_MODED_BACKEND_H_ */
@@ -0,0 +1,319 @@
+/**
+ * @file usb_moded-blocker.c
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-blocker.h"
+
+#include "usb_moded-log.h"
+#include "usb_moded-worker.h"
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * BLOCKER
+ * ------------------------------------------------------------------------- */
+
+static void   blocker_free_cb     (gpointer self);
+static gchar *blocker_read_link   (int dirfd, const char *name);
+static gchar *blocker_read_comm   (int procfd);
+static gchar *blocker_check_links (int procfd, dev_t dev);
+static gchar *blocker_check_fds   (int procfd, dev_t dev);
+static gchar *blocker_check_maps  (int procfd, dev_t dev);
+GPtrArray    *blocker_scan        (const char *mountpoint, bool (*cancel_cb)(void *aptr), void *aptr);
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+static void blocker_free_cb(gpointer self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    blocker_t *blocker = self;
+
+    if( blocker ) {
+        g_free(blocker->bl_name);
+        g_free(blocker->bl_path);
+        g_free(blocker);
+    }
+}
+
+/** Read symlink target
+ *
+ * @param dirfd  directory file descriptor
+ * @param name   symlink name relative to dirfd
+ *
+ * @return link target, or NULL on failure
+ */
+static gchar *blocker_read_link(int dirfd, const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char    buf[PATH_MAX];
+    ssize_t len = readlinkat(dirfd, name, buf, sizeof buf - 1);
+
+    if( len < 0 )
+        return 0;
+
+    buf[len] = 0;
+    return g_strdup(buf);
+}
+
+/** Read process name
+ *
+ * @param procfd  /proc/PID directory file descriptor
+ *
+ * @return process name, or NULL on failure
+ */
+static gchar *blocker_read_comm(int procfd)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar   *res = 0;
+    int      fd  = -1;
+    char     buf[64];
+    ssize_t  len;
+
+    if( (fd = openat(procfd, "comm", O_RDONLY | O_CLOEXEC)) == -1 )
+        goto EXIT;
+
+    if( (len = read(fd, buf, sizeof buf - 1)) <= 0 )
+        goto EXIT;
+
+    buf[len] = 0;
+    buf[strcspn(buf, "\n")] = 0;
+    res = g_strdup(buf);
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    return res;
+}
+
+/** Check whether process working directory or root is on a device
+ *
+ * @param procfd  /proc/PID directory file descriptor
+ * @param dev     device number of the filesystem
+ *
+ * @return matching path, or NULL
+ */
+static gchar *blocker_check_links(int procfd, dev_t dev)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const links[] = { "cwd", "root", "exe", 0 };
+
+    struct stat st;
+
+    for( size_t i = 0; links[i]; ++i ) {
+        if( fstatat(procfd, links[i], &st, 0) == 0 && st.st_dev == dev )
+            return blocker_read_link(procfd, links[i]);
+    }
+    return 0;
+}
+
+/** Check whether process has open files on a device
+ *
+ * @param procfd  /proc/PID directory file descriptor
+ * @param dev     device number of the filesystem
+ *
+ * @return path of matching open file, or NULL
+ */
+static gchar *blocker_check_fds(int procfd, dev_t dev)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar         *res = 0;
+    int            fd  = -1;
+    DIR           *dir = 0;
+    struct dirent *de;
+    struct stat    st;
+
+    if( (fd = openat(procfd, "fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 )
+        goto EXIT;
+
+    if( !(dir = fdopendir(fd)) )
+        goto EXIT;
+    fd = -1;
+
+    while( !res && (de = readdir(dir)) ) {
+        if( de->d_name[0] == '.' )
+            continue;
+        if( fstatat(dirfd(dir), de->d_name, &st, 0) == -1 )
+            continue;
+        if( st.st_dev == dev )
+            res = blocker_read_link(dirfd(dir), de->d_name);
+    }
+
+EXIT:
+    if( dir )
+        closedir(dir);
+    if( fd != -1 )
+        close(fd);
+
+    return res;
+}
+
+/** Check whether process has files on a device mapped to memory
+ *
+ * Device numbers are compared as listed in /proc/PID/maps, so that
+ * no further filesystem access is needed.
+ *
+ * @param procfd  /proc/PID directory file descriptor
+ * @param dev     device number of the filesystem
+ *
+ * @return path of matching mapped file, or NULL
+ */
+static gchar *blocker_check_maps(int procfd, dev_t dev)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar  *res  = 0;
+    int     fd   = -1;
+    FILE   *fh   = 0;
+    char   *line = 0;
+    size_t  size = 0;
+
+    if( (fd = openat(procfd, "maps", O_RDONLY | O_CLOEXEC)) == -1 )
+        goto EXIT;
+
+    if( !(fh = fdopen(fd, "r")) )
+        goto EXIT;
+    fd = -1;
+
+    while( !res && getline(&line, &size, fh) != -1 ) {
+        unsigned      maj = 0, min = 0;
+        unsigned long ino = 0;
+        int           pos = 0;
+
+        /* address perms offset dev inode path */
+        if( sscanf(line, "%*s %*s %*s %x:%x %lu %n", &maj, &min, &ino, &pos) < 3 )
+            continue;
+        if( ino == 0 || makedev(maj, min) != dev )
+            continue;
+
+        line[strcspn(line, "\n")] = 0;
+        res = g_strdup(line + pos);
+    }
+
+EXIT:
+    free(line);
+    if( fh )
+        fclose(fh);
+    if( fd != -1 )
+        close(fd);
+
+    return res;
+}
+
+/** Find processes that keep a filesystem busy
+ *
+ * Walks /proc and checks working directories, open files and
+ * memory mapped files of all processes against the device number
+ * of the given mountpoint.
+ *
+ * The scan is abandoned if worker thread is asked to bail out, or
+ * if the optional cancel callback returns true. The latter allows
+ * scanning also from threads other than the worker thread.
+ *
+ * @param mountpoint  directory path
+ * @param cancel_cb   function returning true when scan should stop, or NULL
+ * @param aptr        argument to pass to cancel_cb
+ *
+ * @return array of blocker_t pointers, or NULL on failure
+ */
+GPtrArray *blocker_scan(const char *mountpoint, bool (*cancel_cb)(void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray     *res  = 0;
+    DIR           *dir  = 0;
+    struct dirent *de;
+    struct stat    st;
+    dev_t          dev;
+
+    if( stat(mountpoint, &st) == -1 ) {
+        log_warning("%s: stat failed: %m", mountpoint);
+        goto EXIT;
+    }
+    dev = st.st_dev;
+
+    if( !(dir = opendir("/proc")) ) {
+        log_err("/proc: can't open: %m");
+        goto EXIT;
+    }
+
+    res = g_ptr_array_new_with_free_func(blocker_free_cb);
+
+    while( (de = readdir(dir)) ) {
+        char  *end = 0;
+        long   pid = strtol(de->d_name, &end, 10);
+        int    procfd;
+        gchar *path;
+
+        if( end == de->d_name || *end || pid <= 0 )
+            continue;
+
+        if( worker_bailing_out() || (cancel_cb && cancel_cb(aptr)) ) {
+            log_debug("blocker scan interrupted");
+            break;
+        }
+
+        procfd = openat(dirfd(dir), de->d_name,
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if( procfd == -1 )
+            continue;
+
+        if( !(path = blocker_check_links(procfd, dev)) &&
+            !(path = blocker_check_fds(procfd, dev)) )
+            path = blocker_check_maps(procfd, dev);
+
+        if( path ) {
+            blocker_t *blocker = g_malloc0(sizeof *blocker);
+            blocker->bl_pid  = (pid_t)pid;
+            blocker->bl_uid  = (fstat(procfd, &st) == 0) ? st.st_uid : (uid_t)-1;
+            blocker->bl_name = blocker_read_comm(procfd) ?: g_strdup("unknown");
+            blocker->bl_path = path;
+            g_ptr_array_add(res, blocker);
+        }
+
+        close(procfd);
+    }
+
+EXIT:
+    if( dir )
+        closedir(dir);
+
+    return res;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file usb_moded-blocker.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+
+#ifndef  USB_MODED_BLOCKER_H_
+# define USB_MODED_BLOCKER_H_
+
+# include <sys/types.h>
+
+# include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Process that keeps a filesystem busy */
+typedef struct blocker_t
+{
+    /** Process id */
+    pid_t  bl_pid;
+
+    /** Owner of the process */
+    uid_t  bl_uid;
+
+    /** Process name, as in /proc/PID/comm */
+    gchar *bl_name;
+
+    /** First file found referencing the filesystem */
+    gchar *bl_path;
+} blocker_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * BLOCKER
+ * ------------------------------------------------------------------------- */
+
+GPtrArray *blocker_scan(const char *mountpoint, bool (*cancel_cb)(void *aptr), void *aptr);
+
+#endif /* USB_MODED_BLOCKER_H_ */
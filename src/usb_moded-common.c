@@ -34,10 +34,17 @@
 #include "usb_moded-worker.h"
 
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
 
 /* ========================================================================= *
  * Types
@@ -56,6 +63,25 @@ typedef struct modemapping_t
     const char *external_mode;
 } modemapping_t;
 
+/** Child process tracking state used by common_spawn_() */
+typedef struct spawnchild_t
+{
+    /** Child process id, or -1 after it has been reaped */
+    pid_t pid;
+
+    /** pidfd for the child, or -1 if not supported by the kernel */
+    int   pidfd;
+
+    /** Read end of child output pipe, or -1 after EOF */
+    int   outfd;
+
+    /** Wait status of the reaped child */
+    int   status;
+
+    /** errno from failed waitpid(), or 0 */
+    int   error;
+} spawnchild_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -81,14 +107,70 @@ void         common_acquire_wakelock             (const char *wakelock_name);
 void         common_release_wakelock             (const char *wakelock_name);
 int          common_system_                      (const char *file, int line, const char *func, const char *command);
 FILE        *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
+int64_t      common_get_monotonic_us             (void);
+static void  common_spawn_log_output             (const char *name, GString *buf, bool flush);
+static int   common_spawn_open_pidfd             (pid_t pid);
+static bool  common_spawn_reap                   (spawnchild_t *child);
+static bool  common_spawn_reap_cb                (void *aptr);
+static bool  common_spawn_ready_cb               (void *aptr);
+static bool  common_spawn_reap_wait              (spawnchild_t *child, unsigned wait_ms);
+static void  common_spawn_relay_output           (spawnchild_t *child, const char *name, GString *buf);
+static void  common_spawn_terminate              (spawnchild_t *child);
+int          common_spawn_                       (const char *file, int line, const char *func, unsigned timeout_ms, const char *const *argv);
+static int   common_wait_add_waiter              (void);
+static void  common_wait_remove_waiter           (int fd);
+void         common_wait_notify                  (void);
+waitres_t    common_wait_fds                     (unsigned tot_ms, const struct pollfd *fds, size_t count, bool (*ready_cb)(void *aptr), void *aptr);
 waitres_t    common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
 bool         common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
-static bool  common_mode_in_list                 (const char *mode, char *const *modes);
+void         common_set_sysroot                  (const char *dir);
+const char  *common_get_sysroot                  (void);
+static bool  common_sysroot_applies              (const char *path);
+const char  *common_sysroot_path                 (const char *path, char *buf, size_t size);
+gchar       *common_sysroot_dup                  (const char *path);
+int          common_sysroot_write_flags          (void);
 bool         common_modename_is_internal         (const char *modename);
 bool         common_modename_is_static           (const char *modename);
 int          common_valid_mode                   (const char *mode);
 gchar       *common_get_mode_list                (mode_list_type_t type, uid_t uid);
 
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Environment to pass to child processes */
+extern char **environ;
+
+/** Mutex for protecting common_wait_waiters */
+static pthread_mutex_t common_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** eventfds of threads blocked in common_wait(), as int pointers
+ *
+ * Each waiter has its own eventfd, so that common_wait_notify()
+ * wakes up all of them instead of whichever happens to poll first.
+ */
+static GSList *common_wait_waiters = 0;
+
+#define COMMON_WAIT_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&common_wait_mutex) != 0 ) { \
+        log_crit("COMMON WAIT LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define COMMON_WAIT_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&common_wait_mutex) != 0 ) { \
+        log_crit("COMMON WAIT UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/** Directory to use instead of "/" for kernel interfaces, or NULL
+ *
+ * Allows running usb-moded against a fake sysfs / configfs tree.
+ */
+static gchar *common_sysroot = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -289,7 +371,8 @@ static void common_write_to_sysfs_file(const char *path, const char *text)
     if (!path || !text)
         goto EXIT;
 
-    if ((fd = open(path, O_WRONLY)) == -1) {
+    char real[PATH_MAX];
+    if ((fd = open(common_sysroot_path(path, real, sizeof real), common_sysroot_write_flags(), 0644)) == -1) {
         if (errno != ENOENT) {
             log_warning("%s: open for writing failed: %m", path);
         }
@@ -412,54 +495,723 @@ common_popen_(const char *file, int line, const char *func,
     return popen(command, type);
 }
 
-waitres_t
-common_wait(unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr)
+/** Get monotonic timestamp
+ *
+ * @return microseconds since unspecified starting point
+ */
+int64_t
+common_get_monotonic_us(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+/** Set alternative root directory for kernel interfaces
+ *
+ * Note: This function should be called only during startup.
+ *
+ * @param dir  directory path, or NULL / empty string to use "/"
+ */
+void
+common_set_sysroot(const char *dir)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(common_sysroot), common_sysroot = 0;
+
+    if( dir && *dir && strcmp(dir, "/") ) {
+        common_sysroot = g_strdup(dir);
+        /* Drop trailing slashes */
+        for( size_t len = strlen(common_sysroot);
+             len > 1 && common_sysroot[len - 1] == '/'; )
+            common_sysroot[--len] = 0;
+        log_notice("using kernel interfaces under %s", common_sysroot);
+    }
+}
+
+/** Get alternative root directory for kernel interfaces
+ *
+ * @return directory path, or NULL if not in use
+ */
+const char *
+common_get_sysroot(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return common_sysroot;
+}
+
+/** Predicate for: path refers to a kernel interface affected by sysroot
+ *
+ * Only sysfs, configfs and sysctl paths are redirected, device nodes
+ * and process information still come from the real system.
+ *
+ * @param path  absolute path
+ *
+ * @return true if path should be prefixed, false otherwise
+ */
+static bool
+common_sysroot_applies(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const lut[] = {
+        "/sys/",
+        "/config/",
+        "/proc/sys/",
+        0
+    };
+
+    if( !common_sysroot || !path )
+        return false;
+
+    /* Already prefixed */
+    size_t len = strlen(common_sysroot);
+    if( !strncmp(path, common_sysroot, len) && path[len] == '/' )
+        return false;
+
+    if( !strcmp(path, "/sys") || !strcmp(path, "/config") )
+        return true;
+
+    for( size_t i = 0; lut[i]; ++i ) {
+        if( !strncmp(path, lut[i], strlen(lut[i])) )
+            return true;
+    }
+
+    return false;
+}
+
+/** Map kernel interface path to sysroot
+ *
+ * @param path  absolute path
+ * @param buf   buffer for prefixed path
+ * @param size  size of buf
+ *
+ * @return path as is if sysroot is not in use / does not apply,
+ *         otherwise buf holding prefixed path
+ */
+const char *
+common_sysroot_path(const char *path, char *buf, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !common_sysroot_applies(path) )
+        return path;
+
+    snprintf(buf, size, "%s%s", common_sysroot, path);
+    return buf;
+}
+
+/** Map kernel interface path to sysroot
+ *
+ * @param path  absolute path
+ *
+ * @return dynamically allocated path, or NULL if path is NULL
+ */
+gchar *
+common_sysroot_dup(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !common_sysroot_applies(path) )
+        return g_strdup(path);
+
+    return g_strconcat(common_sysroot, path, NULL);
+}
+
+/** Get open() flags for writing kernel interface attributes
+ *
+ * Kernel attribute files take the written value as a whole, while
+ * regular files standing in for them under sysroot need to be
+ * truncated so that shorter values do not leave stale data behind.
+ * They are also created on demand, as nothing populates function
+ * and lun directories with attributes the way the kernel does.
+ *
+ * @return flags to pass to open(), which then needs also mode argument
+ */
+int
+common_sysroot_write_flags(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return O_WRONLY | (common_sysroot ? O_CREAT | O_TRUNC : 0);
+}
+
+/** Emit complete lines of child process output to log
+ *
+ * @param name   name of the executable
+ * @param buf    buffer holding unprocessed output
+ * @param flush  true to emit also incomplete last line
+ */
+static void
+common_spawn_log_output(const char *name, GString *buf, bool flush)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *pos;
+
+    while( (pos = memchr(buf->str, '\n', buf->len)) ) {
+        *pos = 0;
+        if( *buf->str )
+            log_debug("%s: %s", name, buf->str);
+        g_string_erase(buf, 0, pos + 1 - buf->str);
+    }
+
+    if( flush && buf->len > 0 ) {
+        log_debug("%s: %s", name, buf->str);
+        g_string_truncate(buf, 0);
+    }
+}
+
+/** Get pidfd for waiting child process exit via poll()
+ *
+ * @param pid  child process id
+ *
+ * @return pidfd, or -1 if not available
+ */
+static int
+common_spawn_open_pidfd(pid_t pid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int fd = -1;
+
+#ifdef SYS_pidfd_open
+    /* Note: pidfds are always close-on-exec */
+    if( (fd = syscall(SYS_pidfd_open, pid, 0)) == -1 && errno != ENOSYS )
+        log_warning("pidfd_open(%d): %m", (int)pid);
+#else
+    (void)pid;
+#endif
+
+    return fd;
+}
+
+/** Reap child process if it has exited
+ *
+ * If waitpid() fails, the child is treated as gone and the
+ * error is stored for common_spawn_() to report.
+ *
+ * @param child  child process tracking state
+ *
+ * @return true if child process is no longer waited for, false otherwise
+ */
+static bool
+common_spawn_reap(spawnchild_t *child)
+{
+    LOG_REGISTER_CONTEXT;
+
+    while( child->pid != -1 ) {
+        pid_t rc = waitpid(child->pid, &child->status, WNOHANG);
+
+        if( rc == 0 )
+            break;
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            child->error = errno;
+            log_err("waitpid(%d): %m", (int)child->pid);
+        }
+
+        child->pid = -1;
+    }
+
+    return child->pid == -1;
+}
+
+/** Wait condition callback: child process has been reaped
+ *
+ * @param aptr  child process tracking state
+ *
+ * @return true if child process is no longer waited for, false otherwise
+ */
+static bool
+common_spawn_reap_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return common_spawn_reap(aptr);
+}
+
+/** Wait condition callback: child has output to relay or has been reaped
+ *
+ * @param aptr  child process tracking state
+ *
+ * @return true if common_spawn_() has something to do, false otherwise
+ */
+static bool
+common_spawn_ready_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    spawnchild_t *child = aptr;
+
+    if( child->outfd != -1 ) {
+        struct pollfd pfd = { .fd = child->outfd, .events = POLLIN };
+        if( poll(&pfd, 1, 0) > 0 )
+            return true;
+    }
+
+    return common_spawn_reap(child);
+}
+
+/** Wait for child process to exit, regardless of worker bailout
+ *
+ * Used for reaping after the child has been signaled, so
+ * common_wait_fds() - which gives up on bailout - is not used.
+ *
+ * @param child    child process tracking state
+ * @param wait_ms  maximum time to wait
+ *
+ * @return true if child process was reaped, false otherwise
+ */
+static bool
+common_spawn_reap_wait(spawnchild_t *child, unsigned wait_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int64_t deadline = common_get_monotonic_us() + wait_ms * INT64_C(1000);
+
+    while( !common_spawn_reap(child) ) {
+        int64_t left_ms = (deadline - common_get_monotonic_us() + 999) / 1000;
+        if( left_ms <= 0 )
+            return false;
+
+        if( child->pidfd != -1 ) {
+            struct pollfd pfd = { .fd = child->pidfd, .events = POLLIN };
+            poll(&pfd, 1, (int)left_ms);
+        }
+        else {
+            /* No pidfd support -> fall back to polling */
+            struct timespec ts = { 0, 10 * 1000 * 1000 };
+            nanosleep(&ts, 0);
+        }
+    }
+
+    return true;
+}
+
+/** Relay available child process output to log
+ *
+ * @param child  child process tracking state
+ * @param name   name of the executable
+ * @param buf    buffer holding unprocessed output
+ */
+static void
+common_spawn_relay_output(spawnchild_t *child, const char *name, GString *buf)
 {
     LOG_REGISTER_CONTEXT;
 
-    struct timespec ts;
+    while( child->outfd != -1 ) {
+        struct pollfd pfd = { .fd = child->outfd, .events = POLLIN };
+        if( poll(&pfd, 1, 0) <= 0 )
+            break;
 
-    waitres_t res = WAIT_FAILED;
+        char    tmp[256];
+        ssize_t rc = read(child->outfd, tmp, sizeof tmp);
+        if( rc > 0 ) {
+            g_string_append_len(buf, tmp, rc);
+            common_spawn_log_output(name, buf, false);
+        }
+        else if( rc == 0 || (errno != EINTR && errno != EAGAIN) ) {
+            close(child->outfd), child->outfd = -1;
+        }
+    }
+}
+
+/** Terminate child process group and reap the child process
+ *
+ * @param child  child process tracking state
+ */
+static void
+common_spawn_terminate(spawnchild_t *child)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pid_t pid = child->pid;
+
+    /* Give the child a chance to exit cleanly ... */
+    kill(-pid, SIGTERM);
+    if( common_spawn_reap_wait(child, 500) )
+        return;
+
+    /* ... before using brute force */
+    log_warning("pid %d did not terminate; killing", (int)pid);
+    kill(-pid, SIGKILL);
+    while( waitpid(pid, &child->status, 0) == -1 ) {
+        if( errno != EINTR ) {
+            child->error = errno;
+            log_err("waitpid(%d): %m", (int)pid);
+            break;
+        }
+    }
+    child->pid = -1;
+}
+
+/** Execute a program without using shell
+ *
+ * Child process gets stdin from /dev/null and stdout + stderr
+ * are redirected to usb-moded debug log.
+ *
+ * When called from the worker thread, the child process is
+ * terminated if the mode switch being made is abandoned.
+ *
+ * @param file        source file making the call
+ * @param line        source line making the call
+ * @param func        function making the call
+ * @param timeout_ms  maximum time to allow the child process to run
+ * @param argv        NULL terminated argument vector, argv[0] is
+ *                    used for looking up the executable from PATH
+ *
+ * @return exit code of the child process, COMMON_SPAWN_WAIT_FAILED if
+ *         the child could not be reaped, or -1 on other failures
+ */
+int
+common_spawn_(const char *file, int line, const char *func,
+              unsigned timeout_ms, const char *const *argv)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int          result      = -1;
+    int          pfd[2]      = { -1, -1 };
+    const char  *aborted     = 0;
+    char         exited[32]  = "";
+    char         trapped[32] = "";
+    const char  *dumped      = "";
+    gchar       *command     = g_strjoinv(" ", (gchar **)argv);
+    GString     *output      = g_string_new(0);
+    int64_t      deadline    = 0;
+    sigset_t     sigs;
+    spawnchild_t child       = {
+        .pid    = -1,
+        .pidfd  = -1,
+        .outfd  = -1,
+        .status = -1,
+    };
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t          at;
+
+    log_debug("EXEC %s; from %s:%d: %s()", command, file, line, func);
+
+    if( pipe2(pfd, O_CLOEXEC) == -1 ) {
+        log_err("pipe: %m");
+        goto EXIT;
+    }
+
+    /* stdin from /dev/null, stdout and stderr to pipe */
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, pfd[1], STDERR_FILENO);
+
+    /* Signals blocked / trapped by usb-moded must not affect the
+     * child, and using separate process group makes it possible
+     * to terminate also possible grandchild processes. */
+    posix_spawnattr_init(&at);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&at, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGTERM);
+    posix_spawnattr_setsigdefault(&at, &sigs);
+    posix_spawnattr_setpgroup(&at, 0);
+    posix_spawnattr_setflags(&at, (POSIX_SPAWN_SETSIGMASK |
+                                   POSIX_SPAWN_SETSIGDEF |
+                                   POSIX_SPAWN_SETPGROUP));
+
+    int err = posix_spawnp(&child.pid, argv[0], &fa, &at,
+                           (char * const *)argv, environ);
+
+    posix_spawnattr_destroy(&at);
+    posix_spawn_file_actions_destroy(&fa);
+
+    close(pfd[1]), pfd[1] = -1;
+
+    if( err ) {
+        child.pid = -1;
+        snprintf(exited, sizeof exited, " exec=failed");
+        errno = err;
+        log_debug("%s: %m", argv[0]);
+        goto EXIT;
+    }
+
+    child.outfd = pfd[0], pfd[0] = -1;
+    child.pidfd = common_spawn_open_pidfd(child.pid);
+
+    deadline = common_get_monotonic_us() + timeout_ms * INT64_C(1000);
 
     for( ;; ) {
-        unsigned nap_ms = (tot_ms > 200) ? 200 : tot_ms;
-
-        ts.tv_sec  = (nap_ms / 1000);
-        ts.tv_nsec = (nap_ms % 1000);
-        ts.tv_nsec *= 1000 * 1000;
-
-        for( ;; ) {
-            if( ready_cb && ready_cb(aptr) ) {
-                res = WAIT_READY;
-                goto EXIT;
-            }
-
-            if( tot_ms <= 0 ) {
-                res = WAIT_TIMEOUT;
-                goto EXIT;
-            }
-
-            if( worker_bailing_out() ) {
-                log_warning("wait canceled");
-                goto EXIT;
-            }
-
-            if( nanosleep(&ts, &ts) == 0 )
-                break;
-
-            if( errno != EINTR ) {
-                log_warning("wait failed: %m");
-                goto EXIT;
-            }
+        /* Relay output until the child closes its end of the pipe */
+        common_spawn_relay_output(&child, argv[0], output);
+
+        /* Note: Daemonizing children might keep the pipe open after
+         *       the child itself has exited -> check exit separately */
+        if( common_spawn_reap(&child) )
+            break;
+
+        if( worker_bailing_out() ) {
+            aborted = " aborted=canceled";
+            break;
         }
 
-        tot_ms -= nap_ms;
+        int64_t left_ms = (deadline - common_get_monotonic_us() + 999) / 1000;
+        if( left_ms <= 0 ) {
+            aborted = " aborted=timeout";
+            break;
+        }
+
+        /* Sleep until there is output, the child exits, or worker
+         * bails out. Without pidfd support exit is noticed only
+         * when common_wait_fds() re-evaluates the condition. */
+        struct pollfd fds[2];
+        size_t        count = 0;
+
+        if( child.outfd != -1 )
+            fds[count++] = (struct pollfd){ .fd = child.outfd, .events = POLLIN };
+        if( child.pidfd != -1 )
+            fds[count++] = (struct pollfd){ .fd = child.pidfd, .events = POLLIN };
+
+        if( common_wait_fds((unsigned)left_ms, fds, count,
+                            common_spawn_ready_cb, &child) == WAIT_FAILED &&
+            !worker_bailing_out() ) {
+            aborted = " aborted=wait_failed";
+            break;
+        }
+    }
+
+    if( child.pid != -1 )
+        common_spawn_terminate(&child);
+
+    if( child.error ) {
+        /* Status is not available -> do not try to decode it */
+        snprintf(exited, sizeof exited, " wait=%s", strerror(child.error));
+        result = COMMON_SPAWN_WAIT_FAILED;
+        goto EXIT;
+    }
+
+    if( WIFSIGNALED(child.status) ) {
+        snprintf(trapped, sizeof trapped, " signal=%s",
+                 strsignal(WTERMSIG(child.status)));
+    }
+
+    if( WCOREDUMP(child.status) )
+        dumped = " core=dumped";
+
+    if( WIFEXITED(child.status) && !aborted ) {
+        result = WEXITSTATUS(child.status);
+        snprintf(exited, sizeof exited, " exit_code=%d", result);
     }
 
 EXIT:
+    common_spawn_log_output(argv[0], output, true);
+
+    if( result != 0 ) {
+        log_warning("EXEC %s; from %s:%d: %s();%s%s%s%s result=%d",
+                    command, file, line, func,
+                    exited, aborted ?: "", trapped, dumped, result);
+    }
+
+    if( pfd[1] != -1 ) close(pfd[1]);
+    if( pfd[0] != -1 ) close(pfd[0]);
+    if( child.outfd != -1 ) close(child.outfd);
+    if( child.pidfd != -1 ) close(child.pidfd);
+
+    g_string_free(output, TRUE);
+    g_free(command);
+
+    return result;
+}
+
+/** Register a common_wait() caller for notifications
+ *
+ * @return eventfd that common_wait_notify() signals, or -1 on failure
+ */
+static int
+common_wait_add_waiter(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if( fd == -1 ) {
+        log_err("failed to create wait eventfd: %m");
+    }
+    else {
+        COMMON_WAIT_LOCKED_ENTER;
+        common_wait_waiters = g_slist_prepend(common_wait_waiters,
+                                              GINT_TO_POINTER(fd));
+        COMMON_WAIT_LOCKED_LEAVE;
+    }
+
+    return fd;
+}
+
+/** Unregister a common_wait() caller and close its eventfd
+ *
+ * @param fd  eventfd from common_wait_add_waiter(), or -1
+ */
+static void
+common_wait_remove_waiter(int fd)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( fd != -1 ) {
+        COMMON_WAIT_LOCKED_ENTER;
+        common_wait_waiters = g_slist_remove(common_wait_waiters,
+                                             GINT_TO_POINTER(fd));
+        COMMON_WAIT_LOCKED_LEAVE;
+        close(fd);
+    }
+}
+
+/** Wake up threads blocked in common_wait()
+ *
+ * Should be called whenever something that a common_wait() ready
+ * callback might be evaluating could have changed - e.g. D-Bus name
+ * owner or systemd unit state changes.
+ */
+void
+common_wait_notify(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    COMMON_WAIT_LOCKED_ENTER;
+    for( GSList *item = common_wait_waiters; item; item = item->next ) {
+        int      fd  = GPOINTER_TO_INT(item->data);
+        uint64_t cnt = 1;
+        if( write(fd, &cnt, sizeof cnt) == -1 && errno != EAGAIN )
+            log_err("failed to signal wait eventfd: %m");
+    }
+    COMMON_WAIT_LOCKED_LEAVE;
+}
+
+/** Wait until condition is met, time limit is reached or worker bails out
+ *
+ * Ready condition is re-evaluated immediately when common_wait_notify()
+ * is called, or when any of the caller provided file descriptors gets
+ * activity. As not all relevant state changes produce notifications,
+ * it is also periodically re-evaluated with increasing intervals.
+ *
+ * The ready callback is responsible for consuming whatever input
+ * is available in the caller provided file descriptors.
+ *
+ * When called from worker thread, pending mode change requests
+ * interrupt the wait without delay.
+ *
+ * @param tot_ms    maximum time to wait [ms]
+ * @param fds       additional file descriptors to poll, or NULL
+ * @param count     number of entries in fds array
+ * @param ready_cb  condition to wait for, or NULL for plain sleep
+ * @param aptr      argument to pass to ready_cb
+ *
+ * @return WAIT_READY, WAIT_TIMEOUT, or WAIT_FAILED
+ */
+waitres_t
+common_wait_fds(unsigned tot_ms, const struct pollfd *fds, size_t count,
+                bool (*ready_cb)(void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    waitres_t res        = WAIT_FAILED;
+    int64_t   deadline   = common_get_monotonic_us() + tot_ms * INT64_C(1000);
+    int       wait_fd    = ready_cb ? common_wait_add_waiter() : -1;
+    int       bailout_fd = worker_get_bailout_fd();
+    unsigned  recheck_ms = COMMON_WAIT_RECHECK_MIN_MS;
+
+    for( ;; ) {
+        if( ready_cb && ready_cb(aptr) ) {
+            res = WAIT_READY;
+            goto EXIT;
+        }
+
+        int64_t left_ms = (deadline - common_get_monotonic_us() + 999) / 1000;
+        if( left_ms <= 0 ) {
+            res = WAIT_TIMEOUT;
+            goto EXIT;
+        }
+
+        if( worker_bailing_out() ) {
+            log_warning("wait canceled");
+            goto EXIT;
+        }
+
+        int nap_ms = (int)left_ms;
+        if( ready_cb && nap_ms > (int)recheck_ms )
+            nap_ms = (int)recheck_ms;
+
+        struct pollfd pfd[2 + COMMON_WAIT_FDS_MAX];
+        nfds_t        nfds = 0;
+        int           wait_ix = -1, bailout_ix = -1;
+
+        for( size_t i = 0; i < count && i < COMMON_WAIT_FDS_MAX; ++i )
+            pfd[nfds++] = fds[i];
+
+        if( wait_fd != -1 ) {
+            wait_ix = nfds++;
+            pfd[wait_ix] = (struct pollfd){ .fd = wait_fd, .events = POLLIN };
+        }
+        if( bailout_fd != -1 ) {
+            bailout_ix = nfds++;
+            pfd[bailout_ix] = (struct pollfd){ .fd = bailout_fd, .events = POLLIN };
+        }
+
+        int rc = poll(pfd, nfds, nap_ms);
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_warning("wait failed: %m");
+            goto EXIT;
+        }
+
+        if( wait_ix != -1 && pfd[wait_ix].revents ) {
+            /* Consume notification and re-evaluate */
+            uint64_t cnt = 0;
+            if( read(wait_fd, &cnt, sizeof cnt) == -1 && errno != EAGAIN )
+                log_warning("wait eventfd read failed: %m");
+        }
+
+        if( bailout_ix != -1 && pfd[bailout_ix].revents ) {
+            /* Worker request fd stays readable until the worker thread
+             * gets to read it. If it does not translate to bailout,
+             * stop polling it so that we do not end up busy looping. */
+            if( !worker_bailing_out() )
+                bailout_fd = -1;
+        }
+
+        if( recheck_ms < COMMON_WAIT_RECHECK_MAX_MS )
+            recheck_ms *= 2;
+    }
+
+EXIT:
+    common_wait_remove_waiter(wait_fd);
+
     return res;
 }
 
+/** Wait until condition is met, time limit is reached or worker bails out
+ *
+ * @param tot_ms    maximum time to wait [ms]
+ * @param ready_cb  condition to wait for, or NULL for plain sleep
+ * @param aptr      argument to pass to ready_cb
+ *
+ * @return WAIT_READY, WAIT_TIMEOUT, or WAIT_FAILED
+ */
+waitres_t
+common_wait(unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return common_wait_fds(tot_ms, 0, 0, ready_cb, aptr);
+}
+
 /** Wrapper to give visibility to blocking sleeps usb-moded is making
  */
 bool
@@ -476,24 +1228,6 @@ common_msleep_(const char *file, int line, const char *func, unsigned msec)
  * MISC
  * ------------------------------------------------------------------------- */
 
-/* check if a mode is in a list */
-static bool common_mode_in_list(const char *mode, char * const *modes)
-{
-    LOG_REGISTER_CONTEXT;
-
-    int i;
-
-    if (!modes)
-        return false;
-
-    for(i = 0; modes[i] != NULL; i++)
-    {
-        if(!strcmp(modes[i], mode))
-            return true;
-    }
-    return false;
-}
-
 /** Check if given usb mode is internal
  *
  * @param modename name of a more
@@ -545,21 +1279,8 @@ int common_valid_mode(const char *mode)
     }
     else
     {
-        const modedata_t *data = usbmoded_get_modedata(mode);
-
-        if( data ) {
-            gchar  *whitelist_value = 0;
-            gchar **whitelist_array = 0;
-
-            if( (whitelist_value = config_get_mode_whitelist()) )
-                whitelist_array = g_strsplit(whitelist_value, ",", 0);
-
-            if (!whitelist_array || common_mode_in_list(data->mode_name, whitelist_array))
-                valid = 0;
-
-            g_strfreev(whitelist_array);
-            g_free(whitelist_value);
-        }
+        if( usbmoded_is_mode_whitelisted(mode) )
+            valid = 0;
     }
     return valid;
 }
@@ -578,11 +1299,9 @@ gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
 
     GString *mode_list_str = g_string_new(NULL);
 
-    gchar  *hidden_modes_value = 0;
-    gchar **hidden_modes_array = 0;
-
-    gchar  *whitelist_value = 0;
-    gchar **whitelist_array = 0;
+    /* Supported: All modes that are not hidden
+     * Available: All whitelisted modes that are not hidden */
+    bool check_whitelist = (type == AVAILABLE_MODES_LIST);
 
     if( usbmoded_get_diag_mode() )
     {
@@ -591,21 +1310,6 @@ gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
         goto EXIT;
     }
 
-    if( (hidden_modes_value = config_get_hidden_modes()) )
-        hidden_modes_array = g_strsplit(hidden_modes_value, ",", 0);
-
-    switch( type ) {
-    case SUPPORTED_MODES_LIST:
-        /* All modes that are not hidden */
-        break;
-
-    case AVAILABLE_MODES_LIST:
-        /* All whitelisted modes that are not hidden */
-        if( (whitelist_value = config_get_mode_whitelist()) )
-            whitelist_array = g_strsplit(whitelist_value, ",", 0);
-        break;
-    }
-
     for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) )
     {
         modedata_t *data = iter->data;
@@ -615,11 +1319,11 @@ gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
             continue;
 
         /* skip items in the hidden list */
-        if (common_mode_in_list(data->mode_name, hidden_modes_array))
+        if (usbmoded_is_mode_hidden(data->mode_name))
             continue;
 
         /* if there is a whitelist skip items not in the list */
-        if (whitelist_array && !common_mode_in_list(data->mode_name, whitelist_array))
+        if (check_whitelist && !usbmoded_is_mode_whitelisted(data->mode_name))
             continue;
 
         g_string_append(mode_list_str, data->mode_name);
@@ -630,11 +1334,5 @@ gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
     g_string_append(mode_list_str, MODE_CHARGING);
 
 EXIT:
-    g_strfreev(whitelist_array);
-    g_free(whitelist_value);
-
-    g_strfreev(hidden_modes_array);
-    g_free(hidden_modes_value);
-
     return g_string_free(mode_list_str, false);
 }
@@ -29,6 +29,8 @@
 
 # include <stdio.h>
 # include <stdbool.h>
+# include <stdint.h>
+# include <poll.h>
 # include <glib.h>
 
 /* ========================================================================= *
@@ -83,8 +85,17 @@ void        common_acquire_wakelock             (const char *wakelock_name);
 void        common_release_wakelock             (const char *wakelock_name);
 int         common_system_                      (const char *file, int line, const char *func, const char *command);
 FILE       *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
+int64_t     common_get_monotonic_us             (void);
+int         common_spawn_                       (const char *file, int line, const char *func, unsigned timeout_ms, const char *const *argv);
+void        common_wait_notify                  (void);
+waitres_t   common_wait_fds                     (unsigned tot_ms, const struct pollfd *fds, size_t count, bool (*ready_cb)(void *aptr), void *aptr);
 waitres_t   common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
 bool        common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
+void        common_set_sysroot                  (const char *dir);
+const char *common_get_sysroot                  (void);
+const char *common_sysroot_path                 (const char *path, char *buf, size_t size);
+gchar      *common_sysroot_dup                  (const char *path);
+int         common_sysroot_write_flags          (void);
 bool        common_modename_is_internal         (const char *modename);
 bool        common_modename_is_static           (const char *modename);
 int         common_valid_mode                   (const char *mode);
@@ -96,6 +107,7 @@ gchar      *common_get_mode_list                (mode_list_type_t type, uid_t ui
 
 # define               common_system(command)      common_system_(__FILE__,__LINE__,__FUNCTION__,(command))
 # define               common_popen(command, type) common_popen_(__FILE__,__LINE__,__FUNCTION__,(command),(type))
+# define               common_spawn(timeout_ms, ...) common_spawn_(__FILE__,__LINE__,__FUNCTION__,(timeout_ms),(const char *const[]){__VA_ARGS__, 0})
 # define               common_msleep(msec)         common_msleep_(__FILE__,__LINE__,__FUNCTION__,(msec))
 # define               common_sleep(sec)           common_msleep_(__FILE__,__LINE__,__FUNCTION__,(sec)*1000)
 
@@ -104,4 +116,19 @@ gchar      *common_get_mode_list                (mode_list_type_t type, uid_t ui
  * ========================================================================= */
 # define UID_UNKNOWN ((uid_t)-1)
 
+/** Default time limit for programs executed via common_spawn() [ms] */
+# define COMMON_SPAWN_TIMEOUT_MS 30000
+
+/** common_spawn() result when child process exit status could not be had */
+# define COMMON_SPAWN_WAIT_FAILED (-2)
+
+/** Initial interval for re-evaluating common_wait() condition [ms] */
+# define COMMON_WAIT_RECHECK_MIN_MS 10
+
+/** Maximum interval for re-evaluating common_wait() condition [ms] */
+# define COMMON_WAIT_RECHECK_MAX_MS 200
+
+/** Maximum number of caller provided file descriptors common_wait_fds() uses */
+# define COMMON_WAIT_FDS_MAX 4
+
 #endif /* USB_MODED_COMMON_H_ */
@@ -50,7 +50,8 @@
 # define USB_MODED_STATIC_CONFIG_FILE   USB_MODED_STATIC_CONFIG_DIR"/usb-moded.ini"
 
 # define USB_MODED_DYNAMIC_CONFIG_DIR    "/var/lib/usb-moded"
-# define USB_MODED_DYNAMIC_CONFIG_FILE   USB_MODED_DYNAMIC_CONFIG_DIR"/usb-moded.ini"
+# define USB_MODED_DYNAMIC_CONFIG_NAME   "usb-moded.ini"
+# define USB_MODED_DYNAMIC_CONFIG_FILE   USB_MODED_DYNAMIC_CONFIG_DIR"/"USB_MODED_DYNAMIC_CONFIG_NAME
 
 #ifdef SAILFISH_ACCESS_CONTROL
 # define MIN_ADDITIONAL_USER 100001
@@ -90,6 +91,9 @@ set_config_result_t  config_set_network_setting     (const char *config, const c
 char                *config_get_network_setting     (const char *config);
 char                *config_get_network_fallback    (const char *config);
 bool                 config_init                    (void);
+void                 config_quit                    (void);
+void                 config_flush                   (void);
+unsigned             config_get_generation          (void);
 char                *config_get_android_manufacturer(void);
 char                *config_get_android_vendor_id   (void);
 char                *config_get_android_product     (void);
@@ -46,11 +46,13 @@
 #endif
 
 #include <sys/stat.h>
+#include <sys/inotify.h>
 
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <pthread.h>
 
 /* ========================================================================= *
  * Prototypes
@@ -105,9 +107,18 @@ static void          config_load_static_config       (GKeyFile *ini);
 static bool          config_load_legacy_config       (GKeyFile *ini);
 static void          config_remove_legacy_config     (void);
 static void          config_load_dynamic_config      (GKeyFile *ini);
-static void          config_save_dynamic_config      (GKeyFile *ini);
+static bool          config_write_file_atomic        (const char *path, const char *data);
+static bool          config_save_dynamic_config      (GKeyFile *ini);
 bool                 config_init                     (void);
+void                 config_quit                     (void);
+static GKeyFile     *config_get_dynamic_locked       (void);
+static void          config_drop_dynamic             (void);
+static gboolean      config_flush_cb                 (gpointer aptr);
+static void          config_schedule_flush           (void);
+void                 config_flush                    (void);
 static GKeyFile     *config_get_settings             (void);
+static void          config_invalidate_settings      (void);
+unsigned             config_get_generation           (void);
 char                *config_get_android_manufacturer (void);
 char                *config_get_android_vendor_id    (void);
 char                *config_get_android_product      (void);
@@ -117,6 +128,90 @@ char                *config_get_mode_whitelist       (void);
 int                  config_is_roaming_not_allowed   (void);
 bool                 config_user_clear               (uid_t uid);
 
+/* ------------------------------------------------------------------------- *
+ * CONFIG_WATCH
+ * ------------------------------------------------------------------------- */
+
+static bool          config_watch_is_relevant        (const struct inotify_event *eve);
+static gboolean      config_watch_input_cb           (GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static int           config_watch_add_dir            (const char *path);
+static bool          config_watch_start              (void);
+static void          config_watch_stop               (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Mutex for protecting the cached settings snapshot
+ *
+ * Settings are queried both from the main thread and from the worker
+ * thread, while invalidation happens from the main thread only.
+ */
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CONFIG_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&config_mutex) != 0 ) { \
+        log_crit("CONFIG LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define CONFIG_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&config_mutex) != 0 ) { \
+        log_crit("CONFIG UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/** Merged static + dynamic settings, or NULL if rebuild is needed
+ *
+ * The keyfile is never modified after it has been constructed.
+ * Users get a reference via config_get_settings() and can keep
+ * using it even if the cache gets invalidated in the meanwhile.
+ */
+static GKeyFile *config_settings_cache = 0;
+
+/** Counter that is bumped whenever cached settings are invalidated */
+static unsigned config_settings_generation = 1;
+
+/** Inotify file descriptor for tracking configuration directories */
+static int config_watch_fd = -1;
+
+/** Inotify watch descriptor for USB_MODED_STATIC_CONFIG_DIR */
+static int config_watch_static_wd = -1;
+
+/** Inotify watch descriptor for USB_MODED_DYNAMIC_CONFIG_DIR */
+static int config_watch_dynamic_wd = -1;
+
+/** Glib io watch id for config_watch_fd */
+static guint config_watch_id = 0;
+
+/** Delay between settings change and writing them to filesystem [ms] */
+#define CONFIG_FLUSH_DELAY_MS 500
+
+/** Delay before first retry after failing to write settings [ms] */
+#define CONFIG_FLUSH_RETRY_MIN_MS 1000
+
+/** Maximum delay between retries of failed settings writes [ms] */
+#define CONFIG_FLUSH_RETRY_MAX_MS 60000
+
+/** In-memory copy of dynamic settings, or NULL if not loaded yet
+ *
+ * Changes are applied here immediately and written to
+ * USB_MODED_DYNAMIC_CONFIG_FILE after a short delay, so
+ * that a burst of changes results in just one file update.
+ */
+static GKeyFile *config_dynamic_ini = 0;
+
+/** Flag for: config_dynamic_ini has changes not written to filesystem */
+static bool config_dynamic_dirty = false;
+
+/** Timer id for delayed config_flush() */
+static guint config_flush_id = 0;
+
+/** Delay for retrying failed config_flush(), or 0 if last one succeeded */
+static unsigned config_flush_retry_ms = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -257,11 +352,10 @@ static int config_get_conf_int(const gchar *entry, const gchar *key)
 {
     LOG_REGISTER_CONTEXT;
 
-    // TODO: use cached values instead of reloading every time?
     GKeyFile *ini = config_get_settings();
     // Note: zero value is returned if key does not exist
     gint val = g_key_file_get_integer(ini, entry, key, 0);
-    g_key_file_free(ini);
+    g_key_file_unref(ini);
     //log_debug("key [%s] %s value is: %d\n", entry, key, val);
     return val;
 }
@@ -270,11 +364,10 @@ char *config_get_conf_string(const gchar *entry, const gchar *key)
 {
     LOG_REGISTER_CONTEXT;
 
-    // TODO: use cached values instead of reloading every time?
     GKeyFile *ini = config_get_settings();
     // Note: null value is returned if key does not exist
     gchar *val = g_key_file_get_string(ini, entry, key, 0);
-    g_key_file_free(ini);
+    g_key_file_unref(ini);
     //log_debug("key [%s] %s value is: %s\n", entry, key, val ?: "<null>");
     return val;
 }
@@ -417,34 +510,26 @@ set_config_result_t config_set_config_setting(const char *entry, const char *key
 
     set_config_result_t ret = SET_CONFIG_UNCHANGED;
 
-    GKeyFile *static_ini = g_key_file_new();
-    GKeyFile *active_ini = g_key_file_new();
-
-    gchar *prev = 0;
+    GKeyFile *active_ini = config_get_settings();
+    gchar    *prev       = g_key_file_get_string(active_ini, entry, key, 0);
 
-    /* Load static configuration */
-    config_load_static_config(static_ini);
+    if( g_strcmp0(prev, value) ) {
+        /* Apply change to in-memory settings */
+        CONFIG_LOCKED_ENTER;
+        g_key_file_set_string(config_get_dynamic_locked(), entry, key, value);
+        config_dynamic_dirty = true;
+        CONFIG_LOCKED_LEAVE;
+        config_invalidate_settings();
 
-    /* Merge static and dynamic settings */
-    config_merge_data(active_ini, static_ini);
-    config_load_dynamic_config(active_ini);
+        /* Update data on filesystem after a while */
+        config_schedule_flush();
 
-    prev = g_key_file_get_string(active_ini, entry, key, 0);
-    if( g_strcmp0(prev, value) ) {
-        g_key_file_set_string(active_ini, entry, key, value);
         ret = SET_CONFIG_UPDATED;
         umdbus_send_config_signal(entry, key, value);
     }
 
-    /* Filter out dynamic data that matches static values */
-    config_purge_data(active_ini, static_ini);
-
-    /* Update data on filesystem if changed */
-    config_save_dynamic_config(active_ini);
-
     g_free(prev);
-    g_key_file_free(active_ini);
-    g_key_file_free(static_ini);
+    g_key_file_unref(active_ini);
 
     return ret;
 }
@@ -960,10 +1045,90 @@ static void config_load_dynamic_config(GKeyFile *ini)
     config_merge_from_file(ini, USB_MODED_DYNAMIC_CONFIG_FILE);
 }
 
-static void config_save_dynamic_config(GKeyFile *ini)
+/** Replace file content in crash safe manner
+ *
+ * Data is written to a temporary file that is synced to
+ * disk and then renamed over the original file.
+ *
+ * @param path  file to write
+ * @param data  content to write
+ *
+ * @return true on success, false otherwise
+ */
+static bool config_write_file_atomic(const char *path, const char *data)
 {
     LOG_REGISTER_CONTEXT;
 
+    bool    ack  = false;
+    int     fd   = -1;
+    gchar  *temp = g_strdup_printf("%s.tmp", path);
+    gchar  *dir  = g_path_get_dirname(path);
+    size_t  todo = strlen(data);
+
+    if( (fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ) {
+        log_err("%s: can't open: %m", temp);
+        goto EXIT;
+    }
+
+    while( todo > 0 ) {
+        ssize_t done = write(fd, data, todo);
+        if( done == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_err("%s: can't write: %m", temp);
+            goto EXIT;
+        }
+        data += done, todo -= done;
+    }
+
+    if( fsync(fd) == -1 ) {
+        log_err("%s: can't sync: %m", temp);
+        goto EXIT;
+    }
+
+    if( close(fd) == -1 ) {
+        fd = -1;
+        log_err("%s: can't close: %m", temp);
+        goto EXIT;
+    }
+    fd = -1;
+
+    if( rename(temp, path) == -1 ) {
+        log_err("%s: can't rename to %s: %m", temp, path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+    /* Make sure the rename itself hits the disk too */
+    if( (fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+        fsync(fd) == -1 )
+        log_warning("%s: can't sync: %m", dir);
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    if( !ack )
+        unlink(temp);
+
+    g_free(dir);
+    g_free(temp);
+
+    return ack;
+}
+
+/** Write dynamic settings to filesystem if they differ from saved data
+ *
+ * @param ini  dynamic settings to save
+ *
+ * @return false if writing failed, true otherwise
+ */
+static bool config_save_dynamic_config(GKeyFile *ini)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack = true;
     gchar  *current_dta = 0;
     gchar  *previous_dta = 0;
 
@@ -972,26 +1137,31 @@ static void config_save_dynamic_config(GKeyFile *ini)
 
     g_file_get_contents(USB_MODED_DYNAMIC_CONFIG_FILE, &previous_dta, 0, 0);
     if( g_strcmp0(previous_dta, current_dta) ) {
-        GError *err = 0;
         if( mkdir(USB_MODED_DYNAMIC_CONFIG_DIR, 0755) == -1 && errno != EEXIST ) {
             log_err("%s: can't create dir: %m", USB_MODED_DYNAMIC_CONFIG_DIR);
+            ack = false;
         }
-        else if( !g_file_set_contents(USB_MODED_DYNAMIC_CONFIG_FILE,
-                                      current_dta, -1, &err) ) {
-            log_err("%s: can't save: %s", USB_MODED_DYNAMIC_CONFIG_FILE,
-                    err->message);
+        else if( !config_write_file_atomic(USB_MODED_DYNAMIC_CONFIG_FILE,
+                                           current_dta) ) {
+            log_err("%s: can't save", USB_MODED_DYNAMIC_CONFIG_FILE);
+            ack = false;
         }
         else {
             log_debug("%s: updated", USB_MODED_DYNAMIC_CONFIG_FILE);
 
+            /* Do not wait for inotify, make changes visible
+             * to subsequent queries immediately */
+            config_invalidate_settings();
+
             /* The legacy file is not needed anymore */
             config_remove_legacy_config();
         }
-        g_clear_error(&err);
     }
 
     g_free(current_dta);
     g_free(previous_dta);
+
+    return ack;
 }
 
 /**
@@ -1032,19 +1202,243 @@ bool config_init(void)
     g_key_file_free(static_ini);
     g_key_file_free(legacy_ini);
 
+    /* Start tracking changes made by other parties */
+    if( !config_watch_start() )
+        log_warning("config change tracking not available");
+
     return ack;
 }
 
+/** Release resources allocated for settings caching
+ */
+void config_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Do not lose pending changes */
+    config_flush();
+
+    /* No retries once shutting down */
+    CONFIG_LOCKED_ENTER;
+    if( config_flush_id ) {
+        g_source_remove(config_flush_id),
+            config_flush_id = 0;
+    }
+    CONFIG_LOCKED_LEAVE;
+
+    config_watch_stop();
+    config_drop_dynamic();
+    config_invalidate_settings();
+}
+
+/** Get in-memory dynamic settings
+ *
+ * Caller must hold config_mutex.
+ *
+ * @return dynamic settings keyfile
+ */
+static GKeyFile *config_get_dynamic_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !config_dynamic_ini ) {
+        config_dynamic_ini = g_key_file_new();
+        config_load_dynamic_config(config_dynamic_ini);
+    }
+    return config_dynamic_ini;
+}
+
+/** Forget in-memory dynamic settings unless there are unsaved changes
+ *
+ * Used when dynamic settings file has been changed by other parties.
+ */
+static void config_drop_dynamic(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *ini = 0;
+
+    CONFIG_LOCKED_ENTER;
+    if( !config_dynamic_dirty )
+        ini = config_dynamic_ini, config_dynamic_ini = 0;
+    CONFIG_LOCKED_LEAVE;
+
+    if( ini )
+        g_key_file_free(ini);
+}
+
+/** Timer callback for delayed writing of dynamic settings
+ *
+ * @param aptr  user data (unused)
+ *
+ * @return FALSE to stop the timer from repeating
+ */
+static gboolean config_flush_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    CONFIG_LOCKED_ENTER;
+    config_flush_id = 0;
+    CONFIG_LOCKED_LEAVE;
+
+    config_flush();
+
+    return FALSE;
+}
+
+/** Schedule writing of dynamic settings to filesystem
+ *
+ * While writing keeps failing, the retry backoff delay is used
+ * instead of the normal short delay.
+ *
+ * Can be called from any thread.
+ */
+static void config_schedule_flush(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    CONFIG_LOCKED_ENTER;
+    if( !config_flush_id ) {
+        guint delay_ms = config_flush_retry_ms ?: CONFIG_FLUSH_DELAY_MS;
+        config_flush_id = g_timeout_add(delay_ms, config_flush_cb, 0);
+    }
+    CONFIG_LOCKED_LEAVE;
+}
+
+/** Write pending dynamic settings changes to filesystem
+ *
+ * Normally done via timer, but must also be called when it is
+ * possible that the process does not get to run the timer.
+ */
+void config_flush(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *active_ini = 0;
+    gchar    *data       = 0;
+
+    CONFIG_LOCKED_ENTER;
+    if( config_flush_id ) {
+        g_source_remove(config_flush_id),
+            config_flush_id = 0;
+    }
+    if( config_dynamic_dirty ) {
+        config_dynamic_dirty = false;
+        data = g_key_file_to_data(config_dynamic_ini, 0, 0);
+    }
+    CONFIG_LOCKED_LEAVE;
+
+    if( !data )
+        goto EXIT;
+
+    active_ini = g_key_file_new();
+    g_key_file_load_from_data(active_ini, data, -1, 0, 0);
+
+    GKeyFile *static_ini = g_key_file_new();
+    config_load_static_config(static_ini);
+
+    /* Filter out dynamic data that matches static values */
+    config_purge_data(active_ini, static_ini);
+
+    /* Update data on filesystem if changed */
+    if( config_save_dynamic_config(active_ini) ) {
+        CONFIG_LOCKED_ENTER;
+        config_flush_retry_ms = 0;
+        CONFIG_LOCKED_LEAVE;
+    }
+    else {
+        /* Keep in-memory changes from being dropped on inotify
+         * and retry with increasing delay */
+        CONFIG_LOCKED_ENTER;
+        config_dynamic_dirty = true;
+        if( !config_flush_retry_ms )
+            config_flush_retry_ms = CONFIG_FLUSH_RETRY_MIN_MS;
+        else if( config_flush_retry_ms < CONFIG_FLUSH_RETRY_MAX_MS / 2 )
+            config_flush_retry_ms *= 2;
+        else
+            config_flush_retry_ms = CONFIG_FLUSH_RETRY_MAX_MS;
+        unsigned retry_ms = config_flush_retry_ms;
+        CONFIG_LOCKED_LEAVE;
+
+        log_warning("retrying settings save in %u ms", retry_ms);
+        config_schedule_flush();
+    }
+
+    g_key_file_free(static_ini);
+
+EXIT:
+    if( active_ini )
+        g_key_file_free(active_ini);
+    g_free(data);
+}
+
+/** Get reference to merged static and dynamic settings
+ *
+ * The returned keyfile must be treated as read-only and
+ * released with g_key_file_unref().
+ *
+ * @return keyfile reference
+ */
 static GKeyFile *config_get_settings(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    GKeyFile *ini = g_key_file_new();
-    config_load_static_config(ini);
-    config_load_dynamic_config(ini);
+    GKeyFile *ini = 0;
+
+    CONFIG_LOCKED_ENTER;
+
+    if( !config_settings_cache ) {
+        config_settings_cache = g_key_file_new();
+        config_load_static_config(config_settings_cache);
+        config_merge_data(config_settings_cache, config_get_dynamic_locked());
+        log_debug("settings generation %u loaded",
+                  config_settings_generation);
+    }
+    ini = g_key_file_ref(config_settings_cache);
+
+    CONFIG_LOCKED_LEAVE;
+
     return ini;
 }
 
+/** Drop cached settings
+ *
+ * Settings are reloaded from filesystem on the next query.
+ */
+static void config_invalidate_settings(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *ini = 0;
+
+    CONFIG_LOCKED_ENTER;
+    ini = config_settings_cache, config_settings_cache = 0;
+    ++config_settings_generation;
+    CONFIG_LOCKED_LEAVE;
+
+    if( ini )
+        g_key_file_unref(ini);
+}
+
+/** Get settings generation
+ *
+ * @return counter value that changes whenever settings might have changed
+ */
+unsigned config_get_generation(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned generation;
+
+    CONFIG_LOCKED_ENTER;
+    generation = config_settings_generation;
+    CONFIG_LOCKED_LEAVE;
+
+    return generation;
+}
+
 char * config_get_android_manufacturer(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -1125,16 +1519,211 @@ bool config_user_clear(uid_t uid)
     }
 #endif
 
-    GKeyFile *active_ini = g_key_file_new();
-    config_load_dynamic_config(active_ini);
+    bool changed = false;
 
     char *key = config_make_user_key_string(MODE_SETTING_KEY, uid);
     if (key) {
-        if (g_key_file_remove_key(active_ini, MODE_SETTING_ENTRY, key, NULL))
-            config_save_dynamic_config(active_ini);
+        CONFIG_LOCKED_ENTER;
+        if (g_key_file_remove_key(config_get_dynamic_locked(), MODE_SETTING_ENTRY, key, NULL))
+            changed = config_dynamic_dirty = true;
+        CONFIG_LOCKED_LEAVE;
         g_free(key);
     }
 
-    g_key_file_free(active_ini);
+    if (changed) {
+        config_invalidate_settings();
+        config_schedule_flush();
+    }
+
     return true;
 }
+
+/* ------------------------------------------------------------------------- *
+ * CONFIG_WATCH
+ * ------------------------------------------------------------------------- */
+
+/** Check if inotify event affects settings
+ *
+ * @param eve  inotify event
+ *
+ * @return true if cached settings should be invalidated, false otherwise
+ */
+static bool config_watch_is_relevant(const struct inotify_event *eve)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Watched directory itself changed */
+    if( !eve->len )
+        return true;
+
+    /* Only the settings file in dynamic config dir */
+    if( eve->wd == config_watch_dynamic_wd )
+        return !strcmp(eve->name, USB_MODED_DYNAMIC_CONFIG_NAME);
+
+    /* Any *.ini file in static config dir */
+    return g_str_has_suffix(eve->name, ".ini");
+}
+
+/** Glib io watch callback for reading inotify events
+ *
+ * @param chn   glib io channel
+ * @param cnd   wakeup reason
+ * @param aptr  user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean config_watch_input_cb(GIOChannel *chn, GIOCondition cnd,
+                                      gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    gboolean keep_watch = FALSE;
+    bool     changed    = false;
+    bool     dynamic    = false;
+    int      fd         = g_io_channel_unix_get_fd(chn);
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if( cnd & ~G_IO_IN )
+        goto EXIT;
+
+    for( ;; ) {
+        ssize_t rc = read(fd, buf, sizeof buf);
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            log_err("config watch: read: %m");
+            goto EXIT;
+        }
+
+        if( rc == 0 ) {
+            log_err("config watch: unexpected eof");
+            goto EXIT;
+        }
+
+        for( char *pos = buf; pos < buf + rc; ) {
+            const struct inotify_event *eve = (void *)pos;
+            pos += sizeof *eve + eve->len;
+
+            if( eve->mask & IN_IGNORED ) {
+                if( eve->wd == config_watch_static_wd )
+                    config_watch_static_wd = -1;
+                else if( eve->wd == config_watch_dynamic_wd )
+                    config_watch_dynamic_wd = -1;
+            }
+
+            if( config_watch_is_relevant(eve) ) {
+                changed = true;
+                if( eve->wd == config_watch_dynamic_wd )
+                    dynamic = true;
+            }
+        }
+    }
+
+    keep_watch = TRUE;
+
+EXIT:
+    if( changed ) {
+        log_debug("settings changed on filesystem");
+        if( dynamic )
+            config_drop_dynamic();
+        config_invalidate_settings();
+    }
+
+    if( !keep_watch ) {
+        log_crit("disabled config watch");
+        config_watch_id = 0;
+        config_watch_stop();
+    }
+
+    return keep_watch;
+}
+
+/** Add inotify watch for a configuration directory
+ *
+ * @param path  directory path
+ *
+ * @return inotify watch descriptor, or -1 on failure
+ */
+static int config_watch_add_dir(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const uint32_t mask = (IN_CLOSE_WRITE | IN_MOVED_TO |
+                                  IN_MOVED_FROM | IN_DELETE |
+                                  IN_DELETE_SELF | IN_MOVE_SELF);
+
+    int wd = inotify_add_watch(config_watch_fd, path, mask);
+    if( wd == -1 )
+        log_warning("%s: can't add inotify watch: %m", path);
+    return wd;
+}
+
+/** Start tracking changes in configuration directories
+ *
+ * @return true on success, false otherwise
+ */
+static bool config_watch_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GIOChannel *chn = 0;
+
+    if( config_watch_id )
+        goto EXIT;
+
+    if( (config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ) {
+        log_err("inotify_init: %m");
+        goto EXIT;
+    }
+
+    /* Dynamic config dir might not exist yet */
+    if( mkdir(USB_MODED_DYNAMIC_CONFIG_DIR, 0755) == -1 && errno != EEXIST )
+        log_warning("%s: can't create dir: %m", USB_MODED_DYNAMIC_CONFIG_DIR);
+
+    config_watch_static_wd  = config_watch_add_dir(USB_MODED_STATIC_CONFIG_DIR);
+    config_watch_dynamic_wd = config_watch_add_dir(USB_MODED_DYNAMIC_CONFIG_DIR);
+
+    if( config_watch_static_wd == -1 && config_watch_dynamic_wd == -1 )
+        goto EXIT;
+
+    if( !(chn = g_io_channel_unix_new(config_watch_fd)) )
+        goto EXIT;
+
+    config_watch_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                     config_watch_input_cb, 0);
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( !config_watch_id )
+        config_watch_stop();
+
+    return config_watch_id != 0;
+}
+
+/** Stop tracking changes in configuration directories
+ */
+static void config_watch_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( config_watch_id ) {
+        g_source_remove(config_watch_id),
+            config_watch_id = 0;
+    }
+
+    if( config_watch_fd != -1 ) {
+        close(config_watch_fd),
+            config_watch_fd = -1;
+    }
+
+    config_watch_static_wd  = -1;
+    config_watch_dynamic_wd = -1;
+}
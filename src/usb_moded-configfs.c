@@ -68,12 +68,14 @@
  * ------------------------------------------------------------------------- */
 
 static gchar      *configfs_get_conf               (const char *key, const char *def);
+gchar             *configfs_get_base_directory     (void);
 static void        configfs_read_configuration     (void);
 static int         configfs_file_type              (const char *path);
 static const char *configfs_function_path          (char *buff, size_t size, const char *func, ...);
 static const char *configfs_unit_path              (char *buff, size_t size, const char *func, const char *unit);
 static const char *configfs_config_path            (char *buff, size_t size, const char *func);
 static bool        configfs_mkdir                  (const char *path);
+static void        configfs_rmdir_attrs            (const char *path);
 static bool        configfs_rmdir                  (const char *path);
 static const char *configfs_register_function      (const char *function);
 #ifdef DEAD_CODE
@@ -83,13 +85,27 @@ static const char *configfs_add_unit               (const char *function, const
 static bool        configfs_remove_unit            (const char *function, const char *unit);
 static bool        configfs_enable_function        (const char *function);
 static bool        configfs_disable_function       (const char *function);
+#ifdef DEAD_CODE
 static bool        configfs_disable_all_functions  (void);
+#endif
 static char       *configfs_strip                  (char *str);
 bool               configfs_in_use                 (void);
 static bool        configfs_probe                  (void);
 static const char *configfs_udc_enable_value       (void);
+bool               configfs_has_udc                (void);
+const char        *configfs_get_udc_device         (void);
 static bool        configfs_write_file             (const char *path, const char *text);
 static bool        configfs_read_file              (const char *path, char *buff, size_t size);
+static bool        configfs_attr_differs           (const char *path, const char *value);
+static bool        configfs_write_attr             (const char *path, const char *value);
+static const char *configfs_normalize_id           (const char *id, char *buff, size_t size);
+static bool        configfs_strv_has               (gchar **vec, size_t len, const char *str);
+static bool        configfs_strv_same              (gchar **a, gchar **b);
+static bool        configfs_strv_same_set          (gchar **a, gchar **b);
+static gchar     **configfs_desired_functions      (const char *functions);
+static gchar     **configfs_enabled_functions      (void);
+static bool        configfs_functions_changed      (gchar **want, gchar **have);
+static bool        configfs_sync_functions         (gchar **want, gchar **have);
 #ifdef DEAD_CODE
 static bool        configfs_read_udc               (char *buff, size_t size);
 #endif // DEAD_CODE
@@ -102,6 +118,7 @@ bool               configfs_set_productid          (const char *id);
 bool               configfs_set_vendorid           (const char *id);
 static const char *configfs_map_function           (const char *func);
 bool               configfs_set_function           (const char *functions);
+bool               configfs_set_gadget             (const char *functions, const char *productid, const char *vendorid);
 bool               configfs_add_mass_storage_lun   (int lun);
 bool               configfs_remove_mass_storage_lun(int lun);
 bool               configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
@@ -133,6 +150,14 @@ static gchar *FUNCTION_MTP             = 0;
 static gchar *RNDIS_CTRL_WCEIS         = 0;
 static gchar *RNDIS_CTRL_ETHADDR       = 0;
 
+/** Function links in the order they were last created by usb-moded
+ *
+ * Readdir order of the config directory does not tell in which order
+ * the links were made - which defines usb interface numbering - so it
+ * needs to be remembered. NULL when live state is not known.
+ */
+static gchar **configfs_functions_applied = 0;
+
 /* ========================================================================= *
  * Settings
  * ========================================================================= */
@@ -144,6 +169,18 @@ static gchar *configfs_get_conf(const char *key, const char *def)
     return config_get_conf_string("configfs", key) ?: g_strdup(def);
 }
 
+/** Get configured gadget base directory
+ *
+ * @return kernel path without sysroot prefix, release with g_free()
+ */
+gchar *configfs_get_base_directory(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return configfs_get_conf("gadget_base_directory",
+                             DEFAULT_GADGET_BASE_DIRECTORY);
+}
+
 /** Parse configfs configuration entries
  *
  * The defaults correspond with ini-file like (h3113 values):
@@ -173,9 +210,9 @@ static void configfs_read_configuration(void)
 
     /* Gadget directories
      */
-    GADGET_BASE_DIRECTORY =
-        configfs_get_conf("gadget_base_directory",
-                          DEFAULT_GADGET_BASE_DIRECTORY);
+    temp_setting = configfs_get_base_directory();
+    GADGET_BASE_DIRECTORY = common_sysroot_dup(temp_setting);
+    g_free(temp_setting);
 
     temp_setting = configfs_get_conf("gadget_func_directory",
                              DEFAULT_GADGET_FUNC_DIRECTORY);
@@ -354,6 +391,38 @@ EXIT:
     return ack;
 }
 
+/** Remove attribute files from a directory under sysroot
+ *
+ * In configfs attributes vanish together with the directory, but
+ * regular files standing in for them must be removed before rmdir()
+ * can succeed.
+ *
+ * @param path  directory path
+ */
+static void
+configfs_rmdir_attrs(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DIR           *dir = opendir(path);
+    struct dirent *de;
+
+    if( !dir )
+        goto EXIT;
+
+    while( (de = readdir(dir)) ) {
+        if( de->d_type != DT_REG )
+            continue;
+        if( unlinkat(dirfd(dir), de->d_name, 0) == -1 )
+            log_warning("%s/%s: unlink failed: %m", path, de->d_name);
+    }
+
+    closedir(dir);
+
+EXIT:
+    return;
+}
+
 static bool
 configfs_rmdir(const char *path)
 {
@@ -361,6 +430,9 @@ configfs_rmdir(const char *path)
 
     bool ack = false;
 
+    if( common_get_sysroot() )
+        configfs_rmdir_attrs(path);
+
     if( rmdir(path) == -1 && errno != ENOENT ) {
         log_err("%s: rmdir failed: %m", path);
         goto EXIT;
@@ -525,6 +597,7 @@ EXIT:
     return ack;
 }
 
+#ifdef DEAD_CODE
 static bool
 configfs_disable_all_functions(void)
 {
@@ -558,6 +631,7 @@ EXIT:
 
     return ack;
 }
+#endif
 
 static char *configfs_strip(char *str)
 {
@@ -609,19 +683,19 @@ configfs_udc_enable_value(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    static bool  probed = false;
     static char *value  = 0;
 
-    if( !probed ) {
-        probed = true;
-
+    /* Device controller might show up later during bootup
+     * -> keep probing until something is found */
+    if( !value ) {
         if (*GADGET_UDC_DEVICE) {
             value = strdup(GADGET_UDC_DEVICE);
         }
         else {
             /* Find first symlink in /sys/class/udc directory */
             struct dirent *de;
-            DIR *dir = opendir("/sys/class/udc");
+            char udc[PATH_MAX];
+            DIR *dir = opendir(common_sysroot_path(CONFIGFS_UDC_CLASS_DIR, udc, sizeof udc));
             if( dir ) {
                 while( (de = readdir(dir)) ) {
                     if( de->d_type != DT_LNK )
@@ -639,6 +713,31 @@ configfs_udc_enable_value(void)
     return value ?: "";
 }
 
+/** Predicate for: There is a device controller the gadget can be bound to
+ *
+ * @return true if udc is available, false otherwise
+ */
+bool
+configfs_has_udc(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return *configfs_udc_enable_value() != 0;
+}
+
+/** Get name of the device controller the gadget gets bound to
+ *
+ * @return configured or detected UDC name, or empty string if
+ *         configfs is not in use or no UDC is known yet
+ */
+const char *
+configfs_get_udc_device(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return configfs_in_use() ? configfs_udc_enable_value() : "";
+}
+
 static bool
 configfs_write_file(const char *path, const char *text)
 {
@@ -656,7 +755,7 @@ configfs_write_file(const char *path, const char *text)
     snprintf(buff, sizeof buff, "%s\n", text);
     size_t size = strlen(buff);
 
-    if( (fd = open(path, O_WRONLY)) == -1 ) {
+    if( (fd = open(path, common_sysroot_write_flags(), 0644)) == -1 ) {
         log_err("%s: can't open for writing: %m", path);
         goto EXIT;
     }
@@ -720,6 +819,251 @@ EXIT:
     return ack;
 }
 
+/** Check if live attribute value differs from desired one
+ *
+ * @param path   attribute path
+ * @param value  desired value, or NULL for don't care
+ *
+ * @return true if attribute needs to be written, false otherwise
+ */
+static bool
+configfs_attr_differs(const char *path, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char prev[64];
+
+    if( !value )
+        return false;
+
+    if( !configfs_read_file(path, prev, sizeof prev) )
+        return true;
+
+    return strcmp(prev, value) != 0;
+}
+
+/** Write attribute value unless it is already in place
+ *
+ * @param path   attribute path
+ * @param value  desired value, or NULL for don't care
+ *
+ * @return true if attribute has the desired value, false otherwise
+ */
+static bool
+configfs_write_attr(const char *path, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !configfs_attr_differs(path, value) )
+        return true;
+
+    return configfs_write_file(path, value);
+}
+
+/** Convert usb id from config file format to what kernel reports
+ *
+ * Config files have things like "0A02", kernel wants to see "0x0a02".
+ *
+ * @param id    usb id string, or NULL
+ * @param buff  buffer for normalized value
+ * @param size  size of buff
+ *
+ * @return normalized id, or id as is if it can't be parsed
+ */
+static const char *
+configfs_normalize_id(const char *id, char *buff, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( id ) {
+        char *end = 0;
+        unsigned num = strtol(id, &end, 16);
+        if( end > id && *end == 0 ) {
+            snprintf(buff, size, "0x%04x", num);
+            id = buff;
+        }
+    }
+    return id;
+}
+
+static bool
+configfs_strv_has(gchar **vec, size_t len, const char *str)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; i < len && vec[i]; ++i ) {
+        if( !strcmp(vec[i], str) )
+            return true;
+    }
+    return false;
+}
+
+static bool
+configfs_strv_same(gchar **a, gchar **b)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t i = 0;
+    for( ; a[i] && b[i]; ++i ) {
+        if( strcmp(a[i], b[i]) )
+            return false;
+    }
+    return !a[i] && !b[i];
+}
+
+static bool
+configfs_strv_same_set(gchar **a, gchar **b)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( g_strv_length(a) != g_strv_length(b) )
+        return false;
+
+    for( size_t i = 0; a[i]; ++i ) {
+        if( !configfs_strv_has(b, G_MAXSIZE, a[i]) )
+            return false;
+    }
+    return true;
+}
+
+/** Parse function list into configfs function names
+ *
+ * @param functions  Comma separated list of function names, or NULL
+ *
+ * @return NULL terminated array of unique function names
+ */
+static gchar **
+configfs_desired_functions(const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray *arr = g_ptr_array_new();
+    gchar    **vec = g_strsplit(functions ?: "", ",", 0);
+
+    for( size_t i = 0; vec[i]; ++i ) {
+        /* Normalize names used by usb-moded itself and already
+         * existing configuration files etc.
+         */
+        const char *use = configfs_map_function(vec[i]);
+        if( !use || !*use )
+            continue;
+        if( configfs_strv_has((gchar **)arr->pdata, arr->len, use) )
+            continue;
+        g_ptr_array_add(arr, g_strdup(use));
+    }
+    g_ptr_array_add(arr, 0);
+
+    g_strfreev(vec);
+    return (gchar **)g_ptr_array_free(arr, FALSE);
+}
+
+/** Get names of function links in the configuration directory
+ *
+ * @return NULL terminated array of function names, or NULL on failure
+ */
+static gchar **
+configfs_enabled_functions(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray *arr = 0;
+    DIR       *dir = 0;
+
+    if( !(dir = opendir(GADGET_CONF_DIRECTORY)) ) {
+        log_err("%s: opendir failed: %m", GADGET_CONF_DIRECTORY);
+        goto EXIT;
+    }
+
+    arr = g_ptr_array_new();
+
+    struct dirent *de;
+    while( (de = readdir(dir)) ) {
+        if( de->d_type != DT_LNK )
+            continue;
+        g_ptr_array_add(arr, g_strdup(de->d_name));
+    }
+    g_ptr_array_add(arr, 0);
+
+EXIT:
+    if( dir )
+        closedir(dir);
+
+    return arr ? (gchar **)g_ptr_array_free(arr, FALSE) : 0;
+}
+
+/** Check if function links differ from what is wanted
+ *
+ * @param want  desired functions, in interface order
+ * @param have  functions currently linked, in readdir order
+ *
+ * @return true if links need to be modified, false otherwise
+ */
+static bool
+configfs_functions_changed(gchar **want, gchar **have)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Link order is known only if live state matches bookkeeping */
+    if( !configfs_functions_applied ||
+        !configfs_strv_same_set(configfs_functions_applied, have) )
+        return true;
+
+    return !configfs_strv_same(configfs_functions_applied, want);
+}
+
+/** Modify function links to match desired state
+ *
+ * Links that are common to both previously applied and desired
+ * ordered function lists are left as is, only the tail part
+ * that differs is unlinked and recreated.
+ *
+ * @note UDC must be unbound before calling this function.
+ *
+ * @param want  desired functions, in interface order
+ * @param have  functions currently linked, in readdir order
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+configfs_sync_functions(gchar **want, gchar **have)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   ack  = false;
+    size_t keep = 0;
+
+    if( configfs_functions_applied &&
+        configfs_strv_same_set(configfs_functions_applied, have) ) {
+        while( configfs_functions_applied[keep] && want[keep] &&
+               !strcmp(configfs_functions_applied[keep], want[keep]) )
+            ++keep;
+    }
+
+    /* Live state is unknown until we are done */
+    g_strfreev(configfs_functions_applied),
+        configfs_functions_applied = 0;
+
+    for( size_t i = 0; have[i]; ++i ) {
+        if( configfs_strv_has(want, keep, have[i]) )
+            continue;
+        if( !configfs_disable_function(have[i]) )
+            goto EXIT;
+    }
+
+    for( size_t i = keep; want[i]; ++i ) {
+        if( !configfs_enable_function(want[i]) )
+            goto EXIT;
+    }
+
+    configfs_functions_applied = g_strdupv(want);
+    log_debug("kept %zu function links", keep);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
 #ifdef DEAD_CODE
 static bool
 configfs_read_udc(char *buff, size_t size)
@@ -792,27 +1136,27 @@ configfs_init(void)
     /* Configure */
     gchar *text;
     if( (text = config_get_android_vendor_id()) ) {
-        configfs_write_file(GADGET_CTRL_ID_VENDOR, text);
+        configfs_write_attr(GADGET_CTRL_ID_VENDOR, text);
         g_free(text);
     }
 
     if( (text = config_get_android_product_id()) ) {
-        configfs_write_file(GADGET_CTRL_ID_PRODUCT, text);
+        configfs_write_attr(GADGET_CTRL_ID_PRODUCT, text);
         g_free(text);
     }
 
     if( (text = config_get_android_manufacturer()) ) {
-        configfs_write_file(GADGET_CTRL_MANUFACTURER, text);
+        configfs_write_attr(GADGET_CTRL_MANUFACTURER, text);
         g_free(text);
     }
 
     if( (text = config_get_android_product()) ) {
-        configfs_write_file(GADGET_CTRL_PRODUCT, text);
+        configfs_write_attr(GADGET_CTRL_PRODUCT, text);
         g_free(text);
     }
 
     if( (text = android_get_serial()) ) {
-        configfs_write_file(GADGET_CTRL_SERIAL, text);
+        configfs_write_attr(GADGET_CTRL_SERIAL, text);
         g_free(text);
     }
 
@@ -877,6 +1221,9 @@ configfs_quit(void)
         RNDIS_CTRL_WCEIS = 0;
     g_free(RNDIS_CTRL_ETHADDR),
         RNDIS_CTRL_ETHADDR= 0;
+
+    g_strfreev(configfs_functions_applied),
+        configfs_functions_applied = 0;
 }
 
 /* Set a charging mode for the configfs gadget
@@ -888,20 +1235,9 @@ configfs_set_charging_mode(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
-
-    if( !configfs_set_function("mass_storage") )
-        goto EXIT;
-
     /* TODO: make this configurable */
-    configfs_set_productid("0AFE");
-
-    if( !configfs_set_udc(true) )
-        goto EXIT;
-
-    ack = true;
+    bool ack = configfs_set_gadget("mass_storage", "0AFE", 0);
 
-EXIT:
     log_debug("CONFIGFS %s() -> %d", __func__, ack);
     return ack;
 }
@@ -917,17 +1253,11 @@ configfs_set_productid(const char *id)
 
     bool ack = false;
 
+    char str[16];
+
     if( id && configfs_in_use() ) {
-        /* Config files have things like "0A02".
-         * Kernel wants to see "0x0a02" ... */
-        char *end = 0;
-        unsigned num = strtol(id, &end, 16);
-        char     str[16];
-        if( end > id && *end == 0 ) {
-            snprintf(str, sizeof str, "0x%04x", num);
-            id = str;
-        }
-        ack = configfs_write_file(GADGET_CTRL_ID_PRODUCT, id);
+        id = configfs_normalize_id(id, str, sizeof str);
+        ack = configfs_write_attr(GADGET_CTRL_ID_PRODUCT, id);
     }
 
     log_debug("CONFIGFS %s(%s) -> %d", __func__, id, ack);
@@ -945,21 +1275,12 @@ configfs_set_vendorid(const char *id)
 
     bool ack = false;
 
+    char str[16];
+
     if( id && configfs_in_use() ) {
         log_debug("%s(%s) was called", __func__, id);
-
-        /* Config files have things like "0A02".
-         * Kernel wants to see "0x0a02" ... */
-        char *end = 0;
-        unsigned num = strtol(id, &end, 16);
-        char     str[16];
-
-        if( end > id && *end == 0 ) {
-            snprintf(str, sizeof str, "0x%04x", num);
-            id = str;
-        }
-
-        ack = configfs_write_file(GADGET_CTRL_ID_VENDOR, id);
+        id = configfs_normalize_id(id, str, sizeof str);
+        ack = configfs_write_attr(GADGET_CTRL_ID_VENDOR, id);
     }
 
     log_debug("CONFIGFS %s(%s) -> %d", __func__, id, ack);
@@ -998,7 +1319,8 @@ configfs_set_function(const char *functions)
 
     bool ack = false;
 
-    gchar **vec = 0;
+    gchar **want = 0;
+    gchar **have = 0;
 
     if( !configfs_in_use() )
         goto EXIT;
@@ -1006,22 +1328,12 @@ configfs_set_function(const char *functions)
     if( !configfs_set_udc(false) )
         goto EXIT;
 
-    if( !configfs_disable_all_functions() )
+    want = configfs_desired_functions(functions);
+    if( !(have = configfs_enabled_functions()) )
         goto EXIT;
 
-    if( functions ) {
-        vec = g_strsplit(functions, ",", 0);
-        for( size_t i = 0; vec[i]; ++i ) {
-            /* Normalize names used by usb-moded itself and already
-             * existing configuration files etc.
-             */
-            const char *use = configfs_map_function(vec[i]);
-            if( !use || !*use )
-                continue;
-            if( !configfs_enable_function(use) )
-                goto EXIT;
-        }
-    }
+    if( !configfs_sync_functions(want, have) )
+        goto EXIT;
 
     /* Leave disabled, so that caller can adjust attributes
      * etc before enabling */
@@ -1030,7 +1342,78 @@ configfs_set_function(const char *functions)
 
 EXIT:
     log_debug("CONFIGFS %s(%s) -> %d", __func__, functions, ack);
-    g_strfreev(vec);
+    g_strfreev(have);
+    g_strfreev(want);
+    return ack;
+}
+
+/* Set active functions and usb ids, then enable the gadget
+ *
+ * Desired gadget state is compared against the live configfs tree
+ * and only the function links and attributes that differ are touched.
+ * UDC is unbound only if something needs to be changed, so that
+ * switching to an equivalent configuration does not cause the host
+ * to re-enumerate the device.
+ *
+ * @param functions Comma separated list of function names to enable
+ * @param productid Product id to use, or NULL to leave as is
+ * @param vendorid  Vendor id to use, or NULL to leave as is
+ *
+ * @return true if successful, false on failure
+ */
+bool
+configfs_set_gadget(const char *functions, const char *productid,
+                    const char *vendorid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    gchar **want = 0;
+    gchar **have = 0;
+    char    pid[16];
+    char    vid[16];
+
+    if( !configfs_in_use() )
+        goto EXIT;
+
+    productid = configfs_normalize_id(productid, pid, sizeof pid);
+    vendorid  = configfs_normalize_id(vendorid, vid, sizeof vid);
+
+    want = configfs_desired_functions(functions);
+    if( !(have = configfs_enabled_functions()) )
+        goto EXIT;
+
+    bool links_changed = configfs_functions_changed(want, have);
+    bool ids_changed   = (configfs_attr_differs(GADGET_CTRL_ID_PRODUCT, productid) ||
+                          configfs_attr_differs(GADGET_CTRL_ID_VENDOR, vendorid));
+
+    if( !links_changed && !ids_changed ) {
+        log_debug("gadget configuration is already in place");
+    }
+    else {
+        if( !configfs_set_udc(false) )
+            goto EXIT;
+
+        if( links_changed && !configfs_sync_functions(want, have) )
+            goto EXIT;
+
+        if( !configfs_write_attr(GADGET_CTRL_ID_PRODUCT, productid) ||
+            !configfs_write_attr(GADGET_CTRL_ID_VENDOR, vendorid) )
+            goto EXIT;
+    }
+
+    /* Bind if not already bound */
+    if( !configfs_set_udc(true) )
+        goto EXIT;
+
+    ack = true;
+
+EXIT:
+    log_debug("CONFIGFS %s(%s, %s, %s) -> %d", __func__, functions,
+              productid ?: "-", vendorid ?: "-", ack);
+    g_strfreev(have);
+    g_strfreev(want);
     return ack;
 }
 
@@ -25,6 +25,14 @@
 # define USB_MODED_CONFIGFS_H_
 
 # include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Directory where usb device controllers show up */
+# define CONFIGFS_UDC_CLASS_DIR "/sys/class/udc"
 
 /* ========================================================================= *
  * Prototypes
@@ -34,16 +42,20 @@
  * CONFIGFS
  * ------------------------------------------------------------------------- */
 
-bool configfs_in_use                 (void);
-bool configfs_set_udc                (bool enable);
-bool configfs_init                   (void);
-void configfs_quit                   (void);
-bool configfs_set_charging_mode      (void);
-bool configfs_set_productid          (const char *id);
-bool configfs_set_vendorid           (const char *id);
-bool configfs_set_function           (const char *functions);
-bool configfs_add_mass_storage_lun   (int lun);
-bool configfs_remove_mass_storage_lun(int lun);
-bool configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
+gchar      *configfs_get_base_directory     (void);
+bool        configfs_in_use                 (void);
+bool        configfs_set_udc                (bool enable);
+bool        configfs_has_udc                (void);
+const char *configfs_get_udc_device         (void);
+bool        configfs_init                   (void);
+void        configfs_quit                   (void);
+bool        configfs_set_charging_mode      (void);
+bool        configfs_set_productid          (const char *id);
+bool        configfs_set_vendorid           (const char *id);
+bool        configfs_set_function           (const char *functions);
+bool        configfs_set_gadget             (const char *functions, const char *productid, const char *vendorid);
+bool        configfs_add_mass_storage_lun   (int lun);
+bool        configfs_remove_mass_storage_lun(int lun);
+bool        configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
 
 #endif /* USB_MODED_CONFIGFS_H_ */
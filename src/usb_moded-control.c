@@ -25,8 +25,10 @@
 #include "usb_moded-control.h"
 
 #include "usb_moded.h"
+#include "usb_moded-backend.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-latency.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-worker.h"
@@ -85,6 +87,7 @@ void             control_device_lock_changed      (void);
 void             control_device_state_changed     (void);
 void             control_settings_changed         (void);
 void             control_init_done_changed        (void);
+void             control_backend_changed          (void);
 static bool      control_get_enabled              (void);
 void             control_set_enabled              (bool enable);
 static bool      control_get_in_rescue_mode       (void);
@@ -518,6 +521,15 @@ void control_init_done_changed(void)
     control_rethink_usb_mode();
 }
 
+/** React to gadget backend selection
+ */
+void control_backend_changed(void)
+{
+    log_debug("backend_pending = %d", backend_discovery_pending());
+
+    control_rethink_usb_mode();
+}
+
 /** Mode changes allowed predicate
  */
 static bool control_get_enabled(void)
@@ -598,6 +610,11 @@ static void control_rethink_usb_mode(void)
         goto BAILOUT;
     }
 
+    if( backend_discovery_pending() ) {
+        log_debug("waiting for gadget backend; mode changes blocked");
+        goto BAILOUT;
+    }
+
     /* Handle cable disconnect / charger connect
      *
      * Only one mode is applicable regardless of things like current
@@ -838,10 +855,16 @@ void control_set_cable_state(cable_state_t cable_state)
     if( control_cable_state == prev )
         goto EXIT;
 
+    log_set_field(LOG_FIELD_CABLE_STATE,
+                  cable_state_repr(control_cable_state));
+
     log_debug("control_cable_state: %s -> %s",
               cable_state_repr(prev),
               cable_state_repr(control_cable_state));
 
+    if( control_cable_state == CABLE_STATE_PC_CONNECTED )
+        latency_cable_connected();
+
     control_rethink_usb_mode();
 
 EXIT:
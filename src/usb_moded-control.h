@@ -52,6 +52,7 @@ void           control_device_lock_changed (void);
 void           control_device_state_changed(void);
 void           control_settings_changed    (void);
 void           control_init_done_changed   (void);
+void           control_backend_changed     (void);
 void           control_set_enabled         (bool enable);
 void           control_set_cable_state     (cable_state_t cable_state);
 cable_state_t  control_get_cable_state     (void);
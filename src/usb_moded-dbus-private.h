@@ -80,6 +80,7 @@ int             umdbus_send_supported_modes_signal  (const char *supported_modes
 int             umdbus_send_available_modes_signal  (const char *available_modes);
 int             umdbus_send_hidden_modes_signal     (const char *hidden_modes);
 int             umdbus_send_whitelisted_modes_signal(const char *whitelist);
+void            umdbus_send_storage_blockers_signal (const char *mountpoint, const GPtrArray *blockers);
 gboolean        umdbus_get_name_owner_async         (const char *name, usb_moded_get_name_owner_fn cb, DBusPendingCall **ppc);
 const char     *umdbus_arg_type_repr                (int type);
 const char     *umdbus_arg_type_signature           (int type);
@@ -38,9 +38,11 @@
 #include "usb_moded.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
+#include "usb_moded-latency.h"
+#include "usb_moded-blocker.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
-#include "usb_moded-network.h"
+#include "usb_moded-worker.h"
 
 #include <sys/stat.h>
 
@@ -169,6 +171,9 @@ struct umdbus_context_t {
 
     /** Reply message to send */
     DBusMessage            *rsp;
+
+    /** Reply will be sent later on by the member callback */
+    bool                    deferred;
 };
 
 /* ========================================================================= *
@@ -209,7 +214,10 @@ static void introspectable_introspect_cb(umdbus_context_t *context);
 static void usb_moded_state_request_cb           (umdbus_context_t *context);
 static void usb_moded_target_state_get_cb        (umdbus_context_t *context);
 static void usb_moded_target_config_get_cb       (umdbus_context_t *context);
+static void usb_moded_state_set_reply_cb         (unsigned seq, worker_result_t result, void *aptr);
+static void usb_moded_state_set_common           (umdbus_context_t *context, bool sync);
 static void usb_moded_state_set_cb               (umdbus_context_t *context);
+static void usb_moded_state_set_sync_cb          (umdbus_context_t *context);
 static void usb_moded_config_set_cb              (umdbus_context_t *context);
 static void usb_moded_config_get_cb              (umdbus_context_t *context);
 static void usb_moded_mode_list_cb               (umdbus_context_t *context);
@@ -221,6 +229,8 @@ static void usb_moded_hidden_get_cb              (umdbus_context_t *context);
 static void usb_moded_whitelisted_modes_get_cb   (umdbus_context_t *context);
 static void usb_moded_whitelisted_modes_set_cb   (umdbus_context_t *context);
 static void usb_moded_user_config_clear_cb       (umdbus_context_t *context);
+static void usb_moded_config_generation_get_cb   (umdbus_context_t *context);
+static void usb_moded_latency_get_cb             (umdbus_context_t *context);
 static void usb_moded_whitelisted_set_cb         (umdbus_context_t *context);
 static void usb_moded_network_set_cb             (umdbus_context_t *context);
 static void usb_moded_network_get_cb             (umdbus_context_t *context);
@@ -282,6 +292,7 @@ bool                        umdbus_append_basic_variant         (DBusMessageIter
 bool                        umdbus_append_bool                  (DBusMessageIter *iter, bool val);
 bool                        umdbus_append_int                   (DBusMessageIter *iter, int val);
 bool                        umdbus_append_string                (DBusMessageIter *iter, const char *val);
+static bool                 umdbus_append_raw_string            (DBusMessageIter *iter, const char *val);
 bool                        umdbus_append_bool_variant          (DBusMessageIter *iter, bool val);
 bool                        umdbus_append_int_variant           (DBusMessageIter *iter, int val);
 bool                        umdbus_append_string_variant        (DBusMessageIter *iter, const char *val);
@@ -547,12 +558,52 @@ usb_moded_target_config_get_cb(umdbus_context_t *context)
         umdbus_append_mode_details(context->rsp, mode);
 }
 
+/** Send deferred reply to set_mode_sync method call
+ *
+ * @param seq     worker command sequence number
+ * @param result  how the mode switch ended
+ * @param aptr    method call message, as void pointer
+ */
+static void
+usb_moded_state_set_reply_cb(unsigned seq, worker_result_t result, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage *msg = aptr;
+    DBusMessage *rsp = 0;
+    const char  *mode = control_get_external_mode();
+
+    log_debug("mode request #%u %s: %s", seq, worker_result_repr(result), mode);
+
+    if( result == WORKER_RESULT_DONE ) {
+        if( (rsp = dbus_message_new_method_return(msg)) )
+            dbus_message_append_args(rsp, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID);
+    }
+    else {
+        rsp = dbus_message_new_error_printf(msg, DBUS_ERROR_FAILED,
+                                            "Mode switch %s",
+                                            worker_result_repr(result));
+    }
+
+    if( rsp && umdbus_connection && !dbus_message_get_no_reply(msg) ) {
+        if( !dbus_connection_send(umdbus_connection, rsp, 0) )
+            log_debug("Failed sending reply. Out Of Memory!\n");
+    }
+
+    if( rsp )
+        dbus_message_unref(rsp);
+    dbus_message_unref(msg);
+}
+
 /** Set usb mode
  *
  * When accepted, mode shows up 1st as target mode and then as active mode
+ *
+ * @param context  method call context
+ * @param sync     true to reply only after mode switch has finished
  */
 static void
-usb_moded_state_set_cb(umdbus_context_t *context)
+usb_moded_state_set_common(umdbus_context_t *context, bool sync)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -560,6 +611,7 @@ usb_moded_state_set_cb(umdbus_context_t *context)
     char       *use  = 0;
     DBusError   err  = DBUS_ERROR_INIT;
     uid_t       uid  = umdbus_get_sender_uid(context->sender);
+    unsigned    seq  = worker_get_request_seq();
 
     if( !dbus_message_get_args(context->msg, &err, DBUS_TYPE_STRING, &use, DBUS_TYPE_INVALID) ) {
         log_err("parse error: %s: %s", err.name, err.message);
@@ -586,6 +638,17 @@ usb_moded_state_set_cb(umdbus_context_t *context)
         /* Requested mode could not be activated */
         log_warning("Mode '%s' was rejected", use);
     }
+    else if( sync && seq != worker_get_request_seq() ) {
+        /* Mode switch initiated, reply when worker is done with it */
+        log_debug("Mode '%s' requested, reply deferred", use);
+
+        seq = worker_get_request_seq();
+        DBusMessage *msg = dbus_message_ref(context->msg);
+        if( worker_add_done_cb(seq, usb_moded_state_set_reply_cb, msg) )
+            context->deferred = true;
+        else
+            dbus_message_unref(msg);
+    }
     else {
         /* Mode switch initiated (or requested mode already active) */
         log_debug("Mode '%s' requested", use);
@@ -596,12 +659,34 @@ usb_moded_state_set_cb(umdbus_context_t *context)
     }
 
     /* Default to returning a generic error context->rsp */
-    if( !context->rsp )
+    if( !context->rsp && !context->deferred )
         context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED, context->member);
 
     dbus_error_free(&err);
 }
 
+/** Set usb mode, reply as soon as the request is accepted
+ */
+static void
+usb_moded_state_set_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    usb_moded_state_set_common(context, false);
+}
+
+/** Set usb mode, reply after the mode switch has finished
+ *
+ * On success the reply carries the mode that is active afterwards.
+ */
+static void
+usb_moded_state_set_sync_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    usb_moded_state_set_common(context, true);
+}
+
 /* ------------------------------------------------------------------------- *
  * default mode
  * ------------------------------------------------------------------------- */
@@ -853,6 +938,92 @@ usb_moded_user_config_clear_cb(umdbus_context_t *context)
     dbus_error_free(&err);
 }
 
+/** Get settings generation
+ *
+ * Clients can use this to check whether settings might have changed
+ * since they were last queried.
+ */
+static void
+usb_moded_config_generation_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dbus_uint32_t generation = config_get_generation();
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_UINT32, &generation, DBUS_TYPE_INVALID);
+}
+
+/** Get timing data for recent mode switches
+ *
+ * Each transition is reported as: sequence number, mode name,
+ * success, duration [us], cable connect to mode active latency [us]
+ * or -1, and list of phases as: name, start offset [us], duration [us].
+ */
+static void
+usb_moded_latency_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    latency_transition_t transitions[LATENCY_TRANSITION_COUNT];
+
+    size_t          count = latency_get_transitions(transitions, LATENCY_TRANSITION_COUNT);
+    DBusMessageIter body, arr;
+    bool            ack   = false;
+
+    if( !(context->rsp = dbus_message_new_method_return(context->msg)) )
+        goto EXIT;
+
+    if( !umdbus_append_init(&body, context->rsp) )
+        goto EXIT;
+
+    if( !umdbus_open_container(&body, &arr, DBUS_TYPE_ARRAY, "(usbxxa(sxx))") )
+        goto EXIT;
+
+    ack = true;
+    for( size_t i = 0; ack && i < count; ++i ) {
+        const latency_transition_t *trans = &transitions[i];
+        DBusMessageIter             rec, phases;
+        DBusBasicValue              seq   = { .u32 = trans->seq };
+        DBusBasicValue              total = { .i64 = trans->duration_us };
+        DBusBasicValue              cable = { .i64 = trans->cable_latency_us };
+
+        if( !umdbus_open_container(&arr, &rec, DBUS_TYPE_STRUCT, 0) ) {
+            ack = false;
+            break;
+        }
+        ack = (umdbus_append_basic_value(&rec, DBUS_TYPE_UINT32, &seq) &&
+               umdbus_append_string(&rec, trans->mode) &&
+               umdbus_append_bool(&rec, trans->success) &&
+               umdbus_append_basic_value(&rec, DBUS_TYPE_INT64, &total) &&
+               umdbus_append_basic_value(&rec, DBUS_TYPE_INT64, &cable));
+        if( ack && (ack = umdbus_open_container(&rec, &phases, DBUS_TYPE_ARRAY, "(sxx)")) ) {
+            for( size_t j = 0; ack && j < trans->phases; ++j ) {
+                const latency_phase_t *phase = &trans->phase[j];
+                DBusMessageIter        ent;
+                DBusBasicValue         offset   = { .i64 = phase->offset_us };
+                DBusBasicValue         duration = { .i64 = phase->duration_us };
+
+                if( !(ack = umdbus_open_container(&phases, &ent, DBUS_TYPE_STRUCT, 0)) )
+                    break;
+                ack = (umdbus_append_string(&ent, phase->name) &&
+                       umdbus_append_basic_value(&ent, DBUS_TYPE_INT64, &offset) &&
+                       umdbus_append_basic_value(&ent, DBUS_TYPE_INT64, &duration));
+                ack = umdbus_close_container(&phases, &ent, ack);
+            }
+            ack = umdbus_close_container(&rec, &phases, ack);
+        }
+        ack = umdbus_close_container(&arr, &rec, ack);
+    }
+
+    ack = umdbus_close_container(&body, &arr, ack);
+
+EXIT:
+    if( !ack && context->rsp ) {
+        dbus_message_unref(context->rsp);
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED, context->member);
+    }
+}
+
 /** Add usb mode to whitelist
  */
 static void
@@ -900,7 +1071,7 @@ usb_moded_network_set_cb(umdbus_context_t *context)
         if( SET_CONFIG_OK(ret) ) {
             if( (context->rsp = dbus_message_new_method_return(context->msg)) )
                 dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &config, DBUS_TYPE_STRING, &setting, DBUS_TYPE_INVALID);
-            network_update();
+            worker_refresh_mode();
         }
         else {
             context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, config);
@@ -970,6 +1141,10 @@ static const member_info_t usb_moded_members[] =
                usb_moded_state_set_cb,
                "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
                "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_STATE_SET_SYNC,
+               usb_moded_state_set_sync_cb,
+               "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
+               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
     ADD_METHOD(USB_MODE_CONFIG_SET,
                usb_moded_config_set_cb,
                "      <arg name=\"config\" type=\"s\" direction=\"in\"/>\n"
@@ -1024,6 +1199,12 @@ static const member_info_t usb_moded_members[] =
     ADD_METHOD(USB_MODE_USER_CONFIG_CLEAR,
                usb_moded_user_config_clear_cb,
                "      <arg name=\"uid\" type=\"u\" direction=\"in\"/>\n"),
+    ADD_METHOD(USB_MODE_CONFIG_GENERATION_GET,
+               usb_moded_config_generation_get_cb,
+               "      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_LATENCY_GET,
+               usb_moded_latency_get_cb,
+               "      <arg name=\"transitions\" type=\"a(usbxxa(sxx))\" direction=\"out\"/>\n"),
     ADD_SIGNAL(USB_MODE_SIGNAL_NAME,
                "      <arg name=\"mode_or_event\" type=\"s\"/>\n"),
     ADD_SIGNAL(USB_MODE_CURRENT_STATE_SIGNAL_NAME,
@@ -1049,6 +1230,9 @@ static const member_info_t usb_moded_members[] =
                "      <arg name=\"modes\" type=\"s\"/>\n"),
     ADD_SIGNAL(USB_MODE_ERROR_SIGNAL_NAME,
                "      <arg name=\"error\" type=\"s\"/>\n"),
+    ADD_SIGNAL(USB_MODE_STORAGE_BLOCKERS_SIGNAL_NAME,
+               "      <arg name=\"mountpoint\" type=\"s\"/>\n"
+               "      <arg name=\"blockers\" type=\"a(uuss)\"/>\n"),
     ADD_SENTINEL
 };
 
@@ -1310,6 +1494,9 @@ static DBusHandlerResult umdbus_msg_handler(DBusConnection *const connection, DB
     }
 
 EXIT:
+    if( context.deferred )
+        status = DBUS_HANDLER_RESULT_HANDLED;
+
     if( context.rsp ) {
         status = DBUS_HANDLER_RESULT_HANDLED;
         if( !dbus_message_get_no_reply(context.msg) ) {
@@ -1881,6 +2068,67 @@ int umdbus_send_whitelisted_modes_signal(const char *whitelist)
     return umdbus_send_signal_ex(USB_MODE_WHITELISTED_MODES_SIGNAL_NAME, whitelist);
 }
 
+/** Send list of processes that prevent unmounting mass storage
+ *
+ * Each blocker is reported as: pid, uid, process name, path.
+ *
+ * @param mountpoint  filesystem that could not be unmounted
+ * @param blockers    array of blocker_t pointers
+ */
+void umdbus_send_storage_blockers_signal(const char *mountpoint,
+                                         const GPtrArray *blockers)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage     *msg = 0;
+    DBusMessageIter  body, arr;
+    bool             ack = false;
+
+    /* Called also from unmount threads, possibly during shutdown */
+    if( !umdbus_connection ) {
+        log_err("storage blockers signal without connection: %s",
+                mountpoint);
+        goto EXIT;
+    }
+
+    if( !(msg = umdbus_new_signal(USB_MODE_STORAGE_BLOCKERS_SIGNAL_NAME)) )
+        goto EXIT;
+
+    if( !umdbus_append_init(&body, msg) )
+        goto EXIT;
+
+    if( !umdbus_append_raw_string(&body, mountpoint) )
+        goto EXIT;
+
+    if( !umdbus_open_container(&body, &arr, DBUS_TYPE_ARRAY, "(uuss)") )
+        goto EXIT;
+
+    ack = true;
+    for( guint i = 0; ack && blockers && i < blockers->len; ++i ) {
+        const blocker_t *blocker = g_ptr_array_index(blockers, i);
+        DBusMessageIter  rec;
+        DBusBasicValue   pid = { .u32 = (dbus_uint32_t)blocker->bl_pid };
+        DBusBasicValue   uid = { .u32 = (dbus_uint32_t)blocker->bl_uid };
+
+        if( !(ack = umdbus_open_container(&arr, &rec, DBUS_TYPE_STRUCT, 0)) )
+            break;
+        ack = (umdbus_append_basic_value(&rec, DBUS_TYPE_UINT32, &pid) &&
+               umdbus_append_basic_value(&rec, DBUS_TYPE_UINT32, &uid) &&
+               umdbus_append_raw_string(&rec, blocker->bl_name) &&
+               umdbus_append_raw_string(&rec, blocker->bl_path));
+        ack = umdbus_close_container(&arr, &rec, ack);
+    }
+
+    if( !umdbus_close_container(&body, &arr, ack) )
+        goto EXIT;
+
+    dbus_connection_send(umdbus_connection, msg, 0);
+
+EXIT:
+    if( msg )
+        dbus_message_unref(msg);
+}
+
 /** Async reply handler for umdbus_get_name_owner_async()
  *
  * @param pc    Pending call object pointer
@@ -2390,6 +2638,43 @@ umdbus_append_string(DBusMessageIter *iter, const char *val)
     return umdbus_append_basic_value(iter, DBUS_TYPE_STRING, &dta);
 }
 
+/** Append string that is not known to be valid UTF-8
+ *
+ * File names, process names and the like are just bytes, while
+ * libdbus aborts the process if string data is not valid UTF-8.
+ * Invalid sequences are replaced with U+FFFD before appending.
+ *
+ * @param iter  message iterator
+ * @param val   string to append, or NULL for empty string
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+umdbus_append_raw_string(DBusMessageIter *iter, const char *val)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *end = 0;
+
+    if( !val )
+        val = "";
+
+    if( g_utf8_validate(val, -1, 0) )
+        return umdbus_append_string(iter, val);
+
+    GString *buf = g_string_new(0);
+    while( !g_utf8_validate(val, -1, &end) ) {
+        g_string_append_len(buf, val, end - val);
+        g_string_append(buf, "\xef\xbf\xbd");
+        val = end + 1;
+    }
+    g_string_append(buf, val);
+
+    bool ack = umdbus_append_string(iter, buf->str);
+    g_string_free(buf, TRUE);
+    return ack;
+}
+
 bool
 umdbus_append_bool_variant(DBusMessageIter *iter, bool val)
 {
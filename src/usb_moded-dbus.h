@@ -57,6 +57,7 @@
 # define USB_MODE_WHITELISTED_MODES_SIGNAL_NAME "sig_usb_whitelisted_modes_ind"
 # define USB_MODE_AVAILABLE_MODES_SIGNAL_NAME   "sig_usb_available_modes_ind"
 # define USB_MODE_TARGET_CONFIG_SIGNAL_NAME     "sig_usb_taget_mode_config_ind"
+# define USB_MODE_STORAGE_BLOCKERS_SIGNAL_NAME  "sig_usb_storage_blockers_ind"
 
 /* supported methods */
 # define USB_MODE_STATE_REQUEST              "mode_request"  /* returns the current mode */
@@ -68,6 +69,7 @@
 # define USB_MODE_UNHIDE                     "unhide_mode"   /* unhide a mode */
 # define USB_MODE_HIDDEN_GET                 "get_hidden"    /* return the hidden modes */
 # define USB_MODE_STATE_SET                  "set_mode"      /* set a mode (only works when connected) */
+# define USB_MODE_STATE_SET_SYNC             "set_mode_sync" /* set a mode, reply when mode switch has finished */
 # define USB_MODE_CONFIG_SET                 "set_config"    /* set the mode that needs to be activated in the config file */
 # define USB_MODE_NETWORK_SET                "net_config"    /* set the network config in the config file */
 # define USB_MODE_NETWORK_GET                "get_net_config"    /* get the network config from the config file */
@@ -78,6 +80,8 @@
 # define USB_MODE_AVAILABLE_MODES_FOR_USER   "get_available_modes_for_user" /* returns a comma separated list of modes which are currently available and permitted for user to select */
 # define USB_MODE_TARGET_CONFIG_GET          "get_target_mode_config" /* returns current target mode configuration */
 # define USB_MODE_USER_CONFIG_CLEAR          "clear_config" /* clear config for a user */
+# define USB_MODE_CONFIG_GENERATION_GET      "get_config_generation" /* returns counter that changes when settings change */
+# define USB_MODE_LATENCY_GET                "get_mode_switch_latency" /* returns timing data for recent mode switches */
 
 /**
  * (Transient) states reported by "sig_usb_state_ind" that are not modes.
@@ -25,10 +25,11 @@
 
 #include "usb_moded-dsme.h"
 
+#include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
-#include "usb_moded-modesetting.h"
+#include "usb_moded-worker.h"
 
 #include <unistd.h>
 
@@ -216,6 +217,10 @@ dsme_state_update(dsme_state_t state)
         if( !dsme_shutdown_state )
             dsme_socket_connect();
 
+        /* Do not leave settings changes pending */
+        if( dsme_shutdown_state )
+            config_flush();
+
         device_state_changed = true;
     }
 
@@ -387,7 +392,7 @@ dsme_socket_recv_cb(GIOChannel *source,
         dsme_socket_processwd_pong();
 
         /* Do heartbeat actions here */
-        modesetting_verify_values();
+        worker_verify_mode();
     }
     else if( (msg2 = DSMEMSG_CAST(DSM_MSGTYPE_STATE_CHANGE_IND, msg)) ) {
         dsme_state_update(msg2->state);
@@ -29,11 +29,149 @@
 
 #include "usb_moded-dyn-config.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-log.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <glob.h>
 
+#ifdef SAILFISH_ACCESS_CONTROL
+# include <sailfishaccesscontrol.h>
+#endif
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Compiled cache of MODE_DIR_PATH ini-files */
+#define MODECACHE_PATH      USB_MODED_DYNAMIC_CONFIG_DIR"/dyn-modes.cache"
+
+/** Compiled cache of DIAG_DIR_PATH ini-files */
+#define MODECACHE_DIAG_PATH USB_MODED_DYNAMIC_CONFIG_DIR"/diag-modes.cache"
+
+/** Mode cache file identifier: "UMMC" */
+#define MODECACHE_MAGIC     0x434d4d55u
+
+/** Mode cache format version, bump when modecache_fields[] changes */
+#define MODECACHE_VERSION   1u
+
+/** Length value used for NULL strings in mode cache */
+#define MODECACHE_NULL      UINT32_MAX
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Bitset word type used for per mode flags */
+typedef guint32 modemask_t;
+
+/** Number of bits in modemask_t */
+#define MODEMASK_BITS (sizeof(modemask_t) * 8)
+
+/** Lookup table for loaded modes
+ *
+ * Mode names are hashed to mode slots, and config dependent attributes
+ * of each mode are kept as bitsets indexed by slot. The bitsets are
+ * recomputed when config generation changes, so that queries neither
+ * parse configuration values nor allocate memory.
+ */
+struct modeindex_t
+{
+    /** Mode name -> slot number + 1 */
+    GHashTable  *lookup;
+
+    /** Mode data objects by slot, owned by mode list */
+    modedata_t **mode;
+
+    /** Number of modes */
+    guint        count;
+
+    /** Config generation flags were evaluated at, or 0 */
+    unsigned     generation;
+
+    /** Is there a whitelist in config */
+    bool         have_whitelist;
+
+    /** Modes listed in hidden config */
+    modemask_t  *hidden;
+
+    /** Modes listed in whitelist config */
+    modemask_t  *whitelisted;
+
+#ifdef SAILFISH_ACCESS_CONTROL
+    /** Group required for each mode */
+    gchar      **group;
+#endif
+};
+
+/** Mode cache file header */
+typedef struct modecache_header_t
+{
+    /** MODECACHE_MAGIC */
+    uint32_t magic;
+
+    /** MODECACHE_VERSION */
+    uint32_t version;
+
+    /** Number of fields stored per mode */
+    uint32_t fields;
+
+    /** Length of source signature following the header */
+    uint32_t signature;
+
+    /** Number of modes following the signature */
+    uint32_t modes;
+} modecache_header_t;
+
+/** Mode data member stored in mode cache */
+typedef struct modecache_field_t
+{
+    /** Offset of member within modedata_t */
+    size_t offset;
+
+    /** true for gchar * members, false for int members */
+    bool   string;
+} modecache_field_t;
+
+/** Read position within mapped mode cache */
+typedef struct modecache_reader_t
+{
+    /** Current position */
+    const uint8_t *pos;
+
+    /** End of data */
+    const uint8_t *end;
+} modecache_reader_t;
+
+/** Immutable mode list with lookup table
+ *
+ * Mode data in a snapshot is never modified after creation. Changes
+ * are made by creating a new snapshot and replacing the published one,
+ * so that threads holding a reference can keep using the old one
+ * without locking. Only the config dependent flags in the index are
+ * evaluated lazily, and need to be serialized by the caller.
+ */
+struct modesnapshot_t
+{
+    /** Reference count */
+    gint         refcount;
+
+    /** Mode data objects, each with a reference held by the list */
+    GList       *modelist;
+
+    /** Lookup table for modelist */
+    modeindex_t *modeindex;
+};
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -42,8 +180,10 @@
  * MODEDATA
  * ------------------------------------------------------------------------- */
 
-static void        modedata_free_cb       (gpointer self);
-void               modedata_free          (modedata_t *self);
+static void        modedata_unref_cb      (gpointer self);
+static void        modedata_delete        (modedata_t *self);
+const modedata_t  *modedata_ref           (const modedata_t *self);
+void               modedata_unref         (const modedata_t *self);
 modedata_t        *modedata_copy          (const modedata_t *that);
 static void        modedata_flush_settings(modedata_t *self);
 void               modedata_cache_settings(modedata_t *self);
@@ -57,26 +197,103 @@ static modedata_t *modedata_load          (const gchar *filename);
 void   modelist_free(GList *modelist);
 GList *modelist_load(bool diag);
 
+/* ------------------------------------------------------------------------- *
+ * MODECACHE
+ * ------------------------------------------------------------------------- */
+
+static gchar *modecache_signature   (const char *dirpath, const glob_t *gb);
+static bool   modecache_read_bytes  (modecache_reader_t *self, void *buf, size_t len);
+static bool   modecache_read_string (modecache_reader_t *self, gchar **pstr);
+static bool   modecache_read        (const char *path, const char *signature, GList **pmodelist);
+static void   modecache_write_string(GByteArray *buf, const gchar *str);
+static void   modecache_write       (const char *path, const char *signature, GList *modelist);
+
+/* ------------------------------------------------------------------------- *
+ * MODEINDEX
+ * ------------------------------------------------------------------------- */
+
+static bool         modemask_test           (const modemask_t *mask, guint slot);
+static void         modemask_set            (modemask_t *mask, guint slot);
+static void         modemask_clear_all      (modemask_t *mask, guint count);
+modeindex_t        *modeindex_create        (GList *modelist);
+void                modeindex_delete        (modeindex_t *self);
+static int          modeindex_slot          (const modeindex_t *self, const char *modename);
+const modedata_t   *modeindex_lookup        (const modeindex_t *self, const char *modename);
+static void         modeindex_mark_listed   (modeindex_t *self, modemask_t *mask, const char *list);
+static void         modeindex_refresh       (modeindex_t *self);
+bool                modeindex_is_hidden     (modeindex_t *self, const char *modename);
+bool                modeindex_is_whitelisted(modeindex_t *self, const char *modename);
+bool                modeindex_is_permitted  (modeindex_t *self, const char *modename, uid_t uid);
+
+/* ------------------------------------------------------------------------- *
+ * MODESNAPSHOT
+ * ------------------------------------------------------------------------- */
+
+modesnapshot_t     *modesnapshot_create       (GList *modelist);
+modesnapshot_t     *modesnapshot_replace_mode (const modesnapshot_t *self, const modedata_t *data);
+modesnapshot_t     *modesnapshot_ref          (modesnapshot_t *self);
+void                modesnapshot_unref        (modesnapshot_t *self);
+GList              *modesnapshot_get_modelist (const modesnapshot_t *self);
+modeindex_t        *modesnapshot_get_modeindex(const modesnapshot_t *self);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+#define MODECACHE_STRING(member) { offsetof(modedata_t, member), true }
+#define MODECACHE_INT(member)    { offsetof(modedata_t, member), false }
+
+/** Mode data members that are loaded from ini-files */
+static const modecache_field_t modecache_fields[] =
+{
+    MODECACHE_STRING(mode_name),
+    MODECACHE_STRING(mode_module),
+    MODECACHE_INT(appsync),
+    MODECACHE_INT(network),
+    MODECACHE_INT(mass_storage),
+    MODECACHE_STRING(network_interface),
+    MODECACHE_STRING(sysfs_path),
+    MODECACHE_STRING(sysfs_value),
+    MODECACHE_STRING(sysfs_reset_value),
+    MODECACHE_STRING(android_extra_sysfs_path),
+    MODECACHE_STRING(android_extra_sysfs_value),
+    MODECACHE_STRING(android_extra_sysfs_path2),
+    MODECACHE_STRING(android_extra_sysfs_value2),
+    MODECACHE_STRING(android_extra_sysfs_path3),
+    MODECACHE_STRING(android_extra_sysfs_value3),
+    MODECACHE_STRING(android_extra_sysfs_path4),
+    MODECACHE_STRING(android_extra_sysfs_value4),
+    MODECACHE_STRING(idProduct),
+    MODECACHE_STRING(idVendorOverride),
+    MODECACHE_INT(nat),
+    MODECACHE_INT(dhcp_server),
+#ifdef CONNMAN
+    MODECACHE_STRING(connman_tethering),
+#endif
+};
+
+#define MODECACHE_FIELD_COUNT G_N_ELEMENTS(modecache_fields)
+
 /* ========================================================================= *
  * MODEDATA
  * ========================================================================= */
 
-/** Type agnostice relase modedata_t object callback
+/** Type agnostic release modedata_t reference callback
  *
  * @param self Object pointer, or NULL
  */
 static void
-modedata_free_cb(gpointer self)
+modedata_unref_cb(gpointer self)
 {
-    modedata_free(self);
+    modedata_unref(self);
 }
 
-/** Relase modedata_t object
+/** Release modedata_t object
  *
  * @param self Object pointer, or NULL
  */
-void
-modedata_free(modedata_t *self)
+static void
+modedata_delete(modedata_t *self)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -105,11 +322,49 @@ modedata_free(modedata_t *self)
     }
 }
 
+/** Add reference to modedata_t object
+ *
+ * Mode data objects are not modified after they have been made
+ * available to other threads, so a reference can be used without
+ * locking.
+ *
+ * @param self Object pointer, or NULL
+ *
+ * @return self
+ */
+const modedata_t *
+modedata_ref(const modedata_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self )
+        g_atomic_int_inc(&((modedata_t *)self)->refcount);
+
+    return self;
+}
+
+/** Drop reference to modedata_t object
+ *
+ * The object is released when the last reference is dropped.
+ *
+ * @param self Object pointer, or NULL
+ */
+void
+modedata_unref(const modedata_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self && g_atomic_int_dec_and_test(&((modedata_t *)self)->refcount) )
+        modedata_delete((modedata_t *)self);
+}
+
 /** Clone modedata_t object
+ *
+ * The clone can be modified until it is shared with other threads.
  *
  * @param that Object pointer, or NULL
  *
- * @return Object pointer, or NULL
+ * @return Object pointer with one reference, or NULL
  */
 modedata_t *
 modedata_copy(const modedata_t *that)
@@ -151,6 +406,7 @@ modedata_copy(const modedata_t *that)
     self->cached_gateway             = g_strdup(that->cached_gateway);
     self->cached_nat_interface       = g_strdup(that->cached_nat_interface);
     self->cached_netmask             = g_strdup(that->cached_netmask);
+    self->refcount                   = 1;
 
 EXIT:
     return self;
@@ -242,6 +498,8 @@ modedata_load(const gchar *filename)
     if( !(self = calloc(1, sizeof *self)) )
         goto EXIT;
 
+    self->refcount = 1;
+
     // [MODE_ENTRY = "mode"]
     self->mode_name         = g_key_file_get_string(settingsfile, MODE_ENTRY, MODE_NAME_KEY, NULL);
     self->mode_module       = g_key_file_get_string(settingsfile, MODE_ENTRY, MODE_MODULE_KEY, NULL);
@@ -328,7 +586,7 @@ EXIT:
     g_key_file_free(settingsfile);
 
     if( !success )
-        modedata_free(self), self = 0;
+        modedata_delete(self), self = 0;
 
     return self;
 }
@@ -346,7 +604,7 @@ modelist_free(GList *modelist)
 {
     LOG_REGISTER_CONTEXT;
 
-    g_list_free_full(modelist, modedata_free_cb);
+    g_list_free_full(modelist, modedata_unref_cb);
 }
 
 /** Load mode data files from configuration directory
@@ -361,24 +619,663 @@ modelist_load(bool diag)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList      *modelist = 0;
-    const char *dirpath  = diag ? DIAG_DIR_PATH : MODE_DIR_PATH;
-    gchar      *pattern  = g_strdup_printf("%s/*.ini", dirpath);
-    glob_t      gb       = {};
+    int64_t     started   = common_get_monotonic_us();
+    GList      *modelist  = 0;
+    const char *dirpath   = diag ? DIAG_DIR_PATH : MODE_DIR_PATH;
+    const char *cachepath = diag ? MODECACHE_DIAG_PATH : MODECACHE_PATH;
+    gchar      *pattern   = g_strdup_printf("%s/*.ini", dirpath);
+    gchar      *signature = 0;
+    glob_t      gb        = {};
+    bool        cached    = false;
 
     if( glob(pattern, 0, 0, &gb) != 0 )
         log_debug("no mode configuration ini-files found");
 
+    signature = modecache_signature(dirpath, &gb);
+
+    if( (cached = modecache_read(cachepath, signature, &modelist)) )
+        goto EXIT;
+
     for( size_t i = 0; i < gb.gl_pathc; ++i ) {
         const char *filepath = gb.gl_pathv[i];
         log_debug("Read file %s\n", filepath);
         modedata_t *list_item = modedata_load(filepath);
         if(list_item)
-            modelist = g_list_append(modelist, list_item);
+            modelist = g_list_prepend(modelist, list_item);
     }
 
+    modelist = g_list_sort(modelist, modedata_sort_cb);
+    modecache_write(cachepath, signature, modelist);
+
+EXIT:
+    log_notice("%u modes loaded from %s in %lld us",
+               g_list_length(modelist), cached ? cachepath : dirpath,
+               (long long)(common_get_monotonic_us() - started));
+
     globfree(&gb);
+    g_free(signature);
     g_free(pattern);
 
-    return g_list_sort(modelist, modedata_sort_cb);
+    return modelist;
+}
+
+/* ========================================================================= *
+ * MODECACHE
+ * ========================================================================= */
+
+/** Describe state of mode configuration files
+ *
+ * Any change in directory or file modification times, sizes or
+ * inode numbers yields a different signature.
+ *
+ * @param dirpath  mode configuration directory
+ * @param gb       ini-files found in dirpath
+ *
+ * @return signature string
+ */
+static gchar *
+modecache_signature(const char *dirpath, const glob_t *gb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString     *sig = g_string_new(0);
+    struct stat  st;
+
+    if( stat(dirpath, &st) == 0 )
+        g_string_append_printf(sig, "%s:%lld.%09ld\n", dirpath,
+                               (long long)st.st_mtim.tv_sec,
+                               (long)st.st_mtim.tv_nsec);
+
+    for( size_t i = 0; i < gb->gl_pathc; ++i ) {
+        const char *filepath = gb->gl_pathv[i];
+        if( stat(filepath, &st) == -1 )
+            continue;
+        g_string_append_printf(sig, "%s:%lld.%09ld:%lld:%llu\n", filepath,
+                               (long long)st.st_mtim.tv_sec,
+                               (long)st.st_mtim.tv_nsec,
+                               (long long)st.st_size,
+                               (unsigned long long)st.st_ino);
+    }
+
+    return g_string_free(sig, FALSE);
+}
+
+static bool
+modecache_read_bytes(modecache_reader_t *self, void *buf, size_t len)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( (size_t)(self->end - self->pos) < len )
+        return false;
+
+    memcpy(buf, self->pos, len);
+    self->pos += len;
+    return true;
+}
+
+static bool
+modecache_read_string(modecache_reader_t *self, gchar **pstr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    uint32_t len = 0;
+
+    if( !modecache_read_bytes(self, &len, sizeof len) )
+        return false;
+
+    if( len == MODECACHE_NULL ) {
+        *pstr = 0;
+        return true;
+    }
+
+    if( (size_t)(self->end - self->pos) < len )
+        return false;
+
+    *pstr = g_strndup((const gchar *)self->pos, len);
+    self->pos += len;
+    return true;
+}
+
+/** Load mode list from compiled cache
+ *
+ * @param path       cache file path
+ * @param signature  current state of mode configuration files
+ * @param pmodelist  where to store list of mode data objects
+ *
+ * @return true if cache was valid and up to date, false otherwise
+ */
+static bool
+modecache_read(const char *path, const char *signature, GList **pmodelist)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool                ack      = false;
+    GList              *modelist = 0;
+    int                 fd       = -1;
+    void               *map      = MAP_FAILED;
+    size_t              size     = 0;
+    modecache_header_t  hdr;
+    modecache_reader_t  rd;
+    struct stat         st;
+
+    if( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 ) {
+        if( errno != ENOENT )
+            log_warning("%s: open failed: %m", path);
+        goto EXIT;
+    }
+
+    if( fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof hdr )
+        goto EXIT;
+
+    size = (size_t)st.st_size;
+    if( (map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED ) {
+        log_warning("%s: mmap failed: %m", path);
+        goto EXIT;
+    }
+
+    rd.pos = map;
+    rd.end = rd.pos + size;
+
+    if( !modecache_read_bytes(&rd, &hdr, sizeof hdr) ||
+        hdr.magic != MODECACHE_MAGIC ||
+        hdr.version != MODECACHE_VERSION ||
+        hdr.fields != MODECACHE_FIELD_COUNT ) {
+        log_debug("%s: incompatible cache", path);
+        goto EXIT;
+    }
+
+    if( hdr.signature != strlen(signature) ||
+        (size_t)(rd.end - rd.pos) < hdr.signature ||
+        memcmp(rd.pos, signature, hdr.signature) ) {
+        log_debug("%s: mode configuration has changed", path);
+        goto EXIT;
+    }
+    rd.pos += hdr.signature;
+
+    for( uint32_t i = 0; i < hdr.modes; ++i ) {
+        modedata_t *data = calloc(1, sizeof *data);
+        if( !data )
+            goto EXIT;
+        data->refcount = 1;
+        modelist = g_list_prepend(modelist, data);
+
+        for( size_t j = 0; j < MODECACHE_FIELD_COUNT; ++j ) {
+            char *member = (char *)data + modecache_fields[j].offset;
+            bool  ok;
+
+            if( modecache_fields[j].string ) {
+                ok = modecache_read_string(&rd, (gchar **)member);
+            }
+            else {
+                int32_t value = 0;
+                ok = modecache_read_bytes(&rd, &value, sizeof value);
+                *(int *)member = value;
+            }
+
+            if( !ok ) {
+                log_warning("%s: truncated cache", path);
+                goto EXIT;
+            }
+        }
+    }
+
+    ack = true;
+
+EXIT:
+    if( map != MAP_FAILED )
+        munmap(map, size);
+
+    if( fd != -1 )
+        close(fd);
+
+    if( ack )
+        *pmodelist = g_list_reverse(modelist);
+    else
+        modelist_free(modelist);
+
+    return ack;
+}
+
+static void
+modecache_write_string(GByteArray *buf, const gchar *str)
+{
+    LOG_REGISTER_CONTEXT;
+
+    uint32_t len = str ? (uint32_t)strlen(str) : MODECACHE_NULL;
+
+    g_byte_array_append(buf, (const guint8 *)&len, sizeof len);
+    if( str )
+        g_byte_array_append(buf, (const guint8 *)str, len);
+}
+
+/** Store mode list to compiled cache
+ *
+ * @param path       cache file path
+ * @param signature  state of mode configuration files modelist is from
+ * @param modelist   list of mode data objects
+ */
+static void
+modecache_write(const char *path, const char *signature, GList *modelist)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GByteArray         *buf = g_byte_array_new();
+    GError             *err = 0;
+    modecache_header_t  hdr = {
+        .magic     = MODECACHE_MAGIC,
+        .version   = MODECACHE_VERSION,
+        .fields    = MODECACHE_FIELD_COUNT,
+        .signature = (uint32_t)strlen(signature),
+        .modes     = g_list_length(modelist),
+    };
+
+    g_byte_array_append(buf, (const guint8 *)&hdr, sizeof hdr);
+    g_byte_array_append(buf, (const guint8 *)signature, hdr.signature);
+
+    for( GList *iter = modelist; iter; iter = g_list_next(iter) ) {
+        const modedata_t *data = iter->data;
+
+        for( size_t j = 0; j < MODECACHE_FIELD_COUNT; ++j ) {
+            const char *member = (const char *)data + modecache_fields[j].offset;
+
+            if( modecache_fields[j].string ) {
+                modecache_write_string(buf, *(gchar * const *)member);
+            }
+            else {
+                int32_t value = *(const int *)member;
+                g_byte_array_append(buf, (const guint8 *)&value, sizeof value);
+            }
+        }
+    }
+
+    if( !g_file_set_contents(path, (const gchar *)buf->data, buf->len, &err) )
+        log_warning("%s: can't write mode cache: %s", path, err->message);
+    else
+        log_debug("%s: mode cache updated", path);
+
+    g_clear_error(&err);
+    g_byte_array_free(buf, TRUE);
+}
+
+/* ========================================================================= *
+ * MODEINDEX
+ * ========================================================================= */
+
+static bool
+modemask_test(const modemask_t *mask, guint slot)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (mask[slot / MODEMASK_BITS] >> (slot % MODEMASK_BITS)) & 1u;
+}
+
+static void
+modemask_set(modemask_t *mask, guint slot)
+{
+    LOG_REGISTER_CONTEXT;
+
+    mask[slot / MODEMASK_BITS] |= (modemask_t)1u << (slot % MODEMASK_BITS);
+}
+
+static void
+modemask_clear_all(modemask_t *mask, guint count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    memset(mask, 0, (count / MODEMASK_BITS + 1) * sizeof *mask);
+}
+
+/** Create lookup table for a mode list
+ *
+ * The index refers to mode data objects owned by the list and must
+ * be deleted before the list is released.
+ *
+ * @param modelist  List of mode data objects
+ *
+ * @return index object
+ */
+modeindex_t *
+modeindex_create(GList *modelist)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modeindex_t *self  = g_malloc0(sizeof *self);
+    guint        words = g_list_length(modelist) / MODEMASK_BITS + 1;
+
+    self->lookup     = g_hash_table_new(g_str_hash, g_str_equal);
+    self->mode       = g_new0(modedata_t *, g_list_length(modelist) + 1);
+    self->count      = 0;
+    self->generation = 0;
+
+    for( GList *iter = modelist; iter; iter = g_list_next(iter) ) {
+        modedata_t *data = iter->data;
+        if( g_hash_table_lookup(self->lookup, data->mode_name) ) {
+            log_warning("duplicate mode %s ignored", data->mode_name);
+            continue;
+        }
+        self->mode[self->count++] = data;
+        g_hash_table_insert(self->lookup, data->mode_name,
+                            GUINT_TO_POINTER(self->count));
+    }
+
+    self->hidden      = g_new0(modemask_t, words);
+    self->whitelisted = g_new0(modemask_t, words);
+
+#ifdef SAILFISH_ACCESS_CONTROL
+    self->group       = g_new0(gchar *, self->count + 1);
+#endif
+
+    return self;
+}
+
+/** Release lookup table
+ *
+ * @param self  index object, or NULL
+ */
+void
+modeindex_delete(modeindex_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        g_hash_table_unref(self->lookup);
+        g_free(self->mode);
+        g_free(self->hidden);
+        g_free(self->whitelisted);
+#ifdef SAILFISH_ACCESS_CONTROL
+        g_strfreev(self->group);
+#endif
+        g_free(self);
+    }
+}
+
+/** Map mode name to slot number
+ *
+ * @param self      index object, or NULL
+ * @param modename  name of mode
+ *
+ * @return slot number, or -1 if mode is not in the index
+ */
+static int
+modeindex_slot(const modeindex_t *self, const char *modename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !self || !modename )
+        return -1;
+
+    return GPOINTER_TO_UINT(g_hash_table_lookup(self->lookup, modename)) - 1;
+}
+
+/** Lookup mode data by name
+ *
+ * @param self      index object, or NULL
+ * @param modename  name of mode
+ *
+ * @return mode data object, or NULL
+ */
+const modedata_t *
+modeindex_lookup(const modeindex_t *self, const char *modename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int slot = modeindex_slot(self, modename);
+    return slot < 0 ? 0 : self->mode[slot];
+}
+
+/** Set bits for modes present in comma separated list
+ *
+ * @param self  index object
+ * @param mask  bitset to modify
+ * @param list  comma separated list of mode names, or NULL
+ */
+static void
+modeindex_mark_listed(modeindex_t *self, modemask_t *mask, const char *list)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **vec = list ? g_strsplit(list, ",", 0) : 0;
+
+    for( size_t i = 0; vec && vec[i]; ++i ) {
+        int slot = modeindex_slot(self, vec[i]);
+        if( slot >= 0 )
+            modemask_set(mask, slot);
+    }
+
+    g_strfreev(vec);
+}
+
+/** Re-evaluate config dependent flags if config has changed
+ *
+ * @param self  index object
+ */
+static void
+modeindex_refresh(modeindex_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned generation = config_get_generation();
+
+    if( self->generation == generation )
+        goto EXIT;
+
+    log_debug("evaluate mode flags for config generation %u", generation);
+    self->generation = generation;
+
+    gchar *hidden    = config_get_hidden_modes();
+    gchar *whitelist = config_get_mode_whitelist();
+
+    modemask_clear_all(self->hidden, self->count);
+    modeindex_mark_listed(self, self->hidden, hidden);
+
+    self->have_whitelist = (whitelist != 0);
+    modemask_clear_all(self->whitelisted, self->count);
+    modeindex_mark_listed(self, self->whitelisted, whitelist);
+
+    g_free(whitelist);
+    g_free(hidden);
+
+#ifdef SAILFISH_ACCESS_CONTROL
+    for( guint slot = 0; slot < self->count; ++slot ) {
+        g_free(self->group[slot]);
+        self->group[slot] = config_get_group_for_mode(self->mode[slot]->mode_name);
+    }
+#endif
+
+EXIT:
+    return;
+}
+
+/** Check if mode is listed in hidden modes config
+ *
+ * @param self      index object, or NULL
+ * @param modename  name of mode
+ *
+ * @return true if mode is hidden, false otherwise
+ */
+bool
+modeindex_is_hidden(modeindex_t *self, const char *modename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int slot = modeindex_slot(self, modename);
+    if( slot < 0 )
+        return false;
+
+    modeindex_refresh(self);
+    return modemask_test(self->hidden, slot);
+}
+
+/** Check if mode is allowed by whitelist config
+ *
+ * @param self      index object, or NULL
+ * @param modename  name of mode
+ *
+ * @return true if there is no whitelist or mode is in it,
+ *         false otherwise
+ */
+bool
+modeindex_is_whitelisted(modeindex_t *self, const char *modename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int slot = modeindex_slot(self, modename);
+    if( slot < 0 )
+        return false;
+
+    modeindex_refresh(self);
+    return !self->have_whitelist || modemask_test(self->whitelisted, slot);
+}
+
+/** Check if user is allowed to use a dynamic mode
+ *
+ * Required groups are cached with the index, but group membership
+ * is checked on every call so that changes made at runtime take
+ * effect immediately.
+ *
+ * @param self      index object, or NULL
+ * @param modename  name of mode
+ * @param uid       user id
+ *
+ * @return true if mode is permitted, or is not a dynamic mode;
+ *         false otherwise
+ */
+bool
+modeindex_is_permitted(modeindex_t *self, const char *modename, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool allowed = true;
+
+#ifdef SAILFISH_ACCESS_CONTROL
+    int slot = modeindex_slot(self, modename);
+    if( slot < 0 )
+        goto EXIT;
+
+    modeindex_refresh(self);
+
+    allowed = sailfish_access_control_hasgroup(uid, self->group[slot]);
+
+EXIT:
+#else
+    (void)self;
+    (void)modename;
+    (void)uid;
+#endif
+
+    return allowed;
+}
+
+/* ========================================================================= *
+ * MODESNAPSHOT
+ * ========================================================================= */
+
+/** Create mode list snapshot
+ *
+ * @param modelist  List of mode data objects; ownership of the list
+ *                  and the references it holds is transferred
+ *
+ * @return snapshot object with one reference
+ */
+modesnapshot_t *
+modesnapshot_create(GList *modelist)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modesnapshot_t *self = g_malloc0(sizeof *self);
+
+    self->refcount  = 1;
+    self->modelist  = modelist;
+    self->modeindex = modeindex_create(modelist);
+
+    return self;
+}
+
+/** Create snapshot where one mode is replaced with updated data
+ *
+ * Unchanged mode data objects are shared with the original snapshot.
+ *
+ * @param self  snapshot object
+ * @param data  mode data to use instead of the one with the same name
+ *
+ * @return snapshot object with one reference
+ */
+modesnapshot_t *
+modesnapshot_replace_mode(const modesnapshot_t *self, const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GList *modelist = 0;
+
+    for( GList *iter = self->modelist; iter; iter = g_list_next(iter) ) {
+        const modedata_t *item = iter->data;
+        if( !g_strcmp0(item->mode_name, data->mode_name) )
+            item = data;
+        modelist = g_list_prepend(modelist, (gpointer)modedata_ref(item));
+    }
+
+    return modesnapshot_create(g_list_reverse(modelist));
+}
+
+/** Add reference to snapshot
+ *
+ * @param self  snapshot object, or NULL
+ *
+ * @return self
+ */
+modesnapshot_t *
+modesnapshot_ref(modesnapshot_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self )
+        g_atomic_int_inc(&self->refcount);
+
+    return self;
+}
+
+/** Drop reference to snapshot
+ *
+ * The snapshot is released when the last reference is dropped.
+ *
+ * @param self  snapshot object, or NULL
+ */
+void
+modesnapshot_unref(modesnapshot_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self && g_atomic_int_dec_and_test(&self->refcount) ) {
+        modeindex_delete(self->modeindex);
+        modelist_free(self->modelist);
+        g_free(self);
+    }
+}
+
+/** Get mode data objects in snapshot
+ *
+ * @param self  snapshot object, or NULL
+ *
+ * @return List of mode data objects, or NULL
+ */
+GList *
+modesnapshot_get_modelist(const modesnapshot_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return self ? self->modelist : 0;
+}
+
+/** Get lookup table for snapshot
+ *
+ * @param self  snapshot object, or NULL
+ *
+ * @return index object, or NULL
+ */
+modeindex_t *
+modesnapshot_get_modeindex(const modesnapshot_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return self ? self->modeindex : 0;
 }
@@ -34,6 +34,7 @@
 
 # include <stdbool.h>
 # include <glib.h>
+# include <sys/types.h>
 
 /* ========================================================================= *
  * Constants
@@ -129,8 +130,17 @@ typedef struct modedata_t
     gchar *cached_nat_interface;           /**< Cached NETWORK_NAT_INTERFACE_KEY setting */
     gchar *cached_netmask;                 /**< Cached NETWORK_NETMASK_KEY setting */
 
+    gint   refcount;                       /**< Reference count, see modedata_ref() */
 } modedata_t;
 
+/** Name lookup table and precomputed flags for a loaded mode list
+ */
+typedef struct modeindex_t modeindex_t;
+
+/** Refcounted mode list and index that are replaced as a whole
+ */
+typedef struct modesnapshot_t modesnapshot_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -139,9 +149,10 @@ typedef struct modedata_t
  * MODEDATA
  * ------------------------------------------------------------------------- */
 
-void        modedata_free          (modedata_t *self);
-modedata_t *modedata_copy          (const modedata_t *that);
-void        modedata_cache_settings(modedata_t *self);
+const modedata_t *modedata_ref           (const modedata_t *self);
+void              modedata_unref         (const modedata_t *self);
+modedata_t       *modedata_copy          (const modedata_t *that);
+void              modedata_cache_settings(modedata_t *self);
 
 /* ------------------------------------------------------------------------- *
  * MODELIST
@@ -150,4 +161,26 @@ void        modedata_cache_settings(modedata_t *self);
 void   modelist_free(GList *modelist);
 GList *modelist_load(bool diag);
 
+/* ------------------------------------------------------------------------- *
+ * MODEINDEX
+ * ------------------------------------------------------------------------- */
+
+modeindex_t *modeindex_create        (GList *modelist);
+void         modeindex_delete        (modeindex_t *self);
+const modedata_t *modeindex_lookup   (const modeindex_t *self, const char *modename);
+bool         modeindex_is_hidden     (modeindex_t *self, const char *modename);
+bool         modeindex_is_whitelisted(modeindex_t *self, const char *modename);
+bool         modeindex_is_permitted  (modeindex_t *self, const char *modename, uid_t uid);
+
+/* ------------------------------------------------------------------------- *
+ * MODESNAPSHOT
+ * ------------------------------------------------------------------------- */
+
+modesnapshot_t *modesnapshot_create       (GList *modelist);
+modesnapshot_t *modesnapshot_replace_mode (const modesnapshot_t *self, const modedata_t *data);
+modesnapshot_t *modesnapshot_ref          (modesnapshot_t *self);
+void            modesnapshot_unref        (modesnapshot_t *self);
+GList          *modesnapshot_get_modelist (const modesnapshot_t *self);
+modeindex_t    *modesnapshot_get_modeindex(const modesnapshot_t *self);
+
 #endif /* USB_MODED_DYN_CONFIG_H_ */
@@ -0,0 +1,253 @@
+/**
+ * @file usb_moded-latency.c
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-latency.h"
+
+#include "usb_moded-common.h"
+#include "usb_moded-log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * LATENCY
+ * ------------------------------------------------------------------------- */
+
+static void latency_close_phase_locked(latency_transition_t *self, int64_t now);
+void        latency_cable_connected   (void);
+void        latency_transition_begin  (const char *mode);
+void        latency_phase             (const char *name);
+void        latency_transition_end    (bool success);
+size_t      latency_get_transitions   (latency_transition_t *buf, size_t max);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Mutex for synchronizing worker thread writes and mainloop reads */
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define LATENCY_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&latency_mutex) != 0 ) { \
+        log_crit("LATENCY LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define LATENCY_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&latency_mutex) != 0 ) { \
+        log_crit("LATENCY UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/** Ring buffer of recently finished mode transitions */
+static latency_transition_t latency_history[LATENCY_TRANSITION_COUNT];
+
+/** Number of transitions recorded so far; ring write position */
+static unsigned latency_history_count = 0;
+
+/** Transition currently being recorded */
+static latency_transition_t latency_current;
+
+/** Whether latency_current holds an unfinished transition */
+static bool latency_current_active = false;
+
+/** Time of the latest cable connect not yet accounted for, or -1 */
+static int64_t latency_cable_us = -1;
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+/** Close the currently open phase of a transition
+ *
+ * @param self  transition object
+ * @param now   current time [us]
+ */
+static void
+latency_close_phase_locked(latency_transition_t *self, int64_t now)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self->phases > 0 ) {
+        latency_phase_t *phase = &self->phase[self->phases - 1];
+        if( phase->duration_us < 0 )
+            phase->duration_us = now - self->begin_us - phase->offset_us;
+    }
+}
+
+/** Register pc cable connect event
+ *
+ * The next mode transition to finish will report the time elapsed
+ * since this event as cable-to-mode-active latency.
+ */
+void
+latency_cable_connected(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int64_t now = common_get_monotonic_us();
+
+    LATENCY_LOCKED_ENTER;
+    latency_cable_us = now;
+    LATENCY_LOCKED_LEAVE;
+}
+
+/** Start recording a mode transition
+ *
+ * Any previously unfinished transition is discarded.
+ *
+ * The mode is also attached to subsequent log messages.
+ *
+ * @param mode  name of the mode being activated
+ */
+void
+latency_transition_begin(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int64_t now = common_get_monotonic_us();
+
+    LATENCY_LOCKED_ENTER;
+    memset(&latency_current, 0, sizeof latency_current);
+    snprintf(latency_current.mode, sizeof latency_current.mode, "%s",
+             mode ?: "");
+    latency_current.begin_us         = now;
+    latency_current.duration_us      = -1;
+    latency_current.cable_latency_us = -1;
+    latency_current_active = true;
+    LATENCY_LOCKED_LEAVE;
+
+    /* Interned -> stays valid for asynchronous logging */
+    log_set_field(LOG_FIELD_MODE, mode ? g_intern_string(mode) : 0);
+    log_set_field(LOG_FIELD_PHASE, 0);
+}
+
+/** Mark start of a new phase within current mode transition
+ *
+ * The previously started phase - if any - ends at this point.
+ * Does nothing if there is no transition being recorded, so
+ * phase marks can be placed in code that is also executed
+ * outside mode transitions.
+ *
+ * When phase table is full, the last phase absorbs the rest.
+ *
+ * @param name  phase name; must be a string literal
+ */
+void
+latency_phase(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int64_t now = common_get_monotonic_us();
+
+    LATENCY_LOCKED_ENTER;
+    if( latency_current_active &&
+        latency_current.phases < LATENCY_PHASE_COUNT ) {
+        latency_close_phase_locked(&latency_current, now);
+        latency_phase_t *phase = &latency_current.phase[latency_current.phases++];
+        phase->name        = name;
+        phase->offset_us   = now - latency_current.begin_us;
+        phase->duration_us = -1;
+        log_set_field(LOG_FIELD_PHASE, name);
+    }
+    LATENCY_LOCKED_LEAVE;
+}
+
+/** Finish recording current mode transition
+ *
+ * @param success true if requested mode was activated, false otherwise
+ */
+void
+latency_transition_end(bool success)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int64_t now = common_get_monotonic_us();
+
+    LATENCY_LOCKED_ENTER;
+    if( latency_current_active ) {
+        latency_current_active = false;
+        latency_close_phase_locked(&latency_current, now);
+        latency_current.success     = success;
+        latency_current.duration_us = now - latency_current.begin_us;
+        if( latency_cable_us >= 0 ) {
+            latency_current.cable_latency_us = now - latency_cable_us;
+            latency_cable_us = -1;
+        }
+        latency_current.seq = ++latency_history_count;
+        latency_history[latency_current.seq % LATENCY_TRANSITION_COUNT] =
+            latency_current;
+
+        log_set_field(LOG_FIELD_PHASE, 0);
+        log_duration(LOG_DEBUG, latency_current.duration_us,
+                     "mode %s %s in %lld us (cable: %lld us)",
+                     latency_current.mode, success ? "activated" : "failed",
+                     (long long)latency_current.duration_us,
+                     (long long)latency_current.cable_latency_us);
+        for( size_t i = 0; i < latency_current.phases; ++i ) {
+            const latency_phase_t *phase = &latency_current.phase[i];
+            /* Tag each phase line so that they can be queried by name */
+            log_set_field(LOG_FIELD_PHASE, phase->name);
+            log_duration(LOG_DEBUG, phase->duration_us,
+                         "  %-20s +%lld us: %lld us", phase->name,
+                         (long long)phase->offset_us,
+                         (long long)phase->duration_us);
+        }
+        log_set_field(LOG_FIELD_PHASE, 0);
+    }
+    LATENCY_LOCKED_LEAVE;
+}
+
+/** Get copy of recently finished mode transitions
+ *
+ * @param buf  where to copy transition data, oldest first
+ * @param max  size of buf in elements
+ *
+ * @return number of transitions copied
+ */
+size_t
+latency_get_transitions(latency_transition_t *buf, size_t max)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t count = 0;
+
+    LATENCY_LOCKED_ENTER;
+    unsigned last  = latency_history_count;
+    unsigned first = 1;
+    if( last > LATENCY_TRANSITION_COUNT )
+        first = last - LATENCY_TRANSITION_COUNT + 1;
+    if( last - first + 1 > max )
+        first = last - max + 1;
+    for( unsigned seq = first; last && seq <= last; ++seq )
+        buf[count++] = latency_history[seq % LATENCY_TRANSITION_COUNT];
+    LATENCY_LOCKED_LEAVE;
+
+    return count;
+}
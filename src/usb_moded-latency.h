@@ -0,0 +1,100 @@
+/**
+ * @file usb_moded-latency.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_LATENCY_H_
+# define USB_MODED_LATENCY_H_
+
+# include <stdbool.h>
+# include <stdint.h>
+# include <stddef.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of mode transitions retained in history */
+# define LATENCY_TRANSITION_COUNT 8
+
+/** Maximum number of phases recorded per mode transition */
+# define LATENCY_PHASE_COUNT      16
+
+/** Maximum length of mode name recorded per mode transition */
+# define LATENCY_MODE_NAME_MAX    64
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Timing of one phase within a mode transition */
+typedef struct latency_phase_t
+{
+    /** Phase name; must be a string literal */
+    const char *name;
+
+    /** Phase start, relative to transition start [us] */
+    int64_t     offset_us;
+
+    /** Phase duration [us] */
+    int64_t     duration_us;
+} latency_phase_t;
+
+/** Timing of one mode transition */
+typedef struct latency_transition_t
+{
+    /** Running transition number */
+    unsigned        seq;
+
+    /** Mode that was requested */
+    char            mode[LATENCY_MODE_NAME_MAX];
+
+    /** Whether requested mode was activated */
+    bool            success;
+
+    /** Transition start time [us, CLOCK_MONOTONIC] */
+    int64_t         begin_us;
+
+    /** Total transition duration [us] */
+    int64_t         duration_us;
+
+    /** Time from cable connect to mode active [us], or -1 */
+    int64_t         cable_latency_us;
+
+    /** Number of valid entries in phase[] */
+    size_t          phases;
+
+    /** Per phase timing data */
+    latency_phase_t phase[LATENCY_PHASE_COUNT];
+} latency_transition_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * LATENCY
+ * ------------------------------------------------------------------------- */
+
+void   latency_cable_connected (void);
+void   latency_transition_begin(const char *mode);
+void   latency_phase           (const char *name);
+void   latency_transition_end  (bool success);
+size_t latency_get_transitions (latency_transition_t *buf, size_t max);
+
+#endif /* USB_MODED_LATENCY_H_ */
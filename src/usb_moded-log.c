@@ -29,146 +29,1441 @@
 #include "usb_moded-log.h"
 
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h> // NOTRIM
 
-#if LOG_ENABLE_CONTEXT
-# include <assert.h> // NOTRIM
+#ifdef SYSTEMD
+# define SD_JOURNAL_SUPPRESS_LOCATION
+# include <systemd/sd-journal.h>
 #endif
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of messages each per-thread ring can hold, must be power of two */
+#define LOG_RING_SIZE       256
+
+/** Maximum number of format arguments stored per message */
+#define LOG_RECORD_ARGS     12
+
+/** Maximum length of formatted message */
+#define LOG_MESSAGE_MAX     512
+
+/** Space for copies of string arguments per message
+ *
+ * String arguments can't make up more than the whole message, so this
+ * is enough to avoid truncating anything that would fit otherwise.
+ */
+#define LOG_RECORD_TEXT     LOG_MESSAGE_MAX
+
+/** Maximum time to wait for in-progress enqueues on exit [ms] */
+#define LOG_DRAIN_QUIESCE_MS 100
+
+/** Where ring buffer contents are written on crash */
+#define LOG_RUNTIME_DIR     "/run/usb-moded"
+#define LOG_CRASH_DUMP_PATH LOG_RUNTIME_DIR "/flight-recorder.log"
+
+/** Messages allowed from a single call site within rate limit window */
+#define LOG_SITE_BURST      5
+
+/** Length of per call site rate limit window [ms] */
+#define LOG_SITE_WINDOW_MS  10000
+
+/** Maximum number of fields sent to journal per message */
+#define LOG_JOURNAL_FIELDS  16
+
+/** Number of function entry / exit events each thread can record */
+#define TRACE_BUFFER_SIZE    (1u << 16)
+
+/** Where function trace is written to by default */
+#define TRACE_OUTPUT_DEFAULT LOG_RUNTIME_DIR "/trace.json"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Raw printf argument, or offset to string copy in record text */
+typedef union log_arg_t
+{
+    long long   i;
+    double      d;
+    const void *p;
+} log_arg_t;
+
+/** Everything about a log message except the message text */
+typedef struct log_meta_t
+{
+    struct timeval  tv;
+    const char     *file;
+    const char     *func;
+    int             line;
+    int             lev;
+    int             err;
+    bool            has_err;
+    unsigned        suppressed;
+    long long       duration_us;
+    const char     *field[LOG_FIELD_COUNT];
+} log_meta_t;
+
+/** Unformatted log message
+ *
+ * Formatting is done in the drain thread by re-parsing the format
+ * string and feeding it the arguments captured here. String arguments
+ * are copied, everything else is stored as-is. If the format uses
+ * conversions that can't be captured, the message is formatted
+ * immediately and stored in text with fmt set to NULL.
+ */
+typedef struct log_record_t
+{
+    log_meta_t      meta;
+    const char     *fmt;
+    int             argc;
+    log_arg_t       argv[LOG_RECORD_ARGS];
+    size_t          used;
+    char            text[LOG_RECORD_TEXT];
+} log_record_t;
+
+/** Single producer, single consumer ring of log records
+ *
+ * Each thread that logs something gets a ring of its own. The thread
+ * itself is the only producer and the drain thread the only consumer,
+ * so no locking is needed - just ordered access to head and tail.
+ *
+ * Consumed records stay in place until the slot gets reused, which
+ * makes it possible to dump recent history after a crash.
+ */
+typedef struct log_ring_t
+{
+    struct log_ring_t *next;
+    int                id;
+    unsigned           head;
+    unsigned           tail;
+    unsigned           dropped;
+    unsigned           dump_beg;
+    unsigned           dump_end;
+    log_record_t       slot[LOG_RING_SIZE];
+} log_ring_t;
+
+#ifdef SYSTEMD
+/** Field vector for a structured journal entry */
+typedef struct log_journal_t
+{
+    struct iovec iov[LOG_JOURNAL_FIELDS];
+    int          cnt;
+    size_t       used;
+    char         buf[LOG_MESSAGE_MAX + 512];
+} log_journal_t;
+#endif
+
+/** Function entry / exit event */
+typedef struct trace_event_t
+{
+    int64_t     ns;
+    const char *func;
+    bool        leave;
+} trace_event_t;
+
+/** Per-thread function trace buffer
+ *
+ * Only the owning thread appends events. Exporting can be done from
+ * other threads, as events are published by updating count last.
+ */
+typedef struct trace_buffer_t
+{
+    struct trace_buffer_t *next;
+    pid_t                  tid;
+    unsigned               generation;
+    unsigned               count;
+    unsigned               depth;
+    unsigned               dropped;
+    trace_event_t          event[TRACE_BUFFER_SIZE];
+} trace_buffer_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
-/* ------------------------------------------------------------------------- *
- * LOG
- * ------------------------------------------------------------------------- */
+/* ------------------------------------------------------------------------- *
+ * FUNCTION_TRACE
+ * ------------------------------------------------------------------------- */
+
+#if LOG_ENABLE_TRACE
+static int64_t         trace_get_time   (void);
+static trace_buffer_t *trace_buffer_self(void);
+static void            trace_buffer_add (trace_buffer_t *self, const char *func, bool leave);
+const char            *trace_enter      (const char *func);
+void                   trace_leave      (const char *func);
+static bool            trace_export     (const char *path);
+void                   trace_set_enabled(bool enable);
+bool                   trace_get_enabled(void);
+void                   trace_set_output (const char *path);
+#endif
+
+/* ------------------------------------------------------------------------- *
+ * LOG_RECORD
+ * ------------------------------------------------------------------------- */
+
+static const char *log_record_spec   (const char *pos, int *stars, char *len, int *prec);
+static bool        log_record_capture(log_record_t *self, const char *fmt, va_list va);
+static void        log_record_format (const log_record_t *self, char *buf, size_t size);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_RING
+ * ------------------------------------------------------------------------- */
+
+static log_ring_t *log_ring_self   (void);
+static bool        log_ring_enqueue(const log_meta_t *meta, const char *fmt, va_list va);
+static log_ring_t *log_ring_oldest (void);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_DRAIN
+ * ------------------------------------------------------------------------- */
+
+static void  log_drain_wakeup (void);
+static bool  log_drain_one    (void);
+static void  log_drain_dropped(void);
+static void *log_drain_thread (void *aptr);
+static bool  log_drain_start  (void);
+static void  log_drain_stop   (void);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_SITE
+ * ------------------------------------------------------------------------- */
+
+static int64_t log_site_get_time(void);
+static bool    log_site_allow   (log_site_t *site, int lev, unsigned *suppressed);
+
+/* ------------------------------------------------------------------------- *
+ * LOG_JOURNAL
+ * ------------------------------------------------------------------------- */
+
+#ifdef SYSTEMD
+static void log_journal_add  (log_journal_t *self, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void log_journal_write(const log_meta_t *meta, const char *msg);
+#endif
+
+/* ------------------------------------------------------------------------- *
+ * LOG_CRASH
+ * ------------------------------------------------------------------------- */
+
+static void log_crash_dump   (int fd);
+static void log_crash_handler(int sig);
+static void log_crash_trap   (void);
+
+/* ------------------------------------------------------------------------- *
+ * LOG
+ * ------------------------------------------------------------------------- */
+
+static char       *log_strip       (char *str);
+static void        log_gettime     (struct timeval *tv);
+static const char *log_level_tag   (int lev);
+static void        log_write       (const log_meta_t *meta, char *msg);
+static void        log_emit_full   (log_site_t *site, const char *file, const char *func, int line, int lev, long long duration_us, const char *fmt, va_list va);
+void               log_emit_va     (const char *file, const char *func, int line, int lev, const char *fmt, va_list va);
+void               log_emit_real   (const char *file, const char *func, int line, int lev, const char *fmt, ...);
+void               log_emit_site   (log_site_t *site, const char *file, const char *func, int line, int lev, long long duration_us, const char *fmt, ...);
+void               log_debugf      (const char *fmt, ...);
+int                log_get_level   (void);
+void               log_set_level   (int lev);
+bool               log_p           (int lev);
+int                log_get_type    (void);
+void               log_set_type    (int type);
+const char        *log_get_name    (void);
+void               log_set_name    (const char *name);
+void               log_set_lineinfo(bool lineinfo);
+bool               log_get_lineinfo(void);
+void               log_set_field   (log_field_t field, const char *value);
+const char        *log_get_field   (log_field_t field);
+void               log_init        (void);
+void               log_quit        (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+static const char *log_name = "<unset>";
+static int log_level = LOG_WARNING;
+static int log_type  = LOG_TO_STDERR;
+static bool log_lineinfo = false;
+static struct timeval log_begtime = { 0, 0 };
+
+/** Context values attached to log messages; static strings only */
+static const char *log_field_value[LOG_FIELD_COUNT];
+
+/** List of all per-thread rings, newest first */
+static log_ring_t *log_ring_list = 0;
+
+/** Number of rings created so far */
+static int log_ring_count = 0;
+
+/** Ring used by the current thread */
+static __thread log_ring_t *log_ring_current = 0;
+
+/** Flag for: messages are passed to drain thread */
+static bool log_drain_running = false;
+
+/** Number of threads currently inside log_ring_enqueue() */
+static int log_drain_writers = 0;
+
+/** Flag for: drain thread should exit */
+static bool log_drain_exit = false;
+
+/** Flag for: drain thread is about to wait for wakeup */
+static bool log_drain_sleeping = false;
+
+/** Eventfd for waking up the drain thread */
+static int log_drain_fd = -1;
+
+/** Drain thread id */
+static pthread_t log_drain_tid;
+
+/** Flag for: fatal signal has been caught */
+static volatile sig_atomic_t log_crashed = 0;
+
+#if LOG_ENABLE_TRACE
+/** Flag for: function entry / exit is recorded */
+bool trace_enabled = false;
+
+/** Trace session counter, used for discarding old events */
+static unsigned trace_generation = 0;
+
+/** List of all per-thread trace buffers */
+static trace_buffer_t *trace_buffer_list = 0;
+
+/** Trace buffer used by the current thread */
+static __thread trace_buffer_t *trace_buffer_current = 0;
+
+/** Where function trace is written to */
+static const char *trace_output = TRACE_OUTPUT_DEFAULT;
+#endif
+
+/* ========================================================================= *
+ * FUNCTION_TRACE
+ * ========================================================================= */
+
+#if LOG_ENABLE_TRACE
+/** Get monotonic timestamp for trace events
+ *
+ * @return nanoseconds since unspecified starting point
+ */
+static int64_t trace_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/** Get trace buffer for the current thread
+ *
+ * Buffers are allocated when tracing is first enabled and never
+ * released. Contents are discarded when a new trace is started.
+ *
+ * @return trace buffer, or NULL on allocation failure
+ */
+static trace_buffer_t *trace_buffer_self(void)
+{
+    trace_buffer_t *self = trace_buffer_current;
+
+    if( !self && (self = calloc(1, sizeof *self)) ) {
+        self->tid  = syscall(SYS_gettid);
+        self->next = __atomic_load_n(&trace_buffer_list, __ATOMIC_RELAXED);
+        while( !__atomic_compare_exchange_n(&trace_buffer_list, &self->next, self,
+                                            true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED) )
+            ;
+        trace_buffer_current = self;
+    }
+
+    unsigned generation = __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE);
+    if( self && self->generation != generation ) {
+        self->generation = generation;
+        self->depth      = 0;
+        self->dropped    = 0;
+        __atomic_store_n(&self->count, 0, __ATOMIC_RELEASE);
+    }
+
+    return self;
+}
+
+/** Append event to trace buffer of the current thread
+ *
+ * @param self  trace buffer
+ * @param func  function name
+ * @param leave true for function exit, false for entry
+ */
+static void trace_buffer_add(trace_buffer_t *self, const char *func, bool leave)
+{
+    unsigned count = __atomic_load_n(&self->count, __ATOMIC_RELAXED);
+
+    self->event[count].ns    = trace_get_time();
+    self->event[count].func  = func;
+    self->event[count].leave = leave;
+
+    __atomic_store_n(&self->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/** Record function entry
+ *
+ * Called via LOG_REGISTER_CONTEXT when tracing is enabled.
+ *
+ * @param func  function name
+ *
+ * @return func if exit needs to be recorded too, or NULL
+ */
+const char *trace_enter(const char *func)
+{
+    int             saved = errno;
+    trace_buffer_t *self  = trace_buffer_self();
+
+    if( !self ) {
+        func = 0;
+    }
+    else if( self->count + self->depth + 2 > TRACE_BUFFER_SIZE ) {
+        /* Keep room for exits from already entered functions */
+        self->dropped += 1;
+        func = 0;
+    }
+    else {
+        trace_buffer_add(self, func, false);
+        self->depth += 1;
+    }
+
+    errno = saved;
+    return func;
+}
+
+/** Record function exit
+ *
+ * Called via LOG_REGISTER_CONTEXT cleanup if entry was recorded.
+ *
+ * @param func  function name
+ */
+void trace_leave(const char *func)
+{
+    int             saved = errno;
+    trace_buffer_t *self  = trace_buffer_current;
+
+    /* Entries from before the current trace was started have
+     * been discarded -> skip matching exits */
+    if( self && self->depth > 0 &&
+        self->generation == __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE) ) {
+        self->depth -= 1;
+        trace_buffer_add(self, func, true);
+    }
+
+    errno = saved;
+}
+
+/** Write recorded events in Chrome trace event format
+ *
+ * The output can be viewed with Perfetto UI or chrome://tracing.
+ *
+ * @param path  file to write to
+ *
+ * @return true on success, false otherwise
+ */
+static bool trace_export(const char *path)
+{
+    bool        ack  = false;
+    FILE       *file = 0;
+    int         pid  = getpid();
+    const char *sep = "";
+
+    if( !strcmp(path, TRACE_OUTPUT_DEFAULT) &&
+        mkdir(LOG_RUNTIME_DIR, 0755) == -1 && errno != EEXIST ) {
+        // fopen() fails too
+    }
+
+    if( !(file = fopen(path, "w")) ) {
+        log_err("%s: can't open for writing: %m", path);
+        goto EXIT;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for( trace_buffer_t *buf = __atomic_load_n(&trace_buffer_list, __ATOMIC_ACQUIRE);
+         buf; buf = buf->next ) {
+        if( buf->generation != trace_generation )
+            continue;
+
+        unsigned count = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE);
+
+        fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                sep, pid, (int)buf->tid,
+                buf->tid == pid ? "main" : "thread");
+        sep = ",";
+
+        for( unsigned i = 0; i < count; ++i ) {
+            const trace_event_t *eve = &buf->event[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld.%03d,"
+                    "\"pid\":%d,\"tid\":%d}",
+                    eve->func, eve->leave ? 'E' : 'B',
+                    (long long)(eve->ns / 1000), (int)(eve->ns % 1000),
+                    pid, (int)buf->tid);
+        }
+
+        if( buf->dropped )
+            log_warning("trace: %u function entries did not fit in buffer",
+                        buf->dropped);
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if( ferror(file) ) {
+        log_err("%s: write error", path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    if( file && fclose(file) == EOF )
+        ack = false;
+
+    return ack;
+}
+
+/** Start or stop function tracing
+ *
+ * Starting discards previously recorded events. Stopping writes
+ * recorded events to file set via trace_set_output().
+ *
+ * @param enable  true to start tracing, false to stop
+ */
+void trace_set_enabled(bool enable)
+{
+    if( trace_enabled == enable )
+        goto EXIT;
+
+    if( enable ) {
+        __atomic_add_fetch(&trace_generation, 1, __ATOMIC_RELEASE);
+        trace_enabled = true;
+        log_notice("function tracing started");
+    }
+    else {
+        trace_enabled = false;
+        if( trace_export(trace_output) )
+            log_notice("function trace written to %s", trace_output);
+    }
+
+EXIT:
+    return;
+}
+
+/** Check if function tracing is enabled
+ *
+ * @return true if tracing is enabled, false otherwise
+ */
+bool trace_get_enabled(void)
+{
+    return trace_enabled;
+}
+
+/** Set file where function trace is written to
+ *
+ * @param path  file path, or NULL for default
+ */
+void trace_set_output(const char *path)
+{
+    trace_output = path ?: TRACE_OUTPUT_DEFAULT;
+}
+#endif // LOG_ENABLE_TRACE
+
+/* ========================================================================= *
+ * LOG_RECORD
+ * ========================================================================= */
+
+/** Parse printf conversion specification
+ *
+ * @param pos    position after the '%' character
+ * @param stars  where to store number of '*' width / precision arguments
+ * @param len    where to store length modifier: 0, 'H' for hh, 'q' for ll,
+ *               or the modifier character itself
+ * @param prec   where to store precision: -1 = not given, -2 = from argument
+ *
+ * @return pointer to conversion character, or NULL if not found
+ */
+static const char *log_record_spec(const char *pos, int *stars, char *len, int *prec)
+{
+    *stars = 0;
+    *len   = 0;
+    *prec  = -1;
+
+    pos += strspn(pos, "-+ #0'");
+
+    if( *pos == '*' )
+        ++*stars, ++pos;
+    else
+        pos += strspn(pos, "0123456789");
+
+    if( *pos == '.' ) {
+        if( *++pos == '*' ) {
+            ++*stars, ++pos;
+            *prec = -2;
+        }
+        else {
+            for( *prec = 0; *pos >= '0' && *pos <= '9'; ++pos )
+                *prec = *prec * 10 + *pos - '0';
+        }
+    }
+
+    switch( *pos ) {
+    case 'h':
+        *len = 'h';
+        if( *++pos == 'h' )
+            *len = 'H', ++pos;
+        break;
+    case 'l':
+        *len = 'l';
+        if( *++pos == 'l' )
+            *len = 'q', ++pos;
+        break;
+    case 'q':
+    case 'j':
+    case 'z':
+    case 't':
+    case 'L':
+        *len = *pos++;
+        break;
+    default:
+        break;
+    }
+
+    return *pos ? pos : 0;
+}
+
+/** Store format arguments to log record
+ *
+ * @param self  log record
+ * @param fmt   printf format string
+ * @param va    arguments for the format string
+ *
+ * @return true if arguments were stored, or false if the format
+ *         contains something that can't be handled
+ */
+static bool log_record_capture(log_record_t *self, const char *fmt, va_list va)
+{
+    bool        ack = false;
+    const char *pos = fmt;
+
+    self->argc = 0;
+    self->used = 0;
+
+    while( (pos = strchr(pos, '%')) ) {
+        int         stars, prec;
+        char        len;
+        const char *conv;
+
+        if( pos[1] == '%' ) {
+            pos += 2;
+            continue;
+        }
+
+        if( !(conv = log_record_spec(pos + 1, &stars, &len, &prec)) )
+            goto EXIT;
+        pos = conv + 1;
+
+        if( self->argc + stars + 1 > LOG_RECORD_ARGS )
+            goto EXIT;
+
+        for( int i = 0; i < stars; ++i ) {
+            int val = va_arg(va, int);
+            self->argv[self->argc++].i = val;
+            if( prec == -2 )
+                prec = val;
+        }
+
+        log_arg_t *arg = &self->argv[self->argc];
+
+        switch( *conv ) {
+        case 'm':
+            continue;
+
+        case 'd':
+        case 'i':
+            switch( len ) {
+            case 'l': arg->i = va_arg(va, long);      break;
+            case 'q': arg->i = va_arg(va, long long); break;
+            case 'j': arg->i = va_arg(va, intmax_t);  break;
+            case 'z': arg->i = va_arg(va, ssize_t);   break;
+            case 't': arg->i = va_arg(va, ptrdiff_t); break;
+            case 'L': goto EXIT;
+            default:  arg->i = va_arg(va, int);       break;
+            }
+            break;
+
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            switch( len ) {
+            case 'l': arg->i = va_arg(va, unsigned long);      break;
+            case 'q': arg->i = va_arg(va, unsigned long long); break;
+            case 'j': arg->i = va_arg(va, uintmax_t);          break;
+            case 'z': arg->i = va_arg(va, size_t);             break;
+            case 't': arg->i = va_arg(va, ptrdiff_t);          break;
+            case 'L': goto EXIT;
+            default:  arg->i = va_arg(va, unsigned);           break;
+            }
+            break;
+
+        case 'c':
+            if( len )
+                goto EXIT;
+            arg->i = va_arg(va, int);
+            break;
+
+        case 'e': case 'E':
+        case 'f': case 'F':
+        case 'g': case 'G':
+        case 'a': case 'A':
+            if( len && len != 'l' )
+                goto EXIT;
+            arg->d = va_arg(va, double);
+            break;
+
+        case 's':
+            {
+                if( len )
+                    goto EXIT;
+
+                /* Strings are copied - truncated if necessary */
+                const char *str   = va_arg(va, const char *) ?: "(null)";
+                size_t      avail = sizeof self->text - self->used;
+                if( avail < 1 )
+                    goto EXIT;
+                size_t      size  = avail - 1;
+                if( prec >= 0 && (size_t)prec < size )
+                    size = prec;
+                size = strnlen(str, size);
+                memcpy(self->text + self->used, str, size);
+                self->text[self->used + size] = 0;
+                arg->i = self->used;
+                self->used += size + 1;
+            }
+            break;
+
+        case 'p':
+            arg->p = va_arg(va, void *);
+            break;
+
+        default:
+            goto EXIT;
+        }
+
+        self->argc += 1;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Format log record into text buffer
+ *
+ * @param self  log record
+ * @param buf   where to store formatted text
+ * @param size  size of buf
+ */
+static void log_record_format(const log_record_t *self, char *buf, size_t size)
+{
+    char       *dst  = buf;
+    char       *end  = buf + size;
+    const char *pos  = self->fmt;
+    int         argi = 0;
+
+    *dst = 0;
+
+    if( !pos ) {
+        snprintf(buf, size, "%s", self->text);
+        goto EXIT;
+    }
+
+    while( *pos && dst < end - 1 ) {
+        const char *beg   = strchr(pos, '%');
+        size_t      avail = end - dst;
+        size_t      todo  = beg ? (size_t)(beg - pos) : strlen(pos);
+
+        if( todo > avail - 1 )
+            todo = avail - 1;
+        memcpy(dst, pos, todo);
+        dst += todo, *dst = 0;
+
+        if( !beg || dst >= end - 1 )
+            break;
+
+        if( beg[1] == '%' ) {
+            *dst++ = '%', *dst = 0;
+            pos = beg + 2;
+            continue;
+        }
+
+        int         stars, prec;
+        char        len;
+        const char *conv = log_record_spec(beg + 1, &stars, &len, &prec);
+        char        spec[32];
+        int         star[2] = { 0, 0 };
+        int         rc      = 0;
+
+        /* Format was already validated in log_record_capture() */
+        pos = conv + 1;
+        if( (size_t)(pos - beg) >= sizeof spec )
+            break;
+        memcpy(spec, beg, pos - beg);
+        spec[pos - beg] = 0;
+
+        for( int i = 0; i < stars; ++i )
+            star[i] = (int)self->argv[argi++].i;
+
+        const log_arg_t *arg = &self->argv[argi];
+        avail = end - dst;
+
+#define LOG_FORMAT_ARG(VAL)\
+     (stars == 0 ? snprintf(dst, avail, spec, VAL) :\
+      stars == 1 ? snprintf(dst, avail, spec, star[0], VAL) :\
+      snprintf(dst, avail, spec, star[0], star[1], VAL))
+
+        switch( *conv ) {
+        case 'm':
+            errno = self->meta.err;
+            rc = snprintf(dst, avail, "%m");
+            --argi;
+            break;
+
+        case 'd':
+        case 'i':
+            switch( len ) {
+            case 'l': rc = LOG_FORMAT_ARG((long)arg->i);      break;
+            case 'q': rc = LOG_FORMAT_ARG((long long)arg->i); break;
+            case 'j': rc = LOG_FORMAT_ARG((intmax_t)arg->i);  break;
+            case 'z': rc = LOG_FORMAT_ARG((ssize_t)arg->i);   break;
+            case 't': rc = LOG_FORMAT_ARG((ptrdiff_t)arg->i); break;
+            default:  rc = LOG_FORMAT_ARG((int)arg->i);       break;
+            }
+            break;
+
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            switch( len ) {
+            case 'l': rc = LOG_FORMAT_ARG((unsigned long)arg->i);      break;
+            case 'q': rc = LOG_FORMAT_ARG((unsigned long long)arg->i); break;
+            case 'j': rc = LOG_FORMAT_ARG((uintmax_t)arg->i);          break;
+            case 'z': rc = LOG_FORMAT_ARG((size_t)arg->i);             break;
+            case 't': rc = LOG_FORMAT_ARG((ptrdiff_t)arg->i);          break;
+            default:  rc = LOG_FORMAT_ARG((unsigned)arg->i);           break;
+            }
+            break;
+
+        case 'c':
+            rc = LOG_FORMAT_ARG((int)arg->i);
+            break;
+
+        case 's':
+            rc = LOG_FORMAT_ARG(self->text + arg->i);
+            break;
+
+        case 'p':
+            rc = LOG_FORMAT_ARG(arg->p);
+            break;
+
+        default:
+            rc = LOG_FORMAT_ARG(arg->d);
+            break;
+        }
+
+#undef LOG_FORMAT_ARG
+
+        argi += 1;
+        if( rc > 0 )
+            dst += ((size_t)rc < avail) ? (size_t)rc : avail - 1;
+    }
+
+EXIT:
+    return;
+}
+
+/* ========================================================================= *
+ * LOG_RING
+ * ========================================================================= */
+
+/** Get ring buffer for the current thread
+ *
+ * Rings are allocated on first use and never released - threads
+ * that log something are expected to stay alive for the lifetime
+ * of the process.
+ *
+ * @return ring buffer, or NULL on allocation failure
+ */
+static log_ring_t *log_ring_self(void)
+{
+    log_ring_t *self = log_ring_current;
+
+    if( !self && (self = calloc(1, sizeof *self)) ) {
+        self->id   = __atomic_add_fetch(&log_ring_count, 1, __ATOMIC_RELAXED);
+        self->next = __atomic_load_n(&log_ring_list, __ATOMIC_RELAXED);
+        while( !__atomic_compare_exchange_n(&log_ring_list, &self->next, self,
+                                            true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED) )
+            ;
+        log_ring_current = self;
+    }
+
+    return self;
+}
+
+/** Pass log message to drain thread
+ *
+ * @param meta  Message details, including errno value to use for %m
+ * @param fmt   The message format string
+ * @param va    Arguments for the format string
+ *
+ * @return true if message was handled, or false if it needs
+ *         to be written synchronously
+ */
+static bool log_ring_enqueue(const log_meta_t *meta, const char *fmt, va_list va)
+{
+    bool        ack  = false;
+    log_ring_t *ring = 0;
+
+    /* Announce before checking, so that log_drain_stop() either sees
+     * us here, or we see the drain has been stopped */
+    __atomic_add_fetch(&log_drain_writers, 1, __ATOMIC_SEQ_CST);
+
+    if( !__atomic_load_n(&log_drain_running, __ATOMIC_SEQ_CST) )
+        goto EXIT;
+
+    if( !(ring = log_ring_self()) )
+        goto EXIT;
+
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if( head - tail >= LOG_RING_SIZE ) {
+        /* Never block the logging thread */
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        ack = true;
+        goto EXIT;
+    }
+
+    log_record_t *rec = &ring->slot[head % LOG_RING_SIZE];
+
+    rec->meta = *meta;
+
+    va_list copy;
+    va_copy(copy, va);
+    if( log_record_capture(rec, fmt, copy) ) {
+        rec->fmt = fmt;
+    }
+    else {
+        rec->fmt = 0;
+        errno = meta->err;
+        vsnprintf(rec->text, sizeof rec->text, fmt, va);
+    }
+    va_end(copy);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    log_drain_wakeup();
+
+    ack = true;
+
+EXIT:
+    __atomic_sub_fetch(&log_drain_writers, 1, __ATOMIC_SEQ_CST);
+    return ack;
+}
+
+/** Locate ring holding the oldest unprocessed message
+ *
+ * @return ring buffer, or NULL if all rings are empty
+ */
+static log_ring_t *log_ring_oldest(void)
+{
+    log_ring_t               *best = 0;
+    const struct timeval     *when = 0;
+
+    for( log_ring_t *ring = __atomic_load_n(&log_ring_list, __ATOMIC_ACQUIRE);
+         ring; ring = ring->next ) {
+        unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if( tail == head )
+            continue;
+        const struct timeval *tv = &ring->slot[tail % LOG_RING_SIZE].meta.tv;
+        if( !when || timercmp(tv, when, <) )
+            best = ring, when = tv;
+    }
 
-static char *log_strip       (char *str);
-static void  log_gettime     (struct timeval *tv);
-void         log_emit_va     (const char *file, const char *func, int line, int lev, const char *fmt, va_list va);
-void         log_emit_real   (const char *file, const char *func, int line, int lev, const char *fmt, ...);
-void         log_debugf      (const char *fmt, ...);
-int          log_get_level   (void);
-void         log_set_level   (int lev);
-bool         log_p           (int lev);
-int          log_get_type    (void);
-void         log_set_type    (int type);
-const char  *log_get_name    (void);
-void         log_set_name    (const char *name);
-void         log_set_lineinfo(bool lineinfo);
-bool         log_get_lineinfo(void);
-void         log_init        (void);
+    return best;
+}
 
 /* ========================================================================= *
- * Data
+ * LOG_DRAIN
  * ========================================================================= */
 
-static const char *log_name = "<unset>";
-static int log_level = LOG_WARNING;
-static int log_type  = LOG_TO_STDERR;
-static bool log_lineinfo = false;
-static struct timeval log_begtime = { 0, 0 };
+/** Wake up drain thread if it is waiting for messages
+ */
+static void log_drain_wakeup(void)
+{
+    if( __atomic_exchange_n(&log_drain_sleeping, false, __ATOMIC_SEQ_CST) ) {
+        uint64_t cnt = 1;
+        if( write(log_drain_fd, &cnt, sizeof cnt) == -1 ) {
+            // drain thread wakes up on next message anyway
+        }
+    }
+}
 
-/* ========================================================================= *
- * CONTEXT STACK
- * ========================================================================= */
+/** Format and output the oldest unprocessed message
+ *
+ * @return true if a message was processed, false if there was none
+ */
+static bool log_drain_one(void)
+{
+    log_ring_t *ring = log_ring_oldest();
+    char        msg[LOG_MESSAGE_MAX];
+
+    if( !ring )
+        return false;
+
+    unsigned            tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    const log_record_t *rec  = &ring->slot[tail % LOG_RING_SIZE];
 
-#if LOG_ENABLE_CONTEXT
-typedef struct context_entry_t
+    log_record_format(rec, msg, sizeof msg);
+    log_write(&rec->meta, msg);
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/** Report messages that did not fit in ring buffers
+ */
+static void log_drain_dropped(void)
 {
-    const char *func;
-    bool        done;
-} context_entry_t;
-
-typedef struct context_stack_t
-{
-    context_entry_t stk[256];
-    int             sp;
-    int             id;
-} context_stack_t;
-
-static int context_count = 0;
-static __thread context_stack_t *context_stack = 0;
-
-static bool log_entry = false;
-static bool log_leave = false;
-
-static void
-context_write(int tab, const char *msg)
-{
-    int tag = 0;
-    if( context_stack ) {
-        tag = context_stack->id;
-        if( tab < 0 && context_stack->sp > 0 )
-            tab = context_stack->sp;
-    }
-    tab = (tab <= 0) ? 0 : (tab * 4);
-    char *txt = 0;
-    int   len = asprintf(&txt, "T%d %*s%s\n",
-                         tag,
-                         tab, "",
-                         msg);
-    if( len > 0 ) {
-        if( write(STDERR_FILENO, txt, len) == - 1 ) {
-            // this is debug logging - do not really care
+    for( log_ring_t *ring = __atomic_load_n(&log_ring_list, __ATOMIC_ACQUIRE);
+         ring; ring = ring->next ) {
+        unsigned dropped = __atomic_exchange_n(&ring->dropped, 0,
+                                               __ATOMIC_RELAXED);
+        if( dropped ) {
+            char       msg[64];
+            log_meta_t meta = {
+                .file        = __FILE__,
+                .func        = __func__,
+                .line        = __LINE__,
+                .lev         = LOG_WARNING,
+                .duration_us = -1,
+            };
+            log_gettime(&meta.tv);
+            snprintf(msg, sizeof msg, "T%d: %u messages dropped",
+                     ring->id, dropped);
+            log_write(&meta, msg);
         }
-        free(txt);
     }
 }
 
-static void
-context_flush(void)
+/** Drain thread main function
+ *
+ * @param aptr (unused)
+ *
+ * @return NULL
+ */
+static void *log_drain_thread(void *aptr)
 {
-    for( int i = 0; i < context_stack->sp; ++i ) {
-        char msg[256];
-        if( context_stack->stk[i].done )
+    (void)aptr;
+
+    struct pollfd pfd = { .fd = log_drain_fd, .events = POLLIN };
+
+    for( ;; ) {
+        log_drain_dropped();
+        while( log_drain_one() )
+            ;
+        if( log_type == LOG_TO_STDERR )
+            fflush(stderr);
+
+        if( __atomic_load_n(&log_drain_exit, __ATOMIC_ACQUIRE) )
+            break;
+
+        /* Announce sleeping, then re-check to avoid missed wakeups */
+        __atomic_store_n(&log_drain_sleeping, true, __ATOMIC_SEQ_CST);
+        if( log_ring_oldest() ||
+            __atomic_load_n(&log_drain_exit, __ATOMIC_SEQ_CST) ) {
+            __atomic_store_n(&log_drain_sleeping, false, __ATOMIC_SEQ_CST);
             continue;
-        context_stack->stk[i].done = true;
-        if( log_leave )
-            snprintf(msg, sizeof msg, "%s() { ...",
-                     context_stack->stk[i].func);
-        else
-            snprintf(msg, sizeof msg, "%s()",
-                     context_stack->stk[i].func);
-        context_write(i, msg);
+        }
+
+        if( poll(&pfd, 1, -1) > 0 ) {
+            uint64_t cnt;
+            if( read(log_drain_fd, &cnt, sizeof cnt) == -1 ) {
+                // eventfd is just a wakeup trigger
+            }
+        }
     }
+
+    return 0;
 }
 
-const char *
-context_enter(const char *func)
+/** Start drain thread
+ *
+ * @return true on success, false otherwise
+ */
+static bool log_drain_start(void)
 {
-    if( !context_stack ) {
-        context_stack = calloc(1, sizeof *context_stack);
-        context_stack->id = ++context_count;
+    bool     ack = false;
+    sigset_t all, old;
+
+    if( log_drain_running )
+        goto DONE;
+
+    if( (log_drain_fd = eventfd(0, EFD_CLOEXEC)) == -1 )
+        goto EXIT;
+
+    /* Leave handling of asynchronous signals to other threads */
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    sigdelset(&all, SIGBUS);
+    sigdelset(&all, SIGILL);
+    sigdelset(&all, SIGFPE);
+    sigdelset(&all, SIGABRT);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&log_drain_tid, 0, log_drain_thread, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+
+    if( rc != 0 ) {
+        close(log_drain_fd), log_drain_fd = -1;
+        goto EXIT;
     }
 
-    context_stack->stk[context_stack->sp].func = func;
-    context_stack->stk[context_stack->sp].done = false;
-    context_stack->sp += 1;
+    __atomic_store_n(&log_drain_running, true, __ATOMIC_RELEASE);
 
-    if( log_entry )
-        context_flush();
+DONE:
+    ack = true;
 
-    return func;
+EXIT:
+    return ack;
+}
+
+/** Stop drain thread and flush remaining messages
+ */
+static void log_drain_stop(void)
+{
+    uint64_t cnt = 1;
+
+    if( !log_drain_running )
+        goto EXIT;
+
+    __atomic_store_n(&log_drain_exit, true, __ATOMIC_SEQ_CST);
+    if( write(log_drain_fd, &cnt, sizeof cnt) == -1 ) {
+        // drain thread re-checks exit flag before sleeping
+    }
+    pthread_join(log_drain_tid, 0);
+
+    /* Messages emitted from now on are written synchronously */
+    __atomic_store_n(&log_drain_running, false, __ATOMIC_SEQ_CST);
+
+    /* Threads that saw the drain running might still be enqueuing */
+    for( int ms = 0; ms < LOG_DRAIN_QUIESCE_MS; ++ms ) {
+        if( !__atomic_load_n(&log_drain_writers, __ATOMIC_SEQ_CST) )
+            break;
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, 0);
+    }
+
+    /* Handle whatever was queued while the thread was exiting */
+    log_drain_dropped();
+    while( log_drain_one() )
+        ;
+    if( log_type == LOG_TO_STDERR )
+        fflush(stderr);
+
+    close(log_drain_fd), log_drain_fd = -1;
+    log_drain_exit = false;
+
+EXIT:
+    return;
+}
+
+/* ========================================================================= *
+ * LOG_SITE
+ * ========================================================================= */
+
+/** Get monotonic time for rate limiting purposes
+ *
+ * @return milliseconds since unspecified starting point
+ */
+static int64_t log_site_get_time(void)
+{
+    struct timespec ts = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+/** Check whether a message from given call site should be emitted
+ *
+ * At most LOG_SITE_BURST messages are let through from a single call
+ * site within LOG_SITE_WINDOW_MS. The number of messages suppressed in
+ * between is reported together with the next emitted message.
+ *
+ * Debug messages are never suppressed - they are meant to be verbose
+ * and are not enabled by default.
+ *
+ * Concurrent use from several threads can let a message or two more
+ * through than allowed, but does not lose count of suppressed ones.
+ *
+ * @param site        Call site state, or NULL
+ * @param lev         Log level of the message
+ * @param suppressed  Where to store number of suppressed repeats
+ *
+ * @return true if message should be emitted, false otherwise
+ */
+static bool log_site_allow(log_site_t *site, int lev, unsigned *suppressed)
+{
+    bool allow = true;
+
+    *suppressed = 0;
+
+    if( !site || lev >= LOG_DEBUG )
+        goto EXIT;
+
+    int64_t now = log_site_get_time();
+    int64_t beg = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+
+    if( beg == 0 || now - beg >= LOG_SITE_WINDOW_MS ) {
+        if( __atomic_compare_exchange_n(&site->window, &beg, now ?: 1,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED) )
+            __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if( __atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_SITE_BURST ) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        allow = false;
+        goto EXIT;
+    }
+
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+EXIT:
+    return allow;
+}
+
+/* ========================================================================= *
+ * LOG_JOURNAL
+ * ========================================================================= */
+
+#ifdef SYSTEMD
+/** Append a "NAME=value" field to journal entry
+ *
+ * Fields that do not fit in the buffer are left out.
+ *
+ * @param self  Journal entry
+ * @param fmt   Format string for the field
+ * @param ...   Arguments for the format string
+ */
+static void log_journal_add(log_journal_t *self, const char *fmt, ...)
+{
+    if( self->cnt >= LOG_JOURNAL_FIELDS )
+        return;
+
+    char   *pos   = self->buf + self->used;
+    size_t  avail = sizeof self->buf - self->used;
+    va_list va;
+
+    va_start(va, fmt);
+    int len = vsnprintf(pos, avail, fmt, va);
+    va_end(va);
+
+    if( len < 0 || (size_t)len >= avail )
+        return;
+
+    self->iov[self->cnt].iov_base = pos;
+    self->iov[self->cnt].iov_len  = len;
+    self->cnt  += 1;
+    self->used += len + 1;
+}
+
+/** Send message to systemd journal with structured fields
+ *
+ * In addition to the standard fields, current mode, transition
+ * phase and cable state are included as USB_MODE, USB_PHASE and
+ * USB_CABLE_STATE. Transition timing messages carry DURATION_US,
+ * and SUPPRESSED tells how many repeats of the message were left
+ * out before this one.
+ *
+ * @param meta  Message details
+ * @param msg   Formatted message
+ */
+static void log_journal_write(const log_meta_t *meta, const char *msg)
+{
+    static const char * const field_name[LOG_FIELD_COUNT] = {
+        [LOG_FIELD_MODE]        = "USB_MODE",
+        [LOG_FIELD_PHASE]       = "USB_PHASE",
+        [LOG_FIELD_CABLE_STATE] = "USB_CABLE_STATE",
+    };
+
+    log_journal_t entry = { .cnt = 0, .used = 0 };
+
+    log_journal_add(&entry, "MESSAGE=%s", msg);
+    log_journal_add(&entry, "PRIORITY=%d", meta->lev);
+    log_journal_add(&entry, "SYSLOG_IDENTIFIER=%s", log_get_name());
+    log_journal_add(&entry, "CODE_FILE=%s", meta->file);
+    log_journal_add(&entry, "CODE_LINE=%d", meta->line);
+    log_journal_add(&entry, "CODE_FUNC=%s", meta->func);
+
+    if( meta->has_err )
+        log_journal_add(&entry, "ERRNO=%d", meta->err);
+
+    if( meta->duration_us >= 0 )
+        log_journal_add(&entry, "DURATION_US=%lld", meta->duration_us);
+
+    if( meta->suppressed )
+        log_journal_add(&entry, "SUPPRESSED=%u", meta->suppressed);
+
+    for( int i = 0; i < LOG_FIELD_COUNT; ++i ) {
+        if( meta->field[i] )
+            log_journal_add(&entry, "%s=%s", field_name[i], meta->field[i]);
+    }
+
+    if( sd_journal_sendv(entry.iov, entry.cnt) < 0 )
+        syslog(meta->lev, "%s", msg);
+}
+#endif // SYSTEMD
+
+/* ========================================================================= *
+ * LOG_CRASH
+ * ========================================================================= */
+
+/** Write recent messages from all rings to a file descriptor
+ *
+ * Both already processed and pending messages are included.
+ *
+ * @param fd  file descriptor to write to
+ */
+static void log_crash_dump(int fd)
+{
+    static const char hdr[] = "--- recent log messages ---\n";
+
+    char msg[LOG_MESSAGE_MAX];
+    char txt[LOG_MESSAGE_MAX + 128];
+
+    if( write(fd, hdr, sizeof hdr - 1) == -1 )
+        return;
+
+    log_ring_t *list = __atomic_load_n(&log_ring_list, __ATOMIC_ACQUIRE);
+
+    /* The oldest slot might be getting overwritten -> skip it */
+    for( log_ring_t *ring = list; ring; ring = ring->next ) {
+        ring->dump_end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        ring->dump_beg = 0;
+        if( ring->dump_end >= LOG_RING_SIZE )
+            ring->dump_beg = ring->dump_end - LOG_RING_SIZE + 1;
+    }
+
+    for( ;; ) {
+        log_ring_t           *best = 0;
+        const struct timeval *when = 0;
+
+        for( log_ring_t *ring = list; ring; ring = ring->next ) {
+            if( ring->dump_beg == ring->dump_end )
+                continue;
+            const struct timeval *tv = &ring->slot[ring->dump_beg % LOG_RING_SIZE].meta.tv;
+            if( !when || timercmp(tv, when, <) )
+                best = ring, when = tv;
+        }
+        if( !best )
+            break;
+
+        const log_record_t *rec = &best->slot[best->dump_beg++ % LOG_RING_SIZE];
+        log_record_format(rec, msg, sizeof msg);
+        int len = snprintf(txt, sizeof txt, "T%d %3ld.%03ld %s %s:%d: %s(): %s\n",
+                           best->id,
+                           (long)rec->meta.tv.tv_sec,
+                           (long)rec->meta.tv.tv_usec / 1000,
+                           log_level_tag(rec->meta.lev),
+                           rec->meta.file, rec->meta.line, rec->meta.func,
+                           log_strip(msg));
+        if( len > (int)sizeof txt - 1 )
+            len = sizeof txt - 1;
+        if( len > 0 && write(fd, txt, len) == -1 )
+            break;
+    }
 }
 
-void
-context_leave(void *aptr)
+/** Handler for fatal signals
+ *
+ * Writes the contents of log rings to stderr and/or crash dump file.
+ *
+ * NOTE: Formatting messages is not strictly async-signal-safe, but
+ *       as the process is about to die anyway, this is a risk worth
+ *       taking.
+ *
+ * @param sig  signal number
+ */
+static void log_crash_handler(int sig)
 {
-    const char *func = *(const char **)aptr;
-    assert( context_stack->sp > 0 );
-    context_stack->sp -= 1;
+    int fd;
+
+    if( !log_crashed ) {
+        log_crashed = 1;
+
+        /* Do not let other threads overwrite rings while dumping */
+        __atomic_store_n(&log_drain_running, false, __ATOMIC_SEQ_CST);
 
-    if( log_leave && context_stack->stk[context_stack->sp].done ) {
-        char msg[256];
-        snprintf(msg, sizeof msg, "} %s()", func);
-        context_write(-1, msg);
+        if( log_type == LOG_TO_STDERR )
+            log_crash_dump(STDERR_FILENO);
+
+        if( mkdir(LOG_RUNTIME_DIR, 0755) == -1 && errno != EEXIST ) {
+            // open fails too
+        }
+        fd = open(LOG_CRASH_DUMP_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+        if( fd != -1 ) {
+            log_crash_dump(fd);
+            close(fd);
+        }
     }
-    assert( context_stack->stk[context_stack->sp].func == func );
+
+    /* Handler was reset to default -> terminate with core dump */
+    raise(sig);
+}
+
+/** Install fatal signal handlers
+ */
+static void log_crash_trap(void)
+{
+    static const int sig[] = {
+        SIGSEGV,
+        SIGBUS,
+        SIGILL,
+        SIGFPE,
+        SIGABRT,
+        -1
+    };
+
+    struct sigaction sa = {
+        .sa_handler = log_crash_handler,
+        .sa_flags   = SA_RESETHAND | SA_NODEFER,
+    };
+    sigemptyset(&sa.sa_mask);
+
+    for( size_t i = 0; sig[i] != -1; ++i )
+        sigaction(sig[i], &sa, 0);
 }
-#endif // LOG_ENABLE_CONTEXT
 
 /* ========================================================================= *
  * Functions
@@ -198,99 +1493,159 @@ static void log_gettime(struct timeval *tv)
     timersub(tv, &log_begtime, tv);
 }
 
-/** Print the logged messages to the selected output
+static const char *log_level_tag(int lev)
+{
+    const char *tag = "U:";
+    switch( lev )
+    {
+    case LOG_CRIT:    tag = "C:"; break;
+    case LOG_ERR:     tag = "E:"; break;
+    case LOG_WARNING: tag = "W:"; break;
+    case LOG_NOTICE:  tag = "N:"; break;
+    case LOG_INFO:    tag = "I:"; break;
+    case LOG_DEBUG:   tag = "D:"; break;
+    }
+    return tag;
+}
+
+/** Write formatted message to the selected output
  *
- * @param file  Source file name
- * @param func  Function name
- * @param line  Line in source file
- * @param lev   The wanted log level
- * @param fmt   The message format string
- * @param va    Arguments for the format string
+ * @param meta  Message details; time is relative to log_init()
+ * @param msg   Formatted message, whitespace gets squeezed
  */
-void log_emit_va(const char *file, const char *func, int line, int lev, const char *fmt, va_list va)
+static void log_write(const log_meta_t *meta, char *msg)
 {
-    int saved = errno;
     char lineinfo[128] = "";
     char timeinfo[32] = "";
     char levelinfo[8] = "";
-    if( log_p(lev) )
+    char repeatinfo[48] = "";
+
+    if( meta->suppressed )
+        snprintf(repeatinfo, sizeof repeatinfo,
+                 " [%u repeats suppressed]", meta->suppressed);
+
+    switch( log_type )
     {
-        switch( log_type )
-        {
-        case LOG_TO_SYSLOG:
+    case LOG_TO_JOURNAL:
+#ifdef SYSTEMD
+        log_journal_write(meta, msg);
+        break;
+#endif
+        // fall through
 
-            vsyslog(lev, fmt, va);
-            break;
+    case LOG_TO_SYSLOG:
 
-        case LOG_TO_STDERR:
+        syslog(meta->lev, "%s%s", msg, repeatinfo);
+        break;
 
-            if( log_get_lineinfo() ) {
-                /* Use gcc error like prefix for logging so
-                 * that logs can be analyzed with jump to
-                 * line parsing  available in editors. */
-                snprintf(lineinfo, sizeof lineinfo,
-                         "%s:%d: %s(): ", file, line, func);
-            }
-            else {
-                snprintf(lineinfo, sizeof lineinfo,
-                         "%s: ", log_get_name());
-            }
+    case LOG_TO_STDERR:
+
+        if( log_get_lineinfo() ) {
+            /* Use gcc error like prefix for logging so
+             * that logs can be analyzed with jump to
+             * line parsing  available in editors. */
+            snprintf(lineinfo, sizeof lineinfo,
+                     "%s:%d: %s(): ", meta->file, meta->line, meta->func);
+        }
+        else {
+            snprintf(lineinfo, sizeof lineinfo,
+                     "%s: ", log_get_name());
+        }
 
 #if LOG_ENABLE_TIMESTAMPS
-            {
-                struct timeval tv;
-                log_gettime(&tv);
-                snprintf(timeinfo, sizeof timeinfo,
-                         "%3ld.%03ld ",
-                        (long)tv.tv_sec,
-                        (long)tv.tv_usec/1000);
-            }
+        snprintf(timeinfo, sizeof timeinfo,
+                 "%3ld.%03ld ",
+                 (long)meta->tv.tv_sec,
+                 (long)meta->tv.tv_usec/1000);
 #endif
 
 #if LOG_ENABLE_LEVELTAGS
-            {
-                static const char *tag = "U:";
-                switch( lev )
-                {
-                case LOG_CRIT:    tag = "C:"; break;
-                case LOG_ERR:     tag = "E:"; break;
-                case LOG_WARNING: tag = "W:"; break;
-                case LOG_NOTICE:  tag = "N:"; break;
-                case LOG_INFO:    tag = "I:"; break;
-                case LOG_DEBUG:   tag = "D:"; break;
-                }
-                snprintf(levelinfo, sizeof levelinfo,
-                         "%s ", tag);
-            }
-#endif
-            {
-                // squeeze whitespace like syslog does
-                char msg[512];
-                errno = saved;
-                vsnprintf(msg, sizeof msg, fmt, va);
-                log_strip(msg);
-#if LOG_ENABLE_CONTEXT
-                char buf[1024];
-                snprintf(buf, sizeof buf, "%s%s%s%s",
-                         lineinfo, timeinfo, levelinfo, msg);
-                context_flush();
-                context_write(-1, buf);
-#else
-                fprintf(stderr, "%s%s%s%s\n",
-                        lineinfo, timeinfo, levelinfo, msg);
+        snprintf(levelinfo, sizeof levelinfo,
+                 "%s ", log_level_tag(meta->lev));
 #endif
-            }
-            fflush(stderr);
-            break;
-
-        default:
-            // no logging
-            break;
+        {
+            // squeeze whitespace like syslog does
+            log_strip(msg);
+            fprintf(stderr, "%s%s%s%s%s\n",
+                    lineinfo, timeinfo, levelinfo, msg, repeatinfo);
         }
+        break;
+
+    default:
+        // no logging
+        break;
+    }
+}
+
+/** Print the logged messages to the selected output
+ *
+ * Normally only the format string and arguments are stored, and
+ * formatting plus output is done later on in the drain thread.
+ * Messages are written synchronously before log_init() and after
+ * log_quit() has been called.
+ *
+ * Suppressed repeats cost just the rate limit check; the current
+ * context values are captured for the journal sink.
+ *
+ * @param site         Call site state for repeat suppression, or NULL
+ * @param file         Source file name
+ * @param func         Function name
+ * @param line         Line in source file
+ * @param lev          The wanted log level
+ * @param duration_us  Duration to attach to message, or -1
+ * @param fmt          The message format string
+ * @param va           Arguments for the format string
+ */
+static void log_emit_full(log_site_t *site, const char *file, const char *func, int line, int lev, long long duration_us, const char *fmt, va_list va)
+{
+    int        saved = errno;
+    log_meta_t meta;
+
+    if( !log_p(lev) )
+        goto EXIT;
+
+    if( !log_site_allow(site, lev, &meta.suppressed) )
+        goto EXIT;
+
+    log_gettime(&meta.tv);
+    meta.file        = file;
+    meta.func        = func;
+    meta.line        = line;
+    meta.lev         = lev;
+    meta.err         = saved;
+    meta.has_err     = strstr(fmt, "%m") != 0;
+    meta.duration_us = duration_us;
+    for( int i = 0; i < LOG_FIELD_COUNT; ++i )
+        meta.field[i] = __atomic_load_n(&log_field_value[i], __ATOMIC_ACQUIRE);
+
+    if( !log_ring_enqueue(&meta, fmt, va) ) {
+        char msg[LOG_MESSAGE_MAX];
+
+        errno = saved;
+        vsnprintf(msg, sizeof msg, fmt, va);
+        log_write(&meta, msg);
+        if( log_type == LOG_TO_STDERR )
+            fflush(stderr);
     }
+
+EXIT:
     errno = saved;
 }
 
+/** Print the logged messages to the selected output
+ *
+ * @param file  Source file name
+ * @param func  Function name
+ * @param line  Line in source file
+ * @param lev   The wanted log level
+ * @param fmt   The message format string
+ * @param va    Arguments for the format string
+ */
+void log_emit_va(const char *file, const char *func, int line, int lev, const char *fmt, va_list va)
+{
+    log_emit_full(0, file, func, line, lev, -1, fmt, va);
+}
+
 /** Print the logged messages to the selected output
  *
  * @param file  Source file name
@@ -308,6 +1663,28 @@ void log_emit_real(const char *file, const char *func, int line, int lev, const
     va_end(va);
 }
 
+/** Print the logged messages to the selected output
+ *
+ * Used via log_emit() and log_duration() macros, which provide
+ * each call site with private repeat suppression state.
+ *
+ * @param site         Call site state for repeat suppression
+ * @param file         Source file name
+ * @param func         Function name
+ * @param line         Line in source file
+ * @param lev          The wanted log level
+ * @param duration_us  Duration to attach to message, or -1
+ * @param fmt          The message format string
+ * @param ...          Arguments for the format string
+ */
+void log_emit_site(log_site_t *site, const char *file, const char *func, int line, int lev, long long duration_us, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    log_emit_full(site, file, func, line, lev, duration_us, fmt, va);
+    va_end(va);
+}
+
 void log_debugf(const char *fmt, ...)
 {
     /* This goes always to stderr */
@@ -403,10 +1780,55 @@ bool log_get_lineinfo(void)
     return log_lineinfo;
 }
 
+/** Set context value to attach to subsequent log messages
+ *
+ * As messages are formatted asynchronously, the value must stay
+ * valid for the lifetime of the process, i.e. be a string literal
+ * or interned string.
+ *
+ * @param field  Which context value to set
+ * @param value  Static string, or NULL to clear the value
+ */
+void log_set_field(log_field_t field, const char *value)
+{
+    if( field < LOG_FIELD_COUNT )
+        __atomic_store_n(&log_field_value[field], value, __ATOMIC_RELEASE);
+}
+
+/** Get context value attached to log messages
+ *
+ * @param field  Which context value to get
+ *
+ * @return static string, or NULL if not set
+ */
+const char *log_get_field(log_field_t field)
+{
+    const char *value = 0;
+    if( field < LOG_FIELD_COUNT )
+        value = __atomic_load_n(&log_field_value[field], __ATOMIC_ACQUIRE);
+    return value;
+}
+
 /** Initialize logging */
 void log_init(void)
 {
     /* Get reference time used for verbose logging */
     if( !timerisset(&log_begtime) )
         gettimeofday(&log_begtime, 0);
+
+    /* Move formatting and output off the logging threads */
+    if( !log_drain_start() )
+        log_warning("log drain thread not started; logging synchronously");
+
+    /* Dump recent messages if the process crashes */
+    log_crash_trap();
+}
+
+/** Flush pending messages and stop logging thread */
+void log_quit(void)
+{
+    /* Write out function trace that is still being recorded */
+    trace_set_enabled(false);
+
+    log_drain_stop();
 }
@@ -28,6 +28,7 @@
 
 # include <stdbool.h>
 # include <stdarg.h>
+# include <stdint.h>
 # include <syslog.h>
 
 /* Logging functionality */
@@ -39,12 +40,13 @@
 # define LOG_ENABLE_DEBUG      01
 # define LOG_ENABLE_TIMESTAMPS 01
 # define LOG_ENABLE_LEVELTAGS  01
-# define LOG_ENABLE_CONTEXT    0
+# define LOG_ENABLE_TRACE      01
 
 enum
 {
     LOG_TO_STDERR, // log to stderr
     LOG_TO_SYSLOG, // log to syslog
+    LOG_TO_JOURNAL,// log to systemd journal with structured fields
 };
 
 enum
@@ -53,21 +55,62 @@ enum
     LOG_MAX_LEVEL = LOG_DEBUG,
 };
 
+/** Context values attached to every log message
+ *
+ * Only the journal sink makes use of these.
+ */
+typedef enum log_field_t
+{
+    LOG_FIELD_MODE,        // mode being activated / active mode
+    LOG_FIELD_PHASE,       // phase of ongoing mode transition
+    LOG_FIELD_CABLE_STATE, // current cable state
+    LOG_FIELD_COUNT
+} log_field_t;
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Repeat suppression state for a single log call site */
+typedef struct log_site_t
+{
+    int64_t  window;     // start of current rate limit window [ms]
+    unsigned count;      // messages within current window
+    unsigned suppressed; // messages dropped since the last one emitted
+} log_site_t;
+
 /* ========================================================================= *
- * CONTEXT STACK
+ * FUNCTION TRACE
  * ========================================================================= */
 
-# if LOG_ENABLE_CONTEXT
-const char *context_enter(const char *func);
-void        context_leave(void *aptr);
+# if LOG_ENABLE_TRACE
+extern bool trace_enabled;
 
+const char *trace_enter      (const char *func);
+void        trace_leave      (const char *func);
+void        trace_set_enabled(bool enable);
+bool        trace_get_enabled(void);
+void        trace_set_output (const char *path);
+
+static inline void trace_leave_cb(const char **pfunc)
+{
+    if( __builtin_expect(*pfunc != 0, 0) )
+        trace_leave(*pfunc);
+}
+
+/* When tracing is disabled, function entry and exit cost
+ * one predictable branch each */
+#  define LOG_REGISTER_CONTEXT\
+     __attribute__((cleanup(trace_leave_cb))) const char *qqq =\
+         (__builtin_expect(trace_enabled, 0) ? trace_enter(__func__) : 0)
+# else
 #  define LOG_REGISTER_CONTEXT\
-     __attribute__((cleanup(context_leave))) const char *qqq =\
-         context_enter(__func__)
-#else
-# define LOG_REGISTER_CONTEXT\
      do{}while(0)
-#endif
+
+#  define trace_set_enabled(ENABLE) do{}while(0)
+#  define trace_get_enabled()       false
+#  define trace_set_output(PATH)    do{}while(0)
+# endif
 
 /* ========================================================================= *
  * Prototypes
@@ -79,6 +122,7 @@ void        context_leave(void *aptr);
 
 void        log_emit_va     (const char *file, const char *func, int line, int lev, const char *fmt, va_list va);
 void        log_emit_real   (const char *file, const char *func, int line, int lev, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+void        log_emit_site   (log_site_t *site, const char *file, const char *func, int line, int lev, long long duration_us, const char *fmt, ...) __attribute__((format(printf, 7, 8)));
 void        log_debugf      (const char *fmt, ...);
 int         log_get_level   (void);
 void        log_set_level   (int lev);
@@ -89,18 +133,28 @@ const char *log_get_name    (void);
 void        log_set_name    (const char *name);
 void        log_set_lineinfo(bool lineinfo);
 bool        log_get_lineinfo(void);
+void        log_set_field   (log_field_t field, const char *value);
+const char *log_get_field   (log_field_t field);
 void        log_init        (void);
+void        log_quit        (void);
 
 /* ========================================================================= *
  * Macros
  * ========================================================================= */
 
-# define log_emit(LEV, FMT, ARGS...) do {\
+/* Each call site gets a private state for suppressing repeats */
+# define log_emit_ex(LEV, US, FMT, ARGS...) do {\
+    static log_site_t log_site;\
     if( log_p(LEV) ) {\
-        log_emit_real(__FILE__,__FUNCTION__,__LINE__, LEV, FMT, ##ARGS);\
+        log_emit_site(&log_site, __FILE__,__FUNCTION__,__LINE__, LEV, US, FMT, ##ARGS);\
     }\
 } while(0)
 
+# define log_emit(LEV, FMT, ARGS...)          log_emit_ex(LEV, -1, FMT, ##ARGS)
+
+/* Message with duration_us field attached, e.g. mode transition time */
+# define log_duration(LEV, US, FMT, ARGS...)  log_emit_ex(LEV, US, FMT, ##ARGS)
+
 # define log_crit(    FMT, ARGS...)   log_emit(LOG_CRIT,    FMT, ##ARGS)
 # define log_err(     FMT, ARGS...)   log_emit(LOG_ERR,     FMT, ##ARGS)
 # define log_warning( FMT, ARGS...)   log_emit(LOG_WARNING, FMT, ##ARGS)
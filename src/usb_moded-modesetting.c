@@ -33,19 +33,48 @@
 
 #include "usb_moded-android.h"
 #include "usb_moded-appsync.h"
+#include "usb_moded-blocker.h"
 #include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-configfs.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-latency.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modules.h"
 #include "usb_moded-network.h"
 #include "usb_moded-worker.h"
 
+#include <sys/mount.h>
+
 #include <unistd.h>
 #include <fcntl.h>
 #include <mntent.h>
 #include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of threads used for unmounting mass storage filesystems */
+#define MODESETTING_UNMOUNT_THREADS_MAX 4
+
+/** How many times unmounting is attempted before giving up */
+#define MODESETTING_UNMOUNT_TRIES       3
+
+/** Delay between unmount attempts [ms] */
+#define MODESETTING_UNMOUNT_RETRY_MS    1000
+
+/** Maximum time to wait for an unmount job to finish [ms] */
+#define MODESETTING_UNMOUNT_TIMEOUT_MS  30000
+
+/** Flags implied by user, users, owner and group mount options, see mount(8) */
+#define MS_USERMOUNT (MS_NOSUID | MS_NODEV | MS_NOEXEC)
 
 /* ========================================================================= *
  * Types
@@ -62,6 +91,126 @@ typedef struct storage_info_t
     gchar *si_mountdevice;;
 } storage_info_t;
 
+/** Mounted filesystem info from /proc/self/mountinfo
+ */
+typedef struct mountinfo_entry_t
+{
+    /** Directory path */
+    gchar *me_mountpoint;
+
+    /** Filesystem type */
+    gchar *me_fstype;
+
+    /** Mount source, e.g. device path */
+    gchar *me_source;
+} mountinfo_entry_t;
+
+typedef struct unmount_pool_t unmount_pool_t;
+
+/** Unmount state of one mass storage mountpoint
+ */
+typedef struct unmount_job_t
+{
+    /** Pool the job belongs to */
+    unmount_pool_t *uj_pool;
+
+    /** Directory path */
+    const char     *uj_mountpoint;
+
+    /** Number of failed unmount attempts */
+    int             uj_tries;
+
+    /** Flag for: job has been finished, protected by pool mutex */
+    bool            uj_done;
+
+    /** Flag for: filesystem is not mounted anymore */
+    bool            uj_success;
+
+    /** Time spent on the job [us] */
+    int64_t         uj_duration_us;
+} unmount_job_t;
+
+/** Threads unmounting mass storage filesystems concurrently
+ *
+ * Threads are started on demand and then kept around for the
+ * lifetime of the process, so that per thread resources such as
+ * log rings get reused rather than leaked on every mode switch.
+ */
+struct unmount_pool_t
+{
+    /** Protects all pool and job state */
+    pthread_mutex_t  up_mutex;
+
+    /** Signaled when jobs are added, finished or canceled */
+    pthread_cond_t   up_cond;
+
+    /** Flag for: up_cond has been initialized */
+    bool             up_initialized;
+
+    /** Array of jobs */
+    unmount_job_t   *up_job;
+
+    /** Number of jobs */
+    size_t           up_count;
+
+    /** Index of the next job to pick up */
+    size_t           up_next;
+
+    /** Flag for: threads should stop as soon as possible */
+    bool             up_cancel;
+
+    /** Number of jobs currently being executed */
+    size_t           up_active;
+
+    /** Number of threads that have been started */
+    size_t           up_threads;
+};
+
+/** Mount option name to mount(2) flag mapping
+ */
+typedef struct mount_option_t
+{
+    /** Option name as used in fstab */
+    const char    *mo_name;
+
+    /** Flag bits to set */
+    unsigned long  mo_set;
+
+    /** Flag bits to clear */
+    unsigned long  mo_clear;
+} mount_option_t;
+
+/** Evidence that modesetting_settle() can wait for
+ */
+typedef enum settle_t
+{
+    /** Usb host has configured the gadget */
+    SETTLE_GADGET          = 1 << 0,
+
+    /** Network interface for the mode exists */
+    SETTLE_NETWORK_EXISTS  = 1 << 1,
+
+    /** Network interface for the mode is up and running */
+    SETTLE_NETWORK_RUNNING = 1 << 2,
+} settle_t;
+
+/** Book keeping data for modesetting_settle()
+ */
+typedef struct settle_state_t
+{
+    /** Mode data to evaluate network conditions against */
+    const modedata_t *data;
+
+    /** Conditions that can and need to be waited for */
+    unsigned          what;
+
+    /** UDC state attribute file, or -1 */
+    int               udc_fd;
+
+    /** Rtnetlink link monitor socket, or -1 */
+    int               link_fd;
+} settle_state_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -75,15 +224,40 @@ void                   modesetting_verify_values              (void);
 static char           *modesetting_strip                      (char *str);
 static char           *modesetting_read_from_file             (const char *path, size_t maxsize);
 int                    modesetting_write_to_file_real         (const char *file, int line, const char *func, const char *path, const char *text);
+static char           *modesetting_unescape_mountinfo         (char *str);
+static void            modesetting_mountinfo_entry_free_cb    (gpointer self);
+static bool            modesetting_mountinfo_parse            (void);
+static void            modesetting_mountinfo_refresh          (void);
+static void            modesetting_mountinfo_invalidate       (void);
+static void            modesetting_mountinfo_quit             (void);
+static const mountinfo_entry_t *modesetting_mountinfo_lookup  (const char *mountpoint);
+static struct mntent  *modesetting_fstab_lookup               (FILE *fh, const char *mountpoint);
+static unsigned long   modesetting_parse_mount_options        (const char *opts, GString *data);
+static gchar          *modesetting_resolve_mount_source       (const char *fsname);
 bool                   modesetting_is_mounted                 (const char *mountpoint);
 bool                   modesetting_mount                      (const char *mountpoint);
 bool                   modesetting_unmount                    (const char *mountpoint);
 static gchar          *modesetting_mountdev                   (const char *mountpoint);
 static void            modesetting_free_storage_info          (storage_info_t *info);
 static storage_info_t *modesetting_get_storage_info           (size_t *pcount);
+static int             modesetting_open_udc_state             (void);
+static bool            modesetting_udc_is_configured          (int fd);
+static bool            modesetting_settle_ready_cb            (void *aptr);
+static bool            modesetting_settle                     (const modedata_t *data, unsigned what, unsigned ceiling_ms);
 static bool            modesetting_enter_mass_storage_mode    (const modedata_t *data);
 static int             modesetting_leave_mass_storage_mode    (const modedata_t *data);
-static void            modesetting_report_mass_storage_blocker(const char *mountpoint, int try);
+static void            modesetting_report_mass_storage_blocker(unmount_job_t *job, int try);
+static bool            modesetting_unmount_pool_canceled_cb   (void *aptr);
+static bool            modesetting_unmount_pool_sleep         (unmount_pool_t *pool, unsigned ms);
+static void            modesetting_unmount_job_run            (unmount_job_t *job);
+static unmount_job_t   *modesetting_unmount_pool_take          (unmount_pool_t *pool, bool wait);
+static void            modesetting_unmount_pool_finish        (unmount_pool_t *pool, unmount_job_t *job);
+static void           *modesetting_unmount_thread_cb          (void *aptr);
+static bool            modesetting_unmount_job_done_cb        (void *aptr);
+static void            modesetting_unmount_pool_start         (unmount_pool_t *pool, const storage_info_t *info, size_t count);
+static bool            modesetting_unmount_pool_wait          (unmount_pool_t *pool, size_t i);
+static bool            modesetting_unmount_pool_wait_all      (unmount_pool_t *pool);
+static void            modesetting_unmount_pool_stop          (unmount_pool_t *pool);
 bool                   modesetting_enter_dynamic_mode         (void);
 void                   modesetting_leave_dynamic_mode         (void);
 void                   modesetting_init                       (void);
@@ -95,6 +269,82 @@ void                   modesetting_quit                       (void);
 
 static GHashTable *tracked_values = 0;
 
+/** Open /proc/self/mountinfo, signals changes via POLLPRI */
+static int modesetting_mountinfo_fd = -1;
+
+/** Mountpoint path -> mountinfo_entry_t lookup table */
+static GHashTable *modesetting_mountinfo = 0;
+
+/** Flag for: modesetting_mountinfo needs to be re-parsed */
+static bool modesetting_mountinfo_stale = true;
+
+/** Unmount threads, shared by all mass storage mode activations */
+static unmount_pool_t modesetting_unmount_pool =
+{
+    .up_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** Mutex for mount table access from worker and unmount threads */
+static pthread_mutex_t modesetting_mountinfo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define MOUNTINFO_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&modesetting_mountinfo_mutex) != 0 ) { \
+        log_crit("MOUNTINFO LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define MOUNTINFO_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&modesetting_mountinfo_mutex) != 0 ) { \
+        log_crit("MOUNTINFO UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/** Mount options that translate to mount(2) flags
+ *
+ * Options that only affect mount(8) behavior are mapped to no-op
+ * entries so that they do not end up in filesystem specific data.
+ *
+ * As documented in mount(8), user, users, owner and group imply
+ * noexec, nosuid and nodev unless overridden by later options -
+ * which works the same way here, as options are applied in order.
+ */
+static const mount_option_t modesetting_mount_options[] =
+{
+    { "defaults",    0,             0            },
+    { "auto",        0,             0            },
+    { "noauto",      0,             0            },
+    { "user",        MS_USERMOUNT,  0            },
+    { "nouser",      0,             0            },
+    { "users",       MS_USERMOUNT,  0            },
+    { "owner",       MS_USERMOUNT,  0            },
+    { "group",       MS_USERMOUNT,  0            },
+    { "nofail",      0,             0            },
+    { "_netdev",     0,             0            },
+    { "ro",          MS_RDONLY,     0            },
+    { "rw",          0,             MS_RDONLY    },
+    { "nosuid",      MS_NOSUID,     0            },
+    { "suid",        0,             MS_NOSUID    },
+    { "nodev",       MS_NODEV,      0            },
+    { "dev",         0,             MS_NODEV     },
+    { "noexec",      MS_NOEXEC,     0            },
+    { "exec",        0,             MS_NOEXEC    },
+    { "sync",        MS_SYNCHRONOUS,0            },
+    { "async",       0,             MS_SYNCHRONOUS },
+    { "dirsync",     MS_DIRSYNC,    0            },
+    { "mand",        MS_MANDLOCK,   0            },
+    { "nomand",      0,             MS_MANDLOCK  },
+    { "noatime",     MS_NOATIME,    0            },
+    { "atime",       0,             MS_NOATIME   },
+    { "nodiratime",  MS_NODIRATIME, 0            },
+    { "diratime",    0,             MS_NODIRATIME },
+    { "relatime",    MS_RELATIME,   0            },
+    { "norelatime",  0,             MS_RELATIME  },
+    { "strictatime", MS_STRICTATIME,0            },
+    { 0,             0,             0            }
+};
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -185,8 +435,9 @@ static char *modesetting_read_from_file(const char *path, size_t maxsize)
     ssize_t  done = 0;
     char    *data = 0;
     char    *text = 0;
+    char     real[PATH_MAX];
 
-    if((fd = open(path, O_RDONLY)) == -1)
+    if((fd = open(common_sysroot_path(path, real, sizeof real), O_RDONLY)) == -1)
     {
         /* Silently ignore things that could result
          * from missing / read-only files */
@@ -264,7 +515,8 @@ int modesetting_write_to_file_real(const char *file, int line, const char *func,
     todo  = strlen(text);
 
     /* no O_CREAT -> writes only to already existing files */
-    if( (fd = TEMP_FAILURE_RETRY(open(path, O_WRONLY))) == -1 )
+    char real[PATH_MAX];
+    if( (fd = TEMP_FAILURE_RETRY(open(common_sysroot_path(path, real, sizeof real), common_sysroot_write_flags(), 0644))) == -1 )
     {
         log_warning("open(%s): %m", path);
         goto cleanup;
@@ -297,31 +549,397 @@ cleanup:
     return err;
 }
 
+/** Decode octal escapes used for white space etc in mountinfo paths
+ *
+ * @param str  string to modify in place
+ *
+ * @return str
+ */
+static char *modesetting_unescape_mountinfo(char *str)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *src = str;
+    char *dst = str;
+
+    while( *src ) {
+        if( src[0] == '\\' &&
+            src[1] >= '0' && src[1] <= '3' &&
+            src[2] >= '0' && src[2] <= '7' &&
+            src[3] >= '0' && src[3] <= '7' ) {
+            *dst++ = (char)(((src[1] - '0') << 6) |
+                            ((src[2] - '0') << 3) |
+                            ((src[3] - '0') << 0));
+            src += 4;
+        }
+        else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = 0;
+    return str;
+}
+
+static void modesetting_mountinfo_entry_free_cb(gpointer self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    mountinfo_entry_t *entry = self;
+
+    if( entry ) {
+        g_free(entry->me_mountpoint);
+        g_free(entry->me_fstype);
+        g_free(entry->me_source);
+        g_free(entry);
+    }
+}
+
+/** Read and index mount table
+ *
+ * Format of /proc/self/mountinfo lines is:
+ *
+ *   id parent major:minor root mountpoint options [optional...] - fstype source superoptions
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_mountinfo_parse(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool     ack  = false;
+    GString *text = g_string_new(0);
+    off_t    offs = 0;
+    char     buff[4096];
+
+    for( ;; ) {
+        ssize_t rc = pread(modesetting_mountinfo_fd, buff, sizeof buff, offs);
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_err("mountinfo: read failed: %m");
+            goto EXIT;
+        }
+        if( rc == 0 )
+            break;
+        g_string_append_len(text, buff, rc);
+        offs += rc;
+    }
+
+    g_hash_table_remove_all(modesetting_mountinfo);
+
+    gchar **lines = g_strsplit(text->str, "\n", 0);
+    for( size_t i = 0; lines[i]; ++i ) {
+        gchar **field = g_strsplit(lines[i], " ", 0);
+        size_t  count = g_strv_length(field);
+        size_t  sep   = 6;
+
+        /* Skip optional fields */
+        while( sep < count && strcmp(field[sep], "-") )
+            ++sep;
+
+        if( count >= 5 && sep + 2 < count ) {
+            mountinfo_entry_t *entry = g_malloc0(sizeof *entry);
+            entry->me_mountpoint = modesetting_unescape_mountinfo(g_strdup(field[4]));
+            entry->me_fstype     = g_strdup(field[sep + 1]);
+            entry->me_source     = modesetting_unescape_mountinfo(g_strdup(field[sep + 2]));
+
+            /* Later entries are mounted on top of earlier ones */
+            g_hash_table_replace(modesetting_mountinfo,
+                                 entry->me_mountpoint, entry);
+        }
+        g_strfreev(field);
+    }
+    g_strfreev(lines);
+
+    log_debug("mountinfo: %u mounts", g_hash_table_size(modesetting_mountinfo));
+    ack = true;
+
+EXIT:
+    g_string_free(text, TRUE);
+    return ack;
+}
+
+/** Make sure mount table snapshot is up to date
+ *
+ * The kernel signals mount table changes as POLLPRI on the open
+ * mountinfo file, so re-parsing is needed only after that.
+ *
+ * Note: Caller must hold modesetting_mountinfo_mutex.
+ */
+static void modesetting_mountinfo_refresh(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !modesetting_mountinfo ) {
+        modesetting_mountinfo =
+            g_hash_table_new_full(g_str_hash, g_str_equal, 0,
+                                  modesetting_mountinfo_entry_free_cb);
+    }
+
+    if( modesetting_mountinfo_fd == -1 ) {
+        modesetting_mountinfo_fd = open("/proc/self/mountinfo",
+                                        O_RDONLY | O_CLOEXEC);
+        if( modesetting_mountinfo_fd == -1 ) {
+            log_err("/proc/self/mountinfo: open failed: %m");
+            goto EXIT;
+        }
+        modesetting_mountinfo_stale = true;
+    }
+
+    struct pollfd pfd = {
+        .fd      = modesetting_mountinfo_fd,
+        .events  = POLLPRI,
+        .revents = 0,
+    };
+    if( poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)) )
+        modesetting_mountinfo_stale = true;
+
+    if( modesetting_mountinfo_stale ) {
+        if( modesetting_mountinfo_parse() )
+            modesetting_mountinfo_stale = false;
+    }
+
+EXIT:
+    return;
+}
+
+/** Force re-parsing of mount table on the next lookup
+ */
+static void modesetting_mountinfo_invalidate(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    MOUNTINFO_LOCKED_ENTER;
+    modesetting_mountinfo_stale = true;
+    MOUNTINFO_LOCKED_LEAVE;
+}
+
+/** Release mount table tracking resources
+ */
+static void modesetting_mountinfo_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    MOUNTINFO_LOCKED_ENTER;
+
+    if( modesetting_mountinfo_fd != -1 ) {
+        close(modesetting_mountinfo_fd),
+            modesetting_mountinfo_fd = -1;
+    }
+
+    if( modesetting_mountinfo ) {
+        g_hash_table_unref(modesetting_mountinfo),
+            modesetting_mountinfo = 0;
+    }
+
+    modesetting_mountinfo_stale = true;
+
+    MOUNTINFO_LOCKED_LEAVE;
+}
+
+/** Lookup top most filesystem mounted at given path
+ *
+ * Note: Caller must hold modesetting_mountinfo_mutex.
+ *
+ * @param mountpoint  directory path
+ *
+ * @return mount info, or NULL if nothing is mounted at mountpoint
+ */
+static const mountinfo_entry_t *modesetting_mountinfo_lookup(const char *mountpoint)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const mountinfo_entry_t *entry = 0;
+    char                     real[PATH_MAX];
+
+    modesetting_mountinfo_refresh();
+
+    if( !modesetting_mountinfo || !mountpoint )
+        goto EXIT;
+
+    if( (entry = g_hash_table_lookup(modesetting_mountinfo, mountpoint)) )
+        goto EXIT;
+
+    /* Kernel reports canonical paths */
+    if( realpath(mountpoint, real) && strcmp(real, mountpoint) )
+        entry = g_hash_table_lookup(modesetting_mountinfo, real);
+
+EXIT:
+    return entry;
+}
+
+/** Find fstab entry for a mountpoint
+ *
+ * @param fh          fstab opened with setmntent()
+ * @param mountpoint  directory path
+ *
+ * @return fstab entry, valid until the next getmntent() call, or NULL
+ */
+static struct mntent *modesetting_fstab_lookup(FILE *fh, const char *mountpoint)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct mntent *me;
+
+    while( (me = getmntent(fh)) ) {
+        if( !strcmp(me->mnt_dir, mountpoint) )
+            break;
+    }
+    return me;
+}
+
+/** Convert fstab options to mount(2) flags and filesystem data
+ *
+ * @param opts  comma separated fstab options
+ * @param data  where to append filesystem specific options
+ *
+ * @return mount flags
+ */
+static unsigned long modesetting_parse_mount_options(const char *opts, GString *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned long   flags = 0;
+    gchar         **vec   = g_strsplit(opts ?: "", ",", 0);
+
+    for( size_t i = 0; vec[i]; ++i ) {
+        const mount_option_t *opt = 0;
+
+        if( !*vec[i] || g_str_has_prefix(vec[i], "x-") ||
+            g_str_has_prefix(vec[i], "comment=") )
+            continue;
+
+        for( opt = modesetting_mount_options; opt->mo_name; ++opt ) {
+            if( !strcmp(opt->mo_name, vec[i]) )
+                break;
+        }
+
+        if( opt->mo_name ) {
+            flags = (flags & ~opt->mo_clear) | opt->mo_set;
+        }
+        else {
+            if( data->len )
+                g_string_append_c(data, ',');
+            g_string_append(data, vec[i]);
+        }
+    }
+
+    g_strfreev(vec);
+    return flags;
+}
+
+/** Convert fstab mount source into device path
+ *
+ * @param fsname  device path, or UUID=xxx / LABEL=xxx tag
+ *
+ * @return device path
+ */
+static gchar *modesetting_resolve_mount_source(const char *fsname)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( g_str_has_prefix(fsname, "UUID=") )
+        return g_strdup_printf("/dev/disk/by-uuid/%s", fsname + 5);
+
+    if( g_str_has_prefix(fsname, "LABEL=") )
+        return g_strdup_printf("/dev/disk/by-label/%s", fsname + 6);
+
+    return g_strdup(fsname);
+}
+
 bool modesetting_is_mounted(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/mountpoint -q '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    bool mounted = false;
+
+    MOUNTINFO_LOCKED_ENTER;
+    mounted = modesetting_mountinfo_lookup(mountpoint) != 0;
+    MOUNTINFO_LOCKED_LEAVE;
+
+    return mounted;
 }
 
+/** Mount filesystem as specified in /etc/fstab
+ *
+ * @param mountpoint  directory path
+ *
+ * @return true if filesystem was mounted, false otherwise
+ */
 bool modesetting_mount(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/mount '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    bool           ack    = false;
+    FILE          *fh     = 0;
+    struct mntent *me     = 0;
+    gchar         *source = 0;
+    GString       *data   = g_string_new(0);
+    unsigned long  flags  = 0;
+
+    if( !(fh = setmntent("/etc/fstab", "r")) ) {
+        log_err("/etc/fstab: can't open: %m");
+        goto EXIT;
+    }
+
+    if( !(me = modesetting_fstab_lookup(fh, mountpoint)) ) {
+        log_err("%s: not in fstab", mountpoint);
+        goto EXIT;
+    }
+
+    if( !strcmp(me->mnt_type, "auto") ) {
+        /* Filesystem type probing is left for mount(8) */
+        ack = common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/bin/mount",
+                           mountpoint) == 0;
+        goto EXIT;
+    }
+
+    source = modesetting_resolve_mount_source(me->mnt_fsname);
+    flags  = modesetting_parse_mount_options(me->mnt_opts, data);
+
+    if( mount(source, mountpoint, me->mnt_type, flags,
+              data->len ? data->str : 0) == -1 ) {
+        log_err("%s: mount %s (%s) failed: %m", mountpoint, source,
+                me->mnt_type);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    modesetting_mountinfo_invalidate();
+
+    if( fh )
+        endmntent(fh);
+    g_string_free(data, TRUE);
+    g_free(source);
+
+    return ack;
 }
 
+/** Unmount filesystem
+ *
+ * @param mountpoint  directory path
+ *
+ * @return true if filesystem was unmounted, false otherwise
+ */
 bool modesetting_unmount(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/umount '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    bool ack = false;
+
+    if( umount2(mountpoint, 0) == -1 ) {
+        log_warning("%s: umount failed: %m", mountpoint);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    modesetting_mountinfo_invalidate();
+
+    return ack;
 }
 
 static gchar *modesetting_mountdev(const char *mountpoint)
@@ -335,12 +953,8 @@ static gchar *modesetting_mountdev(const char *mountpoint)
     if( !(fh = setmntent("/etc/fstab", "r")) )
         goto EXIT;
 
-    while( (me = getmntent(fh)) ) {
-        if( !strcmp(me->mnt_dir, mountpoint) ) {
-            res = g_strdup(me->mnt_fsname);
-            break;
-        }
-    }
+    if( (me = modesetting_fstab_lookup(fh, mountpoint)) )
+        res = g_strdup(me->mnt_fsname);
 
 EXIT:
     if( fh )
@@ -370,62 +984,253 @@ modesetting_get_storage_info(size_t *pcount)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool             ack     = false;
-    storage_info_t  *info    = 0;
-    size_t           count   = 0;
-    char            *setting = 0;
-    gchar          **array   = 0;
+    bool             ack     = false;
+    storage_info_t  *info    = 0;
+    size_t           count   = 0;
+    char            *setting = 0;
+    gchar          **array   = 0;
+
+    /* Get comma separated mountpoint list from config */
+    if( !(setting = config_find_mounts()) ) {
+        log_warning("no mount points configuration");
+        goto EXIT;
+    }
+
+    /* Split mountpoint list to array and count number of items */
+    array = g_strsplit(setting, ",", 0);
+    while( array[count] )
+        ++count;
+
+    if( count < 1 ) {
+        log_warning("no mount points configured");
+        goto EXIT;
+    }
+
+    /* Convert into array of storage_info_t objects */
+    info = g_new0(storage_info_t, count + 1);
+
+    for( size_t i = 0; i < count; ++i ) {
+        const gchar *mountpnt = info[i].si_mountpoint = g_strdup(array[i]);
+
+        if( access(mountpnt, F_OK) == -1 ) {
+            log_warning("mountpoint %s does not exist", mountpnt);
+            goto EXIT;
+        }
+
+        const gchar *mountdev = info[i].si_mountdevice = modesetting_mountdev(mountpnt);
+
+        if( !mountdev ) {
+            log_warning("can't find device for %s", mountpnt);
+            goto EXIT;
+        }
+
+        if( access(mountdev, F_OK) == -1 ) {
+            log_warning("mount device %s does not exist", mountdev);
+            goto EXIT;
+        }
+    }
+
+    ack = true;
+
+EXIT:
+    if( !ack )
+        modesetting_free_storage_info(info), info = 0, count = 0;
+
+    g_strfreev(array);
+    g_free(setting);
+
+    return *pcount = count, info;
+}
+
+/** Open state attribute of the UDC device the gadget is bound to
+ *
+ * Uses the UDC configfs binds the gadget to, or the first UDC
+ * device if that is not known - as is the case with android
+ * gadget, which is used only on devices with one UDC.
+ *
+ * The file supports POLLPRI notifications about state changes.
+ *
+ * @return file descriptor, or -1 if there is no UDC device
+ */
+static int modesetting_open_udc_state(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int            fd   = -1;
+    char           udc[PATH_MAX];
+    char           path[PATH_MAX];
+    const char    *root = common_sysroot_path(CONFIGFS_UDC_CLASS_DIR, udc, sizeof udc);
+    const char    *name = configfs_get_udc_device();
+    DIR           *dir  = 0;
+    struct dirent *de;
+
+    if( *name ) {
+        snprintf(path, sizeof path, "%s/%s/state", root, name);
+        if( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+            log_warning("%s: can't open: %m", path);
+        goto EXIT;
+    }
+
+    if( !(dir = opendir(root)) )
+        goto EXIT;
+
+    while( (de = readdir(dir)) ) {
+        if( de->d_type != DT_LNK || de->d_name[0] == '.' )
+            continue;
+
+        snprintf(path, sizeof path, "%s/%s/state", root, de->d_name);
+        if( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+            log_warning("%s: can't open: %m", path);
+        break;
+    }
+
+EXIT:
+    if( dir )
+        closedir(dir);
+
+    return fd;
+}
+
+/** Check if UDC is in configured state
+ *
+ * Reading the attribute also re-arms POLLPRI notification.
+ *
+ * @param fd  file descriptor from modesetting_open_udc_state()
+ *
+ * @return true if state is "configured", false otherwise
+ */
+static bool modesetting_udc_is_configured(int fd)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char    buff[64] = "";
+    ssize_t rc       = pread(fd, buff, sizeof buff - 1, 0);
+
+    if( rc < 0 ) {
+        log_warning("udc state read failed: %m");
+        return false;
+    }
+
+    buff[rc] = 0;
+    log_debug("udc state = %s", modesetting_strip(buff));
+    return !strcmp(buff, "configured");
+}
+
+/** Check whether all settle conditions are met
+ *
+ * All conditions are evaluated every time so that pending
+ * notifications get consumed from every file descriptor.
+ *
+ * @param aptr  settle state (as void pointer)
+ *
+ * @return true if all awaited conditions are met, false otherwise
+ */
+static bool modesetting_settle_ready_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    settle_state_t *state = aptr;
+    bool            ready = true;
 
-    /* Get comma separated mountpoint list from config */
-    if( !(setting = config_find_mounts()) ) {
-        log_warning("no mount points configuration");
-        goto EXIT;
+    if( state->what & SETTLE_GADGET ) {
+        if( state->udc_fd != -1 ) {
+            if( !modesetting_udc_is_configured(state->udc_fd) )
+                ready = false;
+        }
+        else if( !android_is_configured() ) {
+            ready = false;
+        }
     }
 
-    /* Split mountpoint list to array and count number of items */
-    array = g_strsplit(setting, ",", 0);
-    while( array[count] )
-        ++count;
+    if( state->link_fd != -1 )
+        network_link_monitor_drain(state->link_fd);
 
-    if( count < 1 ) {
-        log_warning("no mount points configured");
-        goto EXIT;
+    if( state->what & SETTLE_NETWORK_RUNNING ) {
+        if( !network_link_running(state->data) )
+            ready = false;
+    }
+    else if( state->what & SETTLE_NETWORK_EXISTS ) {
+        if( !network_link_exists(state->data) )
+            ready = false;
     }
 
-    /* Convert into array of storage_info_t objects */
-    info = g_new0(storage_info_t, count + 1);
-
-    for( size_t i = 0; i < count; ++i ) {
-        const gchar *mountpnt = info[i].si_mountpoint = g_strdup(array[i]);
+    return ready;
+}
 
-        if( access(mountpnt, F_OK) == -1 ) {
-            log_warning("mountpoint %s does not exist", mountpnt);
-            goto EXIT;
-        }
+/** Wait for evidence that hardware / network has settled
+ *
+ * Replaces fixed delays: proceeds as soon as all requested conditions
+ * that can be observed are met, and uses the old delay as time limit.
+ * If none of the conditions can be observed, just sleeps the full
+ * ceiling time like before.
+ *
+ * @param data        dynamic mode data
+ * @param what        bitmask of settle_t conditions to wait for
+ * @param ceiling_ms  maximum time to wait [ms]
+ *
+ * @return true if waiting finished, false if it was canceled
+ */
+static bool modesetting_settle(const modedata_t *data, unsigned what, unsigned ceiling_ms)
+{
+    LOG_REGISTER_CONTEXT;
 
-        const gchar *mountdev = info[i].si_mountdevice = modesetting_mountdev(mountpnt);
+    bool            ack   = false;
+    settle_state_t  state = {
+        .data    = data,
+        .what    = 0,
+        .udc_fd  = -1,
+        .link_fd = -1,
+    };
+    struct pollfd   fds[2];
+    size_t          count = 0;
 
-        if( !mountdev ) {
-            log_warning("can't find device for %s", mountpnt);
-            goto EXIT;
+    if( what & SETTLE_GADGET ) {
+        if( android_in_use() ) {
+            /* State changes are signaled from udev tracking */
+            state.what |= SETTLE_GADGET;
         }
+        else if( (state.udc_fd = modesetting_open_udc_state()) != -1 ) {
+            state.what |= SETTLE_GADGET;
+            fds[count++] = (struct pollfd){ .fd = state.udc_fd, .events = POLLPRI };
+        }
+    }
 
-        if( access(mountdev, F_OK) == -1 ) {
-            log_warning("mount device %s does not exist", mountdev);
-            goto EXIT;
+    if( what & (SETTLE_NETWORK_EXISTS | SETTLE_NETWORK_RUNNING) ) {
+        if( (state.link_fd = network_link_monitor_open()) != -1 ) {
+            state.what |= what & (SETTLE_NETWORK_EXISTS | SETTLE_NETWORK_RUNNING);
+            fds[count++] = (struct pollfd){ .fd = state.link_fd, .events = POLLIN };
         }
     }
 
-    ack = true;
+    if( !state.what ) {
+        ack = common_msleep(ceiling_ms);
+        goto EXIT;
+    }
 
-EXIT:
-    if( !ack )
-        modesetting_free_storage_info(info), info = 0, count = 0;
+    int64_t t0 = common_get_monotonic_us();
+
+    switch( common_wait_fds(ceiling_ms, fds, count,
+                            modesetting_settle_ready_cb, &state) ) {
+    case WAIT_READY:
+        log_debug("settled in %lld ms",
+                  (long long)(common_get_monotonic_us() - t0) / 1000);
+        ack = true;
+        break;
+    case WAIT_TIMEOUT:
+        log_debug("not settled in %u ms; proceeding anyway", ceiling_ms);
+        ack = true;
+        break;
+    default:
+        break;
+    }
 
-    g_strfreev(array);
-    g_free(setting);
+EXIT:
+    if( state.link_fd != -1 )
+        close(state.link_fd);
+    if( state.udc_fd != -1 )
+        close(state.udc_fd);
 
-    return *pcount = count, info;
+    return ack;
 }
 
 static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
@@ -436,6 +1241,7 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
     size_t          count = 0;
     storage_info_t *info  = 0;
     int             nofua = 0;
+    unmount_pool_t *pool  = &modesetting_unmount_pool;
 
     char tmp[256];
 
@@ -455,62 +1261,51 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
         count = 1;
     }
 
-    /* Umount filesystems */
-    for( size_t i = 0 ; i < count; ++i )
-    {
-        const gchar *mountpnt = info[i].si_mountpoint;
-        for( int tries = 0; ; ) {
-
-            if( !modesetting_is_mounted(mountpnt) ) {
-                log_debug("%s is not mounted", mountpnt);
-                break;
-            }
-
-            if( modesetting_unmount(mountpnt) ) {
-                log_debug("unmounted %s", mountpnt);
-                break;
-            }
-
-            if( ++tries == 3 ) {
-                log_err("failed to unmount %s - giving up", mountpnt);
-                modesetting_report_mass_storage_blocker(mountpnt, 2);
-                umdbus_send_error_signal(UMOUNT_ERROR);
-                goto EXIT;
-            }
-
-            log_warning("failed to unmount %s - wait a bit", mountpnt);
-            modesetting_report_mass_storage_blocker(mountpnt, 1);
-            common_sleep(1);
-        }
-    }
+    /* Umount filesystems in parallel */
+    modesetting_unmount_pool_start(pool, info, count);
 
     /* Backend specific actions */
-    if( android_in_use() ) {
-        const gchar *mountdev = info[0].si_mountdevice;
-        android_set_enabled(false);
-        android_set_function("mass_storage");
-        android_set_attr("f_mass_storage", "lun/nofua", nofua ? "1" : "0");
-        android_set_attr("f_mass_storage", "lun/file", mountdev);
-        android_set_enabled(true);
-    }
-    else if( configfs_in_use() ) {
+    if( configfs_in_use() ) {
+        /* Prepare luns while unmounting is still in progress */
+        latency_phase("lun_setup");
         configfs_set_udc(false);
         configfs_set_function(0);
 
         for( size_t i = 0 ; i < count; ++i ) {
-            const gchar *mountdev = info[i].si_mountdevice;
             if( configfs_add_mass_storage_lun(i) ) {
                 configfs_set_mass_storage_attr(i, "cdrom", "0");
                 configfs_set_mass_storage_attr(i, "nofua", nofua ? "1" : "0");
                 configfs_set_mass_storage_attr(i, "removable", "1");
                 configfs_set_mass_storage_attr(i, "ro", "0");
-                configfs_set_mass_storage_attr(i, "file", mountdev);
             }
         }
+
+        /* Attach backing devices as soon as they become available */
+        latency_phase("unmount");
+        for( size_t i = 0 ; i < count; ++i ) {
+            if( !modesetting_unmount_pool_wait(pool, i) )
+                goto EXIT;
+            configfs_set_mass_storage_attr(i, "file", info[i].si_mountdevice);
+        }
         configfs_set_function("mass_storage");
         configfs_set_udc(true);
     }
+    else if( android_in_use() ) {
+        const gchar *mountdev = info[0].si_mountdevice;
+        latency_phase("unmount");
+        if( !modesetting_unmount_pool_wait_all(pool) )
+            goto EXIT;
+        android_set_enabled(false);
+        android_set_function("mass_storage");
+        android_set_attr("f_mass_storage", "lun/nofua", nofua ? "1" : "0");
+        android_set_attr("f_mass_storage", "lun/file", mountdev);
+        android_set_enabled(true);
+    }
     else if( modules_in_use() ) {
+        latency_phase("unmount");
+        if( !modesetting_unmount_pool_wait_all(pool) )
+            goto EXIT;
+
         /* check if the file storage module has been loaded with sufficient luns in the parameter,
          * if not, unload and reload or load it. Since  mountpoints start at 0 the amount of them is one more than their id */
 
@@ -518,18 +1313,19 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
                  "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/file",
                  count - 1);
 
-        if( access(tmp, R_OK) == -1 )
+        char real[PATH_MAX];
+        if( access(common_sysroot_path(tmp, real, sizeof real), R_OK) == -1 )
         {
             log_debug("%s does not exist, unloading and reloading mass_storage\n", tmp);
             modules_unload_module(MODULE_MASS_STORAGE);
-            snprintf(tmp, sizeof tmp, "modprobe %s luns=%zd", MODULE_MASS_STORAGE, count);
-            log_debug("usb-load command = %s", tmp);
-            if( common_system(tmp) != 0 )
+            snprintf(tmp, sizeof tmp, "luns=%zd", count);
+            if( common_spawn(COMMON_SPAWN_TIMEOUT_MS, "modprobe",
+                             MODULE_MASS_STORAGE, tmp) != 0 )
                 goto EXIT;
         }
 
-        /* activate mounts after sleeping 1s to be sure enumeration happened and autoplay will work in windows*/
-        common_sleep(1);
+        /* activate mounts after enumeration has happened to be sure autoplay will work in windows */
+        modesetting_settle(data, SETTLE_GADGET, 1000);
 
         for( size_t i = 0 ; i < count; ++i ) {
             const gchar *mountdev = info[i].si_mountdevice;
@@ -552,6 +1348,7 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
 
 EXIT:
 
+    modesetting_unmount_pool_stop(pool);
     modesetting_free_storage_info(info);
 
     if( ack ) {
@@ -663,43 +1460,365 @@ EXIT:
     return ack;
 }
 
-static void modesetting_report_mass_storage_blocker(const char *mountpoint, int try)
+static void modesetting_report_mass_storage_blocker(unmount_job_t *job, int try)
 {
     LOG_REGISTER_CONTEXT;
 
-    FILE *stream = 0;
-    gchar *lsof_command = 0;
-    int count = 0;
+    const char *mountpoint = job->uj_mountpoint;
 
-    lsof_command = g_strconcat("lsof ", mountpoint, NULL);
-
-    if( (stream = common_popen(lsof_command, "r")) )
-    {
-        char *text = 0;
-        size_t size = 0;
+    /* Scanning /proc can take a while, allow the pool to cut it short */
+    GPtrArray *blockers = blocker_scan(mountpoint,
+                                       modesetting_unmount_pool_canceled_cb,
+                                       job->uj_pool);
 
-        while( getline(&text, &size, stream) >= 0 )
-        {
-            /* skip the first line as it does not contain process info */
-            if(count != 0)
-            {
-                gchar **split = 0;
-                split = g_strsplit((const gchar*)text, " ", 2);
-                log_err("Mass storage blocked by process %s\n", split[0]);
-                umdbus_send_error_signal(split[0]);
-                g_strfreev(split);
-            }
-            count++;
+    if( blockers ) {
+        for( guint i = 0; i < blockers->len; ++i ) {
+            const blocker_t *blocker = g_ptr_array_index(blockers, i);
+            log_err("Mass storage blocked by process %s (pid=%d): %s",
+                    blocker->bl_name, (int)blocker->bl_pid, blocker->bl_path);
+            /* Legacy clients expect process name as error string */
+            umdbus_send_error_signal(blocker->bl_name);
         }
-        pclose(stream);
-        free(text);
+        umdbus_send_storage_blockers_signal(mountpoint, blockers);
+        g_ptr_array_unref(blockers);
     }
-    g_free(lsof_command);
+
     if(try == 2)
         log_err("Setting Mass storage blocked. Giving up.\n");
 
 }
 
+/** Check whether an unmount pool has been canceled
+ *
+ * @param aptr  unmount pool as void pointer
+ *
+ * @return true if pool threads should stop, false otherwise
+ */
+static bool modesetting_unmount_pool_canceled_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unmount_pool_t *pool     = aptr;
+    bool            canceled = false;
+
+    pthread_mutex_lock(&pool->up_mutex);
+    canceled = pool->up_cancel;
+    pthread_mutex_unlock(&pool->up_mutex);
+
+    return canceled;
+}
+
+/** Wait for cancellation of an unmount pool
+ *
+ * @param pool  unmount pool
+ * @param ms    maximum time to wait [ms]
+ *
+ * @return true if the full time was waited, false if pool was canceled
+ */
+static bool modesetting_unmount_pool_sleep(unmount_pool_t *pool, unsigned ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct timespec ts;
+    bool            canceled = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec  += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if( ts.tv_nsec >= 1000000000L ) {
+        ts.tv_nsec -= 1000000000L;
+        ts.tv_sec  += 1;
+    }
+
+    pthread_mutex_lock(&pool->up_mutex);
+    while( !pool->up_cancel ) {
+        if( pthread_cond_timedwait(&pool->up_cond, &pool->up_mutex, &ts) == ETIMEDOUT )
+            break;
+    }
+    canceled = pool->up_cancel;
+    pthread_mutex_unlock(&pool->up_mutex);
+
+    return !canceled;
+}
+
+/** Unmount one filesystem, retrying while it is busy
+ *
+ * @param job  unmount job
+ */
+static void modesetting_unmount_job_run(unmount_job_t *job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *mountpnt = job->uj_mountpoint;
+    int64_t     begin_us = common_get_monotonic_us();
+
+    for( ;; ) {
+        if( !modesetting_is_mounted(mountpnt) ) {
+            log_debug("%s is not mounted", mountpnt);
+            job->uj_success = true;
+            break;
+        }
+
+        if( modesetting_unmount(mountpnt) ) {
+            log_debug("unmounted %s", mountpnt);
+            job->uj_success = true;
+            break;
+        }
+
+        if( ++job->uj_tries == MODESETTING_UNMOUNT_TRIES ) {
+            log_err("failed to unmount %s - giving up", mountpnt);
+            modesetting_report_mass_storage_blocker(job, 2);
+            break;
+        }
+
+        log_warning("failed to unmount %s - wait a bit", mountpnt);
+        modesetting_report_mass_storage_blocker(job, 1);
+        if( !modesetting_unmount_pool_sleep(job->uj_pool, MODESETTING_UNMOUNT_RETRY_MS) )
+            break;
+    }
+
+    job->uj_duration_us = common_get_monotonic_us() - begin_us;
+    log_debug("%s: unmount %s in %lld ms, %d failed attempts", mountpnt,
+              job->uj_success ? "done" : "failed",
+              (long long)(job->uj_duration_us / 1000), job->uj_tries);
+}
+
+/** Pick up the next job to execute
+ *
+ * @param pool  unmount pool
+ * @param wait  true to block until a job is available
+ *
+ * @return job, or NULL if there are none left and wait is false
+ */
+static unmount_job_t *modesetting_unmount_pool_take(unmount_pool_t *pool, bool wait)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unmount_job_t *job = 0;
+
+    pthread_mutex_lock(&pool->up_mutex);
+    for( ;; ) {
+        if( !pool->up_cancel && pool->up_next < pool->up_count ) {
+            job = &pool->up_job[pool->up_next++];
+            pool->up_active += 1;
+            break;
+        }
+        if( !wait )
+            break;
+        pthread_cond_wait(&pool->up_cond, &pool->up_mutex);
+    }
+    pthread_mutex_unlock(&pool->up_mutex);
+
+    return job;
+}
+
+/** Execute a job and mark it finished
+ *
+ * @param pool  unmount pool
+ * @param job   job obtained via modesetting_unmount_pool_take()
+ */
+static void modesetting_unmount_pool_finish(unmount_pool_t *pool, unmount_job_t *job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modesetting_unmount_job_run(job);
+
+    pthread_mutex_lock(&pool->up_mutex);
+    job->uj_done = true;
+    pool->up_active -= 1;
+    pthread_cond_broadcast(&pool->up_cond);
+    pthread_mutex_unlock(&pool->up_mutex);
+
+    /* Wake up worker thread waiting in common_wait() */
+    common_wait_notify();
+}
+
+/** Unmount thread: wait for jobs and execute them
+ *
+ * @param aptr  unmount pool as void pointer
+ *
+ * @return NULL
+ */
+static void *modesetting_unmount_thread_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unmount_pool_t *pool = aptr;
+
+    for( ;; ) {
+        unmount_job_t *job = modesetting_unmount_pool_take(pool, true);
+        modesetting_unmount_pool_finish(pool, job);
+    }
+
+    return 0;
+}
+
+/** Ready callback for waiting unmount job to finish
+ *
+ * @param aptr  unmount job as void pointer
+ *
+ * @return true if job is finished, false otherwise
+ */
+static bool modesetting_unmount_job_done_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unmount_job_t *job  = aptr;
+    bool           done = false;
+
+    pthread_mutex_lock(&job->uj_pool->up_mutex);
+    done = job->uj_done;
+    pthread_mutex_unlock(&job->uj_pool->up_mutex);
+
+    return done;
+}
+
+/** Start unmounting filesystems in parallel
+ *
+ * Jobs are picked up in order, so that waiting for them in order
+ * yields the earliest possible completion of each.
+ *
+ * Threads are started as needed; ones left from earlier activations
+ * are reused.
+ *
+ * @param pool   idle unmount pool
+ * @param info   mountpoints to unmount
+ * @param count  number of entries in info
+ */
+static void modesetting_unmount_pool_start(unmount_pool_t *pool,
+                                           const storage_info_t *info,
+                                           size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !pool->up_initialized ) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&pool->up_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        pool->up_initialized = true;
+    }
+
+    unmount_job_t *job = g_malloc0_n(count + 1, sizeof *job);
+    for( size_t i = 0; i < count; ++i ) {
+        job[i].uj_pool       = pool;
+        job[i].uj_mountpoint = info[i].si_mountpoint;
+    }
+
+    pthread_mutex_lock(&pool->up_mutex);
+    pool->up_job    = job;
+    pool->up_count  = count;
+    pool->up_next   = 0;
+    pool->up_cancel = false;
+    pthread_cond_broadcast(&pool->up_cond);
+    pthread_mutex_unlock(&pool->up_mutex);
+
+    while( pool->up_threads < count &&
+           pool->up_threads < MODESETTING_UNMOUNT_THREADS_MAX ) {
+        pthread_t tid;
+        int err = pthread_create(&tid, 0, modesetting_unmount_thread_cb, pool);
+        if( err ) {
+            log_warning("failed to start unmount thread: %s", strerror(err));
+            break;
+        }
+        pthread_detach(tid);
+        pool->up_threads += 1;
+    }
+
+    /* Fall back to unmounting sequentially */
+    if( pool->up_threads == 0 ) {
+        while( (job = modesetting_unmount_pool_take(pool, false)) )
+            modesetting_unmount_pool_finish(pool, job);
+    }
+}
+
+/** Wait for an unmount job to finish
+ *
+ * @param pool  unmount pool
+ * @param i     job index
+ *
+ * @return true if filesystem got unmounted, false otherwise
+ */
+static bool modesetting_unmount_pool_wait(unmount_pool_t *pool, size_t i)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool           ack = false;
+    unmount_job_t *job = &pool->up_job[i];
+
+    waitres_t res = common_wait(MODESETTING_UNMOUNT_TIMEOUT_MS,
+                                modesetting_unmount_job_done_cb, job);
+    if( res != WAIT_READY ) {
+        log_warning("%s: unmount did not finish", job->uj_mountpoint);
+        /* Giving up is an unmount failure, bailing out is not */
+        if( res == WAIT_TIMEOUT )
+            umdbus_send_error_signal(UMOUNT_ERROR);
+        goto EXIT;
+    }
+
+    if( !job->uj_success ) {
+        umdbus_send_error_signal(UMOUNT_ERROR);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Wait for all unmount jobs to finish
+ *
+ * @param pool  unmount pool
+ *
+ * @return true if all filesystems got unmounted, false otherwise
+ */
+static bool modesetting_unmount_pool_wait_all(unmount_pool_t *pool)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; i < pool->up_count; ++i ) {
+        if( !modesetting_unmount_pool_wait(pool, i) )
+            return false;
+    }
+    return true;
+}
+
+/** Cancel unfinished unmount jobs and release them
+ *
+ * Waits for jobs in progress to finish, after which the pool
+ * threads go back to waiting for more work.
+ *
+ * @param pool  unmount pool
+ */
+static void modesetting_unmount_pool_stop(unmount_pool_t *pool)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !pool->up_job )
+        goto EXIT;
+
+    pthread_mutex_lock(&pool->up_mutex);
+    pool->up_cancel = true;
+    pthread_cond_broadcast(&pool->up_cond);
+
+    /* Jobs refer to storage info owned by the caller */
+    while( pool->up_active > 0 )
+        pthread_cond_wait(&pool->up_cond, &pool->up_mutex);
+
+    unmount_job_t *job = pool->up_job;
+    pool->up_job   = 0;
+    pool->up_count = 0;
+    pool->up_next  = 0;
+    pthread_mutex_unlock(&pool->up_mutex);
+
+    g_free(job);
+
+EXIT:
+    return;
+}
+
 bool modesetting_enter_dynamic_mode(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -740,6 +1859,7 @@ bool modesetting_enter_dynamic_mode(void)
 
     if( data->mass_storage ) {
         log_debug("Dynamic mode is mass storage");
+        latency_phase("mass_storage");
         ack = modesetting_enter_mass_storage_mode(data);
         goto EXIT;
     }
@@ -751,6 +1871,7 @@ bool modesetting_enter_dynamic_mode(void)
 #ifdef APP_SYNC
     if( data->appsync ) {
         log_debug("Dynamic mode is appsync: do pre actions");
+        latency_phase("appsync_pre");
         if( appsync_activate_pre(data->mode_name) != 0 ) {
             log_debug("Appsync failure");
             goto EXIT;
@@ -762,14 +1883,14 @@ bool modesetting_enter_dynamic_mode(void)
      * Configure gadget
      * - - - - - - - - - - - - - - - - - - - */
 
+    latency_phase("configure_gadget");
     if( configfs_in_use() ) {
         /* Configfs based gadget configuration */
-        configfs_set_function(data->sysfs_value);
-        configfs_set_productid(data->idProduct);
         char *id = config_get_android_vendor_id();
-        configfs_set_vendorid(data->idVendorOverride ?: id);
+        bool  ok = configfs_set_gadget(data->sysfs_value, data->idProduct,
+                                       data->idVendorOverride ?: id);
         free(id);
-        if( !configfs_set_udc(true) )
+        if( !ok )
             goto EXIT;
     }
     else if( android_in_use() ) {
@@ -803,11 +1924,10 @@ bool modesetting_enter_dynamic_mode(void)
     if(data->network)
     {
         log_debug("Dynamic mode is network");
+        latency_phase("network_up");
 #ifdef DEBIAN
-        char command[256];
-
-        g_snprintf(command, sizeof command, "ifdown %s ; ifup %s", data->cached_interface, data->cached_interface);
-        common_system(command);
+        common_spawn(COMMON_SPAWN_TIMEOUT_MS, "ifdown", data->cached_interface);
+        common_spawn(COMMON_SPAWN_TIMEOUT_MS, "ifup", data->cached_interface);
 #else
         network_down(data);
         int error = network_up(data);
@@ -815,7 +1935,12 @@ bool modesetting_enter_dynamic_mode(void)
         /* In case of failure, retry upto 3 times */
         for( int i = 0; error && i < 3; ++i ) {
             log_warning("Retry setting up the network");
-            if( !common_msleep(1000) )
+            /* Wait for the interface to appear, or just give it
+             * some time if it already exists */
+            unsigned what = SETTLE_NETWORK_EXISTS;
+            if( network_link_exists(data) )
+                what = 0;
+            if( !modesetting_settle(data, what, 1000) )
                 break;
             if( !(error = network_up(data)) )
                 log_warning("Setting up the network succeeded");
@@ -834,6 +1959,7 @@ bool modesetting_enter_dynamic_mode(void)
          * service is started based on appsync config - i.e. NOT
          * based on either nat or setting in modedata ...
          */
+        latency_phase("udhcpd_config");
         if( network_update_udhcpd_config(data) != 0 )
             goto EXIT;
     }
@@ -846,8 +1972,12 @@ bool modesetting_enter_dynamic_mode(void)
     if(data->appsync )
     {
         log_debug("Dynamic mode is appsync: do post actions");
-        /* let's sleep for a bit (350ms) to allow interfaces to settle before running postsync */
-        common_msleep(350);
+        latency_phase("appsync_post");
+        /* allow gadget and interfaces to settle before running postsync */
+        unsigned what = SETTLE_GADGET;
+        if( data->network )
+            what |= SETTLE_NETWORK_RUNNING;
+        modesetting_settle(data, what, 350);
         appsync_activate_post(data->mode_name);
     }
 
@@ -858,6 +1988,7 @@ bool modesetting_enter_dynamic_mode(void)
 #ifdef CONNMAN
     if( data->connman_tethering ) {
         log_debug("Dynamic mode is tethering");
+        latency_phase("tethering");
         if( !connman_set_tethering(data->connman_tethering, true) )
             goto EXIT;
     }
@@ -992,4 +2123,6 @@ void modesetting_quit(void)
     if( tracked_values ) {
         g_hash_table_unref(tracked_values), tracked_values = 0;
     }
+
+    modesetting_mountinfo_quit();
 }
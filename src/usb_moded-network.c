@@ -33,6 +33,7 @@
 
 #include "usb_moded-network.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
 #include "usb_moded-log.h"
@@ -41,6 +42,14 @@
 #include "usb_moded-dbus-private.h"
 
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
 
 #include <errno.h>
 #include <unistd.h>
@@ -53,6 +62,11 @@
 #define UDHCP_CONFIG_DIR        "/run/usb-moded"
 #define UDHCP_CONFIG_LINK       "/etc/udhcpd.conf"
 
+#define IPTABLES_RULES_PATH     "/run/usb-moded/iptables.rules"
+
+/** How long to wait for each rtnetlink reply before giving up [ms] */
+#define RTNL_REPLY_TIMEOUT_MS   2000
+
 /* ========================================================================= *
  * Types
  * ========================================================================= */
@@ -68,6 +82,30 @@ typedef struct ipforward_data_t
     char *nat_interface;
 } ipforward_data_t;
 
+/** Buffer for constructing rtnetlink requests */
+typedef struct rtnl_request_t
+{
+    struct nlmsghdr      hdr;
+    union {
+        struct ifinfomsg ifi;
+        struct ifaddrmsg ifa;
+        struct rtmsg     rtm;
+    };
+    char                 attrs[128];
+} rtnl_request_t;
+
+/** Context for collecting interface addresses via rtnetlink */
+typedef struct rtnl_addrlist_t
+{
+    /** Interface index to collect addresses for */
+    int     ifindex;
+    /** Copies of matching RTM_NEWADDR messages */
+    GSList *msgs;
+} rtnl_addrlist_t;
+
+/** Callback for handling rtnetlink dump replies */
+typedef void (*rtnl_dump_fn)(const struct nlmsghdr *msg, void *aptr);
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -113,6 +151,21 @@ bool          connman_set_tethering              (const char *technology, bool o
 static bool legacy_get_connection_data(ipforward_data_t *ipforward);
 #endif
 
+/* ------------------------------------------------------------------------- *
+ * RTNL
+ * ------------------------------------------------------------------------- */
+
+static void  rtnl_request_init          (rtnl_request_t *req, int type, int flags);
+static bool  rtnl_request_add_attr      (rtnl_request_t *req, int type, const void *data, size_t len);
+static bool  rtnl_transact              (rtnl_request_t *req, rtnl_dump_fn dump_cb, void *aptr);
+static bool  rtnl_set_link_up           (int ifindex, bool up);
+static void  rtnl_collect_addresses_cb  (const struct nlmsghdr *msg, void *aptr);
+static bool  rtnl_flush_addresses       (int ifindex);
+static bool  rtnl_add_address           (int ifindex, struct in_addr addr, struct in_addr mask);
+static bool  rtnl_add_default_route     (struct in_addr gateway);
+static void  rtnl_get_link_flags_cb     (const struct nlmsghdr *msg, void *aptr);
+static bool  rtnl_get_link_flags        (int ifindex, unsigned *flags);
+
 /* ------------------------------------------------------------------------- *
  * NETWORK
  * ------------------------------------------------------------------------- */
@@ -122,14 +175,21 @@ static char *network_get_interface        (const modedata_t *data);
 static char *network_get_nat_interface    (const modedata_t *data);
 static char *network_get_ip               (const modedata_t *data);
 static char *network_get_netmask          (const modedata_t *data);
+static bool  network_setup_iptables_batch(const char *interface, const char *nat_interface);
 static int   network_setup_ip_forwarding  (const modedata_t *data, ipforward_data_t *ipforward);
 static void  network_cleanup_ip_forwarding(void);
 static int   network_check_udhcpd_symlink (void);
+static bool  network_configure_address    (const char *interface, const char *address, const char *netmask);
+static bool  network_configure_gateway    (const char *gateway);
 static int   network_write_udhcpd_config  (const modedata_t *data, ipforward_data_t *ipforward);
 int          network_update_udhcpd_config (const modedata_t *data);
 int          network_up                   (const modedata_t *data);
 void         network_down                 (const modedata_t *data);
 void         network_update               (void);
+int          network_link_monitor_open    (void);
+void         network_link_monitor_drain   (int fd);
+bool         network_link_exists          (const modedata_t *data);
+bool         network_link_running         (const modedata_t *data);
 
 /* ========================================================================= *
  * IPFORWARD_DATA
@@ -788,6 +848,382 @@ EXIT:
 }
 #endif
 
+/* ========================================================================= *
+ * RTNL
+ * ========================================================================= */
+
+/** Initialize rtnetlink request buffer
+ *
+ * @param req    request buffer
+ * @param type   netlink message type
+ * @param flags  netlink message flags
+ */
+static void
+rtnl_request_init(rtnl_request_t *req, int type, int flags)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Requests can be made from both main and worker thread */
+    static uint32_t seq = 0;
+
+    memset(req, 0, sizeof *req);
+
+    req->hdr.nlmsg_type  = type;
+    req->hdr.nlmsg_flags = NLM_F_REQUEST | flags;
+    req->hdr.nlmsg_seq   = __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+
+    switch( type ) {
+    case RTM_NEWLINK:
+    case RTM_GETLINK:
+        req->hdr.nlmsg_len = NLMSG_LENGTH(sizeof req->ifi);
+        break;
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+    case RTM_GETADDR:
+        req->hdr.nlmsg_len = NLMSG_LENGTH(sizeof req->ifa);
+        break;
+    default:
+        req->hdr.nlmsg_len = NLMSG_LENGTH(sizeof req->rtm);
+        break;
+    }
+}
+
+/** Append attribute to rtnetlink request
+ *
+ * @param req   request buffer
+ * @param type  attribute type
+ * @param data  attribute data
+ * @param len   attribute data length
+ *
+ * @return true on success, false if request buffer is full
+ */
+static bool
+rtnl_request_add_attr(rtnl_request_t *req, int type, const void *data, size_t len)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t offs = NLMSG_ALIGN(req->hdr.nlmsg_len);
+    size_t size = RTA_LENGTH(len);
+
+    if( offs + RTA_ALIGN(size) > sizeof *req ) {
+        log_err("rtnetlink request buffer overflow");
+        return false;
+    }
+
+    struct rtattr *rta = (struct rtattr *)((char *)req + offs);
+    rta->rta_type = type;
+    rta->rta_len  = size;
+    memcpy(RTA_DATA(rta), data, len);
+
+    req->hdr.nlmsg_len = offs + RTA_ALIGN(size);
+    return true;
+}
+
+/** Send rtnetlink request and wait for reply
+ *
+ * @param req      request to send
+ * @param dump_cb  callback for handling dump replies, or NULL
+ * @param aptr     callback context
+ *
+ * If the kernel rejects the request, errno is left holding the reason.
+ * Rejecting NLM_F_EXCL requests with EEXIST is left for the caller
+ * to log as appropriate.
+ *
+ * @return true if kernel acknowledged the request, false otherwise
+ */
+static bool
+rtnl_transact(rtnl_request_t *req, rtnl_dump_fn dump_cb, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack   = false;
+    int  fd    = -1;
+    int  error = 0;
+
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+    struct timeval tmo = {
+        .tv_sec  = RTNL_REPLY_TIMEOUT_MS / 1000,
+        .tv_usec = RTNL_REPLY_TIMEOUT_MS % 1000 * 1000,
+    };
+
+    char buf[8192] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+
+    if( (fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) == -1 ) {
+        log_err("rtnetlink socket: %m");
+        goto EXIT;
+    }
+
+    /* Do not let a lost reply stall the caller indefinitely */
+    if( setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof tmo) == -1 ) {
+        log_err("rtnetlink SO_RCVTIMEO: %m");
+        goto EXIT;
+    }
+
+    if( sendto(fd, req, req->hdr.nlmsg_len, 0,
+               (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_err("rtnetlink send: %m");
+        goto EXIT;
+    }
+
+    for( ;; ) {
+        ssize_t rc = recv(fd, buf, sizeof buf, 0);
+
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                log_err("rtnetlink request %d: no reply in %d ms",
+                        req->hdr.nlmsg_type, RTNL_REPLY_TIMEOUT_MS);
+            else
+                log_err("rtnetlink recv: %m");
+            goto EXIT;
+        }
+
+        size_t len = rc;
+        for( struct nlmsghdr *msg = (struct nlmsghdr *)buf;
+             NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len) ) {
+            if( msg->nlmsg_seq != req->hdr.nlmsg_seq )
+                continue;
+
+            if( msg->nlmsg_type == NLMSG_DONE ) {
+                ack = true;
+                goto EXIT;
+            }
+
+            if( msg->nlmsg_type == NLMSG_ERROR ) {
+                const struct nlmsgerr *err = NLMSG_DATA(msg);
+                if( (error = -err->error) ) {
+                    errno = error;
+                    if( !(error == EEXIST &&
+                          (req->hdr.nlmsg_flags & NLM_F_EXCL)) )
+                        log_warning("rtnetlink request %d: %m",
+                                    req->hdr.nlmsg_type);
+                }
+                else {
+                    ack = true;
+                }
+                goto EXIT;
+            }
+
+            if( dump_cb )
+                dump_cb(msg, aptr);
+        }
+    }
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    if( error )
+        errno = error;
+
+    return ack;
+}
+
+/** Set network interface administrative state
+ *
+ * @param ifindex  interface index
+ * @param up       true to bring interface up, false to take it down
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+rtnl_set_link_up(int ifindex, bool up)
+{
+    LOG_REGISTER_CONTEXT;
+
+    rtnl_request_t req;
+
+    rtnl_request_init(&req, RTM_NEWLINK, NLM_F_ACK);
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index  = ifindex;
+    req.ifi.ifi_change = IFF_UP;
+    req.ifi.ifi_flags  = up ? IFF_UP : 0;
+
+    return rtnl_transact(&req, 0, 0);
+}
+
+/** Address dump callback for rtnl_flush_addresses()
+ *
+ * @param msg   RTM_NEWADDR message
+ * @param aptr  Context data (as rtnl_addrlist_t pointer)
+ */
+static void
+rtnl_collect_addresses_cb(const struct nlmsghdr *msg, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    rtnl_addrlist_t *list = aptr;
+
+    if( msg->nlmsg_type != RTM_NEWADDR )
+        goto EXIT;
+
+    const struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+    if( (int)ifa->ifa_index != list->ifindex || ifa->ifa_family != AF_INET )
+        goto EXIT;
+
+    /* Keep the whole message, it can be reused for deleting */
+    void *copy = g_malloc(msg->nlmsg_len);
+    memcpy(copy, msg, msg->nlmsg_len);
+    list->msgs = g_slist_prepend(list->msgs, copy);
+
+EXIT:
+    return;
+}
+
+/** Remove all ipv4 addresses from network interface
+ *
+ * @param ifindex  interface index
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+rtnl_flush_addresses(int ifindex)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool            ack  = false;
+    rtnl_request_t  req;
+    rtnl_addrlist_t list = { .ifindex = ifindex, .msgs = 0 };
+
+    rtnl_request_init(&req, RTM_GETADDR, NLM_F_DUMP);
+    req.ifa.ifa_family = AF_INET;
+
+    if( !rtnl_transact(&req, rtnl_collect_addresses_cb, &list) )
+        goto EXIT;
+
+    ack = true;
+
+    for( GSList *item = list.msgs; item; item = item->next ) {
+        const struct nlmsghdr *msg = item->data;
+
+        if( msg->nlmsg_len > sizeof req )
+            continue;
+
+        /* Reuse address data from dump, but with fresh header */
+        rtnl_request_init(&req, RTM_DELADDR, NLM_F_ACK);
+        memcpy(&req.ifa, NLMSG_DATA(msg), msg->nlmsg_len - NLMSG_HDRLEN);
+        req.hdr.nlmsg_len = msg->nlmsg_len;
+
+        if( !rtnl_transact(&req, 0, 0) )
+            ack = false;
+    }
+
+EXIT:
+    g_slist_free_full(list.msgs, g_free);
+
+    return ack;
+}
+
+/** Add ipv4 address to network interface
+ *
+ * @param ifindex  interface index
+ * @param addr     address
+ * @param mask     network mask
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+rtnl_add_address(int ifindex, struct in_addr addr, struct in_addr mask)
+{
+    LOG_REGISTER_CONTEXT;
+
+    rtnl_request_t req;
+    struct in_addr brd = { .s_addr = addr.s_addr | ~mask.s_addr };
+
+    rtnl_request_init(&req, RTM_NEWADDR,
+                      NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE);
+    req.ifa.ifa_family    = AF_INET;
+    req.ifa.ifa_prefixlen = __builtin_popcount(mask.s_addr);
+    req.ifa.ifa_scope     = RT_SCOPE_UNIVERSE;
+    req.ifa.ifa_index     = ifindex;
+
+    return (rtnl_request_add_attr(&req, IFA_LOCAL, &addr, sizeof addr) &&
+            rtnl_request_add_attr(&req, IFA_ADDRESS, &addr, sizeof addr) &&
+            rtnl_request_add_attr(&req, IFA_BROADCAST, &brd, sizeof brd) &&
+            rtnl_transact(&req, 0, 0));
+}
+
+/** Add ipv4 default route
+ *
+ * An already existing default route - such as cellular or wlan
+ * uplink - is left in place, like "route add default gw" does.
+ *
+ * @param gateway  gateway address
+ *
+ * @return true on success or if default route exists, false otherwise
+ */
+static bool
+rtnl_add_default_route(struct in_addr gateway)
+{
+    LOG_REGISTER_CONTEXT;
+
+    rtnl_request_t req;
+
+    rtnl_request_init(&req, RTM_NEWROUTE,
+                      NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL);
+    req.rtm.rtm_family   = AF_INET;
+    req.rtm.rtm_dst_len  = 0;
+    req.rtm.rtm_table    = RT_TABLE_MAIN;
+    req.rtm.rtm_protocol = RTPROT_BOOT;
+    req.rtm.rtm_scope    = RT_SCOPE_UNIVERSE;
+    req.rtm.rtm_type     = RTN_UNICAST;
+
+    if( !rtnl_request_add_attr(&req, RTA_GATEWAY, &gateway, sizeof gateway) )
+        return false;
+
+    if( rtnl_transact(&req, 0, 0) )
+        return true;
+
+    if( errno != EEXIST )
+        return false;
+
+    log_debug("default route already exists; not replaced");
+    return true;
+}
+
+/** Link query callback for rtnl_get_link_flags()
+ *
+ * @param msg   Netlink message
+ * @param aptr  Context data (as unsigned pointer)
+ */
+static void
+rtnl_get_link_flags_cb(const struct nlmsghdr *msg, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned *flags = aptr;
+
+    if( msg->nlmsg_type == RTM_NEWLINK ) {
+        const struct ifinfomsg *ifi = NLMSG_DATA(msg);
+        *flags = ifi->ifi_flags;
+    }
+}
+
+/** Get network interface flags
+ *
+ * @param ifindex  interface index
+ * @param flags    where to store IFF_xxx flags
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+rtnl_get_link_flags(int ifindex, unsigned *flags)
+{
+    LOG_REGISTER_CONTEXT;
+
+    rtnl_request_t req;
+
+    *flags = 0;
+
+    rtnl_request_init(&req, RTM_GETLINK, NLM_F_ACK);
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index  = ifindex;
+
+    return rtnl_transact(&req, rtnl_get_link_flags_cb, flags);
+}
+
 /* ========================================================================= *
  * NETWORK
  * ========================================================================= */
@@ -806,8 +1242,9 @@ network_interface_exists(char *interface)
     if(interface)
     {
         char path[PATH_MAX];
+        char real[PATH_MAX];
         snprintf(path, sizeof path, "/sys/class/net/%s", interface);
-        ack = (access(path, F_OK) == 0);
+        ack = (access(common_sysroot_path(path, real, sizeof real), F_OK) == 0);
     }
 
     return ack;
@@ -906,6 +1343,56 @@ network_get_netmask(const modedata_t *data)
     return netmask;
 }
 
+/** Add forwarding rules using single iptables-restore invocation
+ *
+ * @param interface      usb network interface
+ * @param nat_interface  interface to forward to
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+network_setup_iptables_batch(const char *interface, const char *nat_interface)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack   = false;
+    gchar  *rules = 0;
+    GError *err   = 0;
+
+    if( mkdir(UDHCP_CONFIG_DIR, 0775) == -1 && errno != EEXIST ) {
+        log_warning("%s: can't create directory: %m", UDHCP_CONFIG_DIR);
+        goto EXIT;
+    }
+
+    rules = g_strdup_printf("*nat\n"
+                            "-A POSTROUTING -o %s -j MASQUERADE\n"
+                            "COMMIT\n"
+                            "*filter\n"
+                            "-A FORWARD -i %s -o %s -m state --state RELATED,ESTABLISHED -j ACCEPT\n"
+                            "-A FORWARD -i %s -o %s -j ACCEPT\n"
+                            "COMMIT\n",
+                            nat_interface,
+                            nat_interface, interface,
+                            interface, nat_interface);
+
+    if( !g_file_set_contents(IPTABLES_RULES_PATH, rules, -1, &err) ) {
+        log_warning("%s: can't write: %s", IPTABLES_RULES_PATH, err->message);
+        goto EXIT;
+    }
+
+    if( common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/sbin/iptables-restore",
+                     "--noflush", IPTABLES_RULES_PATH) != 0 )
+        goto EXIT;
+
+    ack = true;
+
+EXIT:
+    g_clear_error(&err);
+    g_free(rules);
+
+    return ack;
+}
+
 /** Turn on ip forwarding on the usb interface
  *
  * To cleanup: #network_cleanup_ip_forwarding()
@@ -923,8 +1410,6 @@ network_setup_ip_forwarding(const modedata_t *data, ipforward_data_t *ipforward)
     char *interface     = 0;
     char *nat_interface = 0;
 
-    char command[256];
-
     if( !(interface = network_get_interface(data)) )
         goto EXIT;
 
@@ -939,14 +1424,22 @@ network_setup_ip_forwarding(const modedata_t *data, ipforward_data_t *ipforward)
 
     write_to_file("/proc/sys/net/ipv4/ip_forward", "1");
 
-    snprintf(command, sizeof command, "/sbin/iptables -t nat -A POSTROUTING -o %s -j MASQUERADE", nat_interface);
-    common_system(command);
-
-    snprintf(command, sizeof command, "/sbin/iptables -A FORWARD -i %s -o %s  -m state  --state RELATED,ESTABLISHED -j ACCEPT", nat_interface, interface);
-    common_system(command);
-
-    snprintf(command, sizeof command, "/sbin/iptables -A FORWARD -i %s -o %s -j ACCEPT", interface, nat_interface);
-    common_system(command);
+    /* Prefer adding all rules in one go, fall back to
+     * adding them one by one */
+    if( !network_setup_iptables_batch(interface, nat_interface) ) {
+        common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/sbin/iptables",
+                     "-t", "nat", "-A", "POSTROUTING", "-o", nat_interface,
+                     "-j", "MASQUERADE");
+
+        common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/sbin/iptables",
+                     "-A", "FORWARD", "-i", nat_interface, "-o", interface,
+                     "-m", "state", "--state", "RELATED,ESTABLISHED",
+                     "-j", "ACCEPT");
+
+        common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/sbin/iptables",
+                     "-A", "FORWARD", "-i", interface, "-o", nat_interface,
+                     "-j", "ACCEPT");
+    }
 
     log_debug("ipforwarding success!");
     failed = 0;
@@ -967,7 +1460,7 @@ network_cleanup_ip_forwarding(void)
 
     write_to_file("/proc/sys/net/ipv4/ip_forward", "0");
 
-    common_system("/sbin/iptables -F FORWARD");
+    common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/sbin/iptables", "-F", "FORWARD");
 }
 
 /** Validate udhcpd.conf symlink
@@ -997,6 +1490,79 @@ network_check_udhcpd_symlink(void)
     return ret;
 }
 
+/** Set interface address via rtnetlink
+ *
+ * Existing ipv4 addresses are removed and the interface is brought up,
+ * i.e. the end result is similar to what ifconfig would do.
+ *
+ * @param interface  network interface name
+ * @param address    ipv4 address in dotted notation
+ * @param netmask    ipv4 network mask in dotted notation
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+network_configure_address(const char *interface, const char *address,
+                          const char *netmask)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool           ack     = false;
+    int            ifindex = 0;
+    struct in_addr addr    = { 0 };
+    struct in_addr mask    = { 0 };
+
+    if( !(ifindex = if_nametoindex(interface)) ) {
+        log_warning("%s: can't get interface index: %m", interface);
+        goto EXIT;
+    }
+
+    if( inet_pton(AF_INET, address, &addr) != 1 ) {
+        log_warning("%s: invalid address", address);
+        goto EXIT;
+    }
+
+    if( inet_pton(AF_INET, netmask, &mask) != 1 ) {
+        log_warning("%s: invalid netmask", netmask);
+        goto EXIT;
+    }
+
+    if( !rtnl_flush_addresses(ifindex) )
+        goto EXIT;
+
+    if( !rtnl_add_address(ifindex, addr, mask) )
+        goto EXIT;
+
+    if( !rtnl_set_link_up(ifindex, true) )
+        goto EXIT;
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Set default route via rtnetlink
+ *
+ * @param gateway  ipv4 gateway address in dotted notation
+ *
+ * @return true on success, false otherwise
+ */
+static bool
+network_configure_gateway(const char *gateway)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct in_addr addr = { 0 };
+
+    if( inet_pton(AF_INET, gateway, &addr) != 1 ) {
+        log_warning("%s: invalid gateway", gateway);
+        return false;
+    }
+
+    return rtnl_add_default_route(addr);
+}
+
 /** Write udhcpd.conf
  *
  * @param ipforward  NULL if we want a simple config, otherwise include dns info etc...
@@ -1174,8 +1740,6 @@ network_up(const modedata_t *data)
     gchar *netmask   = 0;
     gchar *gateway   = 0;
 
-    char command[256];
-
     if( !(interface = network_get_interface(data)) ) {
         log_err("no network interface");
         goto EXIT;
@@ -1198,25 +1762,27 @@ network_up(const modedata_t *data)
 
     if( !strcmp(address, "dhcp") )
     {
-        snprintf(command, sizeof command,"dhclient -d %s", interface);
-        if( common_system(command) != 0 ) {
-            snprintf(command, sizeof command,"udhcpc -i %s", interface);
-            if( common_system(command) != 0 )
+        if( common_spawn(COMMON_SPAWN_TIMEOUT_MS, "dhclient", "-d", interface) != 0 ) {
+            if( common_spawn(COMMON_SPAWN_TIMEOUT_MS, "udhcpc", "-i", interface) != 0 )
                 goto EXIT;
         }
     }
     else
     {
-        snprintf(command, sizeof command,"ifconfig %s %s netmask %s", interface, address, netmask);
-        if( common_system(command) != 0 )
+        if( network_configure_address(interface, address, netmask) )
+            log_debug("%s: address set via rtnetlink", interface);
+        else if( common_spawn(COMMON_SPAWN_TIMEOUT_MS, "ifconfig", interface,
+                              address, "netmask", netmask) != 0 )
             goto EXIT;
     }
 
     /* TODO: Check first if there is a gateway set */
     if( gateway )
     {
-        snprintf(command, sizeof command,"route add default gw %s", gateway);
-        if( common_system(command) != 0 )
+        if( network_configure_gateway(gateway) )
+            log_debug("%s: default route set via rtnetlink", gateway);
+        else if( common_spawn(COMMON_SPAWN_TIMEOUT_MS, "route", "add", "default",
+                              "gw", gateway) != 0 )
             goto EXIT;
     }
 
@@ -1248,13 +1814,12 @@ network_down(const modedata_t *data)
 
     gchar *interface = network_get_interface(data);
 
-    char command[256];
-
     log_debug("iface=%s nat=%d", interface ?: "n/a", data->nat);
 
     if( interface ) {
-        snprintf(command, sizeof command,"ifconfig %s down", interface);
-        common_system(command);
+        int ifindex = if_nametoindex(interface);
+        if( !ifindex || !rtnl_set_link_up(ifindex, false) )
+            common_spawn(COMMON_SPAWN_TIMEOUT_MS, "ifconfig", interface, "down");
     }
 
     /* dhcp client shutdown happens on disconnect automatically */
@@ -1274,18 +1839,109 @@ network_update(void)
     LOG_REGISTER_CONTEXT;
 
     if( control_get_cable_state() == CABLE_STATE_PC_CONNECTED ) {
-        modedata_t *data = worker_dup_usb_mode_data();
-        if( data && data->network ) {
+        const modedata_t *data  = worker_ref_usb_mode_data();
+        modedata_t       *fresh = 0;
+        if( data && data->network && (fresh = modedata_copy(data)) ) {
             /* Bring down using old config */
             network_down(data);
 
             /* Update config */
-            modedata_cache_settings(data);
-            worker_set_usb_mode_data(data);
+            modedata_cache_settings(fresh);
+            worker_set_usb_mode_data(fresh);
 
-            /* Bring up using old config */
-            network_up(data);
+            /* Bring up using new config */
+            network_up(fresh);
         }
-        modedata_free(data);
+        modedata_unref(fresh);
+        modedata_unref(data);
+    }
+}
+
+/** Open rtnetlink socket for receiving link state changes
+ *
+ * @return socket file descriptor, or -1 on failure
+ */
+int
+network_link_monitor_open(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct sockaddr_nl sa = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_LINK,
+    };
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                    NETLINK_ROUTE);
+    if( fd == -1 ) {
+        log_err("rtnetlink socket: %m");
+    }
+    else if( bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_err("rtnetlink bind: %m");
+        close(fd), fd = -1;
     }
+
+    return fd;
+}
+
+/** Discard pending link state change messages
+ *
+ * Link state is re-queried on activity, so the content
+ * of the notifications does not matter.
+ *
+ * @param fd  socket from network_link_monitor_open()
+ */
+void
+network_link_monitor_drain(int fd)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char buf[4096];
+
+    while( recv(fd, buf, sizeof buf, 0) > 0 ) {
+        /* nop */
+    }
+}
+
+/** Check if network interface for mode exists
+ *
+ * @param data  Dynamic mode data
+ *
+ * @return true if interface exists, false otherwise
+ */
+bool
+network_link_exists(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *interface = network_get_interface(data);
+    bool  exists    = network_interface_exists(interface);
+
+    g_free(interface);
+    return exists;
+}
+
+/** Check if network interface for mode is up and running
+ *
+ * @param data  Dynamic mode data
+ *
+ * @return true if interface has IFF_UP and IFF_RUNNING set, false otherwise
+ */
+bool
+network_link_running(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool      running   = false;
+    char     *interface = network_get_interface(data);
+    int       ifindex   = interface ? (int)if_nametoindex(interface) : 0;
+    unsigned  flags     = 0;
+
+    if( ifindex > 0 && rtnl_get_link_flags(ifindex, &flags) )
+        running = (flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING);
+
+    log_debug("%s: %s", interface ?: "n/a", running ? "running" : "not running");
+
+    g_free(interface);
+    return running;
 }
@@ -50,5 +50,9 @@ int  network_update_udhcpd_config(const modedata_t *data);
 int  network_up                  (const modedata_t *data);
 void network_down                (const modedata_t *data);
 void network_update              (void);
+int  network_link_monitor_open   (void);
+void network_link_monitor_drain  (int fd);
+bool network_link_exists         (const modedata_t *data);
+bool network_link_running        (const modedata_t *data);
 
 #endif /* USB_MODED_NETWORK_H_ */
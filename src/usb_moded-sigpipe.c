@@ -104,8 +104,6 @@ EXIT:
 static void
 sigpipe_trap_signal_cb(int sig)
 {
-    LOG_REGISTER_CONTEXT;
-
     /* NOTE: This function *MUST* be kept async-signal-safe! */
 
     static volatile int exit_tries = 0;
@@ -188,6 +186,7 @@ sigpipe_trap_signals(void)
         SIGQUIT,
         SIGTERM,
         SIGHUP,
+        SIGUSR1,
         -1
     };
 
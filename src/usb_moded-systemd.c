@@ -25,28 +25,104 @@
 
 #include "usb_moded-systemd.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 
+#include <unistd.h>
+#include <pthread.h>
+
 /* ========================================================================= *
  * Constants
  * ========================================================================= */
 
-#define SYSTEMD_DBUS_SERVICE   "org.freedesktop.systemd1"
-#define SYSTEMD_DBUS_PATH      "/org/freedesktop/systemd1"
-#define SYSTEMD_DBUS_INTERFACE "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_DBUS_SERVICE     "org.freedesktop.systemd1"
+#define SYSTEMD_DBUS_PATH        "/org/freedesktop/systemd1"
+#define SYSTEMD_DBUS_INTERFACE   "org.freedesktop.systemd1.Manager"
+#define SYSTEMD_DBUS_SUBSCRIBE   "Subscribe"
+#define SYSTEMD_DBUS_JOB_REMOVED "JobRemoved"
+
+#define SYSTEMD_JOB_REMOVED_MATCH\
+    "type='signal'"\
+    ",sender='"SYSTEMD_DBUS_SERVICE"'"\
+    ",interface='"SYSTEMD_DBUS_INTERFACE"'"\
+    ",member='"SYSTEMD_DBUS_JOB_REMOVED"'"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Book keeping for one unit control request made as part of a batch
+ */
+typedef struct systemd_job_t
+{
+    /** Name of the unit to control */
+    gchar           *unit;
+
+    /** Pending StartUnit/StopUnit method call, or NULL */
+    DBusPendingCall *pc;
+
+    /** Flag for: Method call reply has been processed */
+    bool             replied;
+
+    /** Job object path from method call reply, or NULL */
+    gchar           *path;
+
+    /** Result from JobRemoved signal, or NULL */
+    gchar           *result;
+
+    /** Flag for: No further state changes are expected */
+    bool             done;
+} systemd_job_t;
+
+/** Set of unit control requests that are executed in parallel
+ */
+struct systemd_batch_t
+{
+    /** StartUnit or StopUnit */
+    const char *method;
+
+    /** Array of systemd_job_t pointers */
+    GPtrArray  *jobs;
+};
 
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_JOB
+ * ------------------------------------------------------------------------- */
+
+static systemd_job_t *systemd_job_create   (const char *unit);
+static void           systemd_job_delete   (systemd_job_t *self);
+static void           systemd_job_delete_cb(gpointer self);
+static bool           systemd_job_succeeded(const systemd_job_t *self);
+static void           systemd_job_take_reply_locked(systemd_job_t *self);
+
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_BATCH
+ * ------------------------------------------------------------------------- */
+
+systemd_batch_t      *systemd_batch_create       (const char *method);
+void                  systemd_batch_delete       (systemd_batch_t *self);
+void                  systemd_batch_add_unit     (systemd_batch_t *self, const char *unit);
+size_t                systemd_batch_count        (const systemd_batch_t *self);
+static systemd_job_t *systemd_batch_find_job_locked(DBusPendingCall *pc, const char *path, const char *unit);
+static void           systemd_batch_reply_cb     (DBusPendingCall *pc, void *aptr);
+static bool           systemd_batch_done_p       (void *aptr);
+bool                  systemd_batch_execute      (systemd_batch_t *self, unsigned timeout_ms);
+bool                  systemd_batch_unit_ok      (const systemd_batch_t *self, const char *unit);
+
 /* ------------------------------------------------------------------------- *
  * SYSTEMD
  * ------------------------------------------------------------------------- */
 
-gboolean systemd_control_service(const char *name, const char *method);
-gboolean systemd_control_start  (void);
-void     systemd_control_stop   (void);
+static DBusHandlerResult systemd_dbus_filter_cb (DBusConnection *con, DBusMessage *msg, void *aptr);
+static void              systemd_subscribe      (void);
+gboolean                 systemd_control_service(const char *name, const char *method);
+gboolean                 systemd_control_start  (void);
+void                     systemd_control_stop   (void);
 
 /* ========================================================================= *
  * Data
@@ -55,10 +131,466 @@ void     systemd_control_stop   (void);
 /* SystemBus connection ref used for systemd control ipc */
 static DBusConnection *systemd_con = NULL;
 
+/** Batches that are currently executing
+ *
+ * Accessed from worker thread executing batches and from mainloop
+ * handling method call replies and systemd signals.
+ */
+static GSList *systemd_batches = NULL;
+
+/** Mutex for protecting systemd_batches and the job states */
+static pthread_mutex_t systemd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SYSTEMD_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&systemd_mutex) != 0 ) { \
+        log_crit("SYSTEMD LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define SYSTEMD_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&systemd_mutex) != 0 ) { \
+        log_crit("SYSTEMD UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_JOB
+ * ------------------------------------------------------------------------- */
+
+static systemd_job_t *
+systemd_job_create(const char *unit)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_t *self = g_malloc0(sizeof *self);
+
+    self->unit    = g_strdup(unit);
+    self->pc      = 0;
+    self->replied = false;
+    self->path    = 0;
+    self->result  = 0;
+    self->done    = false;
+
+    return self;
+}
+
+static void
+systemd_job_delete(systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        if( self->pc ) {
+            dbus_pending_call_cancel(self->pc);
+            dbus_pending_call_unref(self->pc);
+        }
+        g_free(self->unit);
+        g_free(self->path);
+        g_free(self->result);
+        g_free(self);
+    }
+}
+
+static void
+systemd_job_delete_cb(gpointer self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_delete(self);
+}
+
+static bool
+systemd_job_succeeded(const systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (!g_strcmp0(self->result, "done") ||
+            !g_strcmp0(self->result, "skipped"));
+}
+
+/** Process reply to StartUnit/StopUnit method call, if available
+ *
+ * Normally called via pending call notification from mainloop, but
+ * the reply can get dispatched before the worker thread gets to set
+ * up the notification -> also the worker thread checks for replies
+ * while waiting, and whichever thread sees it first handles it.
+ *
+ * @param self  job object
+ */
+static void
+systemd_job_take_reply_locked(systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage *rsp  = 0;
+    DBusError    err  = DBUS_ERROR_INIT;
+    const char  *path = 0;
+
+    if( self->replied || !self->pc ||
+        !dbus_pending_call_get_completed(self->pc) )
+        goto EXIT;
+
+    self->replied = true;
+
+    if( !(rsp = dbus_pending_call_steal_reply(self->pc)) ) {
+        log_err("%s: no reply to systemd unit control request", self->unit);
+    }
+    else if( dbus_set_error_from_message(&err, rsp) ||
+             !dbus_message_get_args(rsp, &err,
+                                    DBUS_TYPE_OBJECT_PATH, &path,
+                                    DBUS_TYPE_INVALID) ) {
+        log_err("%s: systemd unit control request failed: %s: %s",
+                self->unit, err.name, err.message);
+        path = 0;
+    }
+
+    log_debug("%s: job %s", self->unit, path ?: "n/a");
+    if( path && !self->path )
+        self->path = g_strdup(path);
+    else if( !path )
+        self->done = true;
+
+EXIT:
+    dbus_error_free(&err);
+    if( rsp )
+        dbus_message_unref(rsp);
+}
+
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_BATCH
+ * ------------------------------------------------------------------------- */
+
+/** Create a batch of unit control requests
+ *
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @return batch object, to be released with systemd_batch_delete()
+ */
+systemd_batch_t *
+systemd_batch_create(const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_batch_t *self = g_malloc0(sizeof *self);
+
+    self->method = method;
+    self->jobs   = g_ptr_array_new_with_free_func(systemd_job_delete_cb);
+
+    return self;
+}
+
+void
+systemd_batch_delete(systemd_batch_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        g_ptr_array_free(self->jobs, TRUE);
+        g_free(self);
+    }
+}
+
+void
+systemd_batch_add_unit(systemd_batch_t *self, const char *unit)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_ptr_array_add(self->jobs, systemd_job_create(unit));
+}
+
+size_t
+systemd_batch_count(const systemd_batch_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return self ? self->jobs->len : 0;
+}
+
+/** Locate job from currently executing batches
+ *
+ * @param pc    pending method call to match, or NULL
+ * @param path  job object path to match, or NULL
+ * @param unit  unit name to match job with yet unknown path, or NULL
+ *
+ * @return job object, or NULL if not found
+ */
+static systemd_job_t *
+systemd_batch_find_job_locked(DBusPendingCall *pc, const char *path,
+                              const char *unit)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( GSList *item = systemd_batches; item; item = item->next ) {
+        systemd_batch_t *batch = item->data;
+        for( guint i = 0; i < batch->jobs->len; ++i ) {
+            systemd_job_t *job = g_ptr_array_index(batch->jobs, i);
+            if( job->done )
+                continue;
+            if( pc && job->pc == pc )
+                return job;
+            if( path && !g_strcmp0(job->path, path) )
+                return job;
+            if( unit && !job->path && !g_strcmp0(job->unit, unit) )
+                return job;
+        }
+    }
+    return 0;
+}
+
+/** Handle reply to StartUnit/StopUnit method call
+ *
+ * Called from mainloop.
+ *
+ * @param pc    pending call object
+ * @param aptr  (unused)
+ */
+static void
+systemd_batch_reply_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    SYSTEMD_LOCKED_ENTER;
+    systemd_job_t *job = systemd_batch_find_job_locked(pc, 0, 0);
+    if( job )
+        systemd_job_take_reply_locked(job);
+    SYSTEMD_LOCKED_LEAVE;
+
+    common_wait_notify();
+}
+
+/** Predicate for: All jobs in a batch are finished
+ *
+ * Also picks up method call replies that were dispatched before
+ * notification callback could be attached to the pending call.
+ *
+ * @param aptr  batch object (as void pointer)
+ *
+ * @return true if batch is done, false otherwise
+ */
+static bool
+systemd_batch_done_p(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const systemd_batch_t *self = aptr;
+    bool                   done = true;
+
+    SYSTEMD_LOCKED_ENTER;
+    for( guint i = 0; done && i < self->jobs->len; ++i ) {
+        systemd_job_t *job = g_ptr_array_index(self->jobs, i);
+        if( !job->done )
+            systemd_job_take_reply_locked(job);
+        done = job->done;
+    }
+    SYSTEMD_LOCKED_LEAVE;
+
+    return done;
+}
+
+/** Execute all unit control requests in a batch in parallel
+ *
+ * All method calls are made at once, after which the function
+ * blocks until systemd reports all the jobs finished, or the
+ * timeout is reached.
+ *
+ * Replies to the method calls themselves - i.e. jobs getting
+ * queued - are waited for at most SYSTEMD_CONTROL_TIMEOUT_MS.
+ *
+ * Must be called from the worker thread: replies and signals are
+ * handled in the mainloop.
+ *
+ * @param self        batch object
+ * @param timeout_ms  maximum time to wait for the jobs to finish [ms]
+ *
+ * @return true if all jobs finished successfully, false otherwise
+ */
+bool
+systemd_batch_execute(systemd_batch_t *self, unsigned timeout_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack = true;
+    int64_t t0  = common_get_monotonic_us();
+
+    if( !systemd_con ) {
+        log_err("not connected to system bus; skip systemd unit control");
+        return false;
+    }
+
+    SYSTEMD_LOCKED_ENTER;
+    systemd_batches = g_slist_prepend(systemd_batches, self);
+    SYSTEMD_LOCKED_LEAVE;
+
+    for( guint i = 0; i < self->jobs->len; ++i ) {
+        systemd_job_t   *job = g_ptr_array_index(self->jobs, i);
+        DBusMessage     *req = 0;
+        DBusPendingCall *pc  = 0;
+        const char      *arg = "replace";
+
+        log_debug("%s(%s) ...", self->method, job->unit);
+
+        req = dbus_message_new_method_call(SYSTEMD_DBUS_SERVICE,
+                                           SYSTEMD_DBUS_PATH,
+                                           SYSTEMD_DBUS_INTERFACE,
+                                           self->method);
+        if( req &&
+            dbus_message_append_args(req,
+                                     DBUS_TYPE_STRING, &job->unit,
+                                     DBUS_TYPE_STRING, &arg,
+                                     DBUS_TYPE_INVALID) &&
+            dbus_connection_send_with_reply(systemd_con, req, &pc,
+                                            SYSTEMD_CONTROL_TIMEOUT_MS) && pc ) {
+            SYSTEMD_LOCKED_ENTER;
+            job->pc = pc;
+            SYSTEMD_LOCKED_LEAVE;
+            if( !dbus_pending_call_set_notify(pc, systemd_batch_reply_cb, 0, 0) ) {
+                SYSTEMD_LOCKED_ENTER;
+                job->done = true;
+                SYSTEMD_LOCKED_LEAVE;
+            }
+        }
+        else {
+            log_err("failed to send %s.%s(%s) request",
+                    SYSTEMD_DBUS_INTERFACE, self->method, job->unit);
+            if( pc )
+                dbus_pending_call_unref(pc);
+            SYSTEMD_LOCKED_ENTER;
+            job->done = true;
+            SYSTEMD_LOCKED_LEAVE;
+        }
+
+        if( req )
+            dbus_message_unref(req);
+    }
+
+    if( common_wait(timeout_ms, systemd_batch_done_p, self) != WAIT_READY )
+        log_warning("%s batch did not finish in time", self->method);
+
+    SYSTEMD_LOCKED_ENTER;
+    systemd_batches = g_slist_remove(systemd_batches, self);
+    for( guint i = 0; i < self->jobs->len; ++i ) {
+        systemd_job_t *job = g_ptr_array_index(self->jobs, i);
+        job->done = true;
+        if( !systemd_job_succeeded(job) ) {
+            log_warning("%s(%s) -> %s", self->method, job->unit,
+                        job->result ?: "timeout");
+            ack = false;
+        }
+    }
+    SYSTEMD_LOCKED_LEAVE;
+
+    log_debug("%s batch of %u units finished in %lld ms", self->method,
+              self->jobs->len,
+              (long long)(common_get_monotonic_us() - t0) / 1000);
+
+    return ack;
+}
+
+/** Check if a unit control request in finished batch was successful
+ *
+ * @param self  batch object
+ * @param unit  unit name
+ *
+ * @return true if the job finished successfully, false otherwise
+ */
+bool
+systemd_batch_unit_ok(const systemd_batch_t *self, const char *unit)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( guint i = 0; i < self->jobs->len; ++i ) {
+        const systemd_job_t *job = g_ptr_array_index(self->jobs, i);
+        if( !g_strcmp0(job->unit, unit) )
+            return systemd_job_succeeded(job);
+    }
+    return false;
+}
+
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD
+ * ------------------------------------------------------------------------- */
+
+/** D-Bus message filter for tracking systemd job completion
+ *
+ * @param con   dbus connection
+ * @param msg   message to be acted upon
+ * @param aptr  (unused)
+ *
+ * @return DBUS_HANDLER_RESULT_NOT_YET_HANDLED (other filters see the msg too)
+ */
+static DBusHandlerResult
+systemd_dbus_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)con;
+    (void)aptr;
+
+    dbus_uint32_t  id     = 0;
+    const char    *path   = 0;
+    const char    *unit   = 0;
+    const char    *result = 0;
+    DBusError      err    = DBUS_ERROR_INIT;
+
+    if( !dbus_message_is_signal(msg, SYSTEMD_DBUS_INTERFACE,
+                                SYSTEMD_DBUS_JOB_REMOVED) )
+        goto EXIT;
+
+    if( !dbus_message_get_args(msg, &err,
+                               DBUS_TYPE_UINT32, &id,
+                               DBUS_TYPE_OBJECT_PATH, &path,
+                               DBUS_TYPE_STRING, &unit,
+                               DBUS_TYPE_STRING, &result,
+                               DBUS_TYPE_INVALID) ) {
+        log_warning("failed to parse %s signal: %s: %s",
+                    SYSTEMD_DBUS_JOB_REMOVED, err.name, err.message);
+        goto EXIT;
+    }
+
+    SYSTEMD_LOCKED_ENTER;
+    systemd_job_t *job = systemd_batch_find_job_locked(0, path, unit);
+    if( job ) {
+        log_debug("%s: job %s -> %s", unit, path, result);
+        g_free(job->result), job->result = g_strdup(result);
+        job->done = true;
+    }
+    SYSTEMD_LOCKED_LEAVE;
+
+    if( job )
+        common_wait_notify();
+
+EXIT:
+    dbus_error_free(&err);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/** Ask systemd to broadcast job state changes
+ */
+static void
+systemd_subscribe(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage *req = dbus_message_new_method_call(SYSTEMD_DBUS_SERVICE,
+                                                    SYSTEMD_DBUS_PATH,
+                                                    SYSTEMD_DBUS_INTERFACE,
+                                                    SYSTEMD_DBUS_SUBSCRIBE);
+    if( req ) {
+        dbus_message_set_no_reply(req, TRUE);
+        if( !dbus_connection_send(systemd_con, req, 0) )
+            log_warning("failed to subscribe to systemd signals");
+        dbus_message_unref(req);
+    }
+}
+
 // QDBusObjectPath org.freedesktop.systemd1.Manager.StartUnit(QString name, QString mode)
 // QDBusObjectPath org.freedesktop.systemd1.Manager.StopUnit(QString name, QString mode)
 
@@ -101,7 +633,9 @@ gboolean systemd_control_service(const char *name, const char *method)
         goto EXIT;
     }
 
-    rsp = dbus_connection_send_with_reply_and_block(systemd_con, req, -1, &err);
+    rsp = dbus_connection_send_with_reply_and_block(systemd_con, req,
+                                                    SYSTEMD_CONTROL_TIMEOUT_MS,
+                                                    &err);
     if( !rsp ) {
         log_err("no reply to %s.%s request: %s: %s",
                 SYSTEMD_DBUS_INTERFACE,
@@ -159,6 +693,16 @@ systemd_control_start(void)
         log_err("Could not connect to dbus for systemd control\n");
         goto cleanup;
     }
+
+    /* Track job completion */
+    if( !dbus_connection_add_filter(systemd_con, systemd_dbus_filter_cb, 0, 0) ) {
+        log_err("Could not add systemd dbus filter");
+        dbus_connection_unref(systemd_con), systemd_con = 0;
+        goto cleanup;
+    }
+    dbus_bus_add_match(systemd_con, SYSTEMD_JOB_REMOVED_MATCH, 0);
+    systemd_subscribe();
+
     ack = TRUE;
 
 cleanup:
@@ -175,6 +719,9 @@ systemd_control_stop(void)
 
     if(systemd_con)
     {
+        dbus_connection_remove_filter(systemd_con, systemd_dbus_filter_cb, 0);
+        dbus_bus_remove_match(systemd_con, SYSTEMD_JOB_REMOVED_MATCH, 0);
+
         /* Let go of connection ref */
         dbus_connection_unref(systemd_con),
             systemd_con = 0;
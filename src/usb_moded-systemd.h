@@ -26,6 +26,7 @@
 # define USB_MODED_SYSTEMD_H_
 
 # include <glib.h>
+# include <stdbool.h>
 
 /* ========================================================================= *
  * Constants
@@ -34,10 +35,37 @@
 # define SYSTEMD_STOP   "StopUnit"
 # define SYSTEMD_START   "StartUnit"
 
+/** Time limit for systemd unit control requests [ms] */
+# define SYSTEMD_CONTROL_TIMEOUT_MS 10000
+
+/** Time limit for jobs started via systemd_batch_execute() to finish [ms]
+ *
+ * Matches systemd DefaultTimeoutStartSec, so that slow units are
+ * normally failed by systemd before usb-moded gives up waiting.
+ */
+# define SYSTEMD_JOB_TIMEOUT_MS 90000
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+typedef struct systemd_batch_t systemd_batch_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_BATCH
+ * ------------------------------------------------------------------------- */
+
+systemd_batch_t *systemd_batch_create  (const char *method);
+void             systemd_batch_delete  (systemd_batch_t *self);
+void             systemd_batch_add_unit(systemd_batch_t *self, const char *unit);
+size_t           systemd_batch_count   (const systemd_batch_t *self);
+bool             systemd_batch_execute (systemd_batch_t *self, unsigned timeout_ms);
+bool             systemd_batch_unit_ok (const systemd_batch_t *self, const char *unit);
+
 /* ------------------------------------------------------------------------- *
  * SYSTEMD
  * ------------------------------------------------------------------------- */
@@ -31,11 +31,17 @@
 #include "usb_moded-udev.h"
 
 #include "usb_moded.h"
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 
+#include <sys/inotify.h>
+
+#include <unistd.h>
+#include <errno.h>
+
 #include <libudev.h>
 
 /* ========================================================================= *
@@ -52,6 +58,43 @@
 #define PROP_STATUS    "POWER_SUPPLY_STATUS"
 #define PROP_PRESENT   "POWER_SUPPLY_PRESENT"
 
+/** Bounds for delay used for filtering out transient disconnects [ms] */
+#define UMUDEV_DEBOUNCE_MIN_MS      100
+#define UMUDEV_DEBOUNCE_MAX_MS      1000
+
+/** Margin added on top of the longest transient seen so far [%] */
+#define UMUDEV_DEBOUNCE_MARGIN_PCT  50
+
+/** Number of transient durations remembered per device */
+#define UMUDEV_DEBOUNCE_SAMPLES     8
+
+/** Number of disconnects to see before trusting device statistics */
+#define UMUDEV_DEBOUNCE_TRUST       3
+
+/** Minimum delay between reported and active cable state [ms] */
+#define UMUDEV_CABLE_STATE_DELAY_MS 100
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Statistics about short lasting disconnects seen on a device
+ */
+typedef struct umudev_debounce_t
+{
+    /** Start of ongoing disconnect [ms], or -1 if connected */
+    int64_t  began;
+
+    /** Number of disconnects that have ended */
+    unsigned episodes;
+
+    /** Number of transient durations recorded */
+    unsigned count;
+
+    /** Ring buffer of recent transient durations [ms] */
+    int      samples[UMUDEV_DEBOUNCE_SAMPLES];
+} umudev_debounce_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -69,6 +112,26 @@ static gchar               *umudev_read_textfile(const char *dirpath, const char
 static gchar               *umudev_get_config   (const char *key);
 static struct udev_device **umudev_get_devices  (const char *subsystem);
 static void                 umudev_free_devices (struct udev_device **devices);
+static int64_t              umudev_get_time_ms  (void);
+
+/* ------------------------------------------------------------------------- *
+ * UMUDEV_DEBOUNCE
+ * ------------------------------------------------------------------------- */
+
+static umudev_debounce_t *umudev_debounce_get         (const char *syspath);
+static void               umudev_debounce_disconnected(umudev_debounce_t *self);
+static void               umudev_debounce_connected   (umudev_debounce_t *self);
+static gint               umudev_debounce_delay       (const umudev_debounce_t *self);
+static void               umudev_debounce_quit        (void);
+
+/* ------------------------------------------------------------------------- *
+ * UMUDEV_RECONFIG
+ * ------------------------------------------------------------------------- */
+
+static bool     umudev_reconfig_active (void);
+static gboolean umudev_reconfig_done_cb(gpointer aptr);
+void            umudev_reconfig_begin  (void);
+void            umudev_reconfig_end    (void);
 
 /* ------------------------------------------------------------------------- *
  * UMUDEV_CHARGER
@@ -79,7 +142,8 @@ static bool     umudev_charger_set_type     (const char *type);
 static void     umudev_charger_update_from  (struct udev_device *dev);
 static int      umudev_charger_get_score    (struct udev_device *dev);
 static void     umudev_charger_find_device  (void);
-static void     umudev_charger_schedule_poll(void);
+static bool     umudev_charger_agrees_p     (void);
+static void     umudev_charger_schedule_poll(gint delay);
 static void     umudev_charger_cancel_poll  (void);
 static gboolean umudev_charger_poll_cb      (gpointer aptr);
 static void     umudev_charger_poll_now     (void);
@@ -89,7 +153,7 @@ static void     umudev_charger_poll_now     (void);
  * ------------------------------------------------------------------------- */
 
 static gchar *umudev_extcon_parse_state(const char *rawstate);
-static void   umudev_extcon_set_state  (const char *rawstate);
+static void   umudev_extcon_set_state  (const char *syspath, const char *rawstate);
 static void   umudev_extcon_read_from  (const char *syspath);
 static void   umudev_extcon_update_from(struct udev_device *dev);
 static void   umudev_extcon_find_device(void);
@@ -99,11 +163,20 @@ static void   umudev_extcon_find_device(void);
  * ------------------------------------------------------------------------- */
 
 static gchar *umudev_android_parse_state(const char *rawstate);
-static void   umudev_android_set_state  (const char *rawstate);
+static void   umudev_android_set_state  (const char *syspath, const char *rawstate);
 static void   umudev_android_read_from  (const char *syspath);
 static void   umudev_android_update_from(struct udev_device *dev);
 static void   umudev_android_find_device(void);
 
+/* ------------------------------------------------------------------------- *
+ * UMUDEV_SYSROOT
+ * ------------------------------------------------------------------------- */
+
+static void     umudev_sysroot_update  (void);
+static gboolean umudev_sysroot_input_cb(GIOChannel *iochannel, GIOCondition cond, gpointer data);
+static bool     umudev_sysroot_init    (void);
+static void     umudev_sysroot_quit    (void);
+
 /* ------------------------------------------------------------------------- *
  * UMUDEV_CABLE_STATE
  * ------------------------------------------------------------------------- */
@@ -144,12 +217,13 @@ static gchar               *umudev_charger_type       = 0;
 /* Delayed charger property refresh / state re-evaluation
  *
  * This is done when extcon / android_usb changes are seen.
- * The delay needs to be long enough to cover transient android_usb
- * DISCONNECTED states related to mode configuration changes, so
- * that they are not interpreted as physical cable disconnects.
+ * The delay needs to be long enough to cover transient disconnects
+ * the hardware produces, so that they are not interpreted as physical
+ * cable disconnects. Disconnects caused by gadget reconfiguration
+ * are handled separately, see UMUDEV_RECONFIG.
  */
 static guint                umudev_charger_poll_id    = 0;
-static gint                 umudev_charger_poll_delay = 1000;
+static int64_t              umudev_charger_poll_due   = 0;
 
 /* Device monitoring: extcon subsystem */
 static gchar               *umudev_extcon_syspath     = 0;
@@ -161,6 +235,28 @@ static gchar               *umudev_android_syspath    = 0;
 static gchar               *umudev_android_subsystem  = 0;
 static gchar               *umudev_android_state      = NULL;
 
+/* Transient disconnect statistics: syspath -> umudev_debounce_t */
+static GHashTable          *umudev_debounce_lut       = 0;
+
+/* Statistics for the android_usb device that reported state last */
+static umudev_debounce_t   *umudev_android_debounce   = 0;
+
+/* Number of gadget reconfigurations that have not been finished yet
+ *
+ * Incremented from worker thread when mode switch starts, and
+ * decremented in main thread idle callback after it ends - i.e.
+ * after already queued uevents have been processed.
+ */
+static gint                 umudev_reconfig_count     = 0;
+
+/* android_usb DISCONNECTED was caused by gadget reconfiguration */
+static bool                 umudev_android_spurious   = false;
+
+/* Charger monitoring: power_supply attribute files under sysroot */
+static gchar               *umudev_sysroot_charger    = 0;
+static int                  umudev_sysroot_fd         = -1;
+static guint                umudev_sysroot_watch_id   = 0;
+
 static guint                umudev_watch_id           = 0;
 static bool                 umudev_in_cleanup         = false;
 
@@ -289,6 +385,170 @@ static void umudev_free_devices(struct udev_device **devices)
     }
 }
 
+static int64_t umudev_get_time_ms(void)
+{
+    return common_get_monotonic_us() / 1000;
+}
+
+/* ========================================================================= *
+ * UMUDEV_DEBOUNCE
+ *
+ * Extcon and android_usb devices can report short lasting disconnects
+ * also when the cable stays connected. How long these last depends on
+ * hardware, so per device statistics are kept and the delay used for
+ * filtering is derived from the longest transients seen recently.
+ * ========================================================================= */
+
+static umudev_debounce_t *umudev_debounce_get(const char *syspath)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umudev_debounce_t *self = 0;
+
+    if( !syspath )
+        goto EXIT;
+
+    if( !umudev_debounce_lut )
+        umudev_debounce_lut = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+
+    if( !(self = g_hash_table_lookup(umudev_debounce_lut, syspath)) ) {
+        self = g_malloc0(sizeof *self);
+        self->began = -1;
+        g_hash_table_replace(umudev_debounce_lut, g_strdup(syspath), self);
+    }
+
+EXIT:
+    return self;
+}
+
+static void umudev_debounce_disconnected(umudev_debounce_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self && self->began < 0 )
+        self->began = umudev_get_time_ms();
+}
+
+static void umudev_debounce_connected(umudev_debounce_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !self || self->began < 0 )
+        goto EXIT;
+
+    int64_t duration = umudev_get_time_ms() - self->began;
+    self->began = -1;
+    self->episodes += 1;
+
+    /* Anything lasting longer than the maximum delay gets handled
+     * as a real disconnect anyway -> not relevant for tuning. */
+    if( duration < UMUDEV_DEBOUNCE_MAX_MS ) {
+        self->samples[self->count++ % UMUDEV_DEBOUNCE_SAMPLES] = (int)duration;
+        log_debug("transient disconnect: %d ms", (int)duration);
+    }
+
+EXIT:
+    return;
+}
+
+static gint umudev_debounce_delay(const umudev_debounce_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gint delay = UMUDEV_DEBOUNCE_MAX_MS;
+
+    /* Use safe default until device has had a chance to show
+     * what kind of transients it produces */
+    if( !self || self->episodes < UMUDEV_DEBOUNCE_TRUST )
+        goto EXIT;
+
+    unsigned count   = MIN(self->count, UMUDEV_DEBOUNCE_SAMPLES);
+    int      longest = 0;
+    for( unsigned i = 0; i < count; ++i )
+        longest = MAX(longest, self->samples[i]);
+
+    delay = longest * (100 + UMUDEV_DEBOUNCE_MARGIN_PCT) / 100;
+    delay = CLAMP(delay, UMUDEV_DEBOUNCE_MIN_MS, UMUDEV_DEBOUNCE_MAX_MS);
+
+EXIT:
+    return delay;
+}
+
+static void umudev_debounce_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umudev_android_debounce = 0;
+
+    if( umudev_debounce_lut ) {
+        g_hash_table_unref(umudev_debounce_lut),
+            umudev_debounce_lut = 0;
+    }
+}
+
+/* ========================================================================= *
+ * UMUDEV_RECONFIG
+ *
+ * Disabling and re-enabling android_usb gadget while switching modes
+ * makes it report DISCONNECTED state even though the cable stays
+ * connected. Worker thread tells when it is reconfiguring the gadget,
+ * so that such self-induced states can be ignored.
+ * ========================================================================= */
+
+static bool umudev_reconfig_active(void)
+{
+    return g_atomic_int_get(&umudev_reconfig_count) > 0;
+}
+
+static gboolean umudev_reconfig_done_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    if( !g_atomic_int_dec_and_test(&umudev_reconfig_count) )
+        goto EXIT;
+
+    if( !umudev_android_spurious )
+        goto EXIT;
+
+    umudev_android_spurious = false;
+
+    /* Gadget was not re-enumerated by the time mode switch finished,
+     * handle remaining disconnect as if it had started just now. */
+    log_debug("android_usb still disconnected after reconfiguration");
+    umudev_debounce_disconnected(umudev_android_debounce);
+    umudev_charger_schedule_poll(umudev_debounce_delay(umudev_android_debounce));
+
+EXIT:
+    return G_SOURCE_REMOVE;
+}
+
+/** Mark start of gadget reconfiguration
+ *
+ * Can be called from any thread.
+ */
+void umudev_reconfig_begin(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_atomic_int_inc(&umudev_reconfig_count);
+}
+
+/** Mark end of gadget reconfiguration
+ *
+ * Can be called from any thread. Reconfiguration is considered to
+ * be finished only after uevents already queued for the main thread
+ * have been processed.
+ */
+void umudev_reconfig_end(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_idle_add(umudev_reconfig_done_cb, 0);
+}
+
 /* ========================================================================= *
  * UMUDEV_CHARGER
  * ========================================================================= */
@@ -488,15 +748,32 @@ EXIT:
     g_free(tracking);
 }
 
-static void umudev_charger_schedule_poll(void)
+/** Predicate for: cached charger properties indicate pc connection
+ */
+static bool umudev_charger_agrees_p(void)
+{
+    return (!g_strcmp0(umudev_charger_online, "1") &&
+            (!g_strcmp0(umudev_charger_type, "USB") ||
+             !g_strcmp0(umudev_charger_type, "USB_CDP")));
+}
+
+static void umudev_charger_schedule_poll(gint delay)
 {
     LOG_REGISTER_CONTEXT;
 
-    if( !umudev_charger_poll_id ) {
-        umudev_charger_poll_id = g_timeout_add(umudev_charger_poll_delay,
-                                               umudev_charger_poll_cb,
-                                               NULL);
-    }
+    /* Already scheduled poll can be postponed, but not advanced:
+     * it might be covering a transient seen on another device. */
+    int64_t due = umudev_get_time_ms() + delay;
+
+    if( umudev_charger_poll_id && umudev_charger_poll_due >= due )
+        goto EXIT;
+
+    umudev_charger_cancel_poll();
+    umudev_charger_poll_id = g_timeout_add(delay, umudev_charger_poll_cb, NULL);
+    umudev_charger_poll_due = due;
+
+EXIT:
+    return;
 }
 
 static void umudev_charger_cancel_poll(void)
@@ -560,7 +837,7 @@ static gchar *umudev_extcon_parse_state(const char *rawstate)
     return state;
 }
 
-static void umudev_extcon_set_state(const char *rawstate)
+static void umudev_extcon_set_state(const char *syspath, const char *rawstate)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -572,7 +849,24 @@ static void umudev_extcon_set_state(const char *rawstate)
         g_free(umudev_extcon_state),
             umudev_extcon_state = state,
             state = NULL;
-        umudev_charger_schedule_poll();
+
+        umudev_debounce_t *debounce = umudev_debounce_get(syspath);
+
+        if( !g_strcmp0(umudev_extcon_state, "USB=0") ) {
+            umudev_debounce_disconnected(debounce);
+            umudev_charger_schedule_poll(umudev_debounce_delay(debounce));
+        }
+        else if( !g_strcmp0(umudev_extcon_state, "USB=1") ) {
+            umudev_debounce_connected(debounce);
+            /* Nothing to filter when charger agrees with extcon */
+            if( umudev_charger_agrees_p() )
+                umudev_charger_poll_now();
+            else
+                umudev_charger_schedule_poll(umudev_debounce_delay(debounce));
+        }
+        else {
+            umudev_charger_schedule_poll(umudev_debounce_delay(debounce));
+        }
     }
     g_free(state);
 }
@@ -585,7 +879,7 @@ static void umudev_extcon_read_from(const char *syspath)
     LOG_REGISTER_CONTEXT;
     gchar *rawstate = umudev_read_textfile(syspath, "state");
     if( rawstate )
-        umudev_extcon_set_state(rawstate);
+        umudev_extcon_set_state(syspath, rawstate);
     g_free(rawstate);
 }
 
@@ -593,7 +887,7 @@ static void umudev_extcon_update_from(struct udev_device *dev)
 {
     const char *state = udev_device_get_property_value(dev, "STATE");
     if( state )
-        umudev_extcon_set_state(state);
+        umudev_extcon_set_state(udev_device_get_syspath(dev), state);
 }
 
 static void umudev_extcon_find_device(void)
@@ -679,7 +973,7 @@ static gchar *umudev_android_parse_state(const char *rawstate)
     return umudev_strip(g_strdup(rawstate));
 }
 
-static void umudev_android_set_state(const char *rawstate)
+static void umudev_android_set_state(const char *syspath, const char *rawstate)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -691,7 +985,28 @@ static void umudev_android_set_state(const char *rawstate)
         g_free(umudev_android_state),
             umudev_android_state = state,
             state = NULL;
-        umudev_charger_schedule_poll();
+
+        umudev_debounce_t *debounce = umudev_debounce_get(syspath);
+        if( debounce )
+            umudev_android_debounce = debounce;
+
+        if( g_strcmp0(umudev_android_state, "DISCONNECTED") ) {
+            umudev_android_spurious = false;
+            umudev_debounce_connected(debounce);
+            umudev_charger_schedule_poll(umudev_debounce_delay(debounce));
+        }
+        else if( umudev_reconfig_active() ) {
+            /* Caused by usb-moded itself -> ignore */
+            log_debug("android_usb disconnect due to gadget reconfiguration");
+            umudev_android_spurious = true;
+        }
+        else {
+            umudev_debounce_disconnected(debounce);
+            umudev_charger_schedule_poll(umudev_debounce_delay(debounce));
+        }
+
+        /* Mode switch might be waiting for host to configure gadget */
+        common_wait_notify();
     }
     g_free(state);
 }
@@ -705,7 +1020,7 @@ static void umudev_android_read_from(const char *syspath)
 
     gchar *rawstate = umudev_read_textfile(syspath, "state");
     if( rawstate )
-        umudev_android_set_state(rawstate);
+        umudev_android_set_state(syspath, rawstate);
     g_free(rawstate);
 }
 
@@ -713,7 +1028,7 @@ static void umudev_android_update_from(struct udev_device *dev)
 {
     const char *state = udev_device_get_property_value(dev, "USB_STATE");
     if( state )
-        umudev_android_set_state(state);
+        umudev_android_set_state(udev_device_get_syspath(dev), state);
 }
 
 static void umudev_android_find_device(void)
@@ -789,6 +1104,121 @@ EXIT:
     g_free(tracking);
 }
 
+/* ========================================================================= *
+ * UMUDEV_SYSROOT
+ *
+ * Uevents from the host system are meaningless when kernel interfaces
+ * are redirected to a sysroot directory. Instead the charger online
+ * and type attributes are read from files, and re-read whenever
+ * something writes to them.
+ * ========================================================================= */
+
+static void umudev_sysroot_update(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *online = umudev_read_textfile(umudev_sysroot_charger, "online");
+    gchar *type   = umudev_read_textfile(umudev_sysroot_charger, "type");
+
+    umudev_charger_set_online(online ? g_strstrip(online) : NULL);
+    umudev_charger_set_type(type ? g_strstrip(type) : NULL);
+    umudev_evaluate_state();
+
+    g_free(type);
+    g_free(online);
+}
+
+static gboolean umudev_sysroot_input_cb(GIOChannel *iochannel, GIOCondition cond, gpointer data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)iochannel;
+    (void)data;
+
+    char    buff[1024];
+    ssize_t rc;
+
+    if( cond & ~G_IO_IN ) {
+        log_err("sysroot charger watch: unexpected condition 0x%x", cond);
+        umudev_sysroot_watch_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    /* Drain events, attributes are re-read as a whole anyway */
+    while( (rc = read(umudev_sysroot_fd, buff, sizeof buff)) > 0 )
+        ;
+    if( rc == -1 && errno != EAGAIN && errno != EINTR ) {
+        log_err("sysroot charger watch: read failed: %m");
+        umudev_sysroot_watch_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    common_acquire_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+    umudev_sysroot_update();
+    common_release_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static bool umudev_sysroot_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool        ack       = false;
+    GIOChannel *iochannel = 0;
+
+    umudev_sysroot_charger = common_sysroot_dup(UDEV_CHARGER_PATH_FALLBACK);
+
+    if( (umudev_sysroot_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ) {
+        log_err("inotify_init: %m");
+        goto EXIT;
+    }
+
+    if( inotify_add_watch(umudev_sysroot_fd, umudev_sysroot_charger,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) == -1 ) {
+        log_err("%s: can't watch: %m", umudev_sysroot_charger);
+        goto EXIT;
+    }
+
+    if( !(iochannel = g_io_channel_unix_new(umudev_sysroot_fd)) )
+        goto EXIT;
+
+    umudev_sysroot_watch_id = g_io_add_watch(iochannel,
+                                             G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                             umudev_sysroot_input_cb, NULL);
+    if( !umudev_sysroot_watch_id )
+        goto EXIT;
+
+    log_debug("charger device: sysroot %s", umudev_sysroot_charger);
+    umudev_sysroot_update();
+
+    ack = true;
+
+EXIT:
+    if( iochannel )
+        g_io_channel_unref(iochannel);
+
+    return ack;
+}
+
+static void umudev_sysroot_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umudev_sysroot_watch_id ) {
+        g_source_remove(umudev_sysroot_watch_id),
+            umudev_sysroot_watch_id = 0;
+    }
+
+    if( umudev_sysroot_fd != -1 ) {
+        close(umudev_sysroot_fd),
+            umudev_sysroot_fd = -1;
+    }
+
+    g_free(umudev_sysroot_charger),
+        umudev_sysroot_charger = 0;
+}
+
 /* ========================================================================= *
  * UMUDEV_CABLE_STATE
  * ========================================================================= */
@@ -960,8 +1390,16 @@ static void umudev_cable_state_from_udev(cable_state_t curr)
         /* All other transitions are handled with at least 100 ms delay.
          * This should compress multiple stale disconnect + connect
          * pairs into single action.
+         *
+         * Except when extcon and charger agree on pc connection, in
+         * which case it is enough to let queued up events through.
          */
-        gint delay = 100;
+        gint delay = UMUDEV_CABLE_STATE_DELAY_MS;
+
+        if( curr == CABLE_STATE_PC_CONNECTED &&
+            !g_strcmp0(umudev_extcon_state, "USB=1") &&
+            umudev_charger_agrees_p() )
+            delay = 0;
 
         if( curr == CABLE_STATE_PC_CONNECTED && prev != CABLE_STATE_UNKNOWN ) {
             if( delay < usbmoded_get_cable_connection_delay() )
@@ -1079,9 +1517,10 @@ static void umudev_evaluate_state(void)
      *
      * Caveat: transient android_usb disconnects do occur also during
      *         gadget configuration changes i.e. due to actions of
-     *         usb-moded itself -> processing of extcon/android_usb
-     *         changes is delayed in the hope that short lasting
-     *         transient states do not get evaluated.
+     *         usb-moded itself -> such states are ignored, and
+     *         processing of other extcon/android_usb changes is
+     *         delayed long enough to skip over transients the
+     *         hardware has been seen to produce.
      */
 
     const char *override_online = NULL;
@@ -1098,7 +1537,10 @@ static void umudev_evaluate_state(void)
     }
 
     if( umudev_android_state ) {
-        if( !strcmp(umudev_android_state, "DISCONNECTED") ) {
+        if( umudev_android_spurious ) {
+            log_debug("ignoring self-induced android_usb disconnect");
+        }
+        else if( !strcmp(umudev_android_state, "DISCONNECTED") ) {
             override_type = "USB_DCP";
         }
         else {
@@ -1224,6 +1666,12 @@ gboolean umudev_init(void)
     /* Clear in-cleanup in case of restart */
     umudev_in_cleanup = false;
 
+    /* Cable state is emulated when running against sysroot */
+    if( common_get_sysroot() ) {
+        success = umudev_sysroot_init();
+        goto EXIT;
+    }
+
     /* Create the udev object */
     if( !(umudev_object = udev_new()) ) {
         log_err("Can't create umudev_object\n");
@@ -1293,6 +1741,8 @@ void umudev_quit(void)
 
     log_debug("HWhal cleanup\n");
 
+    umudev_sysroot_quit();
+
     if( umudev_watch_id )
     {
         g_source_remove(umudev_watch_id),
@@ -1326,9 +1776,10 @@ void umudev_quit(void)
 
     umudev_cable_state_stop_timer();
 
-    umudev_extcon_set_state(NULL);
-    umudev_android_set_state(NULL);
+    umudev_extcon_set_state(NULL, NULL);
+    umudev_android_set_state(NULL, NULL);
     umudev_charger_set_online(NULL);
     umudev_charger_set_type(NULL);
     umudev_charger_cancel_poll();
+    umudev_debounce_quit();
 }
@@ -46,4 +46,11 @@
 gboolean umudev_init(void);
 void     umudev_quit(void);
 
+/* ------------------------------------------------------------------------- *
+ * UMUDEV_RECONFIG
+ * ------------------------------------------------------------------------- */
+
+void umudev_reconfig_begin(void);
+void umudev_reconfig_end  (void);
+
 #endif /* USB_MODED_UDEV_H_ */
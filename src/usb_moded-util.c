@@ -48,6 +48,7 @@ static int util_set_unhide_mode_config(char *mode);
 static int util_get_hiddenlist        (void);
 static int util_handle_network        (char *network);
 static int util_clear_user_config     (char *uid);
+static int util_get_latency           (void);
 
 /* ------------------------------------------------------------------------- *
  * MAIN
@@ -387,10 +388,83 @@ static int util_clear_user_config(char *uid)
     return ret;
 }
 
+static int util_get_latency(void)
+{
+    DBusMessage *req = NULL;
+    DBusMessage *reply = NULL;
+    int ret = 1;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_LATENCY_GET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            DBusMessageIter body, arr;
+
+            if (dbus_message_iter_init(reply, &body) &&
+                dbus_message_iter_get_arg_type(&body) == DBUS_TYPE_ARRAY)
+            {
+                ret = 0;
+                dbus_message_iter_recurse(&body, &arr);
+                while (dbus_message_iter_get_arg_type(&arr) == DBUS_TYPE_STRUCT)
+                {
+                    DBusMessageIter rec, phases;
+                    dbus_uint32_t seq = 0;
+                    const char *mode = 0;
+                    dbus_bool_t success = 0;
+                    dbus_int64_t total = 0, cable = 0;
+
+                    dbus_message_iter_recurse(&arr, &rec);
+                    dbus_message_iter_get_basic(&rec, &seq);
+                    dbus_message_iter_next(&rec);
+                    dbus_message_iter_get_basic(&rec, &mode);
+                    dbus_message_iter_next(&rec);
+                    dbus_message_iter_get_basic(&rec, &success);
+                    dbus_message_iter_next(&rec);
+                    dbus_message_iter_get_basic(&rec, &total);
+                    dbus_message_iter_next(&rec);
+                    dbus_message_iter_get_basic(&rec, &cable);
+                    dbus_message_iter_next(&rec);
+
+                    printf("#%u %s: %s, total %.3f ms", seq, mode,
+                           success ? "ok" : "failed", total / 1000.0);
+                    if (cable >= 0)
+                        printf(", cable to active %.3f ms", cable / 1000.0);
+                    printf("\n");
+
+                    dbus_message_iter_recurse(&rec, &phases);
+                    while (dbus_message_iter_get_arg_type(&phases) == DBUS_TYPE_STRUCT)
+                    {
+                        DBusMessageIter ent;
+                        const char *name = 0;
+                        dbus_int64_t offset = 0, duration = 0;
+
+                        dbus_message_iter_recurse(&phases, &ent);
+                        dbus_message_iter_get_basic(&ent, &name);
+                        dbus_message_iter_next(&ent);
+                        dbus_message_iter_get_basic(&ent, &offset);
+                        dbus_message_iter_next(&ent);
+                        dbus_message_iter_get_basic(&ent, &duration);
+
+                        printf("\t%-20s +%9.3f ms %9.3f ms\n", name,
+                               offset / 1000.0, duration / 1000.0);
+                        dbus_message_iter_next(&phases);
+                    }
+                    dbus_message_iter_next(&arr);
+                }
+            }
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+    }
+
+    return ret;
+}
+
 int main (int argc, char *argv[])
 {
     int query = 0, network = 0, setmode = 0, config = 0;
     int modelist = 0, mode_configured = 0, hide = 0, unhide = 0, hiddenlist = 0, clear = 0;
+    int latency = 0;
     int res = 1, opt, rescue = 0;
     char *option = 0;
 
@@ -400,7 +474,7 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
-    while ((opt = getopt(argc, argv, "c:dhi:mn:qrs:u:vU:")) != -1)
+    while ((opt = getopt(argc, argv, "c:dhi:lmn:qrs:u:vU:")) != -1)
     {
         switch (opt) {
         case 'c':
@@ -414,6 +488,9 @@ int main (int argc, char *argv[])
             hide = 1;
             option = optarg;
             break;
+        case 'l':
+            latency = 1;
+            break;
         case 'm':
             modelist = 1;
             break;
@@ -450,6 +527,7 @@ int main (int argc, char *argv[])
                    \t-d to get the default mode set in the configuration, \n \
                    \t-h to get this help, \n \
                    \t-i hide a mode,\n \
+                   \t-l to get timing data of recent mode switches,\n \
                    \t-n to get/set network configuration. Use get:${config}/set:${config},${value}\n \
                    \t-m to get the list of supported modes, \n \
                    \t-q to query the current mode,\n \
@@ -496,6 +574,8 @@ int main (int argc, char *argv[])
         res = util_get_hiddenlist();
     else if (clear)
         res = util_clear_user_config(option);
+    else if (latency)
+        res = util_get_latency();
 
     /* subfunctions will return 1 if an error occured, print message */
     if(res)
@@ -28,10 +28,13 @@
 #include "usb_moded-android.h"
 #include "usb_moded-configfs.h"
 #include "usb_moded-control.h"
+#include "usb_moded-latency.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-modules.h"
+#include "usb_moded-network.h"
+#include "usb_moded-udev.h"
 #include "usb_moded-appsync.h"
 
 #include <sys/stat.h>
@@ -39,14 +42,69 @@
 #include <sys/eventfd.h>
 
 #include <pthread.h> // NOTRIM
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <errno.h>
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of commands that can be in flight at any time
+ *
+ * As every command produces exactly one completion, limiting the
+ * number of commands also guarantees that completions always fit
+ * in the completion queue.
+ */
+#define WORKER_QUEUE_SIZE 32
+
 /* ========================================================================= *
  * Types
  * ========================================================================= */
 
+/** Command / completion message passed between main and worker thread */
+typedef struct worker_msg_t
+{
+    /** Sequence number, assigned by the main thread; 0 = unused slot */
+    unsigned         seq;
+
+    /** What the worker is asked to do */
+    worker_cmd_t     cmd;
+
+    /** How the command was completed */
+    worker_result_t  result;
+
+    /** When command was posted / taken / completed [us] */
+    int64_t          posted_us;
+    int64_t          started_us;
+    int64_t          done_us;
+
+    /** Requested mode on command; resulting requested mode on completion */
+    gchar           *mode;
+} worker_msg_t;
+
+/** Single producer, single consumer message queue
+ *
+ * Only the producer updates head and only the consumer updates tail,
+ * so no locking is needed - just ordered access to head and tail.
+ */
+typedef struct worker_queue_t
+{
+    unsigned     head;
+    unsigned     tail;
+    worker_msg_t slot[WORKER_QUEUE_SIZE];
+} worker_queue_t;
+
+/** Main thread callback waiting for command completion */
+typedef struct worker_waiter_t
+{
+    unsigned        seq;
+    worker_done_fn  cb;
+    void           *aptr;
+} worker_waiter_t;
+
 /** Device mounting state */
 typedef enum {
     /** Mountpoint state can't be determined */
@@ -63,6 +121,40 @@ static const char * const devstate_name[] = {
   [DEVSTATE_MOUNTED]   = "mounted",
 };
 
+/** State of an ongoing mode switch */
+typedef struct worker_switch_t
+{
+    /** Hardware mode being activated */
+    gchar            *mode;
+
+    /** Mode details, set for dynamic modes */
+    const modedata_t *data;
+
+    /** Bitmap of pipeline phases that need to be rolled back */
+    unsigned          applied;
+} worker_switch_t;
+
+/** Step in mode switch pipeline
+ *
+ * Each phase that has been applied - successfully or not - gets
+ * rolled back in reverse order when mode switch fails or is
+ * preempted by a newer mode request.
+ */
+typedef struct worker_phase_t
+{
+    /** Phase name, used also for latency tracking */
+    const char *name;
+
+    /** Predicate for: phase is needed for target mode; NULL = always */
+    bool      (*wanted)(const worker_switch_t *sw);
+
+    /** Apply phase, return false on failure */
+    bool      (*apply)(worker_switch_t *sw);
+
+    /** Undo changes made by apply; NULL = nothing to undo */
+    void      (*rollback)(worker_switch_t *sw);
+} worker_phase_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -87,16 +179,55 @@ const char        *worker_get_kernel_module        (void);
 bool               worker_set_kernel_module        (const char *module);
 void               worker_clear_kernel_module      (void);
 const modedata_t  *worker_get_usb_mode_data        (void);
-modedata_t        *worker_dup_usb_mode_data        (void);
+const modedata_t  *worker_ref_usb_mode_data        (void);
 void               worker_set_usb_mode_data        (const modedata_t *data);
-static const char *worker_get_activated_mode_locked(void);
-static bool        worker_set_activated_mode_locked(const char *mode);
-static const char *worker_get_requested_mode_locked(void);
-static bool        worker_set_requested_mode_locked(const char *mode);
-bool               worker_request_hardware_mode    (const char *mode);
+static const char *worker_get_activated_mode       (void);
+static bool        worker_set_activated_mode       (const char *mode);
+static const char *worker_get_requested_mode       (void);
+static bool        worker_set_requested_mode       (const char *mode);
 void               worker_clear_hardware_mode      (void);
 static void        worker_execute                  (void);
+const char        *worker_cmd_repr                 (worker_cmd_t cmd);
+const char        *worker_result_repr              (worker_result_t result);
+static bool        worker_queue_push               (worker_queue_t *self, const worker_msg_t *msg);
+static bool        worker_queue_pop                (worker_queue_t *self, worker_msg_t *msg);
+static void        worker_queue_flush              (worker_queue_t *self);
+static unsigned    worker_next_seq                 (void);
+static unsigned    worker_post                     (worker_cmd_t cmd);
+unsigned           worker_request_hardware_mode    (const char *mode);
+unsigned           worker_get_request_seq          (void);
+unsigned           worker_refresh_mode             (void);
+unsigned           worker_verify_mode              (void);
+unsigned           worker_abort_mode_switch        (void);
+bool               worker_add_done_cb              (unsigned seq, worker_done_fn cb, void *aptr);
+static void        worker_run_done_cbs             (unsigned seq, worker_result_t result);
+static void        worker_cancel_done_cbs          (void);
+static void        worker_handle_completion        (const worker_msg_t *msg);
+static void        worker_handle_mode_completion   (void);
+static bool        worker_receive                  (void);
+static void        worker_complete                 (worker_msg_t *msg, worker_result_t result);
+static void        worker_complete_mode            (worker_result_t result);
+static void        worker_execute_deferred         (void);
+static void        worker_forget_commands          (void);
+static bool        worker_mode_is_charging         (const char *mode);
+static bool        worker_phase_charging_p         (const worker_switch_t *sw);
+static bool        worker_phase_dynamic_p          (const worker_switch_t *sw);
+static bool        worker_phase_mtp_early_p        (const worker_switch_t *sw);
+static bool        worker_phase_mtp_late_p         (const worker_switch_t *sw);
+static bool        worker_phase_check_policy       (worker_switch_t *sw);
+static bool        worker_phase_lookup_mode        (worker_switch_t *sw);
+static void        worker_phase_forget_mode        (worker_switch_t *sw);
+static bool        worker_phase_start_mtp          (worker_switch_t *sw);
+static void        worker_phase_stop_mtp           (worker_switch_t *sw);
+static bool        worker_phase_set_kernel_module  (worker_switch_t *sw);
+static bool        worker_phase_enter_dynamic_mode (worker_switch_t *sw);
+static void        worker_phase_leave_dynamic_mode (worker_switch_t *sw);
+static bool        worker_phase_switch_to_charging (worker_switch_t *sw);
+static bool        worker_pending_request          (const char *mode, gchar **newer);
+static void        worker_leave_mode               (void);
+static void        worker_rollback                 (worker_switch_t *sw);
 static void        worker_switch_to_mode           (const char *mode);
+int                worker_get_bailout_fd           (void);
 static guint       worker_add_iowatch              (int fd, bool close_on_unref, GIOCondition cnd, GIOFunc io_cb, gpointer aptr);
 static void       *worker_thread_cb                (void *aptr);
 static gboolean    worker_notify_cb                (GIOChannel *chn, GIOCondition cnd, gpointer data);
@@ -106,7 +237,8 @@ static void        worker_delete_eventfd           (void);
 static bool        worker_create_eventfd           (void);
 bool               worker_init                     (void);
 void               worker_quit                     (void);
-void               worker_wakeup                   (void);
+static void        worker_consume_wakeup           (void);
+static void        worker_wakeup                   (void);
 static void        worker_notify                   (void);
 
 /* ========================================================================= *
@@ -115,9 +247,67 @@ static void        worker_notify                   (void);
 
 static pthread_t worker_thread_id = 0;
 
+/** Lock for worker_mode_data, which is read also from the main thread */
 static pthread_mutex_t  worker_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/** Flag for: Main thread has changed target mode worker should apply
+/** eventfd descriptor for waking up worker thread after adding new jobs */
+static int              worker_req_evfd  = -1;
+
+/** eventfd descriptor for waking up main thread after executing jobs */
+static int              worker_rsp_evfd  = -1;
+
+/** I/O watch identifier for worker_rsp_evfd */
+static guint            worker_rsp_wid   = 0;
+
+/** Commands from main thread to worker thread */
+static worker_queue_t   worker_cmd_queue;
+
+/** Completions from worker thread to main thread */
+static worker_queue_t   worker_rsp_queue;
+
+/** Latest mode request, not yet taken by the worker thread
+ *
+ * Mode requests bypass the bounded queue so that they can never be
+ * dropped - a newer request simply replaces the one in the slot.
+ */
+static worker_msg_t    *worker_mode_req = 0;
+
+/** Latest finished mode request, not yet seen by the main thread */
+static worker_msg_t    *worker_mode_rsp = 0;
+
+/* Main thread side state */
+
+/** Sequence number of the last posted command */
+static unsigned         worker_post_seq    = 0;
+
+/** Number of queued commands posted, but not completed */
+static unsigned         worker_inflight    = 0;
+
+/** Sequence number of the last posted mode request */
+static unsigned         worker_mode_seq    = 0;
+
+/** Sequence number of verify command in flight, or 0 */
+static unsigned         worker_verify_seq  = 0;
+
+/** Mode requested from / reported by worker thread */
+static gchar           *worker_posted_mode = 0;
+
+/** Callbacks waiting for command completion */
+static GSList          *worker_waiters     = 0;
+
+/* Worker thread side state */
+
+/** Mode request currently being served */
+static worker_msg_t     worker_mode_cmd;
+
+/** Pending abort command */
+static worker_msg_t     worker_abort_cmd;
+
+/** Commands to execute after mode switch */
+static worker_msg_t     worker_deferred[WORKER_QUEUE_SIZE];
+static size_t           worker_deferred_count = 0;
+
+/** Flag for: Main thread has posted mode request or abort command
  *
  * Worker should bailout from synchronous activities related to
  * ongoing activation of a usb mode.
@@ -216,7 +406,7 @@ worker_unmount_mtp_device(void)
 
     if( worker_get_mtp_device_state() != DEVSTATE_UNMOUNTED ) {
         log_debug("unmounting mtp device");
-        common_system("/bin/umount /dev/mtp");
+        common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/bin/umount", "/dev/mtp");
     }
 }
 
@@ -260,13 +450,12 @@ worker_mount_mtp_device(void)
     /* Attempt to mount mtp device using root uid and primary
      * gid of the current user.
      */
-    char cmd[256];
-    snprintf(cmd, sizeof cmd,
-             "/bin/mount -o mode=0770,uid=0,gid=%u -t functionfs mtp /dev/mtp",
-             (unsigned)gid);
+    char opts[64];
+    snprintf(opts, sizeof opts, "mode=0770,uid=0,gid=%u", (unsigned)gid);
 
     log_debug("mounting mtp device");
-    if( common_system(cmd) != 0 )
+    if( common_spawn(COMMON_SPAWN_TIMEOUT_MS, "/bin/mount", "-o", opts,
+                     "-t", "functionfs", "mtp", "/dev/mtp") != 0 )
         goto EXIT;
 
     /* Check that control endpoint is present */
@@ -379,7 +568,8 @@ worker_stop_mtpd(void)
         goto SUCCESS;
     }
 
-    int rc = common_system("systemctl-user stop buteo-mtp.service");
+    int rc = common_spawn(COMMON_SPAWN_TIMEOUT_MS, "systemctl-user", "stop",
+                          "buteo-mtp.service");
     if( rc != 0 ) {
         log_warning("failed to stop mtp daemon; exit code = %d", rc);
         goto FAILURE;
@@ -417,7 +607,8 @@ worker_start_mtpd(void)
     /* Have attempted to start mtp service */
     worker_mtp_service_started = true;
 
-    int rc = common_system("systemctl-user start buteo-mtp.service");
+    int rc = common_spawn(COMMON_SPAWN_TIMEOUT_MS, "systemctl-user", "start",
+                          "buteo-mtp.service");
     if( rc != 0 ) {
         log_warning("failed to start mtp daemon; exit code = %d", rc);
         goto FAILURE;
@@ -531,7 +722,7 @@ void worker_clear_kernel_module(void)
  * ------------------------------------------------------------------------- */
 
 /** Contains the mode data */
-static modedata_t *worker_mode_data = NULL;
+static const modedata_t *worker_mode_data = NULL;
 
 /** get the usb mode data
  *
@@ -546,23 +737,23 @@ const modedata_t *worker_get_usb_mode_data(void)
     return worker_mode_data;
 }
 
-/** get clone of the usb mode data
+/** get reference to the usb mode data
  *
- * Caller must release the returned object via #modedata_free().
+ * Caller must release the returned object via #modedata_unref().
  *
  * @return a pointer to the usb mode data
  */
-modedata_t *worker_dup_usb_mode_data(void)
+const modedata_t *worker_ref_usb_mode_data(void)
 {
     LOG_REGISTER_CONTEXT;
 
     WORKER_LOCKED_ENTER;
 
-    modedata_t *modedata = modedata_copy(worker_mode_data);
+    const modedata_t *modedata = modedata_ref(worker_mode_data);
 
     WORKER_LOCKED_LEAVE;
 
-    return modedata;;
+    return modedata;
 }
 
 /** set the modedata_t data
@@ -577,10 +768,12 @@ void worker_set_usb_mode_data(const modedata_t *data)
 
     WORKER_LOCKED_ENTER;
 
-    modedata_free(worker_mode_data),
-        worker_mode_data = modedata_copy(data);
+    const modedata_t *previous = worker_mode_data;
+    worker_mode_data = modedata_ref(data);
 
     WORKER_LOCKED_LEAVE;
+
+    modedata_unref(previous);
 }
 
 /* ------------------------------------------------------------------------- *
@@ -592,13 +785,16 @@ void worker_set_usb_mode_data(const modedata_t *data)
  * How the usb hardware has been configured.
  *
  * For example internal_mode=MODE_ASK gets
- * mapped to hardware_mode=MODE_CHARGING */
+ * mapped to hardware_mode=MODE_CHARGING
+ *
+ * Note: These are accessed only from the worker thread.
+ */
 static gchar *worker_requested_mode = NULL;
 
 static gchar *worker_activated_mode = NULL;
 
 static const char *
-worker_get_activated_mode_locked(void)
+worker_get_activated_mode(void)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -606,7 +802,7 @@ worker_get_activated_mode_locked(void)
 }
 
 static bool
-worker_set_activated_mode_locked(const char *mode)
+worker_set_activated_mode(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -623,7 +819,7 @@ worker_set_activated_mode_locked(const char *mode)
 }
 
 static const char *
-worker_get_requested_mode_locked(void)
+worker_get_requested_mode(void)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -631,7 +827,7 @@ worker_get_requested_mode_locked(void)
 }
 
 static bool
-worker_set_requested_mode_locked(const char *mode)
+worker_set_requested_mode(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -647,33 +843,16 @@ worker_set_requested_mode_locked(const char *mode)
     return changed;
 }
 
-bool worker_request_hardware_mode(const char *mode)
-{
-    LOG_REGISTER_CONTEXT;
-
-    bool scheduled = false;
-
-    WORKER_LOCKED_ENTER;
-
-    if( !worker_set_requested_mode_locked(mode) )
-        goto EXIT;
-
-    worker_wakeup();
-    scheduled = true;
-
-EXIT:
-    WORKER_LOCKED_LEAVE;
-
-    return scheduled;
-}
-
+/** Release hardware mode bookkeeping
+ *
+ * Note: This function should be called only after worker_quit().
+ */
 void worker_clear_hardware_mode(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    WORKER_LOCKED_ENTER;
     g_free(worker_requested_mode), worker_requested_mode = 0;
-    WORKER_LOCKED_LEAVE;
+    g_free(worker_posted_mode), worker_posted_mode = 0;
 }
 
 static void
@@ -681,230 +860,1097 @@ worker_execute(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    WORKER_LOCKED_ENTER;
+    worker_receive();
 
-    const char *activated = worker_get_activated_mode_locked();
-    const char *requested = worker_get_requested_mode_locked();
+    const char *activated = worker_get_activated_mode();
+    const char *requested = worker_get_requested_mode();
     const char *activate  = common_map_mode_to_hardware(requested);
 
     log_debug("activated = %s", activated);
     log_debug("requested = %s", requested);
     log_debug("activate = %s",   activate);
 
-    bool changed = g_strcmp0(activated, activate) != 0;
-    gchar *mode  = g_strdup(activate);
-
-    WORKER_LOCKED_LEAVE;
-
-    if( changed )
+    if( g_strcmp0(activated, activate) ) {
+        gchar *mode = g_strdup(activate);
         worker_switch_to_mode(mode);
-    else
-        worker_notify();
+        g_free(mode);
+    }
+    else {
+        worker_complete_mode(WORKER_RESULT_DONE);
+    }
 
-    g_free(mode);
+    /* Nothing left to abort */
+    worker_complete(&worker_abort_cmd, WORKER_RESULT_DONE);
 
-    return;
+    worker_execute_deferred();
 }
 
 /* ------------------------------------------------------------------------- *
- * MODE_SWITCH
+ * WORKER_QUEUE
  * ------------------------------------------------------------------------- */
 
-static void
-worker_switch_to_mode(const char *mode)
+const char *
+worker_cmd_repr(worker_cmd_t cmd)
 {
     LOG_REGISTER_CONTEXT;
 
-    const char *override = 0;
-    modedata_t *data     = 0;
-
-    /* set return to 1 to be sure to error out if no matching mode is found either */
-
-    log_debug("Cleaning up previous mode");
-
-    /* Either mtp daemon is not needed, or it must be *started* in
-     * correct phase of gadget configuration when entering mtp mode.
-     *
-     * Similarly, unmount mtp device to make sure sure it gets mounted
-     * with appropriate uid/gid values when it is actually needed.
-     */
-    worker_stop_mtpd();
-    worker_unmount_mtp_device();
-
-    if( worker_get_usb_mode_data() ) {
-        modesetting_leave_dynamic_mode();
-        worker_set_usb_mode_data(NULL);
+    const char *repr = "unknown";
+    switch( cmd ) {
+    case WORKER_CMD_MODE:    repr = "mode";    break;
+    case WORKER_CMD_REFRESH: repr = "refresh"; break;
+    case WORKER_CMD_VERIFY:  repr = "verify";  break;
+    case WORKER_CMD_ABORT:   repr = "abort";   break;
     }
+    return repr;
+}
 
-    /* Mode specific applications have been stopped and we can
-     * take updated appsync configuration in use.
-     */
-    appsync_switch_configuration();
-
-    log_debug("Setting %s\n", mode);
-
-    /* Mode mapping should mean we only see MODE_CHARGING here, but just
-     * in case redirect fixed charging related things to charging ... */
-
-    if( !strcmp(mode, MODE_CHARGING) ||
-        !strcmp(mode, MODE_CHARGING_FALLBACK) ||
-        !strcmp(mode, MODE_CHARGER) ||
-        !strcmp(mode, MODE_UNDEFINED) ||
-        !strcmp(mode, MODE_ASK)) {
-        goto CHARGE;
-    }
+const char *
+worker_result_repr(worker_result_t result)
+{
+    LOG_REGISTER_CONTEXT;
 
-    if( !usbmoded_can_export() ) {
-        log_warning("Policy does not allow mode: %s", mode);
-        goto FAILED;
+    const char *repr = "unknown";
+    switch( result ) {
+    case WORKER_RESULT_DONE:       repr = "done";       break;
+    case WORKER_RESULT_FAILED:     repr = "failed";     break;
+    case WORKER_RESULT_SUPERSEDED: repr = "superseded"; break;
+    case WORKER_RESULT_ABORTED:    repr = "aborted";    break;
     }
+    return repr;
+}
 
-    if( (data = usbmoded_dup_modedata(mode)) ) {
-        log_debug("Matching mode %s found.\n", mode);
+/** Append message to queue
+ *
+ * Must be called only from the producer side thread.
+ *
+ * @param self  queue
+ * @param msg   message to copy; ownership of mode string is transferred
+ *
+ * @return true on success, false if queue is full
+ */
+static bool
+worker_queue_push(worker_queue_t *self, const worker_msg_t *msg)
+{
+    LOG_REGISTER_CONTEXT;
 
-        /* set data before calling any of the dynamic mode functions
-         * as they will use the worker_get_usb_mode_data function */
-        worker_set_usb_mode_data(data);
+    unsigned head = __atomic_load_n(&self->head, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE);
 
-        /* When dealing with configfs, we can't enable UDC without
-         * already having mtpd running */
-        if( worker_mode_is_mtp_mode(mode) && configfs_in_use() ) {
-            if( !worker_mount_mtp_device() )
-                goto FAILED;
-            if( !worker_start_mtpd() )
-                goto FAILED;
-        }
+    if( head - tail >= WORKER_QUEUE_SIZE )
+        return false;
 
-        if( !worker_set_kernel_module(data->mode_module) )
-            goto FAILED;
+    self->slot[head % WORKER_QUEUE_SIZE] = *msg;
+    __atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-        if( !modesetting_enter_dynamic_mode() )
-            goto FAILED;
+/** Take message from queue
+ *
+ * Must be called only from the consumer side thread.
+ *
+ * @param self  queue
+ * @param msg   where to copy message; caller must g_free() mode string
+ *
+ * @return true on success, false if queue is empty
+ */
+static bool
+worker_queue_pop(worker_queue_t *self, worker_msg_t *msg)
+{
+    LOG_REGISTER_CONTEXT;
 
-        /* When dealing with android usb, it must be enabled before
-         * we can start mtpd. Assumption is that the same applies
-         * when using kernel modules. */
-        if( worker_mode_is_mtp_mode(mode) && !configfs_in_use() ) {
-            if( !worker_mount_mtp_device() )
-                goto FAILED;
-            if( !worker_start_mtpd() )
-                goto FAILED;
-        }
+    unsigned tail = __atomic_load_n(&self->tail, __ATOMIC_RELAXED);
+    unsigned head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
 
-        goto SUCCESS;
-    }
+    if( tail == head )
+        return false;
 
-    log_warning("Matching mode %s was not found.", mode);
+    *msg = self->slot[tail % WORKER_QUEUE_SIZE];
+    __atomic_store_n(&self->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-FAILED:
-    worker_bailout_handled = true;
+/** Discard queued messages
+ *
+ * Note: Must be called only while worker thread is not running.
+ *
+ * @param self  queue
+ */
+static void
+worker_queue_flush(worker_queue_t *self)
+{
+    LOG_REGISTER_CONTEXT;
 
-    /* Undo any changes we might have might have already done */
-    if( worker_get_usb_mode_data() ) {
-        log_debug("Cleaning up failed mode switch");
-        worker_stop_mtpd();
-        modesetting_leave_dynamic_mode();
-        worker_set_usb_mode_data(NULL);
-    }
+    worker_msg_t msg;
+    while( worker_queue_pop(self, &msg) )
+        g_free(msg.mode);
+}
 
-    /* From usb configuration point of view MODE_UNDEFINED and
-     * MODE_CHARGING are the same, but for the purposes of exposing
-     * a sane state over D-Bus we need to differentiate between
-     * "failure to set mode" and "aborting mode setting due to cable
-     * disconnect" by inspecting whether target mode has been
-     * switched to undefined.
-     */
-    WORKER_LOCKED_ENTER;
-    const char *requested = worker_get_requested_mode_locked();
-    if( !g_strcmp0(requested, MODE_UNDEFINED) )
-        override = MODE_UNDEFINED;
-    else
-        override = MODE_CHARGING;
-    WORKER_LOCKED_LEAVE;
-    log_warning("mode setting failed, try %s", override);
+/** Allocate command sequence number
+ *
+ * @return sequence number, never 0
+ */
+static unsigned
+worker_next_seq(void)
+{
+    LOG_REGISTER_CONTEXT;
 
-CHARGE:
-    if( worker_switch_to_charging() )
-        goto SUCCESS;
+    /* Zero is reserved for "no command" */
+    if( !++worker_post_seq )
+        ++worker_post_seq;
 
-    log_crit("failed to activate charging, all bets are off");
+    return worker_post_seq;
+}
 
-    /* FIXME: double check this error path */
+/** Pass command to worker thread
+ *
+ * Abort commands make blocking waits in an ongoing mode switch bail
+ * out, other commands are executed after the mode switch has been
+ * finished. Mode requests do not go through here.
+ *
+ * @param cmd   command
+ *
+ * @return command sequence number, or 0 on failure
+ */
+static unsigned
+worker_post(worker_cmd_t cmd)
+{
+    LOG_REGISTER_CONTEXT;
 
-    /* If we get here then usb_module loading failed,
-     * no mode matched, and charging setup failed too.
-     */
+    unsigned seq = 0;
 
-    override = MODE_UNDEFINED;
-    log_warning("mode setting failed, fallback to %s", override);
-    worker_set_kernel_module(MODULE_NONE);
+    if( worker_inflight >= WORKER_QUEUE_SIZE ) {
+        log_err("worker is not keeping up; %s command dropped",
+                worker_cmd_repr(cmd));
+        goto EXIT;
+    }
 
-SUCCESS:
+    worker_msg_t msg = {
+        .seq       = worker_next_seq(),
+        .cmd       = cmd,
+        .result    = WORKER_RESULT_DONE,
+        .posted_us = common_get_monotonic_us(),
+    };
 
-    WORKER_LOCKED_ENTER;
-    if( override ) {
-        worker_set_requested_mode_locked(override);
-        override = common_map_mode_to_hardware(override);
-        worker_set_activated_mode_locked(override);
-    }
-    else {
-        worker_set_activated_mode_locked(mode);
+    if( !worker_queue_push(&worker_cmd_queue, &msg) ) {
+        log_err("worker queue full; %s command dropped",
+                worker_cmd_repr(cmd));
+        goto EXIT;
     }
-    WORKER_LOCKED_LEAVE;
 
-    worker_notify();
+    seq = msg.seq;
+    ++worker_inflight;
+    log_debug("posted %s #%u", worker_cmd_repr(cmd), seq);
 
-    modedata_free(data);
+    /* Set after queueing, so that worker can't clear the flag
+     * without seeing the command too */
+    if( cmd == WORKER_CMD_ABORT )
+        __atomic_store_n(&worker_bailout_requested, true, __ATOMIC_SEQ_CST);
 
-    return;
+    worker_wakeup();
+
+EXIT:
+    return seq;
 }
 
-/* ------------------------------------------------------------------------- *
- * WORKER_THREAD
- * ------------------------------------------------------------------------- */
+/** Request worker thread to activate a mode
+ *
+ * The request replaces any earlier one the worker thread has not
+ * taken yet, and callbacks waiting for the previous request are
+ * notified that it was superseded.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param mode  internal mode name, mapped to hardware mode by worker
+ *
+ * @return command sequence number, or 0 if nothing was scheduled
+ */
+unsigned worker_request_hardware_mode(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
 
-/** eventfd descriptor for waking up worker thread after adding new jobs */
-static int              worker_req_evfd  = -1;
+    unsigned seq = 0;
 
-/** eventfd descriptor for waking up main thread after executing jobs */
-static int              worker_rsp_evfd  = -1;
+    if( !g_strcmp0(worker_posted_mode, mode) )
+        goto EXIT;
 
-/** I/O watch identifier for worker_rsp_evfd */
-static guint            worker_rsp_wid   = 0;
+    worker_msg_t *msg = g_malloc0(sizeof *msg);
+    msg->seq       = seq = worker_next_seq();
+    msg->cmd       = WORKER_CMD_MODE;
+    msg->result    = WORKER_RESULT_DONE;
+    msg->posted_us = common_get_monotonic_us();
+    msg->mode      = g_strdup(mode);
 
-static guint
-worker_add_iowatch(int fd, bool close_on_unref,
-               GIOCondition cnd, GIOFunc io_cb, gpointer aptr)
-{
-    LOG_REGISTER_CONTEXT;
+    worker_msg_t *old = __atomic_exchange_n(&worker_mode_req, msg,
+                                            __ATOMIC_ACQ_REL);
+    if( old )
+        g_free(old->mode), g_free(old);
 
-    guint         wid = 0;
-    GIOChannel   *chn = 0;
+    /* Latest request wins, the previous one is not going to finish */
+    if( worker_mode_seq )
+        worker_run_done_cbs(worker_mode_seq, WORKER_RESULT_SUPERSEDED);
 
-    if( !(chn = g_io_channel_unix_new(fd)) )
-        goto cleanup;
+    g_free(worker_posted_mode), worker_posted_mode = g_strdup(mode);
+    worker_mode_seq = seq;
+    log_debug("posted %s #%u %s", worker_cmd_repr(WORKER_CMD_MODE), seq, mode);
 
-    g_io_channel_set_close_on_unref(chn, close_on_unref);
+    /* Set after publishing, so that worker can't clear the flag
+     * without seeing the request too */
+    __atomic_store_n(&worker_bailout_requested, true, __ATOMIC_SEQ_CST);
 
-    cnd |= G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+    worker_wakeup();
 
-    if( !(wid = g_io_add_watch(chn, cnd, io_cb, aptr)) )
-        goto cleanup;
+EXIT:
+    return seq;
+}
 
-cleanup:
-    if( chn != 0 ) g_io_channel_unref(chn);
+/** Get sequence number of the latest mode request
+ *
+ * @return command sequence number, or 0 if none have been made
+ */
+unsigned worker_get_request_seq(void)
+{
+    LOG_REGISTER_CONTEXT;
 
-    return wid;
+    return worker_mode_seq;
+}
+
+/** Request worker thread to re-apply settings of the active mode
+ *
+ * @return command sequence number, or 0 on failure
+ */
+unsigned worker_refresh_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
 
+    return worker_post(WORKER_CMD_REFRESH);
 }
 
-static void *worker_thread_cb(void *aptr)
+/** Request worker thread to check for unexpected gadget changes
+ *
+ * Only one verify command is kept in flight, further requests made
+ * before it has been executed return the same sequence number.
+ *
+ * @return command sequence number, or 0 on failure
+ */
+unsigned worker_verify_mode(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    (void)aptr;
+    if( !worker_verify_seq )
+        worker_verify_seq = worker_post(WORKER_CMD_VERIFY);
 
-    /* Async cancellation, but disabled */
+    return worker_verify_seq;
+}
+
+/** Request worker thread to abandon ongoing mode switch
+ *
+ * Phases applied so far are rolled back and charging mode is
+ * activated, as if the mode switch had failed.
+ *
+ * @return command sequence number, or 0 on failure
+ */
+unsigned worker_abort_mode_switch(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return worker_post(WORKER_CMD_ABORT);
+}
+
+/** Get notified when a command has been completed
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param seq   command sequence number
+ * @param cb    function to call on completion
+ * @param aptr  user data to pass to the callback
+ *
+ * @return true if callback was added, false otherwise
+ */
+bool worker_add_done_cb(unsigned seq, worker_done_fn cb, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( !seq || !cb )
+        goto EXIT;
+
+    worker_waiter_t *waiter = g_malloc0(sizeof *waiter);
+    waiter->seq  = seq;
+    waiter->cb   = cb;
+    waiter->aptr = aptr;
+    worker_waiters = g_slist_append(worker_waiters, waiter);
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Notify callbacks waiting for given command
+ *
+ * @param seq     command sequence number
+ * @param result  how the command was completed
+ */
+static void
+worker_run_done_cbs(unsigned seq, worker_result_t result)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( GSList *iter = worker_waiters, *next; iter; iter = next ) {
+        next = iter->next;
+        worker_waiter_t *waiter = iter->data;
+        if( waiter->seq != seq )
+            continue;
+        worker_waiters = g_slist_delete_link(worker_waiters, iter);
+        waiter->cb(waiter->seq, result, waiter->aptr);
+        g_free(waiter);
+    }
+}
+
+/** Notify all waiting callbacks that commands were abandoned
+ */
+static void
+worker_cancel_done_cbs(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    while( worker_waiters ) {
+        worker_waiter_t *waiter = worker_waiters->data;
+        worker_waiters = g_slist_delete_link(worker_waiters, worker_waiters);
+        waiter->cb(waiter->seq, WORKER_RESULT_ABORTED, waiter->aptr);
+        g_free(waiter);
+    }
+}
+
+/** Handle command completion in the main thread
+ *
+ * @param msg  completion message
+ */
+static void
+worker_handle_completion(const worker_msg_t *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( msg->cmd != WORKER_CMD_MODE && worker_inflight > 0 )
+        --worker_inflight;
+
+    if( msg->seq == worker_verify_seq )
+        worker_verify_seq = 0;
+
+    log_debug("%s #%u %s: queued %lld us, executed in %lld us",
+              worker_cmd_repr(msg->cmd), msg->seq,
+              worker_result_repr(msg->result),
+              (long long)(msg->started_us - msg->posted_us),
+              (long long)(msg->done_us - msg->started_us));
+
+    /* Completion of older mode requests is not interesting, as
+     * a newer one is still being worked on and waiters have already
+     * been told the older ones were superseded */
+    if( msg->cmd == WORKER_CMD_MODE ) {
+        if( msg->seq != worker_mode_seq )
+            goto EXIT;
+
+        /* Worker might have overridden the requested mode */
+        g_free(worker_posted_mode), worker_posted_mode = g_strdup(msg->mode);
+        control_mode_switched(msg->mode);
+    }
+
+    worker_run_done_cbs(msg->seq, msg->result);
+
+EXIT:
+    return;
+}
+
+/** Handle mode request completion in the main thread
+ */
+static void
+worker_handle_mode_completion(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_msg_t *msg = __atomic_exchange_n(&worker_mode_rsp, 0,
+                                            __ATOMIC_ACQ_REL);
+    if( msg ) {
+        worker_handle_completion(msg);
+        g_free(msg->mode), g_free(msg);
+    }
+}
+
+/** Take commands posted by the main thread
+ *
+ * Mode requests are coalesced, the latest one wins. Refresh and
+ * verify commands are set aside until mode switch is finished.
+ *
+ * @return true if mode request or abort command was received,
+ *         false otherwise
+ */
+static bool
+worker_receive(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool          received = false;
+    worker_msg_t  msg;
+    worker_msg_t *req;
+
+    while( worker_queue_pop(&worker_cmd_queue, &msg) ) {
+        msg.started_us = common_get_monotonic_us();
+
+        log_debug("received %s #%u", worker_cmd_repr(msg.cmd), msg.seq);
+
+        switch( msg.cmd ) {
+        case WORKER_CMD_ABORT:
+            worker_complete(&worker_abort_cmd, WORKER_RESULT_DONE);
+            worker_abort_cmd = msg;
+            received = true;
+            break;
+
+        default:
+            /* Can't overflow as main thread limits commands in flight */
+            if( worker_deferred_count < WORKER_QUEUE_SIZE )
+                worker_deferred[worker_deferred_count++] = msg;
+            else
+                worker_complete(&msg, WORKER_RESULT_FAILED);
+            break;
+        }
+    }
+
+    /* Mode request is taken after queued commands, so that an abort
+     * given before the request does not apply to it */
+    if( (req = __atomic_exchange_n(&worker_mode_req, 0, __ATOMIC_ACQ_REL)) ) {
+        req->started_us = common_get_monotonic_us();
+
+        log_debug("received %s #%u %s", worker_cmd_repr(req->cmd),
+                  req->seq, req->mode);
+
+        /* Main thread has already notified waiters of the old one */
+        g_free(worker_mode_cmd.mode);
+        worker_mode_cmd = *req;
+        g_free(req);
+
+        worker_complete(&worker_abort_cmd, WORKER_RESULT_DONE);
+        worker_set_requested_mode(worker_mode_cmd.mode);
+        received = true;
+    }
+
+    return received;
+}
+
+/** Pass command completion to the main thread
+ *
+ * @param msg     command to complete; cleared afterwards
+ * @param result  how the command was completed
+ */
+static void
+worker_complete(worker_msg_t *msg, worker_result_t result)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !msg->seq )
+        goto EXIT;
+
+    msg->result  = result;
+    msg->done_us = common_get_monotonic_us();
+
+    if( msg->cmd == WORKER_CMD_MODE ) {
+        g_free(msg->mode);
+        msg->mode = g_strdup(worker_get_requested_mode());
+
+        /* Only the latest finished mode request is of interest */
+        worker_msg_t *rsp = g_malloc0(sizeof *rsp);
+        *rsp = *msg;
+        rsp = __atomic_exchange_n(&worker_mode_rsp, rsp, __ATOMIC_ACQ_REL);
+        if( rsp )
+            g_free(rsp->mode), g_free(rsp);
+    }
+    /* Can't overflow as main thread limits commands in flight */
+    else if( !worker_queue_push(&worker_rsp_queue, msg) ) {
+        log_crit("completion queue full; %s #%u lost",
+                 worker_cmd_repr(msg->cmd), msg->seq);
+        g_free(msg->mode);
+    }
+
+    worker_notify();
+
+    memset(msg, 0, sizeof *msg);
+
+EXIT:
+    return;
+}
+
+/** Complete mode request currently being served
+ *
+ * @param result  how the mode switch ended
+ */
+static void
+worker_complete_mode(worker_result_t result)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_complete(&worker_mode_cmd, result);
+}
+
+/** Execute commands that were set aside during mode switch
+ */
+static void
+worker_execute_deferred(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; i < worker_deferred_count; ++i ) {
+        worker_msg_t *msg = &worker_deferred[i];
+
+        switch( msg->cmd ) {
+        case WORKER_CMD_REFRESH:
+            network_update();
+            break;
+        case WORKER_CMD_VERIFY:
+            modesetting_verify_values();
+            break;
+        default:
+            break;
+        }
+
+        worker_complete(msg, WORKER_RESULT_DONE);
+    }
+
+    worker_deferred_count = 0;
+}
+
+/** Discard commands and completions that were not processed
+ *
+ * Note: Must be called only while worker thread is not running.
+ */
+static void
+worker_forget_commands(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(worker_mode_cmd.mode);
+    memset(&worker_mode_cmd, 0, sizeof worker_mode_cmd);
+
+    g_free(worker_abort_cmd.mode);
+    memset(&worker_abort_cmd, 0, sizeof worker_abort_cmd);
+
+    for( size_t i = 0; i < worker_deferred_count; ++i )
+        g_free(worker_deferred[i].mode);
+    worker_deferred_count = 0;
+
+    worker_msg_t *msg;
+    if( (msg = __atomic_exchange_n(&worker_mode_req, 0, __ATOMIC_ACQ_REL)) )
+        g_free(msg->mode), g_free(msg);
+    if( (msg = __atomic_exchange_n(&worker_mode_rsp, 0, __ATOMIC_ACQ_REL)) )
+        g_free(msg->mode), g_free(msg);
+
+    worker_queue_flush(&worker_cmd_queue);
+    worker_queue_flush(&worker_rsp_queue);
+    worker_inflight   = 0;
+    worker_verify_seq = 0;
+
+    worker_cancel_done_cbs();
+}
+
+/* ------------------------------------------------------------------------- *
+ * MODE_SWITCH
+ * ------------------------------------------------------------------------- */
+
+static bool
+worker_mode_is_charging(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Mode mapping should mean we only see MODE_CHARGING here, but just
+     * in case redirect fixed charging related things to charging ... */
+    return (!strcmp(mode, MODE_CHARGING) ||
+            !strcmp(mode, MODE_CHARGING_FALLBACK) ||
+            !strcmp(mode, MODE_CHARGER) ||
+            !strcmp(mode, MODE_UNDEFINED) ||
+            !strcmp(mode, MODE_ASK));
+}
+
+static bool
+worker_phase_charging_p(const worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return worker_mode_is_charging(sw->mode);
+}
+
+static bool
+worker_phase_dynamic_p(const worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return !worker_mode_is_charging(sw->mode);
+}
+
+/** When dealing with configfs, we can't enable UDC without
+ *  already having mtpd running */
+static bool
+worker_phase_mtp_early_p(const worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return worker_mode_is_mtp_mode(sw->mode) && configfs_in_use();
+}
+
+/** When dealing with android usb, it must be enabled before
+ *  we can start mtpd. Assumption is that the same applies
+ *  when using kernel modules. */
+static bool
+worker_phase_mtp_late_p(const worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return worker_mode_is_mtp_mode(sw->mode) && !configfs_in_use();
+}
+
+static bool
+worker_phase_check_policy(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( usbmoded_can_export() )
+        return true;
+
+    log_warning("Policy does not allow mode: %s", sw->mode);
+    return false;
+}
+
+static bool
+worker_phase_lookup_mode(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !(sw->data = usbmoded_ref_modedata(sw->mode)) ) {
+        log_warning("Matching mode %s was not found.", sw->mode);
+        return false;
+    }
+
+    log_debug("Matching mode %s found.", sw->mode);
+
+    /* set data before calling any of the dynamic mode functions
+     * as they will use the worker_get_usb_mode_data function */
+    worker_set_usb_mode_data(sw->data);
+    return true;
+}
+
+static void
+worker_phase_forget_mode(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_set_usb_mode_data(NULL);
+    modedata_unref(sw->data), sw->data = 0;
+}
+
+static bool
+worker_phase_start_mtp(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)sw;
+    return worker_mount_mtp_device() && worker_start_mtpd();
+}
+
+static void
+worker_phase_stop_mtp(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)sw;
+
+    /* Unmount too, so that the next mode gets to mount
+     * the device with appropriate uid/gid values */
+    worker_stop_mtpd();
+    worker_unmount_mtp_device();
+}
+
+static bool
+worker_phase_set_kernel_module(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return worker_set_kernel_module(sw->data->mode_module);
+}
+
+static bool
+worker_phase_enter_dynamic_mode(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)sw;
+    return modesetting_enter_dynamic_mode();
+}
+
+static void
+worker_phase_leave_dynamic_mode(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)sw;
+    modesetting_leave_dynamic_mode();
+}
+
+static bool
+worker_phase_switch_to_charging(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)sw;
+    return worker_switch_to_charging();
+}
+
+/** Mode switch pipeline, executed in order
+ *
+ * Kernel module is not rolled back, as whatever gets activated
+ * next needs to set it up anyway.
+ */
+static const worker_phase_t worker_phase_lut[] =
+{
+    {
+        .name     = "check_policy",
+        .wanted   = worker_phase_dynamic_p,
+        .apply    = worker_phase_check_policy,
+    },
+    {
+        .name     = "lookup_mode",
+        .wanted   = worker_phase_dynamic_p,
+        .apply    = worker_phase_lookup_mode,
+        .rollback = worker_phase_forget_mode,
+    },
+    {
+        .name     = "start_mtp",
+        .wanted   = worker_phase_mtp_early_p,
+        .apply    = worker_phase_start_mtp,
+        .rollback = worker_phase_stop_mtp,
+    },
+    {
+        .name     = "set_kernel_module",
+        .wanted   = worker_phase_dynamic_p,
+        .apply    = worker_phase_set_kernel_module,
+    },
+    {
+        .name     = "enter_dynamic_mode",
+        .wanted   = worker_phase_dynamic_p,
+        .apply    = worker_phase_enter_dynamic_mode,
+        .rollback = worker_phase_leave_dynamic_mode,
+    },
+    {
+        .name     = "start_mtp",
+        .wanted   = worker_phase_mtp_late_p,
+        .apply    = worker_phase_start_mtp,
+        .rollback = worker_phase_stop_mtp,
+    },
+    {
+        .name     = "switch_to_charging",
+        .wanted   = worker_phase_charging_p,
+        .apply    = worker_phase_switch_to_charging,
+    },
+};
+
+/** Check for mode requests made after mode switch was started
+ *
+ * Pending commands are taken from the queue, i.e. blocking waits are
+ * not canceled anymore. An abort command is left in worker_abort_cmd
+ * for the caller to act on.
+ *
+ * @param mode   hardware mode currently being activated
+ * @param newer  where to store newer target mode, or NULL if
+ *               target mode did not change; caller must g_free()
+ *
+ * @return true if there was a pending request, false otherwise
+ */
+static bool
+worker_pending_request(const char *mode, gchar **newer)
+{
+    LOG_REGISTER_CONTEXT;
+
+    *newer = 0;
+
+    /* Clear the flag before checking the queue, so that commands
+     * posted after this are not missed */
+    bool pending = __atomic_exchange_n(&worker_bailout_requested, false,
+                                       __ATOMIC_SEQ_CST);
+    worker_bailout_handled = false;
+
+    /* Consume wakeups before checking for commands, so that the
+     * worker thread does not get woken up for them later on, but
+     * commands posted after this still trigger a wakeup */
+    worker_consume_wakeup();
+
+    /* Refresh / verify commands just get deferred, they do not count
+     * as reasons to retry failed phases */
+    if( worker_receive() )
+        pending = true;
+
+    const char *activate =
+        common_map_mode_to_hardware(worker_get_requested_mode());
+    if( g_strcmp0(activate, mode) )
+        *newer = g_strdup(activate);
+
+    return pending;
+}
+
+/** Clean up whatever the previously activated mode had set up
+ */
+static void
+worker_leave_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    log_debug("Cleaning up previous mode");
+
+    /* Either mtp daemon is not needed, or it must be *started* in
+     * correct phase of gadget configuration when entering mtp mode.
+     *
+     * Similarly, unmount mtp device to make sure sure it gets mounted
+     * with appropriate uid/gid values when it is actually needed.
+     */
+    latency_phase("stop_mtpd");
+    worker_stop_mtpd();
+    latency_phase("unmount_mtp");
+    worker_unmount_mtp_device();
+
+    if( worker_get_usb_mode_data() ) {
+        latency_phase("leave_dynamic_mode");
+        modesetting_leave_dynamic_mode();
+        worker_set_usb_mode_data(NULL);
+    }
+
+    /* Mode specific applications have been stopped and we can
+     * take updated appsync configuration in use.
+     */
+    latency_phase("appsync_config");
+    appsync_switch_configuration();
+}
+
+/** Undo applied mode switch phases in reverse order
+ *
+ * @param sw  mode switch state
+ */
+static void
+worker_rollback(worker_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = G_N_ELEMENTS(worker_phase_lut); i-- > 0; ) {
+        const worker_phase_t *phase = &worker_phase_lut[i];
+
+        if( !(sw->applied & (1u << i)) || !phase->rollback )
+            continue;
+
+        log_debug("rollback: %s", phase->name);
+        phase->rollback(sw);
+    }
+
+    sw->applied = 0;
+}
+
+/** Activate hardware mode
+ *
+ * Previously active mode is cleaned up once, after which the phases
+ * in worker_phase_lut are applied. Before each phase - and after a
+ * failed one - pending mode requests are checked. If the target mode
+ * has changed, phases done so far are rolled back and the pipeline
+ * restarts with the latest target, skipping the intermediate ones.
+ * On abort command phases are rolled back and charging mode is used.
+ *
+ * @param mode  hardware mode to activate
+ */
+static void
+worker_switch_to_mode(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_switch_t  sw       = { .mode = g_strdup(mode) };
+    const char      *override = 0;
+    gchar           *newer    = 0;
+    bool             aborted  = false;
+
+    G_STATIC_ASSERT(G_N_ELEMENTS(worker_phase_lut) <= 32);
+
+    latency_transition_begin(sw.mode);
+
+    /* Gadget disconnects seen from now on are self-induced */
+    umudev_reconfig_begin();
+
+    worker_leave_mode();
+
+RESTART:
+    log_debug("Setting %s", sw.mode);
+
+    for( size_t i = 0; i < G_N_ELEMENTS(worker_phase_lut); ++i ) {
+        const worker_phase_t *phase = &worker_phase_lut[i];
+
+        if( phase->wanted && !phase->wanted(&sw) )
+            continue;
+
+        bool pending = worker_pending_request(sw.mode, &newer);
+        if( worker_abort_cmd.seq )
+            goto ABORTED;
+        if( pending && newer )
+            goto PREEMPTED;
+
+        latency_phase(phase->name);
+        sw.applied |= 1u << i;
+
+        if( !phase->apply(&sw) ) {
+            /* Failure might have been caused by canceled waits */
+            pending = worker_pending_request(sw.mode, &newer);
+            if( worker_abort_cmd.seq )
+                goto ABORTED;
+            if( pending )
+                goto PREEMPTED;
+            goto FAILED;
+        }
+    }
+
+    goto SUCCESS;
+
+PREEMPTED:
+    /* Cleanup should be executed without bailing out */
+    worker_bailout_handled = true;
+    latency_phase("rollback");
+    worker_rollback(&sw);
+    worker_bailout_handled = false;
+
+    if( newer ) {
+        log_debug("mode switch preempted: %s -> %s", sw.mode, newer);
+        latency_transition_end(false);
+        g_free(sw.mode), sw.mode = newer, newer = 0;
+        latency_transition_begin(sw.mode);
+    }
+    else {
+        log_debug("mode switch interrupted: retry %s", sw.mode);
+    }
+    goto RESTART;
+
+ABORTED:
+    g_free(newer), newer = 0;
+    log_warning("mode switch to %s aborted", sw.mode);
+    aborted = true;
+    /* Fall through: clean up as if the mode switch had failed */
+
+FAILED:
+    worker_bailout_handled = true;
+
+    /* Undo any changes we might have might have already done */
+    latency_phase("rollback");
+    log_debug("Cleaning up failed mode switch");
+    worker_rollback(&sw);
+
+    /* From usb configuration point of view MODE_UNDEFINED and
+     * MODE_CHARGING are the same, but for the purposes of exposing
+     * a sane state over D-Bus we need to differentiate between
+     * "failure to set mode" and "aborting mode setting due to cable
+     * disconnect" by inspecting whether target mode has been
+     * switched to undefined.
+     */
+    const char *requested = worker_get_requested_mode();
+    if( !g_strcmp0(requested, MODE_UNDEFINED) )
+        override = MODE_UNDEFINED;
+    else
+        override = MODE_CHARGING;
+
+    if( !worker_mode_is_charging(sw.mode) ) {
+        log_warning("mode setting failed, try %s", override);
+        latency_phase("switch_to_charging");
+        if( worker_switch_to_charging() )
+            goto SUCCESS;
+    }
+
+    log_crit("failed to activate charging, all bets are off");
+
+    /* FIXME: double check this error path */
+
+    /* If we get here then usb_module loading failed,
+     * no mode matched, and charging setup failed too.
+     */
+
+    override = MODE_UNDEFINED;
+    log_warning("mode setting failed, fallback to %s", override);
+    worker_set_kernel_module(MODULE_NONE);
+
+SUCCESS:
+
+    if( override ) {
+        worker_set_requested_mode(override);
+        override = common_map_mode_to_hardware(override);
+        worker_set_activated_mode(override);
+    }
+    else {
+        worker_set_activated_mode(sw.mode);
+    }
+
+    latency_transition_end(override == 0);
+
+    umudev_reconfig_end();
+
+    worker_complete_mode(aborted  ? WORKER_RESULT_ABORTED :
+                         override ? WORKER_RESULT_FAILED  :
+                         WORKER_RESULT_DONE);
+
+    modedata_unref(sw.data);
+    g_free(sw.mode);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- *
+ * WORKER_THREAD
+ * ------------------------------------------------------------------------- */
+
+/** Get file descriptor that becomes readable when worker should bail out
+ *
+ * Can be used for interrupting blocking waits in the worker thread.
+ *
+ * @return file descriptor to poll for input, or -1 if not applicable
+ */
+int
+worker_get_bailout_fd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_thread_p() || worker_bailout_handled )
+        return -1;
+
+    return worker_req_evfd;
+}
+
+static guint
+worker_add_iowatch(int fd, bool close_on_unref,
+               GIOCondition cnd, GIOFunc io_cb, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    guint         wid = 0;
+    GIOChannel   *chn = 0;
+
+    if( !(chn = g_io_channel_unix_new(fd)) )
+        goto cleanup;
+
+    g_io_channel_set_close_on_unref(chn, close_on_unref);
+
+    cnd |= G_IO_ERR | G_IO_HUP | G_IO_NVAL;
+
+    if( !(wid = g_io_add_watch(chn, cnd, io_cb, aptr)) )
+        goto cleanup;
+
+cleanup:
+    if( chn != 0 ) g_io_channel_unref(chn);
+
+    return wid;
+
+}
+
+static void *worker_thread_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    /* Async cancellation, but disabled */
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
 
@@ -934,7 +1980,8 @@ static void *worker_thread_cb(void *aptr)
             continue;
 
         if( cnt > 0 ) {
-            worker_bailout_requested = false;
+            __atomic_store_n(&worker_bailout_requested, false,
+                             __ATOMIC_SEQ_CST);
             worker_bailout_handled = false;
             worker_execute();
         }
@@ -987,15 +2034,12 @@ worker_notify_cb(GIOChannel *chn, GIOCondition cnd, gpointer data)
     if( rc != sizeof cnt )
         goto cleanup_nak;
 
-    {
-        WORKER_LOCKED_ENTER;
-        const char *mode = worker_get_requested_mode_locked();
-        gchar *work = g_strdup(mode);
-        WORKER_LOCKED_LEAVE;
-
-        control_mode_switched(work);
-        g_free(work);
+    worker_msg_t msg;
+    while( worker_queue_pop(&worker_rsp_queue, &msg) ) {
+        worker_handle_completion(&msg);
+        g_free(msg.mode);
     }
+    worker_handle_mode_completion();
 
 cleanup_ack:
     keep_going = TRUE;
@@ -1138,19 +2182,43 @@ worker_quit(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    /* Make possibly ongoing mode switch bail out from blocking waits */
+    if( worker_thread_id && worker_req_evfd != -1 )
+        worker_abort_mode_switch();
+
     worker_stop_thread();
     worker_delete_eventfd();
 
     /* Worker thread is stopped and resources can be released. */
+    worker_forget_commands();
     worker_set_usb_mode_data(0);
 }
 
-void
-worker_wakeup(void)
+/** Consume pending wakeups without blocking
+ *
+ * Note: This function should be called only from the worker thread.
+ */
+static void
+worker_consume_wakeup(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    worker_bailout_requested = true;
+    struct pollfd pfd = { .fd = worker_req_evfd, .events = POLLIN };
+    if( poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN) )
+        goto EXIT;
+
+    uint64_t cnt = 0;
+    if( read(worker_req_evfd, &cnt, sizeof cnt) == -1 )
+        log_warning("failed to consume wakeup: %m");
+
+EXIT:
+    return;
+}
+
+static void
+worker_wakeup(void)
+{
+    LOG_REGISTER_CONTEXT;
 
     uint64_t cnt = 1;
     if( write(worker_req_evfd, &cnt, sizeof cnt) == -1 ) {
@@ -31,6 +31,36 @@
  * Constants
  * ========================================================================= */
 
+/** Commands the main thread can give to the worker thread */
+typedef enum worker_cmd_t
+{
+    WORKER_CMD_MODE,    // activate hardware mode
+    WORKER_CMD_REFRESH, // re-apply settings of the active mode
+    WORKER_CMD_VERIFY,  // check that gadget configuration is intact
+    WORKER_CMD_ABORT,   // abandon ongoing mode switch
+} worker_cmd_t;
+
+/** How a worker command was completed */
+typedef enum worker_result_t
+{
+    WORKER_RESULT_DONE,       // executed successfully
+    WORKER_RESULT_FAILED,     // executed, but failed
+    WORKER_RESULT_SUPERSEDED, // mode request replaced by a newer one
+    WORKER_RESULT_ABORTED,    // abandoned due to abort or exit
+} worker_result_t;
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Callback for getting notified about command completion
+ *
+ * @param seq     command sequence number
+ * @param result  how the command was completed
+ * @param aptr    user data pointer
+ */
+typedef void (*worker_done_fn)(unsigned seq, worker_result_t result, void *aptr);
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -40,16 +70,23 @@
  * ------------------------------------------------------------------------- */
 
 bool              worker_bailing_out          (void);
+int               worker_get_bailout_fd       (void);
 const char       *worker_get_kernel_module    (void);
 bool              worker_set_kernel_module    (const char *module);
 void              worker_clear_kernel_module  (void);
 const modedata_t *worker_get_usb_mode_data    (void);
-modedata_t       *worker_dup_usb_mode_data    (void);
+const modedata_t *worker_ref_usb_mode_data    (void);
 void              worker_set_usb_mode_data    (const modedata_t *data);
-bool              worker_request_hardware_mode(const char *mode);
+const char       *worker_cmd_repr             (worker_cmd_t cmd);
+const char       *worker_result_repr          (worker_result_t result);
+unsigned          worker_request_hardware_mode(const char *mode);
+unsigned          worker_get_request_seq      (void);
+unsigned          worker_refresh_mode         (void);
+unsigned          worker_verify_mode          (void);
+unsigned          worker_abort_mode_switch    (void);
+bool              worker_add_done_cb          (unsigned seq, worker_done_fn cb, void *aptr);
 void              worker_clear_hardware_mode  (void);
 bool              worker_init                 (void);
 void              worker_quit                 (void);
-void              worker_wakeup               (void);
 
 #endif /* USB_MODED_WORKER_H_ */
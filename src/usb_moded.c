@@ -39,6 +39,8 @@
 
 #include "usb_moded-android.h"
 #include "usb_moded-appsync.h"
+#include "usb_moded-backend.h"
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-configfs.h"
 #include "usb_moded-control.h"
@@ -63,10 +65,6 @@
 #include <getopt.h>
 #include <unistd.h>
 
-#ifdef SAILFISH_ACCESS_CONTROL
-# include <sailfishaccesscontrol.h>
-#endif
-
 #ifdef SYSTEMD
 # include <systemd/sd-daemon.h>
 #endif
@@ -109,17 +107,20 @@
  * USBMODED
  * ------------------------------------------------------------------------- */
 
+static modesnapshot_t *usbmoded_ref_modesnapshot     (void);
+static void        usbmoded_publish_modesnapshot      (modesnapshot_t *snapshot);
 GList             *usbmoded_get_modelist              (void);
 void               usbmoded_load_modelist             (void);
 void               usbmoded_free_modelist             (void);
-static modedata_t *usbmoded_lookup_modedata           (const char *modename);
 const modedata_t  *usbmoded_get_modedata              (const char *modename);
 void               usbmoded_refresh_modedata          (const char *modename);
-modedata_t        *usbmoded_dup_modedata              (const char *modename);
+const modedata_t  *usbmoded_ref_modedata              (const char *modename);
 bool               usbmoded_get_rescue_mode           (void);
 void               usbmoded_set_rescue_mode           (bool rescue_mode);
 bool               usbmoded_get_diag_mode             (void);
 void               usbmoded_set_diag_mode             (bool diag_mode);
+bool               usbmoded_is_mode_hidden            (const char *modename);
+bool               usbmoded_is_mode_whitelisted       (const char *modename);
 bool               usbmoded_is_mode_permitted         (const char *modename, uid_t uid);
 void               usbmoded_set_cable_connection_delay(int delay_ms);
 int                usbmoded_get_cable_connection_delay(void);
@@ -175,6 +176,23 @@ static pthread_mutex_t  usbmoded_mutex = PTHREAD_MUTEX_INITIALIZER;
     }\
 }while(0)
 
+/** Mutex held only while taking a reference to published snapshot */
+static pthread_mutex_t  usbmoded_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SNAPSHOT_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&usbmoded_snapshot_mutex) != 0 ) { \
+        log_crit("SNAPSHOT LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define SNAPSHOT_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&usbmoded_snapshot_mutex) != 0 ) { \
+        log_crit("SNAPSHOT UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -183,11 +201,57 @@ static pthread_mutex_t  usbmoded_mutex = PTHREAD_MUTEX_INITIALIZER;
  * MODELIST
  * ------------------------------------------------------------------------- */
 
-/** List of mode data items read from configuration files
+/** Published snapshot of mode data items read from configuration files
+ *
+ * The snapshot is replaced as a whole when mode data changes. Main
+ * thread, which is the only one making changes, can use it directly.
+ *
+ * Note: Other threads should access this only via
+ *       #usbmoded_ref_modesnapshot() or #usbmoded_ref_modedata().
+ */
+static modesnapshot_t *usbmoded_modesnapshot = 0;
+
+/** Get reference to currently published mode list snapshot
  *
- * Note: Worker thread should access this only via #usbmoded_dup_modedata().
+ * Caller must release the returned object via #modesnapshot_unref().
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @return snapshot object, or NULL
+ */
+static modesnapshot_t *
+usbmoded_ref_modesnapshot(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    SNAPSHOT_LOCKED_ENTER;
+    modesnapshot_t *snapshot = modesnapshot_ref(usbmoded_modesnapshot);
+    SNAPSHOT_LOCKED_LEAVE;
+
+    return snapshot;
+}
+
+/** Replace published mode list snapshot
+ *
+ * Threads holding a reference to the previous snapshot can keep
+ * using it until they drop the reference.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param snapshot  snapshot object, or NULL; ownership is transferred
  */
-static GList *usbmoded_modelist = 0;
+static void
+usbmoded_publish_modesnapshot(modesnapshot_t *snapshot)
+{
+    LOG_REGISTER_CONTEXT;
+
+    SNAPSHOT_LOCKED_ENTER;
+    modesnapshot_t *previous = usbmoded_modesnapshot;
+    usbmoded_modesnapshot = snapshot;
+    SNAPSHOT_LOCKED_LEAVE;
+
+    modesnapshot_unref(previous);
+}
 
 /** Get list of dynamic mode data items
  *
@@ -200,7 +264,7 @@ usbmoded_get_modelist(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    return usbmoded_modelist;
+    return modesnapshot_get_modelist(usbmoded_modesnapshot);
 }
 
 /** Load dynamic mode data items
@@ -212,14 +276,11 @@ usbmoded_load_modelist(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    USBMODED_LOCKED_ENTER;
-
-    if( !usbmoded_modelist ) {
+    if( !usbmoded_modesnapshot ) {
         log_notice("load modelist");
-        usbmoded_modelist = modelist_load(usbmoded_get_diag_mode());
+        GList *modelist = modelist_load(usbmoded_get_diag_mode());
+        usbmoded_publish_modesnapshot(modesnapshot_create(modelist));
     }
-
-    USBMODED_LOCKED_LEAVE;
 }
 
 /** Free dynamic mode data items
@@ -231,40 +292,10 @@ usbmoded_free_modelist(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    USBMODED_LOCKED_ENTER;
-
-    if( usbmoded_modelist ) {
+    if( usbmoded_modesnapshot ) {
         log_notice("free modelist");
-        modelist_free(usbmoded_modelist),
-            usbmoded_modelist = 0;
+        usbmoded_publish_modesnapshot(0);
     }
-
-    USBMODED_LOCKED_LEAVE;
-}
-
-/** Lookup dynamic mode data by name
- *
- * Note: Helper for local use only
- *
- * @param modename  Name of mode to lookup
- *
- * @return Mode data object, or NULL
- */
-static modedata_t *
-usbmoded_lookup_modedata(const char *modename)
-{
-    LOG_REGISTER_CONTEXT;
-
-    modedata_t *modedata = 0;
-
-    for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) ) {
-        modedata_t *data = iter->data;
-        if( !g_strcmp0(data->mode_name, modename) ) {
-            modedata = data;
-            break;
-        }
-    }
-    return modedata;
 }
 
 /** Lookup dynamic mode data by name
@@ -280,10 +311,14 @@ usbmoded_get_modedata(const char *modename)
 {
     LOG_REGISTER_CONTEXT;
 
-    return usbmoded_lookup_modedata(modename);
+    return modeindex_lookup(modesnapshot_get_modeindex(usbmoded_modesnapshot),
+                            modename);
 }
 
 /** Refresh settings cached in dynamic mode
+ *
+ * Published mode data is not modified. Instead a new snapshot with
+ * updated copy of the mode data is published.
  *
  * Note: This function should be called only from the main thread.
  *
@@ -294,31 +329,43 @@ usbmoded_refresh_modedata(const char *modename)
 {
     LOG_REGISTER_CONTEXT;
 
-    modedata_t *modedata = usbmoded_lookup_modedata(modename);
-    if( modedata )
-        modedata_cache_settings(modedata);
+    const modedata_t *current  = usbmoded_get_modedata(modename);
+    modedata_t       *modedata = 0;
+
+    if( !current )
+        goto EXIT;
+
+    if( !(modedata = modedata_copy(current)) )
+        goto EXIT;
+
+    modedata_cache_settings(modedata);
+    usbmoded_publish_modesnapshot(modesnapshot_replace_mode(usbmoded_modesnapshot,
+                                                            modedata));
+
+EXIT:
+    modedata_unref(modedata);
 }
 
-/** Lookup and clone dynamic mode data by name
+/** Lookup dynamic mode data by name and get a reference to it
  *
  * Note: This function is safe to call from worker thread too.
  *
- * Caller must release the returned object via #modedata_free().
+ * Caller must release the returned object via #modedata_unref().
  *
  * @param modename  Name of mode to lookup
  *
  * @return Mode data object, or NULL
  */
-modedata_t *
-usbmoded_dup_modedata(const char *modename)
+const modedata_t *
+usbmoded_ref_modedata(const char *modename)
 {
     LOG_REGISTER_CONTEXT;
 
-    USBMODED_LOCKED_ENTER;
-
-    modedata_t *modedata = modedata_copy(usbmoded_get_modedata(modename));
-
-    USBMODED_LOCKED_LEAVE;
+    modesnapshot_t   *snapshot = usbmoded_ref_modesnapshot();
+    const modedata_t *modedata =
+        modedata_ref(modeindex_lookup(modesnapshot_get_modeindex(snapshot),
+                                      modename));
+    modesnapshot_unref(snapshot);
 
     return modedata;
 }
@@ -394,14 +441,55 @@ void usbmoded_set_diag_mode(bool diag_mode)
  * ACCESS_CHECKS
  * ------------------------------------------------------------------------- */
 
+/** Check if dynamic mode is listed in hidden modes config
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param modename  Name of mode
+ *
+ * @return true if mode is hidden, false otherwise
+ */
+bool usbmoded_is_mode_hidden(const char *modename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modesnapshot_t *snapshot = usbmoded_ref_modesnapshot();
+    USBMODED_LOCKED_ENTER;
+    bool hidden = modeindex_is_hidden(modesnapshot_get_modeindex(snapshot), modename);
+    USBMODED_LOCKED_LEAVE;
+    modesnapshot_unref(snapshot);
+
+    return hidden;
+}
+
+/** Check if dynamic mode is allowed by mode whitelist config
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param modename  Name of mode
+ *
+ * @return true if mode exists and whitelist does not exclude it,
+ *         false otherwise
+ */
+bool usbmoded_is_mode_whitelisted(const char *modename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modesnapshot_t *snapshot = usbmoded_ref_modesnapshot();
+    USBMODED_LOCKED_ENTER;
+    bool whitelisted = modeindex_is_whitelisted(modesnapshot_get_modeindex(snapshot), modename);
+    USBMODED_LOCKED_LEAVE;
+    modesnapshot_unref(snapshot);
+
+    return whitelisted;
+}
+
 bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
 {
 #ifdef SAILFISH_ACCESS_CONTROL
     LOG_REGISTER_CONTEXT;
 
-    bool        allowed = true;
-    modedata_t *data = 0;
-    char       *group = 0;
+    bool allowed = true;
 
     /* all modes are allowed for root */
     if( uid == 0 )
@@ -413,20 +501,16 @@ bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
         goto EXIT;
     }
 
-    /* non-dynamic modes are allowed for all */
-    if( !(data = usbmoded_dup_modedata(modename)) )
-        goto EXIT;
-
-    /* dynamic modes are allowed based on group,
-     * which defaults to sailfish-system meaning device owner only */
-    group = config_get_group_for_mode(modename);
-    allowed = sailfish_access_control_hasgroup(uid, group);
+    /* non-dynamic modes are allowed for all, dynamic modes are
+     * allowed based on group, which defaults to sailfish-system
+     * meaning device owner only */
+    modesnapshot_t *snapshot = usbmoded_ref_modesnapshot();
+    USBMODED_LOCKED_ENTER;
+    allowed = modeindex_is_permitted(modesnapshot_get_modeindex(snapshot), modename, uid);
+    USBMODED_LOCKED_LEAVE;
+    modesnapshot_unref(snapshot);
 
 EXIT:
-
-    g_free(group);
-    modedata_free(data);
-
     return allowed;
 
 #else
@@ -677,6 +761,7 @@ void usbmoded_set_init_done(bool reached)
         if( usbmoded_init_done_reached )
             usbmoded_set_rescue_mode(false);
 
+        backend_init_done_changed();
         control_init_done_changed();
     }
 }
@@ -727,6 +812,11 @@ void usbmoded_handle_signal(int signum)
         /* Assume: Stopped by init process */
         usbmoded_exit_mainloop(EXIT_SUCCESS);
     }
+    else if( signum == SIGUSR1 )
+    {
+        /* Toggle function tracing */
+        trace_set_enabled(!trace_get_enabled());
+    }
     else if( signum == SIGHUP )
     {
         /* Reload mode list
@@ -885,30 +975,13 @@ static bool usbmoded_init(void)
 
     /* During bootup the sysfs control structures might
      * not be already in there when usb-moded starts up.
-     * Retry few times unless init done is / gets reached
-     * while waiting.
-     *
-     * Note that waiting here delays also systemd notification
-     * -> changes in wait time might require adjustemnts to
-     *    startup timeout value in usb-moded.service file.
+     * Instead of blocking startup and systemd notification,
+     * track their arrival and hold back mode selection until
+     * a backend gets selected.
      */
-    for( int i = 10; ; ) {
-        if( configfs_init() )
-            break;
-
-        if( android_init() )
-            break;
-
-        /* Must probe / poll since we're not yet running mainloop */
-        usbmoded_probe_init_done();
-
-        if( usbmoded_init_done_p() || --i <= 0 ) {
-            if( !modules_init() )
-                log_crit("No supported usb control mechanisms found");
-            break;
-        }
-
-        common_msleep(2000);
+    if( !backend_init() ) {
+        log_crit("gadget backend discovery could not be started");
+        goto EXIT;
     }
 
     /* Allow making systemd control ipc */
@@ -1021,6 +1094,7 @@ static void usbmoded_cleanup(void)
     umudev_quit();
 
     /* Do backend specific cleanup */
+    backend_quit();
     modules_quit();
     android_quit();
     configfs_quit();
@@ -1046,6 +1120,9 @@ static void usbmoded_cleanup(void)
 
     modesetting_quit();
 
+    /* Undo config_init() */
+    config_quit();
+
     /* Detach from SessionBus connection used for APP_SYNC_DBUS.
      *
      * Can be handled separately from SystemBus side wind down. */
@@ -1074,6 +1151,8 @@ static const char usbmoded_usage_info[] =
 "      log to syslog\n"
 "  -T,  --force-stderr\n"
 "      log to stderr\n"
+"  -j,  --force-journal\n"
+"      log to systemd journal with structured fields\n"
 "  -l,  --log-line-info\n"
 "      log to stderr and show origin of logging\n"
 "  -D,  --debug\n"
@@ -1100,6 +1179,14 @@ static const char usbmoded_usage_info[] =
 "      Dump usb-moded D-Bus introspect data to stdout.\n"
 "  -B --dbus-busconfig-xml\n"
 "      Dump usb-moded D-Bus busconfig data to stdout.\n"
+"  -S --sysroot=<dir>\n"
+"      Access sysfs, configfs and sysctl files under given\n"
+"      directory instead of the real ones. Meant for testing\n"
+"      without usb hardware, see utils/fake-kernel.c.\n"
+"  -t --trace[=<file>]\n"
+"      Record function entry and exit times from startup on.\n"
+"      Tracing can be toggled also by sending SIGUSR1. Trace is\n"
+"      written in Chrome trace event format when it is stopped.\n"
 "\n";
 
 static const struct option usbmoded_long_options[] =
@@ -1109,6 +1196,7 @@ static const struct option usbmoded_long_options[] =
     { "fallback",                       no_argument,       0, 'd' },
     { "force-syslog",                   no_argument,       0, 's' },
     { "force-stderr",                   no_argument,       0, 'T' },
+    { "force-journal",                  no_argument,       0, 'j' },
     { "log-line-info",                  no_argument,       0, 'l' },
     { "debug",                          no_argument,       0, 'D' },
     { "diag",                           no_argument,       0, 'd' },
@@ -1121,10 +1209,12 @@ static const struct option usbmoded_long_options[] =
     { "auto-exit",                      no_argument,       0, 'Q' },
     { "dbus-introspect-xml",            no_argument,       0, 'I' },
     { "dbus-busconfig-xml",             no_argument,       0, 'B' },
+    { "sysroot",                        required_argument, 0, 'S' },
+    { "trace",                          optional_argument, 0, 't' },
     { 0, 0, 0, 0 }
 };
 
-static const char usbmoded_short_options[] = "aifsTlDdhrnvm:b:QIB";
+static const char usbmoded_short_options[] = "aifsTjlDdhrnvm:b:QIBS:t::";
 
 /* Display usbmoded_usage information */
 static void usbmoded_usage(void)
@@ -1166,6 +1256,10 @@ static void usbmoded_parse_options(int argc, char* argv[])
             log_set_type(LOG_TO_STDERR);
             break;
 
+        case 'j':
+            log_set_type(LOG_TO_JOURNAL);
+            break;
+
         case 'D':
             log_set_level(LOG_DEBUG);
             break;
@@ -1215,6 +1309,15 @@ static void usbmoded_parse_options(int argc, char* argv[])
             umdbus_dump_busconfig_xml();
             exit(EXIT_SUCCESS);
 
+        case 'S':
+            common_set_sysroot(optarg);
+            break;
+
+        case 't':
+            trace_set_output(optarg);
+            trace_set_enabled(true);
+            break;
+
         default:
             usbmoded_usage();
             exit(EXIT_FAILURE);
@@ -1319,5 +1422,9 @@ EXIT:
 
     log_debug("usb-moded return from main, with exit code %d",
               usbmoded_exitcode);
+
+    /* Flush messages still held in log buffers */
+    log_quit();
+
     return usbmoded_exitcode;
 }
@@ -0,0 +1,518 @@
+/**
+ * @file fake-kernel.c
+ *
+ * This is a utility for running usb_moded without usb hardware.
+ *
+ * It populates a directory with sysfs / configfs / sysctl files that
+ * usb_moded expects to find, and then emulates kernel side reactions
+ * to what usb_moded writes there: UDC binding, function symlinks and
+ * android_usb enable state. The state changes kernel would announce
+ * via uevents are printed to stdout.
+ *
+ * Cable connection can be emulated by writing to power supply
+ * attributes, e.g. "echo 1 > <rootdir>/sys/class/power_supply/usb/online".
+ * This relies on usb_moded watching the charger files under sysroot
+ * (see UMUDEV_SYSROOT in usb_moded-udev.c), which it does only for the
+ * fallback charger path - a power_supply path set in config is not
+ * used with --sysroot.
+ *
+ * Use together with usb_moded --sysroot=<dir>.
+ *
+ * compile with gcc -o fake-kernel fake-kernel.c
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+#define FAKE_GADGET_DIR   "config/usb_gadget/g1"
+#define FAKE_CONF_DIR     FAKE_GADGET_DIR "/configs/b.1"
+#define FAKE_FUNC_DIR     FAKE_GADGET_DIR "/functions"
+#define FAKE_ANDROID_DIR  "sys/class/android_usb/android0"
+
+#define FAKE_UDC_DEFAULT  "fake-udc.0"
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* -- fake -- */
+
+static void fake_emit_uevent     (const char *subsystem, const char *key, const char *value);
+static bool fake_mkdir           (const char *path);
+static bool fake_write           (const char *path, const char *text);
+static bool fake_read            (const char *path, char *buff, size_t size);
+static bool fake_populate_common (void);
+static bool fake_populate_gadget (void);
+static bool fake_populate_android(void);
+static void fake_set_udc_state   (const char *state);
+static void fake_check_links     (void);
+static void fake_udc_changed     (void);
+static void fake_android_changed (void);
+static void fake_sleep_ms        (int ms);
+static void fake_handle_signal   (int sig);
+static void fake_mainloop        (void);
+static void fake_usage           (const char *name);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Name of the emulated UDC device */
+static const char *fake_udc = FAKE_UDC_DEFAULT;
+
+/** Delay between UDC bind and "configured" state [ms] */
+static int fake_enumerate_ms = 0;
+
+/** Whether to emulate android_usb gadget instead of configfs */
+static bool fake_android = false;
+
+/** Whether to start with pc cable connected */
+static bool fake_connected = false;
+
+/** Whether to stop after populating the tree */
+static bool fake_populate_only = false;
+
+/** Inotify watch descriptors */
+static int fake_wd_gadget  = -1;
+static int fake_wd_config  = -1;
+static int fake_wd_android = -1;
+
+/** Set from signal handler to exit mainloop */
+static volatile sig_atomic_t fake_done = 0;
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+static void fake_emit_uevent(const char *subsystem, const char *key, const char *value)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    printf("%ld.%06ld uevent SUBSYSTEM=%s %s=%s\n",
+           (long)ts.tv_sec, (long)(ts.tv_nsec / 1000),
+           subsystem, key, value);
+    fflush(stdout);
+}
+
+static bool fake_mkdir(const char *path)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s", path);
+
+    for( char *pos = tmp + 1; *pos; ++pos ) {
+        if( *pos != '/' )
+            continue;
+        *pos = 0;
+        if( mkdir(tmp, 0775) == -1 && errno != EEXIST )
+            goto FAIL;
+        *pos = '/';
+    }
+    if( mkdir(tmp, 0775) == -1 && errno != EEXIST )
+        goto FAIL;
+
+    return true;
+
+FAIL:
+    fprintf(stderr, "%s: mkdir failed: %m\n", tmp);
+    return false;
+}
+
+static bool fake_write(const char *path, const char *text)
+{
+    FILE *file = fopen(path, "w");
+    if( !file ) {
+        fprintf(stderr, "%s: can't open for writing: %m\n", path);
+        return false;
+    }
+    fprintf(file, "%s\n", text);
+    fclose(file);
+    return true;
+}
+
+static bool fake_read(const char *path, char *buff, size_t size)
+{
+    bool  ack  = false;
+    FILE *file = fopen(path, "r");
+
+    *buff = 0;
+    if( !file )
+        goto EXIT;
+
+    if( fgets(buff, size, file) ) {
+        buff[strcspn(buff, "\r\n")] = 0;
+        ack = true;
+    }
+    fclose(file);
+
+EXIT:
+    return ack;
+}
+
+static bool fake_populate_common(void)
+{
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+
+    if( !fake_mkdir("sys/power") ||
+        !fake_write("sys/power/wake_lock", "") ||
+        !fake_write("sys/power/wake_unlock", "") )
+        return false;
+
+    if( !fake_mkdir("proc/sys/net/ipv4") ||
+        !fake_write("proc/sys/net/ipv4/ip_forward", "0") )
+        return false;
+
+    if( !fake_mkdir("sys/class/net") )
+        return false;
+
+    /* Charger attributes, usb_moded re-reads these when written to */
+    if( !fake_mkdir("sys/class/power_supply/usb") ||
+        !fake_write("sys/class/power_supply/usb/type", "USB") ||
+        !fake_write("sys/class/power_supply/usb/online",
+                    fake_connected ? "1" : "0") )
+        return false;
+
+    /* UDC device with pollable state attribute, plus class symlink */
+    snprintf(path, sizeof path, "sys/devices/platform/%s", fake_udc);
+    if( !fake_mkdir(path) )
+        return false;
+    snprintf(path, sizeof path, "sys/devices/platform/%s/state", fake_udc);
+    if( !fake_write(path, "not attached") )
+        return false;
+
+    if( !fake_mkdir("sys/class/udc") )
+        return false;
+    snprintf(path, sizeof path, "sys/class/udc/%s", fake_udc);
+    snprintf(link, sizeof link, "../../devices/platform/%s", fake_udc);
+    if( symlink(link, path) == -1 && errno != EEXIST ) {
+        fprintf(stderr, "%s: symlink failed: %m\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool fake_populate_gadget(void)
+{
+    static const char * const attrs[] = {
+        FAKE_GADGET_DIR "/UDC",
+        FAKE_GADGET_DIR "/idVendor",
+        FAKE_GADGET_DIR "/idProduct",
+        FAKE_GADGET_DIR "/strings/0x409/manufacturer",
+        FAKE_GADGET_DIR "/strings/0x409/product",
+        FAKE_GADGET_DIR "/strings/0x409/serialnumber",
+        FAKE_CONF_DIR   "/MaxPower",
+        0
+    };
+
+    if( !fake_mkdir(FAKE_GADGET_DIR "/strings/0x409") ||
+        !fake_mkdir(FAKE_CONF_DIR) ||
+        !fake_mkdir(FAKE_FUNC_DIR) )
+        return false;
+
+    for( size_t i = 0; attrs[i]; ++i ) {
+        if( !fake_write(attrs[i], "") )
+            return false;
+    }
+
+    return true;
+}
+
+static bool fake_populate_android(void)
+{
+    static const char * const attrs[] = {
+        FAKE_ANDROID_DIR "/enable",
+        FAKE_ANDROID_DIR "/functions",
+        FAKE_ANDROID_DIR "/idVendor",
+        FAKE_ANDROID_DIR "/idProduct",
+        FAKE_ANDROID_DIR "/iManufacturer",
+        FAKE_ANDROID_DIR "/iProduct",
+        FAKE_ANDROID_DIR "/iSerial",
+        FAKE_ANDROID_DIR "/f_rndis/ethaddr",
+        FAKE_ANDROID_DIR "/f_rndis/wceis",
+        FAKE_ANDROID_DIR "/f_mass_storage/lun/file",
+        FAKE_ANDROID_DIR "/f_mass_storage/lun/nofua",
+        0
+    };
+
+    if( !fake_mkdir(FAKE_ANDROID_DIR "/f_rndis") ||
+        !fake_mkdir(FAKE_ANDROID_DIR "/f_mass_storage/lun") )
+        return false;
+
+    for( size_t i = 0; attrs[i]; ++i ) {
+        if( !fake_write(attrs[i], "") )
+            return false;
+    }
+
+    return (fake_write(FAKE_ANDROID_DIR "/enable", "0") &&
+            fake_write(FAKE_ANDROID_DIR "/state", "DISCONNECTED"));
+}
+
+static void fake_set_udc_state(const char *state)
+{
+    char path[PATH_MAX];
+    char prev[64];
+
+    snprintf(path, sizeof path, "sys/devices/platform/%s/state", fake_udc);
+    fake_read(path, prev, sizeof prev);
+    if( strcmp(prev, state) && fake_write(path, state) )
+        fake_emit_uevent("udc", "STATE", state);
+}
+
+/** Verify that configuration links point to existing functions
+ *
+ * Kernel refuses to bind UDC if gadget configuration is not sane,
+ * emulate that by complaining about dangling links.
+ */
+static void fake_check_links(void)
+{
+    DIR           *dir = opendir(FAKE_CONF_DIR);
+    struct dirent *de;
+    struct stat    st;
+
+    if( !dir )
+        return;
+
+    while( (de = readdir(dir)) ) {
+        if( de->d_type != DT_LNK )
+            continue;
+        if( fstatat(dirfd(dir), de->d_name, &st, 0) == -1 ||
+            !S_ISDIR(st.st_mode) )
+            fprintf(stderr, "%s/%s: dangling function link\n",
+                    FAKE_CONF_DIR, de->d_name);
+    }
+    closedir(dir);
+}
+
+static void fake_udc_changed(void)
+{
+    char udc[64];
+
+    fake_read(FAKE_GADGET_DIR "/UDC", udc, sizeof udc);
+
+    if( !*udc ) {
+        fake_set_udc_state("not attached");
+        return;
+    }
+
+    if( strcmp(udc, fake_udc) ) {
+        fprintf(stderr, "UDC: unknown device '%s'\n", udc);
+        return;
+    }
+
+    fake_check_links();
+    fake_set_udc_state("default");
+    fake_sleep_ms(fake_enumerate_ms);
+    fake_set_udc_state("configured");
+}
+
+static void fake_android_changed(void)
+{
+    char enable[16];
+    char state[32];
+    const char *want;
+
+    fake_read(FAKE_ANDROID_DIR "/enable", enable, sizeof enable);
+    fake_read(FAKE_ANDROID_DIR "/state", state, sizeof state);
+
+    if( !strcmp(enable, "1") ) {
+        if( !strcmp(state, "CONFIGURED") )
+            return;
+        fake_sleep_ms(fake_enumerate_ms);
+        want = "CONFIGURED";
+    }
+    else {
+        want = "DISCONNECTED";
+    }
+
+    if( strcmp(state, want) && fake_write(FAKE_ANDROID_DIR "/state", want) )
+        fake_emit_uevent("android_usb", "USB_STATE", want);
+}
+
+static void fake_sleep_ms(int ms)
+{
+    struct timespec ts = {
+        .tv_sec  = ms / 1000,
+        .tv_nsec = (ms % 1000) * 1000000L,
+    };
+    while( nanosleep(&ts, &ts) == -1 && errno == EINTR && !fake_done )
+        ;
+}
+
+static void fake_handle_signal(int sig)
+{
+    (void)sig;
+    fake_done = 1;
+}
+
+static void fake_mainloop(void)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    if( fd == -1 ) {
+        fprintf(stderr, "inotify_init: %m\n");
+        return;
+    }
+
+    if( fake_android ) {
+        fake_wd_android = inotify_add_watch(fd, FAKE_ANDROID_DIR,
+                                            IN_CLOSE_WRITE);
+    }
+    else {
+        fake_wd_gadget = inotify_add_watch(fd, FAKE_GADGET_DIR,
+                                           IN_CLOSE_WRITE);
+        fake_wd_config = inotify_add_watch(fd, FAKE_CONF_DIR,
+                                           IN_CREATE | IN_DELETE);
+    }
+
+    /* No SA_RESTART: signals must interrupt blocking read */
+    struct sigaction sa = { .sa_handler = fake_handle_signal };
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+
+    while( !fake_done ) {
+        char buff[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t rc = read(fd, buff, sizeof buff);
+
+        if( rc == -1 ) {
+            if( errno == EINTR || errno == EAGAIN )
+                continue;
+            fprintf(stderr, "inotify read: %m\n");
+            break;
+        }
+
+        for( char *pos = buff; pos < buff + rc; ) {
+            const struct inotify_event *eve = (void *)pos;
+            pos += sizeof *eve + eve->len;
+
+            if( !eve->len )
+                continue;
+
+            if( eve->wd == fake_wd_gadget && !strcmp(eve->name, "UDC") )
+                fake_udc_changed();
+            else if( eve->wd == fake_wd_config )
+                printf("function link %s: %s\n",
+                       (eve->mask & IN_CREATE) ? "added" : "removed",
+                       eve->name);
+            else if( eve->wd == fake_wd_android && !strcmp(eve->name, "enable") )
+                fake_android_changed();
+        }
+        fflush(stdout);
+    }
+
+    close(fd);
+}
+
+static void fake_usage(const char *name)
+{
+    printf("USAGE\n"
+           "  %s [options] <rootdir>\n"
+           "\n"
+           "OPTIONS\n"
+           "  -a, --android           emulate android_usb gadget\n"
+           "  -c, --connected         start with pc cable connected\n"
+           "                          (needs usb_moded --sysroot=<rootdir>)\n"
+           "  -u, --udc=<name>        name of the UDC device [%s]\n"
+           "  -e, --enumerate=<ms>    delay before host configures gadget\n"
+           "  -p, --populate-only     create files and exit\n"
+           "  -h, --help              show this help and exit\n"
+           "\n"
+           "Run usb_moded with --sysroot=<rootdir> to use the emulated\n"
+           "kernel interfaces.\n",
+           name, FAKE_UDC_DEFAULT);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option optl[] = {
+        { "android",       no_argument,       0, 'a' },
+        { "connected",     no_argument,       0, 'c' },
+        { "udc",           required_argument, 0, 'u' },
+        { "enumerate",     required_argument, 0, 'e' },
+        { "populate-only", no_argument,       0, 'p' },
+        { "help",          no_argument,       0, 'h' },
+        { 0,               0,                 0, 0   }
+    };
+
+    int opt;
+    while( (opt = getopt_long(argc, argv, "acu:e:ph", optl, 0)) != -1 ) {
+        switch( opt ) {
+        case 'a':
+            fake_android = true;
+            break;
+        case 'c':
+            fake_connected = true;
+            break;
+        case 'u':
+            fake_udc = optarg;
+            break;
+        case 'e':
+            fake_enumerate_ms = atoi(optarg);
+            break;
+        case 'p':
+            fake_populate_only = true;
+            break;
+        case 'h':
+            fake_usage(*argv);
+            return EXIT_SUCCESS;
+        default:
+            fake_usage(*argv);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if( optind + 1 != argc ) {
+        fake_usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    if( !fake_mkdir(argv[optind]) || chdir(argv[optind]) == -1 ) {
+        fprintf(stderr, "%s: can't use as root: %m\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if( !fake_populate_common() )
+        return EXIT_FAILURE;
+
+    if( fake_android ? !fake_populate_android() : !fake_populate_gadget() )
+        return EXIT_FAILURE;
+
+    if( !fake_populate_only )
+        fake_mainloop();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,901 @@
+/**
+ * @file mode-bench.c
+ *
+ * This is a benchmark utility for measuring usb_moded mode switches.
+ *
+ * It drives a running usb_moded over D-Bus through every ordered
+ * pair of available modes, and optionally through cable connect and
+ * rapid flip-flop scenarios. Latency percentiles and resource usage
+ * per transition are reported, and can be saved as / compared against
+ * a baseline file.
+ *
+ * Meant to be used against usb_moded --sysroot=<dir> and fake-kernel,
+ * which allows also cable connects to be emulated via -S option.
+ *
+ * compile with gcc -o mode-bench mode-bench.c $(pkg-config --cflags --libs dbus-1)
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "../src/usb_moded-dbus.h"
+#include "../src/usb_moded-modes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <dbus/dbus.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of modes to benchmark */
+#define BENCH_MODES_MAX      32
+
+/** Default number of measurements per transition */
+#define BENCH_ITERATIONS     5
+
+/** Default number of requests in flip-flop bursts */
+#define BENCH_FLIPS          5
+
+/** Default time limit for reaching requested mode [ms] */
+#define BENCH_TIMEOUT_MS     30000
+
+/** How long mode must stay unchanged to be considered settled [ms] */
+#define BENCH_QUIET_MS       1000
+
+/** Default allowed p95 slowdown compared to baseline [%] */
+#define BENCH_TOLERANCE_PCT  20
+
+/** Slowdowns smaller than this are considered noise [us] */
+#define BENCH_NOISE_US       2000
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Resource usage counters of usb_moded process */
+typedef struct
+{
+    long long rc_syscalls;  /**< read + write syscalls, from /proc/PID/io */
+    long long rc_forks;     /**< forks system wide, from /proc/stat */
+    long long rc_vmdata;    /**< data segment size [kB] */
+} bench_counters_t;
+
+/** Measurements for one transition type */
+typedef struct
+{
+    char             *br_scenario;
+    char             *br_from;
+    char             *br_to;
+    int64_t          *br_lat_us;
+    size_t            br_count;
+    size_t            br_alloc;
+    int               br_failed;
+    bench_counters_t  br_usage;
+} bench_row_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* -- bench -- */
+
+static int64_t      bench_now_us        (void);
+static long long    bench_read_counter  (const char *path, const char *key);
+static void         bench_get_counters  (bench_counters_t *counters);
+static bench_row_t *bench_get_row       (const char *scenario, const char *from, const char *to);
+static void         bench_add_sample    (bench_row_t *row, int64_t lat_us, const bench_counters_t *beg, const bench_counters_t *end);
+static int          bench_compare_us    (const void *a, const void *b);
+static int64_t      bench_percentile    (const bench_row_t *row, int pct);
+
+/* -- dbus -- */
+
+static bool         bench_call          (const char *method, const char *arg, char **reply_str);
+static unsigned     bench_get_daemon_pid(void);
+static bool         bench_handle_messages(void);
+static void         bench_drain_signals (void);
+static int64_t      bench_wait_mode     (const char *target, int64_t t0, bool settle);
+
+/* -- cable -- */
+
+static bool         bench_set_cable     (bool connected);
+
+/* -- scenarios -- */
+
+static bool         bench_enter_mode    (const char *mode);
+static void         bench_run_switch    (void);
+static void         bench_run_flipflop  (void);
+static void         bench_run_cable     (void);
+static void         bench_run_bounce    (void);
+
+/* -- report -- */
+
+static void         bench_report        (void);
+static bool         bench_save_baseline (const char *path);
+static int          bench_check_baseline(const char *path);
+
+/* -- main -- */
+
+static void         bench_usage         (const char *name);
+static bool         bench_scenario_p    (const char *name);
+static bool         bench_scenario_ran  (const char *name);
+int                 main                (int argc, char **argv);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+static DBusConnection *bench_conn = 0;
+
+/** Pid of usb_moded process, or 0 if not known */
+static unsigned bench_daemon_pid = 0;
+
+/** Modes to benchmark */
+static char *bench_modes[BENCH_MODES_MAX];
+static int   bench_mode_count = 0;
+
+/** Most recently seen current mode */
+static char bench_mode_current[64] = "";
+
+/** Options */
+static int         bench_iterations  = BENCH_ITERATIONS;
+static int         bench_flips       = BENCH_FLIPS;
+static int         bench_timeout_ms  = BENCH_TIMEOUT_MS;
+static int         bench_tolerance   = BENCH_TOLERANCE_PCT;
+static const char *bench_sysroot     = 0;
+static const char *bench_scenarios   = "switch,flipflop,cable,bounce";
+
+/** Collected measurements */
+static bench_row_t *bench_rows      = 0;
+static size_t       bench_row_count = 0;
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+static int64_t bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000) + ts.tv_nsec / 1000;
+}
+
+static long long bench_read_counter(const char *path, const char *key)
+{
+    long long  value = 0;
+    size_t     len   = strlen(key);
+    FILE      *file  = fopen(path, "r");
+    char       line[256];
+
+    if( !file )
+        return 0;
+
+    while( fgets(line, sizeof line, file) ) {
+        if( !strncmp(line, key, len) ) {
+            value = strtoll(line + len, 0, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+static void bench_get_counters(bench_counters_t *counters)
+{
+    char path[PATH_MAX];
+
+    memset(counters, 0, sizeof *counters);
+    counters->rc_forks = bench_read_counter("/proc/stat", "processes ");
+
+    if( !bench_daemon_pid )
+        return;
+
+    snprintf(path, sizeof path, "/proc/%u/io", bench_daemon_pid);
+    counters->rc_syscalls = (bench_read_counter(path, "syscr:") +
+                             bench_read_counter(path, "syscw:"));
+
+    snprintf(path, sizeof path, "/proc/%u/status", bench_daemon_pid);
+    counters->rc_vmdata = bench_read_counter(path, "VmData:");
+}
+
+static bench_row_t *bench_get_row(const char *scenario, const char *from, const char *to)
+{
+    for( size_t i = 0; i < bench_row_count; ++i ) {
+        bench_row_t *row = bench_rows + i;
+        if( !strcmp(row->br_scenario, scenario) &&
+            !strcmp(row->br_from, from) &&
+            !strcmp(row->br_to, to) )
+            return row;
+    }
+
+    bench_rows = realloc(bench_rows, (bench_row_count + 1) * sizeof *bench_rows);
+    if( !bench_rows )
+        abort();
+
+    bench_row_t *row = bench_rows + bench_row_count++;
+    memset(row, 0, sizeof *row);
+    row->br_scenario = strdup(scenario);
+    row->br_from     = strdup(from);
+    row->br_to       = strdup(to);
+    return row;
+}
+
+static void bench_add_sample(bench_row_t *row, int64_t lat_us,
+                             const bench_counters_t *beg,
+                             const bench_counters_t *end)
+{
+    if( lat_us < 0 ) {
+        row->br_failed += 1;
+        return;
+    }
+
+    if( row->br_count == row->br_alloc ) {
+        row->br_alloc = row->br_alloc ? row->br_alloc * 2 : 16;
+        row->br_lat_us = realloc(row->br_lat_us,
+                                 row->br_alloc * sizeof *row->br_lat_us);
+        if( !row->br_lat_us )
+            abort();
+    }
+    row->br_lat_us[row->br_count++] = lat_us;
+
+    row->br_usage.rc_syscalls += end->rc_syscalls - beg->rc_syscalls;
+    row->br_usage.rc_forks    += end->rc_forks    - beg->rc_forks;
+    row->br_usage.rc_vmdata   += end->rc_vmdata   - beg->rc_vmdata;
+}
+
+static int bench_compare_us(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/** Get nearest-rank percentile of latency samples
+ *
+ * @note Samples must have been sorted.
+ */
+static int64_t bench_percentile(const bench_row_t *row, int pct)
+{
+    if( !row->br_count )
+        return -1;
+
+    size_t rank = (row->br_count * pct + 99) / 100;
+    if( rank < 1 )
+        rank = 1;
+    return row->br_lat_us[rank - 1];
+}
+
+/* ------------------------------------------------------------------------- *
+ * dbus
+ * ------------------------------------------------------------------------- */
+
+static bool bench_call(const char *method, const char *arg, char **reply_str)
+{
+    bool         ack   = false;
+    DBusMessage *req   = 0;
+    DBusMessage *rsp   = 0;
+    DBusError    err   = DBUS_ERROR_INIT;
+    const char  *str   = 0;
+
+    req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT,
+                                       USB_MODE_INTERFACE, method);
+    if( !req )
+        goto EXIT;
+
+    if( arg )
+        dbus_message_append_args(req, DBUS_TYPE_STRING, &arg, DBUS_TYPE_INVALID);
+
+    rsp = dbus_connection_send_with_reply_and_block(bench_conn, req,
+                                                    bench_timeout_ms, &err);
+    if( !rsp )
+        goto EXIT;
+
+    if( reply_str ) {
+        if( !dbus_message_get_args(rsp, &err, DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_INVALID) )
+            goto EXIT;
+        *reply_str = strdup(str);
+    }
+
+    ack = true;
+
+EXIT:
+    if( dbus_error_is_set(&err) && strcmp(err.name, DBUS_ERROR_FAILED) )
+        fprintf(stderr, "%s: %s: %s\n", method, err.name, err.message);
+    dbus_error_free(&err);
+    if( rsp )
+        dbus_message_unref(rsp);
+    if( req )
+        dbus_message_unref(req);
+    return ack;
+}
+
+static unsigned bench_get_daemon_pid(void)
+{
+    dbus_uint32_t  pid  = 0;
+    const char    *name = USB_MODE_SERVICE;
+    DBusMessage   *req  = 0;
+    DBusMessage   *rsp  = 0;
+
+    req = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS,
+                                       "GetConnectionUnixProcessID");
+    if( !req )
+        goto EXIT;
+
+    dbus_message_append_args(req, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+    rsp = dbus_connection_send_with_reply_and_block(bench_conn, req, -1, 0);
+    if( rsp )
+        dbus_message_get_args(rsp, 0, DBUS_TYPE_UINT32, &pid, DBUS_TYPE_INVALID);
+
+EXIT:
+    if( rsp )
+        dbus_message_unref(rsp);
+    if( req )
+        dbus_message_unref(req);
+    return pid;
+}
+
+/** Process queued messages, keeping track of current mode
+ *
+ * @return true if current mode signal was seen
+ */
+static bool bench_handle_messages(void)
+{
+    bool         seen = false;
+    DBusMessage *msg;
+
+    while( (msg = dbus_connection_pop_message(bench_conn)) ) {
+        const char *mode = 0;
+        if( dbus_message_is_signal(msg, USB_MODE_INTERFACE,
+                                   USB_MODE_CURRENT_STATE_SIGNAL_NAME) &&
+            dbus_message_get_args(msg, 0, DBUS_TYPE_STRING, &mode,
+                                  DBUS_TYPE_INVALID) ) {
+            snprintf(bench_mode_current, sizeof bench_mode_current,
+                     "%s", mode);
+            seen = true;
+        }
+        dbus_message_unref(msg);
+    }
+    return seen;
+}
+
+static void bench_drain_signals(void)
+{
+    dbus_connection_read_write(bench_conn, 0);
+    bench_handle_messages();
+}
+
+/** Wait for usb_moded to reach a mode
+ *
+ * @param target  mode to wait for, or NULL for any mode other than
+ *                MODE_BUSY / MODE_UNDEFINED
+ * @param t0      start of measurement [us]
+ * @param settle  true to also require the mode to stay unchanged
+ *                for BENCH_QUIET_MS
+ *
+ * @return time from t0 to reaching the mode [us], or -1 on timeout
+ */
+static int64_t bench_wait_mode(const char *target, int64_t t0, bool settle)
+{
+    int64_t deadline = t0 + bench_timeout_ms * INT64_C(1000);
+    int64_t reached  = -1;
+
+    for( ;; ) {
+        int64_t now = bench_now_us();
+
+        if( bench_handle_messages() )
+            reached = -1;
+
+        bool match = (target
+                      ? !strcmp(bench_mode_current, target)
+                      : (*bench_mode_current &&
+                         strcmp(bench_mode_current, MODE_BUSY) &&
+                         strcmp(bench_mode_current, MODE_UNDEFINED)));
+
+        if( match && reached < 0 )
+            reached = now;
+
+        if( match && !settle )
+            break;
+
+        if( match && now - reached >= BENCH_QUIET_MS * INT64_C(1000) )
+            break;
+
+        if( now >= deadline ) {
+            fprintf(stderr, "timeout waiting for %s; current %s\n",
+                    target ?: "mode", bench_mode_current);
+            return -1;
+        }
+
+        int64_t wake = deadline;
+        if( match )
+            wake = reached + BENCH_QUIET_MS * INT64_C(1000);
+        dbus_connection_read_write(bench_conn, (int)((wake - now + 999) / 1000));
+    }
+
+    return reached - t0;
+}
+
+/* ------------------------------------------------------------------------- *
+ * cable
+ * ------------------------------------------------------------------------- */
+
+static bool bench_set_cable(bool connected)
+{
+    char  path[PATH_MAX];
+    FILE *file;
+
+    snprintf(path, sizeof path, "%s/sys/class/power_supply/usb/online",
+             bench_sysroot);
+    if( !(file = fopen(path, "w")) ) {
+        fprintf(stderr, "%s: can't open for writing: %m\n", path);
+        return false;
+    }
+    fprintf(file, "%d\n", connected);
+    fclose(file);
+    return true;
+}
+
+/* ------------------------------------------------------------------------- *
+ * scenarios
+ * ------------------------------------------------------------------------- */
+
+static bool bench_enter_mode(const char *mode)
+{
+    bench_drain_signals();
+
+    if( !strcmp(bench_mode_current, mode) )
+        return true;
+
+    if( !bench_call(USB_MODE_STATE_SET, mode, 0) ) {
+        fprintf(stderr, "%s: could not activate mode\n", mode);
+        return false;
+    }
+    return bench_wait_mode(mode, bench_now_us(), true) >= 0;
+}
+
+/** Measure transitions between every ordered pair of modes */
+static void bench_run_switch(void)
+{
+    for( int a = 0; a < bench_mode_count; ++a ) {
+        for( int b = 0; b < bench_mode_count; ++b ) {
+            if( a == b )
+                continue;
+
+            bench_row_t *row = bench_get_row("switch", bench_modes[a],
+                                             bench_modes[b]);
+
+            for( int i = 0; i < bench_iterations; ++i ) {
+                bench_counters_t beg, end;
+                int64_t          lat = -1;
+
+                if( !bench_enter_mode(bench_modes[a]) )
+                    break;
+
+                bench_get_counters(&beg);
+                int64_t t0 = bench_now_us();
+                if( bench_call(USB_MODE_STATE_SET, bench_modes[b], 0) )
+                    lat = bench_wait_mode(bench_modes[b], t0, false);
+                bench_get_counters(&end);
+
+                bench_add_sample(row, lat, &beg, &end);
+            }
+        }
+    }
+}
+
+/** Measure settling after a burst of alternating mode requests
+ *
+ * Requests that usb_moded rejects because it is busy are not retried,
+ * the burst always ends with a request for the second mode.
+ */
+static void bench_run_flipflop(void)
+{
+    for( int a = 0; a < bench_mode_count; ++a ) {
+        int b = (a + 1) % bench_mode_count;
+        if( a == b )
+            break;
+
+        bench_row_t *row = bench_get_row("flipflop", bench_modes[a],
+                                         bench_modes[b]);
+
+        for( int i = 0; i < bench_iterations; ++i ) {
+            bench_counters_t beg, end;
+            int64_t          lat = -1;
+
+            if( !bench_enter_mode(bench_modes[a]) )
+                break;
+
+            bench_get_counters(&beg);
+            int64_t t0 = bench_now_us();
+            for( int k = 0; k < bench_flips; ++k ) {
+                const char *mode = bench_modes[(k & 1) ? a : b];
+                bench_call(USB_MODE_STATE_SET, mode, 0);
+            }
+            /* Make sure the last word is for the target mode */
+            if( !(bench_flips & 1) ) {
+                while( !bench_call(USB_MODE_STATE_SET, bench_modes[b], 0) ) {
+                    if( bench_now_us() - t0 > bench_timeout_ms * INT64_C(1000) )
+                        break;
+                    bench_wait_mode(0, bench_now_us(), false);
+                }
+            }
+            lat = bench_wait_mode(bench_modes[b], t0, true);
+            bench_get_counters(&end);
+
+            bench_add_sample(row, lat, &beg, &end);
+        }
+    }
+}
+
+/** Measure time from cable connect to mode being active */
+static void bench_run_cable(void)
+{
+    for( int i = 0; i < bench_iterations; ++i ) {
+        bench_counters_t beg, end;
+
+        if( !bench_set_cable(false) ||
+            bench_wait_mode(MODE_UNDEFINED, bench_now_us(), true) < 0 )
+            break;
+
+        bench_get_counters(&beg);
+        int64_t t0  = bench_now_us();
+        int64_t lat = bench_set_cable(true) ? bench_wait_mode(0, t0, false) : -1;
+        bench_get_counters(&end);
+
+        bench_row_t *row = bench_get_row("cable", MODE_UNDEFINED,
+                                         lat < 0 ? "?" : bench_mode_current);
+        bench_add_sample(row, lat, &beg, &end);
+
+        /* Let the mode settle before next disconnect */
+        bench_wait_mode(0, bench_now_us(), true);
+    }
+}
+
+/** Measure settling after cable bouncing */
+static void bench_run_bounce(void)
+{
+    for( int i = 0; i < bench_iterations; ++i ) {
+        bench_counters_t beg, end;
+
+        if( !bench_set_cable(true) ||
+            bench_wait_mode(0, bench_now_us(), true) < 0 )
+            break;
+
+        char from[sizeof bench_mode_current];
+        snprintf(from, sizeof from, "%s", bench_mode_current);
+
+        bench_get_counters(&beg);
+        int64_t t0 = bench_now_us();
+        for( int k = 0; k < bench_flips; ++k ) {
+            bench_set_cable(false);
+            bench_set_cable(true);
+        }
+        int64_t lat = bench_wait_mode(from, t0, true);
+        bench_get_counters(&end);
+
+        bench_add_sample(bench_get_row("bounce", from, from), lat, &beg, &end);
+    }
+}
+
+/* ------------------------------------------------------------------------- *
+ * report
+ * ------------------------------------------------------------------------- */
+
+static void bench_report(void)
+{
+    printf("%-8s %-20s %-20s %4s %4s %9s %9s %9s %9s %8s %6s %7s\n",
+           "scenario", "from", "to", "n", "fail",
+           "p50[ms]", "p95[ms]", "p99[ms]", "max[ms]",
+           "syscall", "fork", "vm[kB]");
+
+    for( size_t i = 0; i < bench_row_count; ++i ) {
+        bench_row_t *row = bench_rows + i;
+        size_t       n   = row->br_count;
+
+        qsort(row->br_lat_us, n, sizeof *row->br_lat_us, bench_compare_us);
+
+        printf("%-8s %-20s %-20s %4zu %4d", row->br_scenario,
+               row->br_from, row->br_to, n, row->br_failed);
+        if( !n ) {
+            printf("\n");
+            continue;
+        }
+        printf(" %9.3f %9.3f %9.3f %9.3f %8lld %6lld %7lld\n",
+               bench_percentile(row, 50) / 1000.0,
+               bench_percentile(row, 95) / 1000.0,
+               bench_percentile(row, 99) / 1000.0,
+               row->br_lat_us[n - 1] / 1000.0,
+               row->br_usage.rc_syscalls / (long long)n,
+               row->br_usage.rc_forks / (long long)n,
+               row->br_usage.rc_vmdata / (long long)n);
+    }
+}
+
+/** Save latency percentiles as baseline
+ *
+ * Format: one line per transition with fields
+ *   scenario from to p50_us p95_us p99_us
+ */
+static bool bench_save_baseline(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if( !file ) {
+        fprintf(stderr, "%s: can't open for writing: %m\n", path);
+        return false;
+    }
+
+    for( size_t i = 0; i < bench_row_count; ++i ) {
+        bench_row_t *row = bench_rows + i;
+        if( !row->br_count )
+            continue;
+        fprintf(file, "%s %s %s %lld %lld %lld\n",
+                row->br_scenario, row->br_from, row->br_to,
+                (long long)bench_percentile(row, 50),
+                (long long)bench_percentile(row, 95),
+                (long long)bench_percentile(row, 99));
+    }
+
+    fclose(file);
+    return true;
+}
+
+/** Compare p95 latencies against baseline
+ *
+ * Failed transitions count as regressions, as do baseline transitions
+ * of scenarios that were run, but yielded no successful samples.
+ *
+ * @return number of regressions found, or -1 on error
+ */
+static int bench_check_baseline(const char *path)
+{
+    int   regressions = 0;
+    FILE *file        = fopen(path, "r");
+    char  line[256];
+
+    if( !file ) {
+        fprintf(stderr, "%s: can't open for reading: %m\n", path);
+        return -1;
+    }
+
+    for( size_t i = 0; i < bench_row_count; ++i ) {
+        bench_row_t *row = bench_rows + i;
+        if( row->br_failed ) {
+            printf("REGRESSION %s %s -> %s: %d of %zd transitions failed\n",
+                   row->br_scenario, row->br_from, row->br_to,
+                   row->br_failed, row->br_count + row->br_failed);
+            ++regressions;
+        }
+    }
+
+    while( fgets(line, sizeof line, file) ) {
+        char         scenario[64], from[64], to[64];
+        long long    p50, p95, p99;
+        bench_row_t *row = 0;
+
+        if( sscanf(line, "%63s %63s %63s %lld %lld %lld",
+                   scenario, from, to, &p50, &p95, &p99) != 6 )
+            continue;
+
+        for( size_t i = 0; i < bench_row_count; ++i ) {
+            if( !strcmp(bench_rows[i].br_scenario, scenario) &&
+                !strcmp(bench_rows[i].br_from, from) &&
+                !strcmp(bench_rows[i].br_to, to) ) {
+                row = bench_rows + i;
+                break;
+            }
+        }
+
+        if( !row || !row->br_count ) {
+            if( !bench_scenario_ran(scenario) )
+                continue;
+            /* Failures have been reported already */
+            if( !row || !row->br_failed ) {
+                printf("REGRESSION %s %s -> %s: no samples, baseline %.3f ms\n",
+                       scenario, from, to, p95 / 1000.0);
+                ++regressions;
+            }
+            continue;
+        }
+
+        int64_t now   = bench_percentile(row, 95);
+        int64_t limit = p95 + p95 * bench_tolerance / 100 + BENCH_NOISE_US;
+        if( now > limit ) {
+            printf("REGRESSION %s %s -> %s: p95 %.3f ms, baseline %.3f ms\n",
+                   scenario, from, to, now / 1000.0, p95 / 1000.0);
+            ++regressions;
+        }
+    }
+
+    fclose(file);
+    return regressions;
+}
+
+/* ------------------------------------------------------------------------- *
+ * main
+ * ------------------------------------------------------------------------- */
+
+static void bench_usage(const char *name)
+{
+    printf("USAGE\n"
+           "  %s [options]\n"
+           "\n"
+           "OPTIONS\n"
+           "  -m, --modes=<m1,m2,...>    modes to use [available modes]\n"
+           "  -s, --scenarios=<s1,...>   scenarios to run [%s]\n"
+           "  -n, --iterations=<n>       measurements per transition [%d]\n"
+           "  -f, --flips=<n>            requests per flip-flop burst [%d]\n"
+           "  -t, --timeout=<ms>         time limit per transition [%d]\n"
+           "  -S, --sysroot=<dir>        sysroot of usb_moded, for cable emulation\n"
+           "  -w, --write-baseline=<f>   save results as baseline\n"
+           "  -c, --check-baseline=<f>   compare p95 latencies against baseline\n"
+           "  -T, --tolerance=<pct>      allowed p95 slowdown [%d]\n"
+           "  -h, --help                 show this help and exit\n"
+           "\n"
+           "Scenarios cable and bounce require --sysroot.\n"
+           "Exit status is 2 if regressions were found.\n",
+           name, bench_scenarios, BENCH_ITERATIONS, BENCH_FLIPS,
+           BENCH_TIMEOUT_MS, BENCH_TOLERANCE_PCT);
+}
+
+static bool bench_scenario_p(const char *name)
+{
+    size_t      len = strlen(name);
+    const char *pos = bench_scenarios;
+
+    while( (pos = strstr(pos, name)) ) {
+        bool beg = (pos == bench_scenarios || pos[-1] == ',');
+        bool end = (pos[len] == 0 || pos[len] == ',');
+        if( beg && end )
+            return true;
+        pos += len;
+    }
+    return false;
+}
+
+/** Check whether a scenario gets run with the current options
+ */
+static bool bench_scenario_ran(const char *name)
+{
+    if( !bench_sysroot && (!strcmp(name, "cable") || !strcmp(name, "bounce")) )
+        return false;
+    return bench_scenario_p(name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option optl[] = {
+        { "modes",          required_argument, 0, 'm' },
+        { "scenarios",      required_argument, 0, 's' },
+        { "iterations",     required_argument, 0, 'n' },
+        { "flips",          required_argument, 0, 'f' },
+        { "timeout",        required_argument, 0, 't' },
+        { "sysroot",        required_argument, 0, 'S' },
+        { "write-baseline", required_argument, 0, 'w' },
+        { "check-baseline", required_argument, 0, 'c' },
+        { "tolerance",      required_argument, 0, 'T' },
+        { "help",           no_argument,       0, 'h' },
+        { 0,                0,                 0, 0   }
+    };
+
+    int         exit_code = EXIT_FAILURE;
+    char       *modes     = 0;
+    const char *save_path = 0;
+    const char *check_path = 0;
+    DBusError   err       = DBUS_ERROR_INIT;
+
+    int opt;
+    while( (opt = getopt_long(argc, argv, "m:s:n:f:t:S:w:c:T:h", optl, 0)) != -1 ) {
+        switch( opt ) {
+        case 'm': modes = strdup(optarg);           break;
+        case 's': bench_scenarios = optarg;         break;
+        case 'n': bench_iterations = atoi(optarg);  break;
+        case 'f': bench_flips = atoi(optarg);       break;
+        case 't': bench_timeout_ms = atoi(optarg);  break;
+        case 'S': bench_sysroot = optarg;           break;
+        case 'w': save_path = optarg;               break;
+        case 'c': check_path = optarg;              break;
+        case 'T': bench_tolerance = atoi(optarg);   break;
+        case 'h':
+            bench_usage(*argv);
+            return EXIT_SUCCESS;
+        default:
+            bench_usage(*argv);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if( !(bench_conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err)) ) {
+        fprintf(stderr, "system bus connect failed: %s: %s\n",
+                err.name, err.message);
+        goto EXIT;
+    }
+
+    dbus_bus_add_match(bench_conn,
+                       "type='signal'"
+                       ",interface='" USB_MODE_INTERFACE "'"
+                       ",member='" USB_MODE_CURRENT_STATE_SIGNAL_NAME "'",
+                       0);
+
+    if( !(bench_daemon_pid = bench_get_daemon_pid()) )
+        fprintf(stderr, "usb_moded pid not known; resource usage not tracked\n");
+
+    char *current = 0;
+    if( !bench_call(USB_MODE_STATE_REQUEST, 0, &current) ) {
+        fprintf(stderr, "usb_moded is not responding\n");
+        goto EXIT;
+    }
+    snprintf(bench_mode_current, sizeof bench_mode_current, "%s", current);
+    free(current);
+
+    if( bench_sysroot ) {
+        /* Mode requests are accepted only when pc is connected */
+        if( !bench_set_cable(true) ||
+            bench_wait_mode(0, bench_now_us(), true) < 0 )
+            goto EXIT;
+    }
+
+    if( !modes && !bench_call(USB_MODE_LIST, 0, &modes) )
+        goto EXIT;
+
+    for( char *tok, *pos = modes; (tok = strtok(pos, ", ")); pos = 0 ) {
+        if( bench_mode_count < BENCH_MODES_MAX )
+            bench_modes[bench_mode_count++] = tok;
+    }
+
+    if( bench_scenario_ran("switch") )
+        bench_run_switch();
+    if( bench_scenario_ran("flipflop") )
+        bench_run_flipflop();
+    if( bench_scenario_ran("cable") )
+        bench_run_cable();
+    if( bench_scenario_ran("bounce") )
+        bench_run_bounce();
+
+    bench_report();
+
+    if( save_path && !bench_save_baseline(save_path) )
+        goto EXIT;
+
+    exit_code = EXIT_SUCCESS;
+
+    if( check_path ) {
+        int regressions = bench_check_baseline(check_path);
+        if( regressions < 0 )
+            exit_code = EXIT_FAILURE;
+        else if( regressions > 0 )
+            exit_code = 2;
+    }
+
+EXIT:
+    dbus_error_free(&err);
+    if( bench_conn ) {
+        dbus_connection_close(bench_conn);
+        dbus_connection_unref(bench_conn);
+    }
+    free(modes);
+    return exit_code;
+}
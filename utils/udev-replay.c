@@ -0,0 +1,911 @@
+/**
+ * @file udev-replay.c
+ *
+ * This is a utility for replaying recorded uevent traces through
+ * the cable detection logic of usb_moded.
+ *
+ * The usb_moded-udev.c module is built in as is, with libudev,
+ * glib timers and the rest of usb_moded replaced by stand-ins that
+ * serve devices and events from a trace file and run everything on
+ * a virtual clock. For each trace the resulting cable state and the
+ * time it took to reach it are reported, which allows evaluating
+ * effects of debounce delays without waiting for them in real time.
+ *
+ * Traces are recorded with "udev-search --record=<file>", see
+ * udev-search.c for description of the format.
+ *
+ * compile with gcc -o udev-replay udev-replay.c $(pkg-config --cflags --libs glib-2.0 dbus-1)
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/* Glib functions that need to run on virtual clock / against trace
+ * data are redirected before any glib headers get included. */
+#define g_timeout_add         replay_timeout_add
+#define g_source_remove       replay_source_remove
+#define g_io_add_watch        replay_io_add_watch
+#define g_io_add_watch_full   replay_io_add_watch_full
+#define g_io_channel_unix_new replay_io_channel_unix_new
+#define g_io_channel_unref    replay_io_channel_unref
+#define g_file_get_contents   replay_file_get_contents
+
+#include "../src/usb_moded-udev.c"
+
+#include <stdarg.h>
+#include <getopt.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** How long to keep running timers after the last event [ms] */
+#define REPLAY_TAIL_MS     60000
+
+/** Maximum number of concurrently active virtual timers */
+#define REPLAY_TIMERS_MAX  16
+
+/** Watch id returned for io watches, never dispatched */
+#define REPLAY_IO_WATCH_ID 0x7fffffff
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+struct udev
+{
+    int dummy;
+};
+
+struct udev_monitor
+{
+    int dummy;
+};
+
+struct udev_list_entry
+{
+    struct udev_list_entry *next;
+    gchar                  *name;
+};
+
+struct udev_enumerate
+{
+    gchar                  *subsystem;
+    struct udev_list_entry *entries;
+};
+
+struct udev_device
+{
+    gchar      *syspath;
+    gchar      *alias;      /**< /sys/class/SUBSYSTEM/SYSNAME */
+    gchar      *subsystem;
+    gchar      *sysname;
+    gchar      *action;
+    GHashTable *props;
+    GHashTable *attrs;
+};
+
+/** Trace record */
+typedef struct
+{
+    int64_t             rec_ms;
+    gchar              *rec_action;
+    gchar              *rec_subsystem;
+    gchar              *rec_syspath;
+    GHashTable         *rec_props;
+    GHashTable         *rec_attrs;
+} replay_record_t;
+
+/** Virtual timer */
+typedef struct
+{
+    guint               tmr_id;
+    int64_t             tmr_due;
+    guint               tmr_interval;
+    GSourceFunc         tmr_func;
+    gpointer            tmr_data;
+} replay_timer_t;
+
+/** Cable state change made by usb_moded-udev.c */
+typedef struct
+{
+    int64_t             chg_ms;
+    cable_state_t       chg_state;
+} replay_change_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* -- replay -- */
+
+static char               *replay_unescape        (const char *text);
+static replay_record_t    *replay_record_parse    (char *line);
+static void                replay_record_delete   (replay_record_t *rec);
+static GPtrArray          *replay_load            (const char *path);
+static struct udev_device *replay_device_lookup   (const char *syspath);
+static void                replay_device_delete   (struct udev_device *dev);
+static void                replay_copy_entry      (gpointer key, gpointer val, gpointer aptr);
+static struct udev_device *replay_device_update   (const replay_record_t *rec);
+static void                replay_run_timers      (int64_t limit);
+static void                replay_reset           (void);
+static void                replay_enumerate_delete(struct udev_enumerate *list);
+static bool                replay_trace           (const char *path);
+static void                replay_usage           (const char *name);
+int                        main                   (int argc, char **argv);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Virtual clock [ms] */
+static int64_t replay_now_ms = 0;
+
+/** Virtual timers */
+static replay_timer_t replay_timers[REPLAY_TIMERS_MAX];
+static guint          replay_timer_id = 0;
+
+/** Devices known from the trace being replayed */
+static GPtrArray *replay_devices = 0;
+
+/** Device returned by next udev_monitor_receive_device() call */
+static struct udev_device *replay_pending = 0;
+
+/** Enumerations made during replay */
+static GPtrArray *replay_enumerates = 0;
+
+/** Cable state changes seen during replay */
+static GArray *replay_changes = 0;
+
+/** Config values given with -C option */
+static GHashTable *replay_config = 0;
+
+/** Options */
+static int  replay_connection_delay = 0;
+static bool replay_verbose          = false;
+static bool replay_timeline         = false;
+
+static struct udev         replay_udev;
+static struct udev_monitor replay_monitor;
+
+/* ========================================================================= *
+ * Stand-ins for glib
+ * ========================================================================= */
+
+guint replay_timeout_add(guint interval, GSourceFunc func, gpointer data)
+{
+    for( size_t i = 0; i < REPLAY_TIMERS_MAX; ++i ) {
+        replay_timer_t *tmr = replay_timers + i;
+        if( tmr->tmr_id )
+            continue;
+        if( ++replay_timer_id == REPLAY_IO_WATCH_ID )
+            replay_timer_id = 1;
+        tmr->tmr_id       = replay_timer_id;
+        tmr->tmr_due      = replay_now_ms + interval;
+        tmr->tmr_interval = interval;
+        tmr->tmr_func     = func;
+        tmr->tmr_data     = data;
+        return tmr->tmr_id;
+    }
+    fprintf(stderr, "out of virtual timers\n");
+    abort();
+}
+
+gboolean replay_source_remove(guint id)
+{
+    for( size_t i = 0; i < REPLAY_TIMERS_MAX; ++i ) {
+        if( replay_timers[i].tmr_id == id ) {
+            replay_timers[i].tmr_id = 0;
+            return TRUE;
+        }
+    }
+    return id == REPLAY_IO_WATCH_ID;
+}
+
+guint replay_io_add_watch(GIOChannel *channel, GIOCondition condition,
+                          GIOFunc func, gpointer user_data)
+{
+    (void)channel, (void)condition, (void)func, (void)user_data;
+    return REPLAY_IO_WATCH_ID;
+}
+
+guint replay_io_add_watch_full(GIOChannel *channel, gint priority,
+                               GIOCondition condition, GIOFunc func,
+                               gpointer user_data, GDestroyNotify notify)
+{
+    (void)channel, (void)priority, (void)condition;
+    (void)func, (void)user_data, (void)notify;
+    return REPLAY_IO_WATCH_ID;
+}
+
+GIOChannel *replay_io_channel_unix_new(int fd)
+{
+    static int dummy;
+    (void)fd;
+    return (GIOChannel *)&dummy;
+}
+
+void replay_io_channel_unref(GIOChannel *channel)
+{
+    (void)channel;
+}
+
+/** Serve sysfs attribute files from trace snapshots */
+gboolean replay_file_get_contents(const gchar *filename, gchar **contents,
+                                  gsize *length, GError **error)
+{
+    (void)error;
+
+    gboolean            ack  = FALSE;
+    gchar              *dir  = g_path_get_dirname(filename);
+    gchar              *attr = g_path_get_basename(filename);
+    struct udev_device *dev  = replay_device_lookup(dir);
+    const char         *data = dev ? g_hash_table_lookup(dev->attrs, attr) : 0;
+
+    if( data ) {
+        *contents = g_strdup(data);
+        if( length )
+            *length = strlen(data);
+        ack = TRUE;
+    }
+
+    g_free(attr);
+    g_free(dir);
+    return ack;
+}
+
+/* ========================================================================= *
+ * Stand-ins for libudev
+ * ========================================================================= */
+
+struct udev *udev_new(void)
+{
+    return &replay_udev;
+}
+
+struct udev *udev_unref(struct udev *udev)
+{
+    (void)udev;
+    return 0;
+}
+
+struct udev_monitor *udev_monitor_new_from_netlink(struct udev *udev, const char *name)
+{
+    (void)udev, (void)name;
+    return &replay_monitor;
+}
+
+struct udev_monitor *udev_monitor_unref(struct udev_monitor *monitor)
+{
+    (void)monitor;
+    return 0;
+}
+
+int udev_monitor_filter_add_match_subsystem_devtype(struct udev_monitor *monitor,
+                                                    const char *subsystem,
+                                                    const char *devtype)
+{
+    (void)monitor, (void)subsystem, (void)devtype;
+    return 0;
+}
+
+int udev_monitor_enable_receiving(struct udev_monitor *monitor)
+{
+    (void)monitor;
+    return 0;
+}
+
+int udev_monitor_get_fd(struct udev_monitor *monitor)
+{
+    (void)monitor;
+    return -1;
+}
+
+struct udev_device *udev_monitor_receive_device(struct udev_monitor *monitor)
+{
+    (void)monitor;
+    struct udev_device *dev = replay_pending;
+    replay_pending = 0;
+    return dev;
+}
+
+struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *syspath)
+{
+    (void)udev;
+    return replay_device_lookup(syspath);
+}
+
+/* Devices are owned by the replay device table */
+struct udev_device *udev_device_ref(struct udev_device *dev)
+{
+    return dev;
+}
+
+struct udev_device *udev_device_unref(struct udev_device *dev)
+{
+    (void)dev;
+    return 0;
+}
+
+const char *udev_device_get_property_value(struct udev_device *dev, const char *key)
+{
+    return g_hash_table_lookup(dev->props, key);
+}
+
+const char *udev_device_get_syspath(struct udev_device *dev)
+{
+    return dev->syspath;
+}
+
+const char *udev_device_get_subsystem(struct udev_device *dev)
+{
+    return dev->subsystem;
+}
+
+const char *udev_device_get_sysname(struct udev_device *dev)
+{
+    return dev->sysname;
+}
+
+const char *udev_device_get_action(struct udev_device *dev)
+{
+    return dev->action;
+}
+
+struct udev_enumerate *udev_enumerate_new(struct udev *udev)
+{
+    (void)udev;
+    struct udev_enumerate *list = g_new0(struct udev_enumerate, 1);
+    g_ptr_array_add(replay_enumerates, list);
+    return list;
+}
+
+int udev_enumerate_add_match_subsystem(struct udev_enumerate *list, const char *subsystem)
+{
+    g_free(list->subsystem), list->subsystem = g_strdup(subsystem);
+    return 0;
+}
+
+int udev_enumerate_scan_devices(struct udev_enumerate *list)
+{
+    struct udev_list_entry **tail = &list->entries;
+
+    for( guint i = 0; i < replay_devices->len; ++i ) {
+        struct udev_device *dev = g_ptr_array_index(replay_devices, i);
+        if( g_strcmp0(dev->subsystem, list->subsystem) )
+            continue;
+        struct udev_list_entry *entry = g_new0(struct udev_list_entry, 1);
+        entry->name = g_strdup(dev->syspath);
+        *tail = entry, tail = &entry->next;
+    }
+    return 0;
+}
+
+struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *list)
+{
+    return list->entries;
+}
+
+struct udev_list_entry *udev_list_entry_get_next(struct udev_list_entry *entry)
+{
+    return entry->next;
+}
+
+const char *udev_list_entry_get_name(struct udev_list_entry *entry)
+{
+    return entry->name;
+}
+
+/* ========================================================================= *
+ * Stand-ins for the rest of usb_moded
+ * ========================================================================= */
+
+bool log_p(int lev)
+{
+    return replay_verbose || lev <= LOG_WARNING;
+}
+
+void log_emit_site(log_site_t *site, const char *file, const char *func,
+                   int line, int lev, long long duration_us,
+                   const char *fmt, ...)
+{
+    (void)site, (void)file, (void)line, (void)lev, (void)duration_us;
+
+    va_list va;
+    va_start(va, fmt);
+    fprintf(stderr, "%8lld ms %s: ", (long long)replay_now_ms, func);
+    vfprintf(stderr, fmt, va);
+    if( !*fmt || fmt[strlen(fmt) - 1] != '\n' )
+        fputc('\n', stderr);
+    va_end(va);
+}
+
+bool trace_enabled = false;
+
+const char *trace_enter(const char *func)
+{
+    return func;
+}
+
+void trace_leave(const char *func)
+{
+    (void)func;
+}
+
+char *config_get_conf_string(const gchar *entry, const gchar *key)
+{
+    (void)entry;
+    return g_strdup(g_hash_table_lookup(replay_config, key));
+}
+
+const char *cable_state_repr(cable_state_t state)
+{
+    static const char * const lut[CABLE_STATE_NUMOF] = {
+        [CABLE_STATE_UNKNOWN]           = "unknown",
+        [CABLE_STATE_DISCONNECTED]      = "disconnected",
+        [CABLE_STATE_CHARGER_CONNECTED] = "charger_connected",
+        [CABLE_STATE_PC_CONNECTED]      = "pc_connected",
+    };
+    return (state < CABLE_STATE_NUMOF) ? lut[state] : "invalid";
+}
+
+void control_set_cable_state(cable_state_t cable_state)
+{
+    replay_change_t chg = {
+        .chg_ms    = replay_now_ms,
+        .chg_state = cable_state,
+    };
+    g_array_append_val(replay_changes, chg);
+
+    if( replay_timeline )
+        printf("%8lld ms cable state: %s\n", (long long)replay_now_ms,
+               cable_state_repr(cable_state));
+}
+
+bool control_get_connection_state(void)
+{
+    if( !replay_changes->len )
+        return false;
+
+    switch( g_array_index(replay_changes, replay_change_t,
+                          replay_changes->len - 1).chg_state ) {
+    case CABLE_STATE_CHARGER_CONNECTED:
+    case CABLE_STATE_PC_CONNECTED:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void umdbus_send_event_signal(const char *state_ind)
+{
+    if( replay_timeline )
+        printf("%8lld ms event: %s\n", (long long)replay_now_ms, state_ind);
+}
+
+int usbmoded_get_cable_connection_delay(void)
+{
+    return replay_connection_delay;
+}
+
+void usbmoded_delay_suspend(void)
+{
+}
+
+void common_acquire_wakelock(const char *wakelock_name)
+{
+    (void)wakelock_name;
+}
+
+void common_release_wakelock(const char *wakelock_name)
+{
+    (void)wakelock_name;
+}
+
+void common_wait_notify(void)
+{
+}
+
+int64_t common_get_monotonic_us(void)
+{
+    return replay_now_ms * 1000;
+}
+
+const char *common_get_sysroot(void)
+{
+    return 0;
+}
+
+gchar *common_sysroot_dup(const char *path)
+{
+    return g_strdup(path);
+}
+
+/* ========================================================================= *
+ * Replay
+ * ========================================================================= */
+
+static char *replay_unescape(const char *text)
+{
+    char *res = g_malloc(strlen(text) + 1);
+    char *out = res;
+
+    while( *text ) {
+        unsigned val;
+        if( text[0] == '\\' && text[1] == 'x' &&
+            sscanf(text + 2, "%2x", &val) == 1 ) {
+            *out++ = (char)val;
+            text += 4;
+        }
+        else {
+            *out++ = *text++;
+        }
+    }
+    *out = 0;
+    return res;
+}
+
+static replay_record_t *replay_record_parse(char *line)
+{
+    replay_record_t *rec  = 0;
+    char            *pos  = line;
+    char            *ms   = strtok_r(line, " \t\n", &pos);
+    char            *act  = strtok_r(0, " \t\n", &pos);
+    char            *sub  = strtok_r(0, " \t\n", &pos);
+    char            *path = strtok_r(0, " \t\n", &pos);
+
+    if( !ms || *ms == '#' || !path )
+        goto EXIT;
+
+    rec = g_new0(replay_record_t, 1);
+    rec->rec_ms        = strtoll(ms, 0, 10);
+    rec->rec_action    = g_strdup(act);
+    rec->rec_subsystem = g_strdup(sub);
+    rec->rec_syspath   = replay_unescape(path);
+    rec->rec_props     = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    rec->rec_attrs     = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+
+    for( char *tok; (tok = strtok_r(0, " \t\n", &pos)); ) {
+        char *val = strchr(tok, '=');
+        if( !val )
+            continue;
+        *val++ = 0;
+        if( *tok == '@' )
+            g_hash_table_insert(rec->rec_attrs, g_strdup(tok + 1),
+                                replay_unescape(val));
+        else
+            g_hash_table_insert(rec->rec_props, g_strdup(tok),
+                                replay_unescape(val));
+    }
+
+EXIT:
+    return rec;
+}
+
+static void replay_record_delete(replay_record_t *rec)
+{
+    if( rec ) {
+        g_hash_table_unref(rec->rec_attrs);
+        g_hash_table_unref(rec->rec_props);
+        g_free(rec->rec_syspath);
+        g_free(rec->rec_subsystem);
+        g_free(rec->rec_action);
+        g_free(rec);
+    }
+}
+
+static GPtrArray *replay_load(const char *path)
+{
+    GPtrArray *records = 0;
+    FILE      *file    = fopen(path, "r");
+    char      *line    = 0;
+    size_t     size    = 0;
+
+    if( !file ) {
+        fprintf(stderr, "%s: can't open for reading: %m\n", path);
+        goto EXIT;
+    }
+
+    records = g_ptr_array_new_with_free_func((GDestroyNotify)replay_record_delete);
+    while( getline(&line, &size, file) != -1 ) {
+        replay_record_t *rec = replay_record_parse(line);
+        if( rec )
+            g_ptr_array_add(records, rec);
+    }
+
+EXIT:
+    free(line);
+    if( file )
+        fclose(file);
+    return records;
+}
+
+static struct udev_device *replay_device_lookup(const char *syspath)
+{
+    for( guint i = 0; syspath && i < replay_devices->len; ++i ) {
+        struct udev_device *dev = g_ptr_array_index(replay_devices, i);
+        if( !strcmp(dev->syspath, syspath) || !strcmp(dev->alias, syspath) )
+            return dev;
+    }
+    return 0;
+}
+
+static void replay_device_delete(struct udev_device *dev)
+{
+    g_hash_table_unref(dev->attrs);
+    g_hash_table_unref(dev->props);
+    g_free(dev->action);
+    g_free(dev->sysname);
+    g_free(dev->subsystem);
+    g_free(dev->alias);
+    g_free(dev->syspath);
+    g_free(dev);
+}
+
+static void replay_copy_entry(gpointer key, gpointer val, gpointer aptr)
+{
+    g_hash_table_insert(aptr, g_strdup(key), g_strdup(val));
+}
+
+/** Update device table from a trace record
+ *
+ * Uevents carry full property sets, so properties are replaced as
+ * a whole. Attributes are known only from snapshots and are kept.
+ */
+static struct udev_device *replay_device_update(const replay_record_t *rec)
+{
+    struct udev_device *dev = replay_device_lookup(rec->rec_syspath);
+
+    if( !dev ) {
+        dev = g_new0(struct udev_device, 1);
+        dev->syspath   = g_strdup(rec->rec_syspath);
+        dev->subsystem = g_strdup(rec->rec_subsystem);
+        dev->sysname   = g_path_get_basename(rec->rec_syspath);
+        dev->alias     = g_strdup_printf("/sys/class/%s/%s",
+                                         dev->subsystem, dev->sysname);
+        dev->props     = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+        dev->attrs     = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+        g_ptr_array_add(replay_devices, dev);
+    }
+
+    g_free(dev->action), dev->action = g_strdup(rec->rec_action);
+    g_hash_table_remove_all(dev->props);
+    g_hash_table_foreach(rec->rec_props, replay_copy_entry, dev->props);
+    g_hash_table_foreach(rec->rec_attrs, replay_copy_entry, dev->attrs);
+
+    return dev;
+}
+
+/** Advance virtual clock, dispatching timers that expire before limit */
+static void replay_run_timers(int64_t limit)
+{
+    for( ;; ) {
+        replay_timer_t *first = 0;
+
+        for( size_t i = 0; i < REPLAY_TIMERS_MAX; ++i ) {
+            replay_timer_t *tmr = replay_timers + i;
+            if( tmr->tmr_id && tmr->tmr_due <= limit &&
+                (!first || tmr->tmr_due < first->tmr_due) )
+                first = tmr;
+        }
+
+        if( !first )
+            break;
+
+        guint id = first->tmr_id;
+        replay_now_ms = first->tmr_due;
+        if( first->tmr_func(first->tmr_data) ) {
+            /* Reschedule unless removed from within callback */
+            if( first->tmr_id == id )
+                first->tmr_due = replay_now_ms + first->tmr_interval;
+        }
+        else if( first->tmr_id == id ) {
+            first->tmr_id = 0;
+        }
+    }
+}
+
+static void replay_reset(void)
+{
+    memset(replay_timers, 0, sizeof replay_timers);
+    replay_now_ms  = 0;
+    replay_pending = 0;
+
+    g_ptr_array_set_size(replay_devices, 0);
+    g_ptr_array_set_size(replay_enumerates, 0);
+    g_array_set_size(replay_changes, 0);
+
+    /* Module state that survives umudev_quit() */
+    umudev_cable_state_current     = CABLE_STATE_UNKNOWN;
+    umudev_cable_state_active      = CABLE_STATE_UNKNOWN;
+    umudev_cable_state_previous    = CABLE_STATE_UNKNOWN;
+    umudev_cable_state_timer_id    = 0;
+    umudev_cable_state_timer_delay = -1;
+    umudev_charger_poll_id         = 0;
+}
+
+static void replay_enumerate_delete(struct udev_enumerate *list)
+{
+    while( list->entries ) {
+        struct udev_list_entry *entry = list->entries;
+        list->entries = entry->next;
+        g_free(entry->name);
+        g_free(entry);
+    }
+    g_free(list->subsystem);
+    g_free(list);
+}
+
+static bool replay_trace(const char *path)
+{
+    bool       ack     = false;
+    GPtrArray *records = replay_load(path);
+    int64_t    first   = -1;
+    int64_t    last    = 0;
+
+    if( !records )
+        goto EXIT;
+
+    replay_reset();
+
+    /* Devices present when recording started */
+    for( guint i = 0; i < records->len; ++i ) {
+        replay_record_t *rec = g_ptr_array_index(records, i);
+        if( !strcmp(rec->rec_action, "snapshot") )
+            replay_device_update(rec);
+    }
+
+    if( replay_timeline )
+        printf("%s:\n", path);
+
+    if( !umudev_init() ) {
+        fprintf(stderr, "%s: no usable devices in trace\n", path);
+        goto EXIT;
+    }
+
+    for( guint i = 0; i < records->len; ++i ) {
+        replay_record_t *rec = g_ptr_array_index(records, i);
+        if( !strcmp(rec->rec_action, "snapshot") )
+            continue;
+
+        replay_run_timers(rec->rec_ms);
+        replay_now_ms = rec->rec_ms;
+        if( first < 0 )
+            first = rec->rec_ms;
+        last = rec->rec_ms;
+
+        if( replay_timeline )
+            printf("%8lld ms uevent: %s %s\n", (long long)rec->rec_ms,
+                   rec->rec_action, rec->rec_syspath);
+
+        replay_pending = replay_device_update(rec);
+        umudev_io_input_cb(0, G_IO_IN, 0);
+    }
+
+    replay_run_timers(last + REPLAY_TAIL_MS);
+
+    if( !replay_changes->len ) {
+        printf("%s: no cable state reported\n", path);
+    }
+    else {
+        replay_change_t *chg = &g_array_index(replay_changes, replay_change_t,
+                                              replay_changes->len - 1);
+        if( first < 0 )
+            first = 0;
+        printf("%s: %s after %u changes; stable at %lld ms"
+               " (%lld ms after first event, %lld ms after last event)\n",
+               path, cable_state_repr(chg->chg_state), replay_changes->len,
+               (long long)chg->chg_ms,
+               (long long)(chg->chg_ms - first),
+               (long long)(chg->chg_ms - last));
+    }
+
+    ack = true;
+
+EXIT:
+    umudev_quit();
+    if( records )
+        g_ptr_array_unref(records);
+    return ack;
+}
+
+static void replay_usage(const char *name)
+{
+    printf("USAGE\n"
+           "  %s [options] <trace>...\n"
+           "\n"
+           "OPTIONS\n"
+           "  -d, --cable-connection-delay=<ms>  pc connection delay [0]\n"
+           "  -C, --config=<key>=<value>         [udev] config value\n"
+           "  -t, --timeline                     show events and state changes\n"
+           "  -v, --verbose                      show usb_moded debug logging\n"
+           "  -h, --help                         show this help and exit\n",
+           name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option optl[] = {
+        { "cable-connection-delay", required_argument, 0, 'd' },
+        { "config",                 required_argument, 0, 'C' },
+        { "timeline",               no_argument,       0, 't' },
+        { "verbose",                no_argument,       0, 'v' },
+        { "help",                   no_argument,       0, 'h' },
+        { 0,                        0,                 0, 0   }
+    };
+
+    int exit_code = EXIT_SUCCESS;
+
+    replay_config     = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, g_free);
+    replay_devices    = g_ptr_array_new_with_free_func((GDestroyNotify)replay_device_delete);
+    replay_enumerates = g_ptr_array_new_with_free_func((GDestroyNotify)replay_enumerate_delete);
+    replay_changes    = g_array_new(FALSE, TRUE, sizeof(replay_change_t));
+
+    int opt;
+    while( (opt = getopt_long(argc, argv, "d:C:tvh", optl, 0)) != -1 ) {
+        switch( opt ) {
+        case 'd':
+            replay_connection_delay = atoi(optarg);
+            break;
+        case 'C':
+            {
+                char *val = strchr(optarg, '=');
+                if( !val ) {
+                    replay_usage(*argv);
+                    return EXIT_FAILURE;
+                }
+                g_hash_table_insert(replay_config,
+                                    g_strndup(optarg, val - optarg),
+                                    g_strdup(val + 1));
+            }
+            break;
+        case 't':
+            replay_timeline = true;
+            break;
+        case 'v':
+            replay_verbose = true;
+            break;
+        case 'h':
+            replay_usage(*argv);
+            return EXIT_SUCCESS;
+        default:
+            replay_usage(*argv);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if( optind == argc ) {
+        replay_usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    for( int i = optind; i < argc; ++i ) {
+        if( !replay_trace(argv[i]) )
+            exit_code = EXIT_FAILURE;
+    }
+
+    g_array_unref(replay_changes);
+    g_ptr_array_unref(replay_enumerates);
+    g_ptr_array_unref(replay_devices);
+    g_hash_table_unref(replay_config);
+
+    return exit_code;
+}
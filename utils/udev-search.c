@@ -6,6 +6,21 @@
  *
  * This is in case usb_moded can not figure it out for itself.
  *
+ * With --record option it instead captures uevents relevant for
+ * cable detection (power_supply, extcon and android_usb subsystems)
+ * in a format that can be fed to udev-replay. One record per line:
+ *
+ *   <ms> <action> <subsystem> <syspath> [KEY=VALUE]... [@ATTR=VALUE]...
+ *
+ * - ms is time since start of recording
+ * - action "snapshot" denotes device state when recording started,
+ *   other actions are as reported by udev
+ * - KEY=VALUE pairs are udev properties, @ATTR=VALUE pairs sysfs
+ *   attributes (only in snapshots)
+ * - whitespace, backslash and non-printable characters in values are
+ *   written as \xNN escapes
+ * - empty lines and lines starting with '#' are ignored
+ *
  * compile with gcc -o udev-search udev-search.c -ludev
  *
  * Copyright (c) 2014 - 2020 Jolla Ltd.
@@ -32,6 +47,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
 
 #include <libudev.h>
 
@@ -43,6 +63,35 @@
 
 static int check_device_is_usb_power_supply(const char *syspath);
 
+/* -- record -- */
+
+static int64_t record_now_ms   (void);
+static void    record_escape   (FILE *file, const char *text);
+static void    record_device   (FILE *file, int64_t ms, const char *action, struct udev_device *dev);
+static void    record_snapshot (struct udev *udev, FILE *file);
+static int     record_uevents  (const char *path);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Subsystems that affect cable state evaluation in usb_moded */
+static const char * const record_subsystems[] = {
+    "power_supply",
+    "extcon",
+    "android_usb",
+    NULL
+};
+
+/** Sysfs attributes usb_moded reads directly */
+static const char * const record_attrs[] = {
+    "state",
+    NULL
+};
+
+/** Start of recording */
+static int64_t record_start_ms = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -87,10 +136,148 @@ static int check_device_is_usb_power_supply(const char *syspath)
     return score;
 }
 
+static int64_t record_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
+static void record_escape(FILE *file, const char *text)
+{
+    for( const unsigned char *pos = (const unsigned char *)text; *pos; ++pos ) {
+        if( *pos <= ' ' || *pos >= 0x7f || *pos == '\\' )
+            fprintf(file, "\\x%02x", *pos);
+        else
+            fputc(*pos, file);
+    }
+}
+
+static void record_device(FILE *file, int64_t ms, const char *action,
+                          struct udev_device *dev)
+{
+    struct udev_list_entry *entry;
+
+    fprintf(file, "%lld %s %s ", (long long)ms, action,
+            udev_device_get_subsystem(dev));
+    record_escape(file, udev_device_get_syspath(dev));
+
+    udev_list_entry_foreach(entry, udev_device_get_properties_list_entry(dev)) {
+        fprintf(file, " %s=", udev_list_entry_get_name(entry));
+        record_escape(file, udev_list_entry_get_value(entry) ?: "");
+    }
+
+    if( !strcmp(action, "snapshot") ) {
+        for( size_t i = 0; record_attrs[i]; ++i ) {
+            const char *value = udev_device_get_sysattr_value(dev, record_attrs[i]);
+            if( value ) {
+                fprintf(file, " @%s=", record_attrs[i]);
+                record_escape(file, value);
+            }
+        }
+    }
+
+    fprintf(file, "\n");
+    fflush(file);
+}
+
+static void record_snapshot(struct udev *udev, FILE *file)
+{
+    for( size_t i = 0; record_subsystems[i]; ++i ) {
+        struct udev_enumerate  *list = udev_enumerate_new(udev);
+        struct udev_list_entry *entry;
+
+        udev_enumerate_add_match_subsystem(list, record_subsystems[i]);
+        udev_enumerate_scan_devices(list);
+        udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(list)) {
+            struct udev_device *dev =
+                udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+            if( dev ) {
+                record_device(file, 0, "snapshot", dev);
+                udev_device_unref(dev);
+            }
+        }
+        udev_enumerate_unref(list);
+    }
+}
+
+static int record_uevents(const char *path)
+{
+    int                  ret     = EXIT_FAILURE;
+    FILE                *file    = stdout;
+    struct udev         *udev    = udev_new();
+    struct udev_monitor *monitor = 0;
+
+    if( strcmp(path, "-") && !(file = fopen(path, "w")) ) {
+        fprintf(stderr, "%s: can't open for writing: %m\n", path);
+        file = 0;
+        goto EXIT;
+    }
+
+    if( !udev || !(monitor = udev_monitor_new_from_netlink(udev, "udev")) )
+        goto EXIT;
+
+    for( size_t i = 0; record_subsystems[i]; ++i )
+        udev_monitor_filter_add_match_subsystem_devtype(monitor,
+                                                        record_subsystems[i],
+                                                        NULL);
+    if( udev_monitor_enable_receiving(monitor) != 0 )
+        goto EXIT;
+
+    /* Snapshot after enabling monitor so that no changes get lost */
+    record_start_ms = record_now_ms();
+    fprintf(file, "# usb-moded uevent trace\n");
+    record_snapshot(udev, file);
+
+    struct pollfd pfd = {
+        .fd     = udev_monitor_get_fd(monitor),
+        .events = POLLIN,
+    };
+
+    while( poll(&pfd, 1, -1) >= 0 ) {
+        struct udev_device *dev = udev_monitor_receive_device(monitor);
+        if( !dev )
+            continue;
+        record_device(file, record_now_ms() - record_start_ms,
+                      udev_device_get_action(dev) ?: "change", dev);
+        udev_device_unref(dev);
+    }
+
+    ret = EXIT_SUCCESS;
+
+EXIT:
+    if( monitor )
+        udev_monitor_unref(monitor);
+    if( udev )
+        udev_unref(udev);
+    if( file && file != stdout )
+        fclose(file);
+    return ret;
+}
+
 int main (int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    static const struct option optl[] = {
+        { "record", required_argument, 0, 'r' },
+        { "help",   no_argument,       0, 'h' },
+        { 0,        0,                 0, 0   }
+    };
+
+    int opt;
+    while( (opt = getopt_long(argc, argv, "r:h", optl, 0)) != -1 ) {
+        switch( opt ) {
+        case 'r':
+            return record_uevents(optarg);
+        case 'h':
+            printf("USAGE\n"
+                   "  %s                  find usb power supply device\n"
+                   "  %s --record=<file>  record uevents, '-' for stdout\n",
+                   *argv, *argv);
+            return EXIT_SUCCESS;
+        default:
+            return EXIT_FAILURE;
+        }
+    }
 
     struct udev *udev;
     struct udev_enumerate *list;